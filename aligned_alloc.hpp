@@ -0,0 +1,70 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace Util
+{
+static inline void *memalign_alloc(size_t boundary, size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, boundary);
+#else
+	void *ptr = nullptr;
+	if (posix_memalign(&ptr, boundary, size) != 0)
+		return nullptr;
+	return ptr;
+#endif
+}
+
+static inline void *memalign_calloc(size_t boundary, size_t size)
+{
+	void *ptr = memalign_alloc(boundary, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+static inline void memalign_free(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+struct AlignedDeleter
+{
+	void operator()(void *ptr) const
+	{
+		memalign_free(ptr);
+	}
+};
+}
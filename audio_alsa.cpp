@@ -0,0 +1,427 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "audio_alsa.hpp"
+#include "realtime.hpp"
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+
+static snd_pcm_format_t to_alsa_format(DSP::SampleFormat format)
+{
+	switch (format)
+	{
+	case DSP::SampleFormat::S16:
+		return SND_PCM_FORMAT_S16;
+	case DSP::SampleFormat::S24_32:
+		return SND_PCM_FORMAT_S24;
+	case DSP::SampleFormat::S32:
+		return SND_PCM_FORMAT_S32;
+	default:
+		return SND_PCM_FORMAT_FLOAT;
+	}
+}
+
+ALSAAudio::ALSAAudio(BackendCallback *callback_, const Options &options_)
+	: callback(callback_), options(options_)
+{
+	DSP::init_dither(dither, 0x414c5341);
+}
+
+ALSAAudio::~ALSAAudio()
+{
+	stop();
+	if (pcm)
+		snd_pcm_close(pcm);
+}
+
+bool ALSAAudio::init_hw_params()
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+
+	int err = snd_pcm_hw_params_any(pcm, params);
+	if (err < 0)
+	{
+		fprintf(stderr, "ALSA: no hardware configuration available: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	if ((err = snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0)
+	{
+		fprintf(stderr, "ALSA: device does not support interleaved mmap access: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	// The requested format first, then whatever needs the least conversion.
+	const DSP::SampleFormat formats[] = {
+		options.format, DSP::SampleFormat::F32, DSP::SampleFormat::S32,
+		DSP::SampleFormat::S24_32, DSP::SampleFormat::S16,
+	};
+
+	bool found_format = false;
+	for (auto f : formats)
+	{
+		if (snd_pcm_hw_params_test_format(pcm, params, to_alsa_format(f)) == 0 &&
+		    snd_pcm_hw_params_set_format(pcm, params, to_alsa_format(f)) == 0)
+		{
+			format = f;
+			found_format = true;
+			break;
+		}
+	}
+
+	if (!found_format)
+	{
+		fprintf(stderr, "ALSA: device supports none of our sample formats.\n");
+		return false;
+	}
+
+	if ((err = snd_pcm_hw_params_set_channels(pcm, params, channels)) < 0)
+	{
+		fprintf(stderr, "ALSA: failed to set %u channels: %s.\n", channels, snd_strerror(err));
+		return false;
+	}
+
+	unsigned rate = unsigned(sample_rate);
+	if ((err = snd_pcm_hw_params_set_rate_near(pcm, params, &rate, nullptr)) < 0)
+	{
+		fprintf(stderr, "ALSA: failed to set sample rate: %s.\n", snd_strerror(err));
+		return false;
+	}
+	sample_rate = float(rate);
+
+	snd_pcm_uframes_t period = std::min<size_t>(options.period_frames, MaxPeriodFrames);
+	int dir = 0;
+	if ((err = snd_pcm_hw_params_set_period_size_near(pcm, params, &period, &dir)) < 0)
+	{
+		fprintf(stderr, "ALSA: failed to set period size: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	unsigned periods = std::max(options.periods, 2u);
+	dir = 0;
+	if ((err = snd_pcm_hw_params_set_periods_near(pcm, params, &periods, &dir)) < 0)
+	{
+		fprintf(stderr, "ALSA: failed to set period count: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	if ((err = snd_pcm_hw_params(pcm, params)) < 0)
+	{
+		fprintf(stderr, "ALSA: failed to apply hardware parameters: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	dir = 0;
+	snd_pcm_hw_params_get_period_size(params, &period_frames, &dir);
+	snd_pcm_hw_params_get_buffer_size(params, &buffer_frames);
+
+	if (period_frames == 0 || period_frames > MaxPeriodFrames)
+	{
+		fprintf(stderr, "ALSA: unsupported period size %lu.\n", static_cast<unsigned long>(period_frames));
+		return false;
+	}
+
+	return true;
+}
+
+bool ALSAAudio::init_sw_params()
+{
+	snd_pcm_sw_params_t *params;
+	snd_pcm_sw_params_alloca(&params);
+
+	int err = snd_pcm_sw_params_current(pcm, params);
+	if (err < 0)
+	{
+		fprintf(stderr, "ALSA: failed to query software parameters: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	// Wake up once per period. The stream is started explicitly once the ring is full.
+	// A start threshold at the boundary keeps PCMs like dmix from starting on their own as the ring fills.
+	snd_pcm_uframes_t boundary = 0;
+	snd_pcm_sw_params_get_boundary(params, &boundary);
+	snd_pcm_sw_params_set_avail_min(pcm, params, period_frames);
+	snd_pcm_sw_params_set_start_threshold(pcm, params, boundary ? boundary : buffer_frames);
+
+	if ((err = snd_pcm_sw_params(pcm, params)) < 0)
+	{
+		fprintf(stderr, "ALSA: failed to apply software parameters: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+bool ALSAAudio::init(float sample_rate_, unsigned channels_)
+{
+	// The DSP conversion kernels only deal with stereo.
+	if (channels_ != 2)
+		return false;
+
+	sample_rate = sample_rate_;
+	channels = channels_;
+
+	int err = snd_pcm_open(&pcm, options.device.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0)
+	{
+		fprintf(stderr, "ALSA: failed to open PCM %s: %s.\n", options.device.c_str(), snd_strerror(err));
+		pcm = nullptr;
+		return false;
+	}
+
+	if (!init_hw_params() || !init_sw_params())
+		return false;
+
+	fprintf(stderr, "ALSA: %s, %s, %.0f Hz, %lu frames x %lu periods (%.2f ms).\n",
+	        options.device.c_str(), DSP::sample_format_to_string(format), double(sample_rate),
+	        static_cast<unsigned long>(period_frames), static_cast<unsigned long>(buffer_frames / period_frames),
+	        1e3 * double(buffer_frames) / double(sample_rate));
+
+	if (callback)
+		callback->set_backend_parameters(sample_rate, channels, period_frames);
+
+	return true;
+}
+
+bool ALSAAudio::start()
+{
+	if (is_active || !pcm)
+		return false;
+
+	int err = snd_pcm_prepare(pcm);
+	if (err < 0)
+	{
+		fprintf(stderr, "ALSA: failed to prepare PCM: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	is_active = true;
+	dead = false;
+	xruns = 0;
+
+	if (callback)
+	{
+		callback->on_backend_start();
+		thr = std::thread(&ALSAAudio::thread_runner, this);
+	}
+
+	return true;
+}
+
+bool ALSAAudio::stop()
+{
+	if (!is_active)
+		return false;
+	is_active = false;
+
+	if (thr.joinable())
+	{
+		dead.store(true, std::memory_order_relaxed);
+		thr.join();
+	}
+
+	snd_pcm_drop(pcm);
+
+	if (callback)
+		callback->on_backend_stop();
+
+	if (xruns)
+		fprintf(stderr, "ALSA: recovered from %llu xruns.\n", static_cast<unsigned long long>(xruns));
+	return true;
+}
+
+static bool areas_are_interleaved_stereo(const snd_pcm_channel_area_t *areas, unsigned sample_bits)
+{
+	return areas[0].addr == areas[1].addr &&
+	       areas[0].first % 8 == 0 &&
+	       areas[1].first == areas[0].first + sample_bits &&
+	       areas[0].step == 2 * sample_bits &&
+	       areas[1].step == 2 * sample_bits;
+}
+
+bool ALSAAudio::fill_buffer(float * const *mix_channels, snd_pcm_uframes_t frames) noexcept
+{
+	unsigned sample_bits = 8 * DSP::get_sample_format_size(format);
+
+	while (frames)
+	{
+		const snd_pcm_channel_area_t *areas = nullptr;
+		snd_pcm_uframes_t offset = 0;
+		snd_pcm_uframes_t count = frames;
+
+		int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &count);
+		if (err < 0)
+			return recover(err);
+
+		if (!areas_are_interleaved_stereo(areas, sample_bits))
+		{
+			if (!failing)
+				fprintf(stderr, "ALSA: unexpected mmap layout.\n");
+			return false;
+		}
+
+		// The ring may wrap in the middle of a period.
+		count = std::min(count, period_frames);
+		callback->mix_samples(mix_channels, count);
+
+		auto *target = static_cast<uint8_t *>(areas[0].addr) + (areas[0].first + offset * areas[0].step) / 8;
+		DSP::interleave_stereo(target, format, mix_channels[0], mix_channels[1], count,
+		                       options.dither ? &dither : nullptr);
+
+		snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, count);
+		if (committed < 0)
+			return recover(int(committed));
+		if (snd_pcm_uframes_t(committed) != count)
+			return recover(-EPIPE);
+
+		frames -= count;
+	}
+
+	return true;
+}
+
+bool ALSAAudio::recover(int err) noexcept
+{
+	if (err == -EPIPE || err == -ESTRPIPE)
+	{
+		xruns++;
+		if (callback)
+			callback->on_backend_xrun();
+	}
+
+	err = snd_pcm_recover(pcm, err, 1);
+	if (err < 0)
+	{
+		if (!failing)
+			fprintf(stderr, "ALSA: failed to recover: %s.\n", snd_strerror(err));
+		return false;
+	}
+
+	// The stream is prepared again, the thread fills the ring and restarts it.
+	return true;
+}
+
+void ALSAAudio::restart() noexcept
+{
+	// Exiting the thread would leave the process running without audio, and nothing would notice.
+	// Prepare the PCM from scratch so that the thread refills and starts it,
+	// and back off so that a device which is gone for good doesn't make us spin.
+	std::this_thread::sleep_for(std::chrono::milliseconds(RetryMsecs));
+	snd_pcm_drop(pcm);
+	snd_pcm_prepare(pcm);
+}
+
+void ALSAAudio::update_latency() noexcept
+{
+	snd_pcm_sframes_t delay = 0;
+	if (snd_pcm_delay(pcm, &delay) == 0)
+		callback->set_latency_usec(uint32_t(1e6 * double(std::max<snd_pcm_sframes_t>(delay, 0)) / sample_rate));
+}
+
+void ALSAAudio::thread_runner() noexcept
+{
+	Util::setup_current_thread(Util::ThreadRole::Audio);
+
+	float mix_channels[2][MaxPeriodFrames];
+	float *mix_channel_ptr[2] = { mix_channels[0], mix_channels[1] };
+
+	pollfd fds[MaxPollDescriptors];
+	int num_fds = snd_pcm_poll_descriptors(pcm, fds, MaxPollDescriptors);
+	if (num_fds <= 0)
+	{
+		fprintf(stderr, "ALSA: no poll descriptors.\n");
+		return;
+	}
+
+	// Wake up regularly even if the device stalls, so that stop() is never stuck.
+	int timeout_msecs = std::max(10, int(4e3 * double(buffer_frames) / double(sample_rate)));
+	failing = false;
+
+	while (!dead.load(std::memory_order_relaxed))
+	{
+		// After start() or an xrun, fill the whole ring before starting playback.
+		if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+		{
+			snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+			bool ok = true;
+			while (ok && avail >= snd_pcm_sframes_t(period_frames))
+			{
+				ok = fill_buffer(mix_channel_ptr, period_frames);
+				avail -= snd_pcm_sframes_t(period_frames);
+			}
+
+			// Some plugins ignore the threshold and are running already.
+			if (!ok || (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED && snd_pcm_start(pcm) < 0))
+			{
+				if (!failing)
+					fprintf(stderr, "ALSA: failed to start playback, retrying.\n");
+				failing = true;
+				restart();
+				continue;
+			}
+
+			if (failing)
+				fprintf(stderr, "ALSA: playback resumed.\n");
+			failing = false;
+			update_latency();
+		}
+
+		int ret = poll(fds, nfds_t(num_fds), timeout_msecs);
+		if (ret < 0 && errno != EINTR)
+		{
+			if (!failing)
+				fprintf(stderr, "ALSA: poll failed, retrying.\n");
+			failing = true;
+			restart();
+			continue;
+		}
+		else if (ret <= 0)
+			continue;
+
+		unsigned short revents = 0;
+		snd_pcm_poll_descriptors_revents(pcm, fds, unsigned(num_fds), &revents);
+		if ((revents & (POLLOUT | POLLERR)) == 0)
+			continue;
+
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+		bool ok = avail >= 0 || recover(int(avail));
+		while (ok && avail >= snd_pcm_sframes_t(period_frames))
+		{
+			ok = fill_buffer(mix_channel_ptr, period_frames);
+			avail -= snd_pcm_sframes_t(period_frames);
+		}
+
+		if (!ok)
+		{
+			if (!failing)
+				fprintf(stderr, "ALSA: playback failed, retrying.\n");
+			failing = true;
+			restart();
+			continue;
+		}
+
+		update_latency();
+	}
+}
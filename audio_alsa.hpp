@@ -0,0 +1,94 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <alsa/asoundlib.h>
+#include <thread>
+#include <atomic>
+#include <string>
+#include "audio_backend.hpp"
+#include "dsp.hpp"
+
+// Talks to an ALSA PCM directly, bypassing the sound server.
+// Rendered audio is converted straight into the mmap'ed ring buffer from a poll-driven thread,
+// so the only buffering is period_frames * periods, which makes a few milliseconds of latency possible.
+// Can be exercised without hardware through the null or file plugins.
+struct ALSAAudio final : AudioBackend
+{
+public:
+	struct Options
+	{
+		// Any ALSA PCM name, e.g. hw:0, plughw:0 or null.
+		std::string device = "default";
+		size_t period_frames = 128;
+		unsigned periods = 3;
+		// Falls back to other formats if the device doesn't support this one.
+		DSP::SampleFormat format = DSP::SampleFormat::F32;
+		bool dither = true;
+	};
+
+	ALSAAudio(BackendCallback *callback_, const Options &options_);
+	~ALSAAudio() override;
+
+	bool init(float sample_rate_, unsigned channels_) override;
+	bool start() override;
+	bool stop() override;
+
+	float get_sample_rate() const override
+	{
+		return sample_rate;
+	}
+
+	unsigned get_num_channels() const override
+	{
+		return channels;
+	}
+
+	enum { MaxPeriodFrames = 4096, MaxPollDescriptors = 8, RetryMsecs = 100 };
+
+	BackendCallback *callback;
+	Options options;
+	DSP::Dither dither;
+	float sample_rate = 0.0f;
+	unsigned channels = 0;
+
+	snd_pcm_t *pcm = nullptr;
+	snd_pcm_uframes_t period_frames = 0;
+	snd_pcm_uframes_t buffer_frames = 0;
+	DSP::SampleFormat format = DSP::SampleFormat::F32;
+
+	std::thread thr;
+	std::atomic<bool> dead;
+	bool is_active = false;
+	uint64_t xruns = 0;
+	// Audio thread only. Errors are logged once until playback works again.
+	bool failing = false;
+
+	bool init_hw_params();
+	bool init_sw_params();
+	void thread_runner() noexcept;
+	bool fill_buffer(float * const *mix_channels, snd_pcm_uframes_t frames) noexcept;
+	bool recover(int err) noexcept;
+	void restart() noexcept;
+	void update_latency() noexcept;
+};
@@ -0,0 +1,75 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class BackendCallback
+{
+public:
+	virtual ~BackendCallback() = default;
+	virtual void mix_samples(float * const *channels, size_t num_frames) noexcept = 0;
+
+	virtual void set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames) = 0;
+	virtual void on_backend_stop() = 0;
+	virtual void on_backend_start() = 0;
+	virtual void set_latency_usec(uint32_t usec) = 0;
+
+	// The backend ran out of audio to play. Called from whichever thread noticed it.
+	virtual void on_backend_xrun() noexcept {}
+
+	// Nothing is sounding and nothing is pending, so the next block would be silence.
+	// Only called from the thread which calls mix_samples(). The backend may then skip
+	// mix_samples() and write silence itself, or go idle after a while.
+	virtual bool is_silent() noexcept { return false; }
+
+	// The backend wrote num_frames of silence itself after is_silent(), instead of calling mix_samples().
+	// Same thread as mix_samples(), so that anything keeping time can account for them.
+	virtual void skip_samples(size_t) noexcept {}
+
+	// Whether the backend may stop asking for audio after a while of silence.
+	// Callbacks which must see every frame, e.g. to record the output, return false.
+	virtual bool allows_idle() noexcept { return true; }
+
+	// Delay the callback adds on top of the backend, e.g. limiter lookahead.
+	// Fixed once set_backend_parameters() returns. Backends which can tell the system about it do so.
+	virtual uint32_t get_processing_latency_usec() noexcept { return 0; }
+};
+
+class AudioBackend
+{
+public:
+	virtual ~AudioBackend() = default;
+	void operator=(const AudioBackend &) = delete;
+
+	virtual bool init(float sample_rate, unsigned channels) = 0;
+	virtual bool start() = 0;
+	virtual bool stop() = 0;
+
+	// Resumes a backend which went idle on silence. Called after posting new events, so it must be cheap when not idle.
+	virtual void wake() {}
+
+	virtual float get_sample_rate() const = 0;
+	virtual unsigned get_num_channels() const = 0;
+};
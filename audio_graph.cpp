@@ -0,0 +1,397 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "audio_graph.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static constexpr size_t BufferAlignment = 64;
+
+unsigned AudioGraph::add_node(AudioNode *node)
+{
+	Node entry = {};
+	entry.node = node;
+	entry.inputs.resize(node->get_num_inputs(), Port{ Unconnected, 0 });
+	nodes.push_back(std::move(entry));
+	return unsigned(nodes.size() - 1);
+}
+
+bool AudioGraph::connect(unsigned source, unsigned output_index, unsigned target, unsigned input)
+{
+	if (source >= nodes.size() || target >= nodes.size() ||
+	    output_index >= nodes[source].node->get_num_outputs() || input >= nodes[target].inputs.size())
+	{
+		fprintf(stderr, "AudioGraph: invalid connection from %u:%u to %u:%u.\n", source, output_index, target, input);
+		return false;
+	}
+
+	nodes[target].inputs[input] = { source, output_index };
+	return true;
+}
+
+bool AudioGraph::set_output(unsigned node, unsigned output_index)
+{
+	if (node >= nodes.size() || output_index >= nodes[node].node->get_num_outputs())
+	{
+		fprintf(stderr, "AudioGraph: invalid output %u:%u.\n", node, output_index);
+		return false;
+	}
+
+	output = { node, output_index };
+	return true;
+}
+
+bool AudioGraph::sort_nodes()
+{
+	for (auto &node : nodes)
+	{
+		node.scheduled = false;
+		node.output_readers.assign(node.node->get_num_outputs(), 0);
+	}
+
+	// Only what the output depends on is worth running.
+	std::vector<unsigned> stack = { output.node };
+	nodes[output.node].scheduled = true;
+	while (!stack.empty())
+	{
+		unsigned index = stack.back();
+		stack.pop_back();
+		for (auto &input : nodes[index].inputs)
+		{
+			if (input.node != Unconnected && !nodes[input.node].scheduled)
+			{
+				nodes[input.node].scheduled = true;
+				stack.push_back(input.node);
+			}
+		}
+	}
+
+	std::vector<unsigned> pending(nodes.size());
+	unsigned num_scheduled = 0;
+	for (unsigned i = 0; i < nodes.size(); i++)
+	{
+		if (!nodes[i].scheduled)
+			continue;
+
+		num_scheduled++;
+		for (auto &input : nodes[i].inputs)
+		{
+			if (input.node != Unconnected)
+			{
+				pending[i]++;
+				nodes[input.node].output_readers[input.output]++;
+			}
+		}
+	}
+	nodes[output.node].output_readers[output.output]++;
+
+	// Kahn's algorithm, a node is ready once every input has been produced.
+	schedule.clear();
+	for (unsigned i = 0; i < nodes.size(); i++)
+		if (nodes[i].scheduled && pending[i] == 0)
+			schedule.push_back(i);
+
+	for (size_t i = 0; i < schedule.size(); i++)
+	{
+		unsigned index = schedule[i];
+		for (unsigned j = 0; j < nodes.size(); j++)
+		{
+			if (!nodes[j].scheduled)
+				continue;
+			for (auto &input : nodes[j].inputs)
+				if (input.node == index && --pending[j] == 0)
+					schedule.push_back(j);
+		}
+	}
+
+	if (schedule.size() != num_scheduled)
+	{
+		fprintf(stderr, "AudioGraph: the graph has a cycle.\n");
+		return false;
+	}
+
+	return true;
+}
+
+void AudioGraph::assign_buffers()
+{
+	// Walk back from the output through in-place nodes which are the only reader of their input.
+	// The stage at the start of that chain writes straight into the backend's buffer.
+	Port external = output;
+	for (;;)
+	{
+		auto &node = nodes[external.node];
+		if (external.output != 0 || !node.node->processes_in_place() || node.inputs.empty())
+			break;
+
+		auto &source = node.inputs[0];
+		if (source.node == Unconnected || nodes[source.node].output_readers[source.output] != 1)
+			break;
+		external = source;
+	}
+
+	num_buffers = NumFixedBuffers;
+	std::vector<unsigned> references(NumFixedBuffers);
+	std::vector<unsigned> free_buffers;
+
+	for (unsigned index : schedule)
+	{
+		auto &node = nodes[index];
+		unsigned num_outputs = node.node->get_num_outputs();
+
+		node.input_buffers.clear();
+		for (auto &input : node.inputs)
+		{
+			node.input_buffers.push_back(input.node == Unconnected ?
+			                             unsigned(SilenceBuffer) :
+			                             nodes[input.node].output_buffers[input.output]);
+		}
+
+		// Outputs are picked before inputs are released, so that nothing aliases by accident.
+		bool in_place = node.node->processes_in_place() && !node.inputs.empty() &&
+		                node.inputs[0].node != Unconnected && references[node.input_buffers[0]] == 1 &&
+		                num_outputs != 0;
+
+		node.output_buffers.resize(num_outputs);
+		for (unsigned i = 0; i < num_outputs; i++)
+		{
+			unsigned buffer;
+			if (index == external.node && i == external.output)
+				buffer = OutputBuffer;
+			else if (i == 0 && in_place)
+				buffer = node.input_buffers[0];
+			else if (!free_buffers.empty())
+			{
+				buffer = free_buffers.back();
+				free_buffers.pop_back();
+			}
+			else
+			{
+				buffer = num_buffers++;
+				references.resize(num_buffers);
+			}
+			node.output_buffers[i] = buffer;
+		}
+
+		for (unsigned i = 0; i < node.inputs.size(); i++)
+		{
+			unsigned buffer = node.input_buffers[i];
+			if (node.inputs[i].node == Unconnected || (i == 0 && in_place))
+				continue;
+			if (--references[buffer] == 0 && buffer >= NumFixedBuffers)
+				free_buffers.push_back(buffer);
+		}
+
+		// Outputs nobody reads are free again right after the node.
+		for (unsigned i = 0; i < num_outputs; i++)
+		{
+			unsigned buffer = node.output_buffers[i];
+			references[buffer] = node.output_readers[i];
+			if (references[buffer] == 0 && buffer >= NumFixedBuffers)
+				free_buffers.push_back(buffer);
+		}
+	}
+
+	buses.assign(num_buffers, AudioBus{});
+	for (unsigned index : schedule)
+	{
+		auto &node = nodes[index];
+		node.input_buses.clear();
+		node.output_buses.clear();
+		for (unsigned buffer : node.input_buffers)
+			node.input_buses.push_back(&buses[buffer]);
+		for (unsigned buffer : node.output_buffers)
+			node.output_buses.push_back(&buses[buffer]);
+	}
+}
+
+bool AudioGraph::compile()
+{
+	schedule.clear();
+	storage.reset();
+
+	if (output.node == Unconnected)
+	{
+		fprintf(stderr, "AudioGraph: no output.\n");
+		return false;
+	}
+
+	if (!sort_nodes())
+		return false;
+
+	assign_buffers();
+
+	needs_every_frame = false;
+	for (unsigned index : schedule)
+		needs_every_frame = needs_every_frame || nodes[index].node->needs_every_frame();
+	return true;
+}
+
+unsigned AudioGraph::get_num_scheduled_nodes() const noexcept
+{
+	return unsigned(schedule.size());
+}
+
+unsigned AudioGraph::get_num_buffers() const noexcept
+{
+	return num_buffers > NumFixedBuffers ? num_buffers - NumFixedBuffers : 0;
+}
+
+void AudioGraph::set_backend_parameters(float sample_rate_, unsigned, size_t max_num_frames)
+{
+	sample_rate = sample_rate_;
+	max_frames = (max_num_frames + 15) & ~size_t(15);
+	if (schedule.empty())
+		return;
+
+	for (unsigned index : schedule)
+		nodes[index].node->prepare(sample_rate, max_frames);
+
+	// The backend's output has no storage of its own.
+	size_t channel_frames = max_frames;
+	storage.reset(static_cast<float *>(Util::memalign_calloc(
+			BufferAlignment, (num_buffers - 1) * 2 * channel_frames * sizeof(float))));
+	for (unsigned i = 1; i < num_buffers; i++)
+	{
+		buses[i].channels[0] = storage.get() + (i - 1) * 2 * channel_frames;
+		buses[i].channels[1] = buses[i].channels[0] + channel_frames;
+		buses[i].silent = i == SilenceBuffer;
+	}
+
+	// Latencies are known once the nodes are prepared.
+	total_latency = 0;
+	for (auto it = schedule.rbegin(); it != schedule.rend(); ++it)
+	{
+		auto &node = nodes[*it];
+		node.downstream_latency = 0;
+		for (unsigned index : schedule)
+		{
+			auto &reader = nodes[index];
+			for (auto &input : reader.inputs)
+			{
+				if (input.node == *it)
+				{
+					node.downstream_latency = std::max(node.downstream_latency,
+					                                   reader.downstream_latency + reader.node->get_latency_frames());
+				}
+			}
+		}
+		total_latency = std::max(total_latency, node.downstream_latency + node.node->get_latency_frames());
+	}
+}
+
+bool AudioGraph::is_silent() noexcept
+{
+	for (unsigned index : schedule)
+		if (!nodes[index].node->is_silent())
+			return false;
+	return true;
+}
+
+void AudioGraph::process_block(size_t num_frames) noexcept
+{
+	auto &out = buses[OutputBuffer];
+	if (is_silent())
+	{
+		memset(out.channels[0], 0, num_frames * sizeof(float));
+		memset(out.channels[1], 0, num_frames * sizeof(float));
+		out.silent = true;
+		for (unsigned index : schedule)
+			nodes[index].node->skip(num_frames);
+		return;
+	}
+
+	for (unsigned index : schedule)
+	{
+		auto &node = nodes[index];
+		node.node->process(node.input_buses.data(), node.output_buses.data(), num_frames);
+	}
+}
+
+void AudioGraph::mix_samples(float * const *channels, size_t num_frames) noexcept
+{
+	if (!storage)
+	{
+		memset(channels[0], 0, num_frames * sizeof(float));
+		memset(channels[1], 0, num_frames * sizeof(float));
+		return;
+	}
+
+	// Node buffers only hold max_frames, so a backend asking for more than it promised is served in pieces.
+	size_t offset = 0;
+	while (offset < num_frames)
+	{
+		size_t to_process = std::min(num_frames - offset, max_frames);
+		auto &out = buses[OutputBuffer];
+		out.channels[0] = channels[0] + offset;
+		out.channels[1] = channels[1] + offset;
+		process_block(to_process);
+		offset += to_process;
+	}
+}
+
+void AudioGraph::skip_samples(size_t num_frames) noexcept
+{
+	if (!storage)
+		return;
+
+	// Same as the silent path of process_block(), but the backend wrote the zeros.
+	while (num_frames != 0)
+	{
+		size_t to_skip = std::min(num_frames, max_frames);
+		for (unsigned index : schedule)
+			nodes[index].node->skip(to_skip);
+		num_frames -= to_skip;
+	}
+}
+
+bool AudioGraph::allows_idle() noexcept
+{
+	return !needs_every_frame;
+}
+
+void AudioGraph::on_backend_start()
+{
+	for (unsigned index : schedule)
+		nodes[index].node->on_start();
+}
+
+void AudioGraph::on_backend_stop()
+{
+	for (unsigned index : schedule)
+		nodes[index].node->on_stop();
+}
+
+void AudioGraph::set_latency_usec(uint32_t usec)
+{
+	for (unsigned index : schedule)
+	{
+		auto &node = nodes[index];
+		node.node->set_latency_usec(usec + uint32_t(1e6 * double(node.downstream_latency) / double(sample_rate)));
+	}
+}
+
+uint32_t AudioGraph::get_processing_latency_usec() noexcept
+{
+	return sample_rate > 0.0f ? uint32_t(1e6 * double(total_latency) / double(sample_rate)) : 0;
+}
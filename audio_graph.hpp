@@ -0,0 +1,176 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "audio_backend.hpp"
+#include "aligned_alloc.hpp"
+
+// Planar stereo signal along one edge of an AudioGraph.
+struct AudioBus
+{
+	float *channels[2];
+	// Set by the producer when the block is all zeros, so that consumers can skip work.
+	// The buffer still holds the zeros.
+	bool silent;
+};
+
+// One processing stage of an AudioGraph, with any number of stereo inputs and outputs.
+class AudioNode
+{
+public:
+	virtual ~AudioNode() = default;
+
+	virtual unsigned get_num_inputs() const noexcept = 0;
+	virtual unsigned get_num_outputs() const noexcept = 0;
+
+	// Output 0 may share its buffer with input 0. Such nodes must still work when it doesn't.
+	virtual bool processes_in_place() const noexcept
+	{
+		return false;
+	}
+
+	// Called off the audio thread before the graph runs. Every allocation happens here.
+	virtual void prepare(float sample_rate, size_t max_frames) = 0;
+
+	// num_frames never exceeds max_frames. Unconnected inputs are silent.
+	// Every output must be written and flagged, inputs must not be written
+	// except input 0 of an in-place node.
+	virtual void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept = 0;
+
+	// The node has nothing left to output until it gets new input or events. Audio thread only.
+	virtual bool is_silent() noexcept
+	{
+		return true;
+	}
+
+	// While every node is silent, the graph writes silence and calls this instead of process().
+	virtual void skip(size_t) noexcept
+	{
+	}
+
+	// The node must see every frame through process() or skip(), so the backend may not go idle.
+	virtual bool needs_every_frame() const noexcept
+	{
+		return false;
+	}
+
+	virtual void on_start()
+	{
+	}
+
+	virtual void on_stop()
+	{
+	}
+
+	// The next frame this node outputs is heard usec from now, including every stage after it.
+	virtual void set_latency_usec(uint32_t)
+	{
+	}
+
+	// Delay from input to output, fixed once prepare() returns.
+	virtual unsigned get_latency_frames() const noexcept
+	{
+		return 0;
+	}
+};
+
+// Runs a set of nodes on every block a backend asks for. compile() works out everything up front:
+// the nodes are sorted topologically, nodes which don't lead to the output are left out,
+// and buffers are handed to the next writer as soon as their last reader has run.
+// In-place nodes reuse the buffer of their input, and the stage which writes the output
+// writes straight into the backend's buffer. Processing a block never allocates.
+class AudioGraph final : public BackendCallback
+{
+public:
+	// Nodes are not owned and must outlive the graph.
+	unsigned add_node(AudioNode *node);
+
+	// Every input takes one output, an output can feed any number of inputs.
+	bool connect(unsigned source, unsigned output, unsigned target, unsigned input);
+	bool set_output(unsigned node, unsigned output);
+
+	// Fails on cycles and without an output. Must be called before the backend is initialized.
+	bool compile();
+
+	// Scheduled nodes and the buffers they share, backend output excluded.
+	unsigned get_num_scheduled_nodes() const noexcept;
+	unsigned get_num_buffers() const noexcept;
+
+	void mix_samples(float * const *channels, size_t num_frames) noexcept override;
+	void set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames) override;
+	void on_backend_stop() override;
+	void on_backend_start() override;
+	void set_latency_usec(uint32_t usec) override;
+	bool is_silent() noexcept override;
+	void skip_samples(size_t num_frames) noexcept override;
+	bool allows_idle() noexcept override;
+	// Longest path through the scheduled nodes.
+	uint32_t get_processing_latency_usec() noexcept override;
+
+private:
+	enum : unsigned { Unconnected = ~0u };
+	// The backend's output and the silence unconnected inputs read from.
+	enum { OutputBuffer = 0, SilenceBuffer = 1, NumFixedBuffers = 2 };
+
+	struct Port
+	{
+		unsigned node;
+		unsigned output;
+	};
+
+	struct Node
+	{
+		AudioNode *node;
+		std::vector<Port> inputs;
+
+		// Filled in by compile().
+		bool scheduled = false;
+		std::vector<unsigned> output_readers;
+		std::vector<unsigned> input_buffers;
+		std::vector<unsigned> output_buffers;
+		std::vector<const AudioBus *> input_buses;
+		std::vector<AudioBus *> output_buses;
+		// Latency of the stages after this one, along the longest path.
+		unsigned downstream_latency = 0;
+	};
+
+	std::vector<Node> nodes;
+	Port output = { Unconnected, 0 };
+
+	std::vector<unsigned> schedule;
+	unsigned num_buffers = 0;
+	std::vector<AudioBus> buses;
+	std::unique_ptr<float, Util::AlignedDeleter> storage;
+	size_t max_frames = 0;
+	float sample_rate = 0.0f;
+	unsigned total_latency = 0;
+	bool needs_every_frame = false;
+
+	bool sort_nodes();
+	void assign_buffers();
+	void process_block(size_t num_frames) noexcept;
+};
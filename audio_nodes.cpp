@@ -0,0 +1,461 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "audio_nodes.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static constexpr float MeterWindowSeconds = 0.05f;
+static constexpr size_t RingAlignment = 64;
+
+static void copy_bus(AudioBus &output, const AudioBus &input, size_t num_frames) noexcept
+{
+	for (unsigned c = 0; c < 2; c++)
+		if (output.channels[c] != input.channels[c])
+			memcpy(output.channels[c], input.channels[c], num_frames * sizeof(float));
+	output.silent = input.silent;
+}
+
+MixerNode::MixerNode(unsigned num_inputs_)
+	: num_inputs(std::max(1u, std::min(num_inputs_, unsigned(DSP::MaxMixInputs))))
+{
+}
+
+void MixerNode::set_input_level(unsigned input, float gain, float pan)
+{
+	if (input >= num_inputs)
+		return;
+
+	pan = std::max(-1.0f, std::min(1.0f, pan));
+	auto &channel = channels[input];
+	channel.target_gain_left.store(gain * std::min(1.0f, 1.0f - pan), std::memory_order_relaxed);
+	channel.target_gain_right.store(gain * std::min(1.0f, 1.0f + pan), std::memory_order_relaxed);
+}
+
+void MixerNode::get_input_meter(unsigned input, float &peak, float &rms) const noexcept
+{
+	if (input >= num_inputs)
+	{
+		peak = 0.0f;
+		rms = 0.0f;
+		return;
+	}
+
+	peak = channels[input].peak.load(std::memory_order_relaxed);
+	rms = channels[input].rms.load(std::memory_order_relaxed);
+}
+
+unsigned MixerNode::get_num_inputs() const noexcept
+{
+	return num_inputs;
+}
+
+unsigned MixerNode::get_num_outputs() const noexcept
+{
+	return 1;
+}
+
+void MixerNode::prepare(float sample_rate, size_t)
+{
+	meter_window_frames = uint32_t(MeterWindowSeconds * sample_rate);
+}
+
+void MixerNode::clear_meters() noexcept
+{
+	for (unsigned i = 0; i < num_inputs; i++)
+	{
+		auto &channel = channels[i];
+		channel.peak.store(0.0f, std::memory_order_relaxed);
+		channel.rms.store(0.0f, std::memory_order_relaxed);
+		channel.window_peak = 0.0f;
+		channel.window_sum_squares = 0.0f;
+		channel.window_frames = 0;
+	}
+}
+
+void MixerNode::skip(size_t) noexcept
+{
+	clear_meters();
+}
+
+void MixerNode::process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept
+{
+	DSP::MixInput mix_inputs[DSP::MaxMixInputs];
+	unsigned mix_channels[DSP::MaxMixInputs];
+	unsigned num_mixed = 0;
+	float inv_frames = 1.0f / float(num_frames);
+
+	for (unsigned i = 0; i < num_inputs; i++)
+	{
+		auto &channel = channels[i];
+		float target_left = channel.target_gain_left.load(std::memory_order_relaxed);
+		float target_right = channel.target_gain_right.load(std::memory_order_relaxed);
+
+		if (!inputs[i]->silent)
+		{
+			auto &input = mix_inputs[num_mixed];
+			input.left = inputs[i]->channels[0];
+			input.right = inputs[i]->channels[1];
+			input.gain_left = channel.gain_left;
+			input.gain_right = channel.gain_right;
+			input.step_left = (target_left - channel.gain_left) * inv_frames;
+			input.step_right = (target_right - channel.gain_right) * inv_frames;
+			mix_channels[num_mixed++] = i;
+		}
+
+		channel.gain_left = target_left;
+		channel.gain_right = target_right;
+	}
+
+	auto &output = *outputs[0];
+	output.silent = num_mixed == 0;
+	if (output.silent)
+	{
+		memset(output.channels[0], 0, num_frames * sizeof(float));
+		memset(output.channels[1], 0, num_frames * sizeof(float));
+		clear_meters();
+		return;
+	}
+
+	DSP::mix_stereo_inputs(output.channels[0], output.channels[1], mix_inputs, num_mixed, num_frames);
+
+	for (unsigned i = 0; i < num_inputs; i++)
+		channels[i].window_frames += uint32_t(num_frames);
+	for (unsigned i = 0; i < num_mixed; i++)
+	{
+		auto &channel = channels[mix_channels[i]];
+		channel.window_peak = std::max(channel.window_peak, mix_inputs[i].peak);
+		channel.window_sum_squares += mix_inputs[i].sum_squares;
+	}
+
+	for (unsigned i = 0; i < num_inputs; i++)
+	{
+		auto &channel = channels[i];
+		if (channel.window_frames >= meter_window_frames)
+		{
+			channel.peak.store(channel.window_peak, std::memory_order_relaxed);
+			channel.rms.store(sqrtf(channel.window_sum_squares / float(2 * channel.window_frames)),
+			                  std::memory_order_relaxed);
+			channel.window_peak = 0.0f;
+			channel.window_sum_squares = 0.0f;
+			channel.window_frames = 0;
+		}
+	}
+}
+
+GainNode::GainNode(float gain_)
+	: target_gain(gain_), gain(gain_)
+{
+}
+
+void GainNode::set_gain(float gain_)
+{
+	target_gain.store(gain_, std::memory_order_relaxed);
+}
+
+unsigned GainNode::get_num_inputs() const noexcept
+{
+	return 1;
+}
+
+unsigned GainNode::get_num_outputs() const noexcept
+{
+	return 1;
+}
+
+bool GainNode::processes_in_place() const noexcept
+{
+	return true;
+}
+
+void GainNode::prepare(float, size_t)
+{
+}
+
+void GainNode::process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept
+{
+	auto &input = *inputs[0];
+	auto &output = *outputs[0];
+	float target = target_gain.load(std::memory_order_relaxed);
+
+	if (input.silent)
+	{
+		copy_bus(output, input, num_frames);
+		gain = target;
+		return;
+	}
+
+	float step = (target - gain) / float(num_frames);
+	for (unsigned c = 0; c < 2; c++)
+	{
+		const float *in = input.channels[c];
+		float *out = output.channels[c];
+		for (size_t i = 0; i < num_frames; i++)
+			out[i] = in[i] * (gain + step * float(i));
+	}
+
+	output.silent = false;
+	gain = target;
+}
+
+LimiterNode::LimiterNode(const Limiter::Options &options_)
+	: options(options_)
+{
+}
+
+float LimiterNode::consume_min_gain() noexcept
+{
+	return limiter.consume_min_gain();
+}
+
+unsigned LimiterNode::get_num_inputs() const noexcept
+{
+	return 1;
+}
+
+unsigned LimiterNode::get_num_outputs() const noexcept
+{
+	return 1;
+}
+
+bool LimiterNode::processes_in_place() const noexcept
+{
+	return true;
+}
+
+void LimiterNode::prepare(float sample_rate, size_t max_frames)
+{
+	enabled = limiter.init(sample_rate, max_frames, options);
+	if (enabled)
+	{
+		fprintf(stderr, "Limiter: ceiling %.1f dBTP, %u frames delay (%.2f ms).\n",
+		        double(options.ceiling_db), limiter.get_latency_frames(),
+		        1e3 * double(limiter.get_latency_frames()) / double(sample_rate));
+	}
+	else
+		fprintf(stderr, "Invalid limiter options, running without a limiter.\n");
+	idle = true;
+}
+
+void LimiterNode::process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept
+{
+	auto &output = *outputs[0];
+	copy_bus(output, *inputs[0], num_frames);
+	if (!enabled)
+		return;
+
+	// Drops what little tail is left in the lookahead.
+	if (output.silent)
+	{
+		skip(num_frames);
+		return;
+	}
+
+	limiter.process(output.channels, num_frames);
+	idle = false;
+}
+
+void LimiterNode::skip(size_t) noexcept
+{
+	if (enabled && !idle)
+	{
+		limiter.reset();
+		idle = true;
+	}
+}
+
+void LimiterNode::on_start()
+{
+	if (enabled)
+		limiter.reset();
+	idle = true;
+}
+
+unsigned LimiterNode::get_latency_frames() const noexcept
+{
+	return enabled ? limiter.get_latency_frames() : 0;
+}
+
+ConvolverNode::ConvolverNode(const Convolver::Options &options_)
+	: options(options_)
+{
+}
+
+bool ConvolverNode::load(const char *path)
+{
+	return convolver.load(path);
+}
+
+unsigned ConvolverNode::get_num_inputs() const noexcept
+{
+	return 1;
+}
+
+unsigned ConvolverNode::get_num_outputs() const noexcept
+{
+	return 1;
+}
+
+bool ConvolverNode::processes_in_place() const noexcept
+{
+	return true;
+}
+
+void ConvolverNode::prepare(float sample_rate, size_t)
+{
+	enabled = convolver.init(sample_rate, options);
+	if (!enabled)
+		fprintf(stderr, "Invalid convolution options, running without the impulse response.\n");
+}
+
+void ConvolverNode::process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept
+{
+	auto &output = *outputs[0];
+	copy_bus(output, *inputs[0], num_frames);
+	if (!enabled)
+		return;
+
+	// The impulse response keeps ringing after the input goes quiet.
+	if (!output.silent)
+		convolver.process(output.channels, num_frames);
+	else if (!convolver.is_drained())
+	{
+		convolver.drain(output.channels, num_frames);
+		output.silent = false;
+	}
+}
+
+bool ConvolverNode::is_silent() noexcept
+{
+	return !enabled || convolver.is_drained();
+}
+
+void ConvolverNode::on_start()
+{
+	if (enabled)
+		convolver.reset();
+}
+
+TapNode::TapNode(float buffer_seconds_)
+	: buffer_seconds(buffer_seconds_)
+{
+}
+
+unsigned TapNode::get_num_inputs() const noexcept
+{
+	return 1;
+}
+
+unsigned TapNode::get_num_outputs() const noexcept
+{
+	return 1;
+}
+
+bool TapNode::processes_in_place() const noexcept
+{
+	return true;
+}
+
+void TapNode::prepare(float sample_rate_, size_t max_frames)
+{
+	auto frames = std::max(size_t(buffer_seconds * sample_rate_), max_frames);
+	ring_frames = 1;
+	while (ring_frames < frames)
+		ring_frames *= 2;
+
+	ring.reset(static_cast<float *>(Util::memalign_calloc(RingAlignment, 2 * ring_frames * sizeof(float))));
+	write_count.store(0, std::memory_order_relaxed);
+	read_count.store(0, std::memory_order_relaxed);
+	sample_rate.store(sample_rate_, std::memory_order_release);
+}
+
+void TapNode::write(const float *left, const float *right, size_t num_frames) noexcept
+{
+	uint64_t written = write_count.load(std::memory_order_relaxed);
+	uint64_t consumed = read_count.load(std::memory_order_acquire);
+	if (ring_frames - size_t(written - consumed) < num_frames)
+	{
+		dropped.fetch_add(num_frames, std::memory_order_relaxed);
+		return;
+	}
+
+	float *data = ring.get();
+	for (size_t i = 0; i < num_frames; i++)
+	{
+		size_t index = size_t(written + i) & (ring_frames - 1);
+		data[2 * index + 0] = left ? left[i] : 0.0f;
+		data[2 * index + 1] = right ? right[i] : 0.0f;
+	}
+	write_count.store(written + num_frames, std::memory_order_release);
+}
+
+void TapNode::process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept
+{
+	auto &output = *outputs[0];
+	copy_bus(output, *inputs[0], num_frames);
+	write(output.channels[0], output.channels[1], num_frames);
+}
+
+void TapNode::skip(size_t num_frames) noexcept
+{
+	// Keep the capture continuous through silence.
+	write(nullptr, nullptr, num_frames);
+}
+
+bool TapNode::needs_every_frame() const noexcept
+{
+	// A gap in the capture would shorten the recording.
+	return true;
+}
+
+size_t TapNode::read(float *interleaved, size_t max_frames) noexcept
+{
+	if (sample_rate.load(std::memory_order_acquire) <= 0.0f)
+		return 0;
+
+	uint64_t consumed = read_count.load(std::memory_order_relaxed);
+	uint64_t written = write_count.load(std::memory_order_acquire);
+	auto available = size_t(std::min<uint64_t>(written - consumed, max_frames));
+
+	const float *data = ring.get();
+	for (size_t i = 0; i < available; i++)
+	{
+		size_t index = size_t(consumed + i) & (ring_frames - 1);
+		interleaved[2 * i + 0] = data[2 * index + 0];
+		interleaved[2 * i + 1] = data[2 * index + 1];
+	}
+
+	read_count.store(consumed + available, std::memory_order_release);
+	return available;
+}
+
+uint64_t TapNode::get_dropped_frames() const noexcept
+{
+	return dropped.load(std::memory_order_relaxed);
+}
+
+float TapNode::get_sample_rate() const noexcept
+{
+	return sample_rate.load(std::memory_order_acquire);
+}
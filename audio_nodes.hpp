@@ -0,0 +1,176 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include "audio_graph.hpp"
+#include "aligned_alloc.hpp"
+#include "dsp.hpp"
+#include "limiter.hpp"
+#include "convolver.hpp"
+
+// Sums up to DSP::MaxMixInputs inputs with per-input gain and pan, and meters every input after its gain.
+// Silent inputs are left out of the sum.
+class MixerNode final : public AudioNode
+{
+public:
+	explicit MixerNode(unsigned num_inputs);
+
+	// Safe to call from any thread, changes are ramped over a block.
+	// pan is a balance control in [-1, 1], the center position leaves both channels at gain.
+	void set_input_level(unsigned input, float gain, float pan);
+
+	// Post-gain peak and RMS, measured over a short window.
+	void get_input_meter(unsigned input, float &peak, float &rms) const noexcept;
+
+	unsigned get_num_inputs() const noexcept override;
+	unsigned get_num_outputs() const noexcept override;
+	void prepare(float sample_rate, size_t max_frames) override;
+	void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept override;
+	void skip(size_t num_frames) noexcept override;
+
+private:
+	struct Channel
+	{
+		std::atomic<float> target_gain_left{1.0f};
+		std::atomic<float> target_gain_right{1.0f};
+		float gain_left = 1.0f;
+		float gain_right = 1.0f;
+
+		float window_peak = 0.0f;
+		float window_sum_squares = 0.0f;
+		uint32_t window_frames = 0;
+		std::atomic<float> peak{0.0f};
+		std::atomic<float> rms{0.0f};
+	};
+
+	Channel channels[DSP::MaxMixInputs];
+	unsigned num_inputs;
+	uint32_t meter_window_frames = 0;
+
+	void clear_meters() noexcept;
+};
+
+// Gain ramped over a block, in place.
+class GainNode final : public AudioNode
+{
+public:
+	explicit GainNode(float gain = 1.0f);
+
+	// Safe to call from any thread.
+	void set_gain(float gain);
+
+	unsigned get_num_inputs() const noexcept override;
+	unsigned get_num_outputs() const noexcept override;
+	bool processes_in_place() const noexcept override;
+	void prepare(float sample_rate, size_t max_frames) override;
+	void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept override;
+
+private:
+	std::atomic<float> target_gain;
+	float gain;
+};
+
+// See Limiter. Runs in place and adds its lookahead to the graph latency.
+class LimiterNode final : public AudioNode
+{
+public:
+	explicit LimiterNode(const Limiter::Options &options);
+
+	// Lowest limiter gain since the last call, 1 if it didn't have to act. Safe from any thread.
+	float consume_min_gain() noexcept;
+
+	unsigned get_num_inputs() const noexcept override;
+	unsigned get_num_outputs() const noexcept override;
+	bool processes_in_place() const noexcept override;
+	void prepare(float sample_rate, size_t max_frames) override;
+	void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept override;
+	void skip(size_t num_frames) noexcept override;
+	void on_start() override;
+	unsigned get_latency_frames() const noexcept override;
+
+private:
+	Limiter limiter;
+	Limiter::Options options;
+	bool enabled = false;
+	// The lookahead was cleared when the input went silent.
+	bool idle = true;
+};
+
+// See Convolver. Runs in place, and keeps the graph going until the tail has rung out.
+class ConvolverNode final : public AudioNode
+{
+public:
+	explicit ConvolverNode(const Convolver::Options &options);
+	bool load(const char *path);
+
+	unsigned get_num_inputs() const noexcept override;
+	unsigned get_num_outputs() const noexcept override;
+	bool processes_in_place() const noexcept override;
+	void prepare(float sample_rate, size_t max_frames) override;
+	void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept override;
+	bool is_silent() noexcept override;
+	void on_start() override;
+
+private:
+	Convolver convolver;
+	Convolver::Options options;
+	bool enabled = false;
+};
+
+// Passes its input through and copies it into a ring buffer, which another thread drains,
+// e.g. to record the output. Frames which don't fit because the reader fell behind are dropped.
+class TapNode final : public AudioNode
+{
+public:
+	explicit TapNode(float buffer_seconds);
+
+	// Reader side, from a single thread. Returns interleaved stereo frames.
+	size_t read(float *interleaved, size_t max_frames) noexcept;
+	uint64_t get_dropped_frames() const noexcept;
+	// 0 until the graph is prepared.
+	float get_sample_rate() const noexcept;
+
+	unsigned get_num_inputs() const noexcept override;
+	unsigned get_num_outputs() const noexcept override;
+	bool processes_in_place() const noexcept override;
+	void prepare(float sample_rate, size_t max_frames) override;
+	void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept override;
+	void skip(size_t num_frames) noexcept override;
+	bool needs_every_frame() const noexcept override;
+
+private:
+	float buffer_seconds;
+	std::atomic<float> sample_rate{0.0f};
+	std::unique_ptr<float, Util::AlignedDeleter> ring;
+	// Power of two, in frames.
+	size_t ring_frames = 0;
+	std::atomic<uint64_t> write_count{0};
+	std::atomic<uint64_t> read_count{0};
+	std::atomic<uint64_t> dropped{0};
+
+	void write(const float *left, const float *right, size_t num_frames) noexcept;
+};
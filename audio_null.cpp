@@ -0,0 +1,168 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "audio_null.hpp"
+#include "timer.hpp"
+#include "dsp.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+NullAudio::NullAudio(BackendCallback *callback_, const Options &options_)
+	: callback(callback_), options(options_)
+{
+	options.block_frames = std::max<size_t>(1, std::min<size_t>(options.block_frames, MaxBlockFrames));
+}
+
+NullAudio::~NullAudio()
+{
+	stop();
+}
+
+bool NullAudio::init(float sample_rate_, unsigned channels_)
+{
+	if (channels_ == 0 || channels_ > MaxChannels)
+		return false;
+
+	sample_rate = sample_rate_;
+	channels = channels_;
+
+	if (!options.wav_path.empty() && !wav.init(options.wav_path.c_str(), unsigned(sample_rate), channels))
+		return false;
+
+	if (callback)
+		callback->set_backend_parameters(sample_rate, channels, options.block_frames);
+
+	return true;
+}
+
+bool NullAudio::start()
+{
+	if (is_active)
+		return false;
+	is_active = true;
+	dead = false;
+
+	if (callback)
+	{
+		callback->on_backend_start();
+		thr = std::thread(&NullAudio::thread_runner, this);
+	}
+
+	return true;
+}
+
+bool NullAudio::stop()
+{
+	if (!is_active)
+		return false;
+	is_active = false;
+
+	if (thr.joinable())
+	{
+		dead.store(true, std::memory_order_relaxed);
+		thr.join();
+	}
+
+	if (callback)
+		callback->on_backend_stop();
+
+	wav.close();
+	return true;
+}
+
+void NullAudio::report_stats() const
+{
+	if (!frames_rendered)
+		return;
+
+	double audio_time = double(frames_rendered) / sample_rate;
+	double render_time = 1e-9 * double(render_time_nsecs);
+	double wall_time = 1e-9 * double(wall_time_nsecs);
+
+	fprintf(stderr, "NullAudio: rendered %.3f s of audio in %.3f s (wall %.3f s), realtime factor %.2fx, %.1f ns / frame.\n",
+	        audio_time, render_time, wall_time,
+	        render_time > 0.0 ? audio_time / render_time : 0.0,
+	        1e9 * render_time / double(frames_rendered));
+}
+
+void NullAudio::thread_runner() noexcept
+{
+	float mix_channels[MaxChannels][MaxBlockFrames];
+	float interleaved[MaxChannels * MaxBlockFrames];
+	float *mix_channel_ptr[MaxChannels];
+	for (unsigned i = 0; i < channels; i++)
+		mix_channel_ptr[i] = mix_channels[i];
+
+	uint64_t max_frames = options.duration > 0.0 ? uint64_t(options.duration * sample_rate) : UINT64_MAX;
+	int64_t start_time = Util::get_current_time_nsecs();
+
+	while (!dead.load(std::memory_order_relaxed) && frames_rendered < max_frames)
+	{
+		size_t to_write = size_t(std::min<uint64_t>(options.block_frames, max_frames - frames_rendered));
+
+		if (options.realtime)
+		{
+			// Don't run ahead of wall time by more than one block.
+			auto target_time = start_time + int64_t(1e9 * double(frames_rendered) / sample_rate);
+			auto current_time = Util::get_current_time_nsecs();
+			if (target_time > current_time)
+				std::this_thread::sleep_for(std::chrono::nanoseconds(target_time - current_time));
+		}
+
+		auto render_start = Util::get_current_time_nsecs();
+		callback->mix_samples(mix_channel_ptr, to_write);
+		render_time_nsecs += Util::get_current_time_nsecs() - render_start;
+
+		// The block we just rendered is presented immediately.
+		callback->set_latency_usec(0);
+
+		if (!options.wav_path.empty())
+		{
+			if (channels == 2)
+			{
+				DSP::interleave_stereo_f32(interleaved, mix_channels[0], mix_channels[1], to_write);
+			}
+			else
+			{
+				float *out = interleaved;
+				for (size_t f = 0; f < to_write; f++)
+					for (unsigned c = 0; c < channels; c++)
+						*out++ = mix_channels[c][f];
+			}
+
+			if (!wav.write(interleaved, to_write))
+			{
+				fprintf(stderr, "NullAudio: failed to write WAV output.\n");
+				break;
+			}
+		}
+
+		frames_rendered += to_write;
+	}
+
+	wall_time_nsecs = Util::get_current_time_nsecs() - start_time;
+
+	// Report as soon as the duration runs out, main may stay blocked on its MIDI source for a long time.
+	// The WAV is finished here too, so that it can be used right away.
+	wav.close();
+	report_stats();
+}
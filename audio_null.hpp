@@ -0,0 +1,86 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <string>
+#include "audio_backend.hpp"
+#include "wav.hpp"
+
+// Headless backend which drives the callback from its own clock.
+// Either paced to wall time, or free-running as fast as the CPU allows.
+// Useful for measuring render throughput on machines without a sound server.
+
+struct NullAudio final : AudioBackend
+{
+public:
+	struct Options
+	{
+		// If false, render as fast as possible.
+		bool realtime = true;
+		size_t block_frames = 256;
+		// Stop rendering after this many seconds of audio. 0 means unbounded.
+		double duration = 0.0;
+		// Optional output file.
+		std::string wav_path;
+	};
+
+	NullAudio(BackendCallback *callback_, const Options &options_);
+	~NullAudio() override;
+
+	bool init(float sample_rate_, unsigned channels_) override;
+	bool start() override;
+	bool stop() override;
+
+	float get_sample_rate() const override
+	{
+		return sample_rate;
+	}
+
+	unsigned get_num_channels() const override
+	{
+		return channels;
+	}
+
+	enum { MaxChannels = 2, MaxBlockFrames = 1024 };
+
+	BackendCallback *callback;
+	Options options;
+	float sample_rate = 0.0f;
+	unsigned channels = 0;
+
+	void thread_runner() noexcept;
+
+	std::thread thr;
+	std::atomic<bool> dead;
+	bool is_active = false;
+
+	WAVWriter wav;
+
+	uint64_t frames_rendered = 0;
+	int64_t render_time_nsecs = 0;
+	int64_t wall_time_nsecs = 0;
+
+	void report_stats() const;
+};
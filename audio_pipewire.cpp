@@ -0,0 +1,274 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "audio_pipewire.hpp"
+#include "dsp.hpp"
+#include <spa/param/audio/format-utils.h>
+#include <spa/param/latency-utils.h>
+#include <stdio.h>
+#include <algorithm>
+
+// How long init() waits for format negotiation, in seconds.
+static constexpr int NegotiationTimeoutSeconds = 5;
+
+PipeWireAudio::PipeWireAudio(BackendCallback *callback_, const Options &options_)
+	: callback(callback_), options(options_)
+{
+	pw_init(nullptr, nullptr);
+
+	stream_events.version = PW_VERSION_STREAM_EVENTS;
+	stream_events.state_changed = [](void *data, pw_stream_state, pw_stream_state state, const char *error) {
+		static_cast<PipeWireAudio *>(data)->on_state_changed(state, error);
+	};
+	stream_events.param_changed = [](void *data, uint32_t id, const spa_pod *param) {
+		static_cast<PipeWireAudio *>(data)->on_param_changed(id, param);
+	};
+	stream_events.process = [](void *data) {
+		static_cast<PipeWireAudio *>(data)->on_process();
+	};
+}
+
+PipeWireAudio::~PipeWireAudio()
+{
+	stop();
+
+	if (loop)
+		pw_thread_loop_stop(loop);
+	if (stream)
+		pw_stream_destroy(stream);
+	if (loop)
+		pw_thread_loop_destroy(loop);
+
+	pw_deinit();
+}
+
+void PipeWireAudio::on_state_changed(pw_stream_state state, const char *error)
+{
+	if (state == PW_STREAM_STATE_ERROR || state == PW_STREAM_STATE_UNCONNECTED)
+	{
+		if (error)
+			fprintf(stderr, "PipeWire: stream error: %s.\n", error);
+		has_error = true;
+	}
+
+	pw_thread_loop_signal(loop, false);
+}
+
+void PipeWireAudio::on_param_changed(uint32_t id, const spa_pod *param)
+{
+	if (id != SPA_PARAM_Format || !param)
+		return;
+
+	spa_audio_info_raw info = {};
+	if (spa_format_audio_raw_parse(param, &info) < 0)
+		return;
+
+	// The rate was left open, so this is the graph rate.
+	sample_rate = float(info.rate);
+	has_format = true;
+	pw_thread_loop_signal(loop, false);
+}
+
+bool PipeWireAudio::init(float sample_rate_, unsigned channels_)
+{
+	// The DSP conversion kernels only deal with stereo.
+	if (channels_ != 2)
+		return false;
+
+	sample_rate = sample_rate_;
+	channels = channels_;
+	mix_buffer.resize(2 * MaxBlockFrames);
+	mix_channels[0] = mix_buffer.data();
+	mix_channels[1] = mix_buffer.data() + MaxBlockFrames;
+
+	loop = pw_thread_loop_new("sussybard", nullptr);
+	if (!loop)
+		return false;
+
+	auto *props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio",
+	                                PW_KEY_MEDIA_CATEGORY, "Playback",
+	                                PW_KEY_MEDIA_ROLE, "Music",
+	                                nullptr);
+	pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%u/%u", options.quantum, unsigned(sample_rate_));
+	if (!options.target.empty())
+		pw_properties_set(props, "target.object", options.target.c_str());
+
+	stream = pw_stream_new_simple(pw_thread_loop_get_loop(loop), "Sussybard", props, &stream_events, this);
+	if (!stream)
+		return false;
+
+	// Leave the rate open, so that we get the graph rate instead of a resampler.
+	spa_audio_info_raw info = {};
+	info.format = SPA_AUDIO_FORMAT_F32;
+	info.channels = channels_;
+	info.position[0] = SPA_AUDIO_CHANNEL_FL;
+	info.position[1] = SPA_AUDIO_CHANNEL_FR;
+
+	uint8_t pod_buffer[1024];
+	spa_pod_builder builder = SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+	const spa_pod *params[1] = { spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info) };
+
+	pw_thread_loop_lock(loop);
+	if (pw_thread_loop_start(loop) < 0)
+	{
+		pw_thread_loop_unlock(loop);
+		return false;
+	}
+
+	auto flags = static_cast<pw_stream_flags>(PW_STREAM_FLAG_AUTOCONNECT |
+	                                          PW_STREAM_FLAG_MAP_BUFFERS |
+	                                          PW_STREAM_FLAG_RT_PROCESS |
+	                                          PW_STREAM_FLAG_INACTIVE);
+	if (pw_stream_connect(stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, flags, params, 1) < 0)
+	{
+		pw_thread_loop_unlock(loop);
+		return false;
+	}
+
+	while (!has_format && !has_error)
+	{
+		if (pw_thread_loop_timed_wait(loop, NegotiationTimeoutSeconds) != 0)
+		{
+			fprintf(stderr, "PipeWire: timed out waiting for format negotiation.\n");
+			has_error = true;
+		}
+	}
+	pw_thread_loop_unlock(loop);
+
+	if (has_error)
+		return false;
+
+	fprintf(stderr, "PipeWire: %.0f Hz, requested quantum %u.\n", double(sample_rate), options.quantum);
+	if (callback)
+	{
+		callback->set_backend_parameters(sample_rate, channels, MaxBlockFrames);
+		publish_process_latency();
+	}
+
+	return true;
+}
+
+// Lets the graph include our own delay, e.g. limiter lookahead, in the latency it reports to others.
+void PipeWireAudio::publish_process_latency()
+{
+	uint32_t usec = callback->get_processing_latency_usec();
+	if (!usec)
+		return;
+
+	spa_process_latency_info info = {};
+	info.ns = uint64_t(usec) * 1000;
+
+	uint8_t pod_buffer[256];
+	spa_pod_builder builder = SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+	const spa_pod *params[1] = { spa_process_latency_build(&builder, SPA_PARAM_ProcessLatency, &info) };
+
+	pw_thread_loop_lock(loop);
+	int ret = pw_stream_update_params(stream, params, 1);
+	pw_thread_loop_unlock(loop);
+
+	if (ret < 0)
+		fprintf(stderr, "PipeWire: failed to report processing latency.\n");
+}
+
+bool PipeWireAudio::start()
+{
+	if (is_active || !stream)
+		return false;
+
+	pw_thread_loop_lock(loop);
+	if (callback)
+		callback->on_backend_start();
+	int ret = pw_stream_set_active(stream, true);
+	pw_thread_loop_unlock(loop);
+
+	is_active = ret >= 0;
+	if (!is_active)
+		fprintf(stderr, "PipeWireAudio::start() failed.\n");
+	return is_active;
+}
+
+bool PipeWireAudio::stop()
+{
+	if (!is_active)
+		return false;
+
+	pw_thread_loop_lock(loop);
+	int ret = pw_stream_set_active(stream, false);
+	if (callback)
+		callback->on_backend_stop();
+	pw_thread_loop_unlock(loop);
+
+	is_active = false;
+	if (ret < 0)
+		fprintf(stderr, "PipeWireAudio::stop() failed.\n");
+	return ret >= 0;
+}
+
+void PipeWireAudio::update_latency(uint32_t queued_frames) noexcept
+{
+	pw_time time = {};
+	if (pw_stream_get_time_n(stream, &time, sizeof(time)) < 0 || time.rate.denom == 0)
+		return;
+
+	// delay is in graph clock ticks until the device, buffered is in stream frames,
+	// and the quantum we just queued plays out before the next frame we render.
+	double delay_usec = 1e6 * double(time.delay) * double(time.rate.num) / double(time.rate.denom);
+	double buffered_usec = 1e6 * double(time.buffered + queued_frames) / double(sample_rate);
+	callback->set_latency_usec(uint32_t(std::max(0.0, delay_usec + buffered_usec)));
+}
+
+void PipeWireAudio::on_process() noexcept
+{
+	pw_buffer *buffer = pw_stream_dequeue_buffer(stream);
+	if (!buffer)
+		return;
+
+	spa_buffer *buf = buffer->buffer;
+	auto *target = static_cast<float *>(buf->datas[0].data);
+	if (!target)
+	{
+		pw_stream_queue_buffer(stream, buffer);
+		return;
+	}
+
+	uint32_t stride = uint32_t(sizeof(float) * channels);
+	uint32_t num_frames = buf->datas[0].maxsize / stride;
+	// One graph quantum.
+	if (buffer->requested)
+		num_frames = std::min(num_frames, uint32_t(buffer->requested));
+
+	uint32_t offset = 0;
+	while (offset < num_frames)
+	{
+		uint32_t to_render = std::min<uint32_t>(num_frames - offset, MaxBlockFrames);
+		callback->mix_samples(mix_channels, to_render);
+		DSP::interleave_stereo_f32(target + 2 * offset, mix_channels[0], mix_channels[1], to_render);
+		offset += to_render;
+	}
+
+	buf->datas[0].chunk->offset = 0;
+	buf->datas[0].chunk->stride = int32_t(stride);
+	buf->datas[0].chunk->size = num_frames * stride;
+	pw_stream_queue_buffer(stream, buffer);
+
+	update_latency(num_frames);
+}
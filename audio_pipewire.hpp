@@ -0,0 +1,84 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <pipewire/pipewire.h>
+#include <string>
+#include <vector>
+#include "audio_backend.hpp"
+
+// Native PipeWire stream. mix_samples() runs directly in the graph's realtime process callback,
+// one graph quantum at a time, so there is no extra buffer or IPC hop on top of the graph itself.
+// The stream takes the graph's rate, so the server doesn't resample either.
+struct PipeWireAudio final : AudioBackend
+{
+public:
+	struct Options
+	{
+		// Node name or serial to connect to, e.g. a null sink for testing. Empty means the default sink.
+		std::string target;
+		// Requested graph quantum. The graph may run with a larger one if other clients need it.
+		unsigned quantum = 128;
+	};
+
+	PipeWireAudio(BackendCallback *callback_, const Options &options_);
+	~PipeWireAudio() override;
+
+	bool init(float sample_rate_, unsigned channels_) override;
+	bool start() override;
+	bool stop() override;
+
+	float get_sample_rate() const override
+	{
+		return sample_rate;
+	}
+
+	unsigned get_num_channels() const override
+	{
+		return channels;
+	}
+
+	// Upper bound of the graph quantum in PipeWire's default configuration.
+	enum { MaxBlockFrames = 8192 };
+
+	BackendCallback *callback;
+	Options options;
+	float sample_rate = 0.0f;
+	unsigned channels = 0;
+
+	pw_thread_loop *loop = nullptr;
+	pw_stream *stream = nullptr;
+	pw_stream_events stream_events = {};
+	bool has_format = false;
+	bool has_error = false;
+	bool is_active = false;
+
+	std::vector<float> mix_buffer;
+	float *mix_channels[2] = {};
+
+	void on_process() noexcept;
+	void on_param_changed(uint32_t id, const spa_pod *param);
+	void on_state_changed(pw_stream_state state, const char *error);
+	void update_latency(uint32_t queued_frames) noexcept;
+	void publish_process_latency();
+};
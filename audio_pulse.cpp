@@ -23,18 +23,26 @@
 #include "audio_pulse.hpp"
 #include <pulse/pulseaudio.h>
 #include "dsp.hpp"
+#include "realtime.hpp"
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
 
-static constexpr size_t MAX_NUM_SAMPLES = 256;
+// Playback has to be free of underflows for this long before the target latency is lowered again.
+static constexpr double SHRINK_AFTER_SECONDS = 10.0;
 using namespace std;
 
 Pulse::Pulse(BackendCallback *callback_)
-	: callback(callback_)
+	: Pulse(callback_, {})
 {
 }
 
+Pulse::Pulse(BackendCallback *callback_, const Options &options_)
+	: callback(callback_), options(options_)
+{
+	DSP::init_dither(dither, 0x5eed);
+}
+
 Pulse::~Pulse()
 {
 	if (is_active)
@@ -87,6 +95,19 @@ static void stream_buffer_attr_cb(pa_stream *s, void *data)
 		pa->update_buffer_attr(*server_attr);
 }
 
+static void stream_set_buffer_attr_cb(pa_stream *s, int success, void *data)
+{
+	auto *pa = static_cast<Pulse *>(data);
+	auto *server_attr = pa_stream_get_buffer_attr(s);
+	if (success && server_attr)
+		pa->update_buffer_attr(*server_attr);
+}
+
+static void stream_underflow_cb(pa_stream *, void *data)
+{
+	static_cast<Pulse *>(data)->on_underflow();
+}
+
 static void stream_request_cb(pa_stream *s, size_t length, void *data)
 {
 	auto *pa = static_cast<Pulse *>(data);
@@ -99,54 +120,54 @@ static void stream_request_cb(pa_stream *s, size_t length, void *data)
 		return;
 	}
 
-	// For callback based audio, render out audio immediately as requested.
-
-	float mix_channels[Pulse::MaxChannels][MAX_NUM_SAMPLES];
-	float *mix_channel_ptr[Pulse::MaxChannels];
-	for (unsigned i = 0; i < pa->channels; i++)
-		mix_channel_ptr[i] = mix_channels[i];
-
-	void *out_data;
-	if (pa_stream_begin_write(s, &out_data, &length) < 0)
+	// The mainloop thread is created by libpulse, so this is the first chance to set it up.
+	if (!pa->has_thread_setup)
 	{
-		fprintf(stderr, "pa_stream_begin_write() failed.\n");
-		return;
+		Util::setup_current_thread(Util::ThreadRole::Audio);
+		pa->has_thread_setup = true;
 	}
 
-	auto *out_interleaved = static_cast<float *>(out_data);
-	size_t out_frames = pa->to_frames(length);
-	unsigned channels = pa->channels;
+	// For callback based audio, render out audio immediately as requested.
+	size_t frame_size = pa->get_frame_size();
+	size_t remaining = pa->to_render_frames(pa->to_frames(length));
+	size_t written_frames = 0;
+	bool silent = true;
 
-	if (pa->is_active)
+	while (remaining != 0)
 	{
-		while (out_frames != 0)
+		// The server may hand out less than asked for, its memory blocks are limited in size.
+		void *out_data;
+		size_t out_length = remaining * frame_size;
+		if (pa_stream_begin_write(s, &out_data, &out_length) < 0)
 		{
-			size_t to_write = std::min<size_t>(out_frames, MAX_NUM_SAMPLES);
-			cb->mix_samples(mix_channel_ptr, to_write);
-			out_frames -= to_write;
+			fprintf(stderr, "pa_stream_begin_write() failed.\n");
+			break;
+		}
 
-			if (channels == 2)
-			{
-				DSP::interleave_stereo_f32(out_interleaved, mix_channels[0], mix_channels[1], to_write);
-				out_interleaved += to_write * channels;
-			}
-			else
-			{
-				for (size_t f = 0; f < to_write; f++)
-					for (unsigned c = 0; c < channels; c++)
-						*out_interleaved++ = mix_channels[c][f];
-			}
+		size_t out_frames = std::min(pa->to_frames(out_length), remaining);
+
+		// Less than a frame would never shrink remaining, leave the rest for the next request.
+		if (!out_frames)
+		{
+			pa_stream_cancel_write(s);
+			break;
 		}
-	}
-	else
-		memset(out_interleaved, 0, sizeof(float) * channels * out_frames);
 
-	if (pa_stream_write(s, out_data, length, nullptr, 0, PA_SEEK_RELATIVE) < 0)
-	{
-		fprintf(stderr, "pa_stream_write() failed.\n");
-		return;
+		silent = pa->write_frames(static_cast<uint8_t *>(out_data), out_frames) && silent;
+
+		if (pa_stream_write(s, out_data, out_frames * frame_size, nullptr, 0, PA_SEEK_RELATIVE) < 0)
+		{
+			fprintf(stderr, "pa_stream_write() failed.\n");
+			break;
+		}
+
+		remaining -= out_frames;
+		written_frames += out_frames;
 	}
 
+	pa->on_written(written_frames);
+	pa->update_idle(written_frames, silent);
+
 	// Update latency information.
 	pa_usec_t latency_usec;
 	int negative = 0;
@@ -155,12 +176,192 @@ static void stream_request_cb(pa_stream *s, size_t length, void *data)
 	if (negative)
 		latency_usec = 0;
 
+	// Carried frames are rendered already, and play out before the next block.
+	latency_usec += pa_usec_t(1e6 * double(pa->carry_frames) / double(pa->sample_rate));
 	cb->set_latency_usec(uint32_t(latency_usec));
 }
 
+bool Pulse::write_frames(uint8_t *out_interleaved, size_t out_frames) noexcept
+{
+	if (carry_buffer.empty())
+		return render(out_interleaved, out_frames);
+
+	// Whole blocks only. The rest of the last block is kept for the next write,
+	// since the server hands out memory in sizes which have nothing to do with our blocks.
+	size_t frame_size = get_frame_size();
+	size_t block_frames = options.block_frames;
+	bool silent = true;
+
+	size_t to_copy = std::min(carry_frames, out_frames);
+	if (to_copy)
+	{
+		memcpy(out_interleaved, carry_buffer.data() + (block_frames - carry_frames) * frame_size, to_copy * frame_size);
+		carry_frames -= to_copy;
+		out_interleaved += to_copy * frame_size;
+		out_frames -= to_copy;
+		silent = carry_silent;
+	}
+
+	size_t whole_frames = out_frames - out_frames % block_frames;
+	if (whole_frames)
+	{
+		silent = render(out_interleaved, whole_frames) && silent;
+		out_interleaved += whole_frames * frame_size;
+		out_frames -= whole_frames;
+	}
+
+	if (out_frames)
+	{
+		carry_silent = render(carry_buffer.data(), block_frames);
+		memcpy(out_interleaved, carry_buffer.data(), out_frames * frame_size);
+		carry_frames = block_frames - out_frames;
+		silent = carry_silent && silent;
+	}
+
+	return silent;
+}
+
+bool Pulse::render(uint8_t *out_interleaved, size_t out_frames) noexcept
+{
+	size_t frame_size = get_frame_size();
+	// Writing zeros directly skips the synth as well as format conversion and dither.
+	if (!is_active || is_idle.load(std::memory_order_relaxed))
+	{
+		memset(out_interleaved, 0, frame_size * out_frames);
+		return true;
+	}
+
+	if (callback->is_silent())
+	{
+		memset(out_interleaved, 0, frame_size * out_frames);
+		callback->skip_samples(out_frames);
+		return true;
+	}
+
+	auto format = options.format;
+	auto *dither_state = options.dither ? &dither : nullptr;
+	size_t max_frames = get_max_block_frames();
+
+	while (out_frames != 0)
+	{
+		size_t to_write = std::min(out_frames, max_frames);
+		callback->mix_samples(mix_channels, to_write);
+		out_frames -= to_write;
+
+		if (channels == 2)
+		{
+			DSP::interleave_stereo(out_interleaved, format, mix_channels[0], mix_channels[1], to_write, dither_state);
+		}
+		else
+		{
+			// Mono, reuse the stereo kernels by feeding the same channel twice and dropping half.
+			for (size_t f = 0; f < to_write; f++)
+			{
+				uint8_t stereo[2 * sizeof(float)];
+				DSP::interleave_stereo(stereo, format, mix_channels[0] + f, mix_channels[0] + f, 1, dither_state);
+				memcpy(out_interleaved + f * frame_size, stereo, frame_size);
+			}
+		}
+
+		out_interleaved += to_write * frame_size;
+	}
+
+	return false;
+}
+
+void Pulse::update_idle(size_t frames, bool silent) noexcept
+{
+	if (!silent)
+	{
+		silent_frames = 0;
+		return;
+	}
+
+	silent_frames += frames;
+	if (options.idle_seconds <= 0.0 || !is_active || is_idle.load(std::memory_order_relaxed) ||
+	    double(silent_frames) < options.idle_seconds * double(sample_rate) || !callback->allows_idle())
+	{
+		return;
+	}
+
+	// The buffer is full of silence by now, and stays that way while corked.
+	// When wake() uncorks, that silence plays out while the next blocks are rendered,
+	// so the first note lands at the usual latency.
+	is_idle.store(true, std::memory_order_relaxed);
+
+	// Pairs with the fence in wake(). Either wake() sees us idle, or we see the event it was called for.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!callback->is_silent())
+	{
+		is_idle.store(false, std::memory_order_relaxed);
+		return;
+	}
+
+	callback->on_backend_stop();
+	if (auto *op = pa_stream_cork(stream, 1, nullptr, nullptr))
+		pa_operation_unref(op);
+}
+
+void Pulse::wake()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!is_idle.load(std::memory_order_relaxed))
+		return;
+
+	pa_threaded_mainloop_lock(mainloop);
+	if (is_idle.load(std::memory_order_relaxed) && is_active)
+	{
+		silent_frames = 0;
+		// Whatever was carried over is from before the stream went idle.
+		carry_frames = 0;
+		if (callback)
+			callback->on_backend_start();
+		// Don't wait for the server, the caller is about to dispatch a key press.
+		if (auto *op = pa_stream_cork(stream, 0, nullptr, nullptr))
+			pa_operation_unref(op);
+		is_idle.store(false, std::memory_order_relaxed);
+	}
+	pa_threaded_mainloop_unlock(mainloop);
+}
+
+size_t Pulse::to_render_frames(size_t frames) const noexcept
+{
+	if (!options.whole_blocks || !options.block_frames)
+		return frames;
+
+	// Round down, but always make progress. Overshooting a request by less than a block only adds a little latency.
+	size_t blocks = std::max<size_t>(frames / options.block_frames, 1);
+	return blocks * options.block_frames;
+}
+
+size_t Pulse::get_max_block_frames() const noexcept
+{
+	return options.block_frames ? options.block_frames : size_t(MaxBlockFrames);
+}
+
+size_t Pulse::get_frame_size() const noexcept
+{
+	return channels * DSP::get_sample_format_size(options.format);
+}
+
 size_t Pulse::to_frames(size_t size) const noexcept
 {
-	return size / (channels * sizeof(float));
+	return size / get_frame_size();
+}
+
+static pa_sample_format_t to_pa_sample_format(DSP::SampleFormat format)
+{
+	switch (format)
+	{
+	case DSP::SampleFormat::S16:
+		return PA_SAMPLE_S16NE;
+	case DSP::SampleFormat::S24_32:
+		return PA_SAMPLE_S24_32NE;
+	case DSP::SampleFormat::S32:
+		return PA_SAMPLE_S32NE;
+	default:
+		return PA_SAMPLE_FLOAT32NE;
+	}
 }
 
 void Pulse::update_buffer_attr(const pa_buffer_attr &attr) noexcept
@@ -168,6 +369,67 @@ void Pulse::update_buffer_attr(const pa_buffer_attr &attr) noexcept
 	buffer_frames = to_frames(attr.tlength);
 }
 
+void Pulse::set_target_latency(uint32_t usec) noexcept
+{
+	usec = std::max(usec, uint32_t(options.min_latency_ms * 1e3));
+	usec = std::min(usec, uint32_t(options.max_latency_ms * 1e3));
+	if (usec == target_latency_usec)
+		return;
+
+	target_latency_usec = usec;
+	clean_frames = 0;
+
+	pa_buffer_attr attr = {};
+	attr.maxlength = -1u;
+	attr.tlength = uint32_t(pa_usec_to_bytes(usec, pa_stream_get_sample_spec(stream)));
+	attr.prebuf = -1u;
+	attr.minreq = -1u;
+	attr.fragsize = -1u;
+
+	if (auto *op = pa_stream_set_buffer_attr(stream, &attr, stream_set_buffer_attr_cb, this))
+		pa_operation_unref(op);
+
+	fprintf(stderr, "Pulse: target latency %.1f ms (%u underflows).\n", 1e-3 * double(usec), underflows);
+}
+
+void Pulse::on_underflow() noexcept
+{
+	if (!is_active)
+		return;
+
+	underflows++;
+	if (callback)
+		callback->on_backend_xrun();
+
+	// Give the server one full buffer at the new size before growing again,
+	// a single glitch tends to report several underflows back to back.
+	if (clean_frames < buffer_frames)
+		return;
+
+	set_target_latency(target_latency_usec * 2);
+}
+
+void Pulse::on_written(size_t frames) noexcept
+{
+	clean_frames += frames;
+	if (target_latency_usec <= uint32_t(options.min_latency_ms * 1e3) ||
+	    double(clean_frames) < SHRINK_AFTER_SECONDS * double(sample_rate))
+	{
+		return;
+	}
+
+	// Our own counter restarts on every change, the server's counts bytes played since the last underrun,
+	// so both have to agree that playback has been clean.
+	const pa_timing_info *timing = pa_stream_get_timing_info(stream);
+	if (!timing || double(pa_bytes_to_usec(uint64_t(timing->since_underrun), pa_stream_get_sample_spec(stream))) <
+	               SHRINK_AFTER_SECONDS * 1e6)
+	{
+		return;
+	}
+
+	set_target_latency(target_latency_usec - target_latency_usec / 4);
+}
+
 bool Pulse::init(float sample_rate_, unsigned channels_)
 {
 	sample_rate = sample_rate_;
@@ -176,6 +438,30 @@ bool Pulse::init(float sample_rate_, unsigned channels_)
 	if (channels_ > Pulse::MaxChannels)
 		return false;
 
+	if (options.block_frames > MaxBlockFrames)
+	{
+		fprintf(stderr, "Pulse: block size must be at most %u frames.\n", unsigned(MaxBlockFrames));
+		return false;
+	}
+
+	// Planar scratch which the callback renders into, sized for the largest block.
+	size_t max_frames = get_max_block_frames();
+	mix_buffer.reset(static_cast<float *>(Util::memalign_calloc(64, channels_ * max_frames * sizeof(float))));
+	if (!mix_buffer)
+		return false;
+	for (unsigned i = 0; i < channels_; i++)
+		mix_channels[i] = mix_buffer.get() + i * max_frames;
+
+	if (options.whole_blocks && options.block_frames)
+		carry_buffer.resize(options.block_frames * get_frame_size());
+	carry_frames = 0;
+
+	if (options.min_latency_ms <= 0.0 || options.min_latency_ms > options.max_latency_ms)
+	{
+		fprintf(stderr, "Pulse: invalid latency bounds [%.1f, %.1f] ms.\n", options.min_latency_ms, options.max_latency_ms);
+		return false;
+	}
+
 	mainloop = pa_threaded_mainloop_new();
 	if (!mainloop)
 		return false;
@@ -203,7 +489,7 @@ bool Pulse::init(float sample_rate_, unsigned channels_)
 	}
 
 	pa_sample_spec spec = {};
-	spec.format = PA_SAMPLE_FLOAT32NE;
+	spec.format = to_pa_sample_format(options.format);
 	spec.channels = uint8_t(channels_);
 	spec.rate = uint32_t(sample_rate_);
 
@@ -217,10 +503,13 @@ bool Pulse::init(float sample_rate_, unsigned channels_)
 	pa_stream_set_state_callback(stream, stream_state_cb, this);
 	pa_stream_set_write_callback(stream, stream_request_cb, this);
 	pa_stream_set_buffer_attr_callback(stream, stream_buffer_attr_cb, this);
+	pa_stream_set_underflow_callback(stream, stream_underflow_cb, this);
 
 	pa_buffer_attr buffer_attr = {};
 	buffer_attr.maxlength = -1u;
-	buffer_attr.tlength = pa_usec_to_bytes(20000, &spec);
+	// Start aggressive, the controller backs off if the machine can't keep up.
+	target_latency_usec = uint32_t(options.min_latency_ms * 1e3);
+	buffer_attr.tlength = pa_usec_to_bytes(target_latency_usec, &spec);
 	buffer_attr.prebuf = -1u;
 	buffer_attr.minreq = -1u;
 	buffer_attr.fragsize = -1u;
@@ -249,8 +538,13 @@ bool Pulse::init(float sample_rate_, unsigned channels_)
 
 	auto *stream_spec = pa_stream_get_sample_spec(stream);
 	this->sample_rate = float(stream_spec->rate);
+	if (options.format != DSP::SampleFormat::F32)
+	{
+		fprintf(stderr, "Pulse: converting to %s%s client side.\n",
+		        DSP::sample_format_to_string(options.format), options.dither ? " with dither" : "");
+	}
 	if (callback)
-		callback->set_backend_parameters(this->sample_rate, channels_, MAX_NUM_SAMPLES);
+		callback->set_backend_parameters(this->sample_rate, channels_, get_max_block_frames());
 
 	if (const auto *attr = pa_stream_get_buffer_attr(stream))
 		update_buffer_attr(*attr);
@@ -266,6 +560,7 @@ bool Pulse::start()
 
 	has_success = false;
 	pa_threaded_mainloop_lock(mainloop);
+	carry_frames = 0;
 	if (callback)
 		callback->on_backend_start();
 	pa_stream_cork(stream, 0, stream_success_cb, this);
@@ -275,6 +570,8 @@ bool Pulse::start()
 	pa_threaded_mainloop_unlock(mainloop);
 
 	is_active = true;
+	is_idle.store(false, std::memory_order_relaxed);
+	silent_frames = 0;
 	has_success = false;
 	if (success < 0)
 		fprintf(stderr, "Pulse::start() failed.\n");
@@ -298,6 +595,7 @@ bool Pulse::stop()
 	pa_threaded_mainloop_unlock(mainloop);
 
 	is_active = false;
+	is_idle.store(false, std::memory_order_relaxed);
 	has_success = false;
 	if (success < 0)
 		fprintf(stderr, "Pulse::stop() failed.\n");
@@ -25,33 +25,62 @@
 #include <pulse/pulseaudio.h>
 #include <atomic>
 #include <vector>
-#include "synth.hpp"
+#include <memory>
+#include "audio_backend.hpp"
+#include "dsp.hpp"
+#include "aligned_alloc.hpp"
 
 // Hacked and stripped down version of Granite's Pulse backend.
 
-struct Pulse
+struct Pulse final : AudioBackend
 {
 public:
+	struct Options
+	{
+		// Integer formats are converted client side, which saves the server a conversion pass
+		// and halves the bandwidth for S16.
+		DSP::SampleFormat format = DSP::SampleFormat::F32;
+		bool dither = true;
+		// Bounds of the adaptive target latency (tlength). The stream starts at the minimum,
+		// grows after underflows and shrinks again after sustained clean playback.
+		double min_latency_ms = 5.0;
+		double max_latency_ms = 100.0;
+		// Frames per mix_samples() call. 0 renders each request in as few calls as the scratch buffer allows.
+		unsigned block_frames = 0;
+		// With block_frames set, round each request to whole blocks so the callback always sees the same size.
+		// Where the server's buffer splits a block, the rest of it is written with the next one.
+		// Otherwise the remainder of a request is rendered as a short block.
+		bool whole_blocks = false;
+		// Cork the stream after this much silence, and uncork on wake(). 0 keeps the stream running.
+		double idle_seconds = 10.0;
+	};
+
 	explicit Pulse(BackendCallback *callback_);
-	~Pulse();
+	Pulse(BackendCallback *callback_, const Options &options_);
+	~Pulse() override;
 
-	bool init(float sample_rate_, unsigned channels_);
-	bool start();
-	bool stop();
+	bool init(float sample_rate_, unsigned channels_) override;
+	bool start() override;
+	bool stop() override;
+	void wake() override;
 
-	float get_sample_rate() const
+	float get_sample_rate() const override
 	{
 		return sample_rate;
 	}
 
-	unsigned get_num_channels() const
+	unsigned get_num_channels() const override
 	{
 		return channels;
 	}
 
 	enum { MaxChannels = 2 };
+	// Largest block rendered in one call, the server rarely asks for more than this at once.
+	enum { MaxBlockFrames = 4096 };
 
 	BackendCallback *callback;
+	Options options;
+	DSP::Dither dither;
 	float sample_rate = 0.0f;
 	unsigned channels = 0;
 
@@ -59,12 +88,37 @@ public:
 	pa_context *context = nullptr;
 	pa_stream *stream = nullptr;
 	size_t buffer_frames = 0;
+
+	std::unique_ptr<float, Util::AlignedDeleter> mix_buffer;
+	float *mix_channels[MaxChannels] = {};
+
+	// With whole_blocks, the last carry_frames frames of a block which didn't fit the previous write, output format.
+	std::vector<uint8_t> carry_buffer;
+	size_t carry_frames = 0;
+	bool carry_silent = true;
+
+	// Latency controller state, only touched on the mainloop thread.
+	uint32_t target_latency_usec = 0;
+	size_t clean_frames = 0;
+	unsigned underflows = 0;
 	int success = -1;
 	bool has_success = false;
 	bool is_active = false;
+	bool has_thread_setup = false;
+
+	// Corked on silence. Set on the mainloop thread, cleared by wake() under the mainloop lock.
+	std::atomic<bool> is_idle{false};
+	size_t silent_frames = 0;
 
 	void update_buffer_attr(const pa_buffer_attr &attr) noexcept;
+	void set_target_latency(uint32_t usec) noexcept;
+	void on_underflow() noexcept;
+	void on_written(size_t frames) noexcept;
 	size_t to_frames(size_t size) const noexcept;
+	size_t to_render_frames(size_t frames) const noexcept;
+	size_t get_max_block_frames() const noexcept;
+	bool render(uint8_t *out_interleaved, size_t out_frames) noexcept;
+	bool write_frames(uint8_t *out_interleaved, size_t out_frames) noexcept;
+	void update_idle(size_t frames, bool silent) noexcept;
+	size_t get_frame_size() const noexcept;
 };
-
-using AudioBackend = Pulse;
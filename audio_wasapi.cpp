@@ -22,6 +22,7 @@
 
 #include "audio_wasapi.hpp"
 #include "dsp.hpp"
+#include "realtime.hpp"
 #include <algorithm>
 
 static const size_t MAX_NUM_FRAMES = 256;
@@ -213,6 +214,7 @@ void WASAPI::thread_runner() noexcept
 {
 	DWORD task_index = 0;
 	HANDLE audio_task = AvSetMmThreadCharacteristicsA("Pro Audio", &task_index);
+	Util::setup_current_thread(Util::ThreadRole::Audio);
 
 	if (!kick_start())
 	{
@@ -232,6 +234,10 @@ void WASAPI::thread_runner() noexcept
 		if (!get_write_avail_blocking(write_avail))
 			break;
 
+		// kick_start() filled the whole endpoint buffer, so finding it empty means it ran dry.
+		if (write_avail == buffer_frames)
+			callback->on_backend_xrun();
+
 		float *interleaved = nullptr;
 		if (FAILED(pRenderClient->GetBuffer(write_avail, reinterpret_cast<BYTE **>(&interleaved))))
 			break;
@@ -250,6 +256,11 @@ void WASAPI::thread_runner() noexcept
 
 		if (FAILED(pRenderClient->ReleaseBuffer(to_release, 0)))
 			break;
+
+		// Everything queued up in the endpoint buffer plays before the next frame we render.
+		UINT32 padding;
+		if (SUCCEEDED(pAudioClient->GetCurrentPadding(&padding)))
+			callback->set_latency_usec(uint32_t(1e6 * double(padding) / sample_rate));
 	}
 
 	if (audio_task)
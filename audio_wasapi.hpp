@@ -29,26 +29,26 @@
 #include <mmdeviceapi.h>
 #include <avrt.h>
 
-#include "synth.hpp"
+#include "audio_backend.hpp"
 
 // Hacked and stripped down version of Granite's WASAPI backend.
 
-struct WASAPI
+struct WASAPI final : AudioBackend
 {
 public:
 	explicit WASAPI(BackendCallback *callback_);
-	~WASAPI();
+	~WASAPI() override;
 
-	bool init(float sample_rate_, unsigned channels_);
-	bool start();
-	bool stop();
+	bool init(float sample_rate_, unsigned channels_) override;
+	bool start() override;
+	bool stop() override;
 
-	float get_sample_rate() const
+	float get_sample_rate() const override
 	{
 		return sample_rate;
 	}
 
-	unsigned get_num_channels() const
+	unsigned get_num_channels() const override
 	{
 		return channels;
 	}
@@ -78,5 +78,3 @@ public:
 	bool get_write_avail(UINT32 &avail) noexcept;
 	bool get_write_avail_blocking(UINT32 &avail) noexcept;
 };
-
-using AudioBackend = WASAPI;
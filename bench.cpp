@@ -0,0 +1,1684 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "synth.hpp"
+#include "resampler.hpp"
+#include "fm_engine.hpp"
+#include "limiter.hpp"
+#include "convolver.hpp"
+#include "audio_graph.hpp"
+#include "audio_nodes.hpp"
+#include "sample_bank.hpp"
+#include "wav.hpp"
+#include "dsp.hpp"
+#include "timer.hpp"
+#include "cli_parser.hpp"
+
+// Micro-benchmarks for the audio render path.
+// Human readable results go to stderr, CSV goes to stdout (or --output) so runs can be diffed.
+
+struct BenchResult
+{
+	std::string name;
+	unsigned block_frames;
+	unsigned splits;
+	unsigned voices;
+	double ns_per_frame;
+	double realtime_factor;
+	double worst_block_usec;
+};
+
+struct BenchArguments
+{
+	std::string output;
+	std::string filter;
+	std::string simd_level;
+	double seconds = 2.0;
+	float sample_rate = 48000.0f;
+	unsigned render_threads = 1;
+};
+
+static const unsigned block_sizes[] = { 16, 32, 64, 128, 256, 512, 1024 };
+
+static BenchResult bench_synth(const BenchArguments &args, Synth::Engine engine,
+                               unsigned block_frames, unsigned splits, unsigned voices,
+                               unsigned render_threads = 0, const SampleBank *bank = nullptr)
+{
+	std::unique_ptr<Synth> synth(new Synth);
+	synth->set_sample_bank(bank);
+	synth->set_render_threads(render_threads);
+	synth->set_num_splits(splits);
+	for (unsigned split = 0; split < splits; split++)
+		synth->set_split_engine(split, engine);
+
+	// Same stages as the default output path.
+	MixerNode mixer(splits);
+	LimiterNode limiter{Limiter::Options()};
+	AudioGraph graph;
+	unsigned synth_node = graph.add_node(synth.get());
+	unsigned mixer_node = graph.add_node(&mixer);
+	unsigned limiter_node = graph.add_node(&limiter);
+	for (unsigned split = 0; split < splits; split++)
+		graph.connect(synth_node, split, mixer_node, split);
+	graph.connect(mixer_node, 0, limiter_node, 0);
+	graph.set_output(limiter_node, 0);
+	graph.compile();
+
+	graph.set_backend_parameters(args.sample_rate, 2, block_frames);
+	graph.on_backend_start();
+
+	// Spread held notes over the range a Bard can play.
+	for (unsigned split = 0; split < splits; split++)
+		for (unsigned voice = 0; voice < voices; voice++)
+			synth->post_note_on(int(split), int(48 + (voice * 7) % 37));
+
+	std::vector<float> left(block_frames), right(block_frames);
+	float *channels[2] = { left.data(), right.data() };
+
+	// Warm up caches and get past the attack phase.
+	for (unsigned i = 0; i < 16; i++)
+		graph.mix_samples(channels, block_frames);
+
+	auto num_blocks = std::max<size_t>(1, size_t(args.seconds * args.sample_rate) / block_frames);
+	int64_t total_time = 0;
+	int64_t worst_time = 0;
+
+	for (size_t i = 0; i < num_blocks; i++)
+	{
+		auto start_time = Util::get_current_time_nsecs();
+		graph.mix_samples(channels, block_frames);
+		auto block_time = Util::get_current_time_nsecs() - start_time;
+		total_time += block_time;
+		worst_time = std::max(worst_time, block_time);
+	}
+
+	graph.on_backend_stop();
+
+	BenchResult result = {};
+	if (engine == Synth::Engine::Wavetable)
+		result.name = "synth_wavetable";
+	else if (engine == Synth::Engine::NativeFM)
+		result.name = "synth_fm_native";
+	else if (engine == Synth::Engine::SampleBank)
+		result.name = "synth_sample_bank";
+	else
+		result.name = "synth";
+	if (render_threads)
+		result.name += "_threaded";
+	result.block_frames = block_frames;
+	result.splits = splits;
+	result.voices = voices;
+
+	double frames = double(num_blocks * block_frames);
+	result.ns_per_frame = double(total_time) / frames;
+	result.realtime_factor = total_time ? (1e9 * frames / args.sample_rate) / double(total_time) : 0.0;
+	result.worst_block_usec = 1e-3 * double(worst_time);
+	return result;
+}
+
+// Renders the same sine to both channels.
+struct SineCallback final : BackendCallback
+{
+	explicit SineCallback(double frequency_)
+		: frequency(frequency_)
+	{
+	}
+
+	void mix_samples(float * const *channels, size_t num_frames) noexcept override
+	{
+		for (size_t i = 0; i < num_frames; i++, frame++)
+		{
+			float v = float(sin(2.0 * 3.14159265358979323846 * frequency * double(frame) / sample_rate));
+			channels[0][i] = v;
+			channels[1][i] = v;
+		}
+	}
+
+	void set_backend_parameters(float sample_rate_, unsigned, size_t) override
+	{
+		sample_rate = sample_rate_;
+	}
+
+	void on_backend_stop() override
+	{
+	}
+
+	void on_backend_start() override
+	{
+		frame = 0;
+	}
+
+	void set_latency_usec(uint32_t) override
+	{
+	}
+
+	double frequency;
+	double sample_rate = 0.0;
+	uint64_t frame = 0;
+};
+
+static BenchResult bench_resampler(const BenchArguments &args, Resampler::Quality quality, unsigned block_frames)
+{
+	SineCallback sine(1000.0);
+	Resampler resampler(&sine, 44100.0f, quality);
+	resampler.set_backend_parameters(args.sample_rate, 2, block_frames);
+	resampler.on_backend_start();
+
+	std::vector<float> left(block_frames), right(block_frames);
+	float *channels[2] = { left.data(), right.data() };
+
+	auto num_blocks = std::max<size_t>(1, size_t(args.seconds * args.sample_rate) / block_frames);
+	int64_t total_time = 0;
+	int64_t worst_time = 0;
+
+	for (size_t i = 0; i < num_blocks; i++)
+	{
+		auto start_time = Util::get_current_time_nsecs();
+		resampler.mix_samples(channels, block_frames);
+		auto block_time = Util::get_current_time_nsecs() - start_time;
+		total_time += block_time;
+		worst_time = std::max(worst_time, block_time);
+	}
+
+	BenchResult result = {};
+	result.name = std::string("resample_44100_") + Resampler::quality_to_string(quality);
+	result.block_frames = block_frames;
+	result.splits = 0;
+	result.voices = 0;
+
+	double frames = double(num_blocks * block_frames);
+	result.ns_per_frame = double(total_time) / frames;
+	result.realtime_factor = total_time ? (1e9 * frames / args.sample_rate) / double(total_time) : 0.0;
+	result.worst_block_usec = 1e-3 * double(worst_time);
+	return result;
+}
+
+static bool verify_resampler()
+{
+	// The kernel against the scalar reference, with arbitrary coefficients.
+	enum { Taps = 32, Phases = 3, Step = 2, Count = 1027 };
+	std::vector<float> filters(Taps * Phases), in_left(Count * Step / Phases + Taps + 1), in_right(in_left.size());
+	for (size_t i = 0; i < filters.size(); i++)
+		filters[i] = sinf(float(i) * 0.31f);
+	for (size_t i = 0; i < in_left.size(); i++)
+	{
+		in_left[i] = sinf(float(i) * 0.01f);
+		in_right[i] = cosf(float(i) * 0.013f);
+	}
+
+	DSP::PolyphaseState state = {};
+	state.filters = filters.data();
+	state.taps = Taps;
+	state.num_phases = Phases;
+	state.step = Step;
+	auto reference_state = state;
+
+	std::vector<float> left(Count), right(Count), reference_left(Count), reference_right(Count);
+	DSP::resample_stereo(left.data(), right.data(), in_left.data(), in_right.data(), state, Count);
+	DSP::resample_stereo_scalar(reference_left.data(), reference_right.data(),
+	                            in_left.data(), in_right.data(), reference_state, Count);
+
+	for (unsigned i = 0; i < Count; i++)
+	{
+		if (fabsf(left[i] - reference_left[i]) > 1e-4f || fabsf(right[i] - reference_right[i]) > 1e-4f)
+		{
+			fprintf(stderr, "resample_stereo: mismatch at %u.\n", i);
+			return false;
+		}
+	}
+
+	if (state.phase != reference_state.phase || state.position != reference_state.position)
+	{
+		fprintf(stderr, "resample_stereo: state mismatch.\n");
+		return false;
+	}
+
+	// End to end, a resampled sine must match the ideal sine at the output rate.
+	// Output frame 0 lines up with the first rendered frame, skip the startup transient.
+	static const Resampler::Quality qualities[] = {
+		Resampler::Quality::Low, Resampler::Quality::Medium, Resampler::Quality::High,
+	};
+	static const float tolerances[] = { 3e-3f, 3e-4f, 3e-5f };
+
+	for (unsigned q = 0; q < 3; q++)
+	{
+		SineCallback sine(1000.0);
+		Resampler resampler(&sine, 32000.0f, qualities[q]);
+		resampler.set_backend_parameters(48000.0f, 2, 256);
+		resampler.on_backend_start();
+
+		float *channels[2] = { left.data(), right.data() };
+		float max_error = 0.0f;
+		for (unsigned block = 0; block < 8; block++)
+		{
+			resampler.mix_samples(channels, 256);
+			for (unsigned i = 0; i < 256; i++)
+			{
+				unsigned frame = block * 256 + i;
+				if (frame < 256)
+					continue;
+				auto expected = float(sin(2.0 * 3.14159265358979323846 * 1000.0 * double(frame) / 48000.0));
+				max_error = std::max(max_error, std::max(fabsf(left[i] - expected), fabsf(right[i] - expected)));
+			}
+		}
+
+		if (max_error > tolerances[q])
+		{
+			fprintf(stderr, "resample_stereo: %s quality error %g exceeds %g.\n",
+			        Resampler::quality_to_string(qualities[q]), max_error, tolerances[q]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool verify_limiter()
+{
+	// Kernels against the scalar references. Both read history in front of the block.
+	enum { Count = 1027, History = 64, Window = 25 };
+	std::vector<float> left(History + Count), right(History + Count);
+	for (size_t i = 0; i < left.size(); i++)
+	{
+		left[i] = sinf(float(i) * 0.37f) * 1.5f;
+		right[i] = cosf(float(i) * 0.011f) * float(i % 17) * 0.1f;
+	}
+
+	float filters[DSP::TruePeakPhases * DSP::TruePeakTaps];
+	DSP::init_true_peak_filters(filters);
+
+	std::vector<float> peak(History + Count), reference_peak(History + Count);
+	DSP::true_peak_stereo(peak.data() + History, left.data() + History, right.data() + History, filters, Count);
+	DSP::true_peak_stereo_scalar(reference_peak.data() + History, left.data() + History, right.data() + History,
+	                             filters, 0, Count);
+
+	for (unsigned i = History; i < History + Count; i++)
+	{
+		if (fabsf(peak[i] - reference_peak[i]) > 1e-5f)
+		{
+			fprintf(stderr, "true_peak_stereo: mismatch at %u.\n", i - History);
+			return false;
+		}
+	}
+
+	for (unsigned i = 0; i < History; i++)
+		reference_peak[i] = float(i % 5) * 0.5f;
+
+	std::vector<float> gain(Count), reference_gain(Count);
+	DSP::limiter_gain(gain.data(), reference_peak.data() + History, Count, Window, 0.5f);
+	DSP::limiter_gain_scalar(reference_gain.data(), reference_peak.data() + History, 0, Count, Window, 0.5f);
+
+	for (unsigned i = 0; i < Count; i++)
+	{
+		if (fabsf(gain[i] - reference_gain[i]) > 1e-5f)
+		{
+			fprintf(stderr, "limiter_gain: mismatch at %u.\n", i);
+			return false;
+		}
+	}
+
+	// End to end, loud chords with transients must come out below the ceiling,
+	// and a quiet signal must come out untouched, only delayed.
+	const float sample_rate = 48000.0f;
+	const unsigned block_frames = 100;
+	const unsigned num_blocks = 480;
+	Limiter::Options options;
+	Limiter limiter;
+	if (!limiter.init(sample_rate, block_frames, options))
+		return false;
+
+	float ceiling = powf(10.0f, options.ceiling_db / 20.0f);
+	std::vector<float> input_left(block_frames * num_blocks), input_right(input_left.size());
+	for (size_t i = 0; i < input_left.size(); i++)
+	{
+		float t = float(i) / sample_rate;
+		float burst = (i % 4800) < 10 ? 4.0f : 0.0f;
+		input_left[i] = 1.5f * sinf(2.0f * 3.14159265f * 440.0f * t) + 1.2f * sinf(2.0f * 3.14159265f * 11025.0f * t) + burst;
+		input_right[i] = 2.5f * sinf(2.0f * 3.14159265f * 660.0f * t) - burst;
+	}
+
+	std::vector<float> output_left(History + input_left.size()), output_right(output_left.size());
+	for (unsigned block = 0; block < num_blocks; block++)
+	{
+		float *channels[2] = { output_left.data() + History + block * block_frames,
+		                       output_right.data() + History + block * block_frames };
+		memcpy(channels[0], input_left.data() + block * block_frames, block_frames * sizeof(float));
+		memcpy(channels[1], input_right.data() + block * block_frames, block_frames * sizeof(float));
+		limiter.process(channels, block_frames);
+	}
+
+	std::vector<float> output_peak(output_left.size());
+	DSP::true_peak_stereo_scalar(output_peak.data() + History, output_left.data() + History,
+	                             output_right.data() + History, filters, 0, input_left.size());
+	float worst = *std::max_element(output_peak.begin(), output_peak.end());
+	// The detector only estimates the true peak, leave a little room for its error.
+	if (worst > ceiling * 1.01f)
+	{
+		fprintf(stderr, "Limiter: true peak %.3f exceeds ceiling %.3f.\n", worst, ceiling);
+		return false;
+	}
+
+	limiter.reset();
+	unsigned delay = limiter.get_latency_frames();
+	for (unsigned block = 0; block < 4; block++)
+	{
+		float *channels[2] = { output_left.data() + block * block_frames, output_right.data() + block * block_frames };
+		for (unsigned i = 0; i < block_frames; i++)
+		{
+			channels[0][i] = 0.1f * input_left[block * block_frames + i];
+			channels[1][i] = 0.1f * input_right[block * block_frames + i];
+		}
+		limiter.process(channels, block_frames);
+	}
+
+	for (unsigned i = delay; i < 4 * block_frames; i++)
+	{
+		if (fabsf(output_left[i] - 0.1f * input_left[i - delay]) > 1e-6f ||
+		    fabsf(output_right[i] - 0.1f * input_right[i - delay]) > 1e-6f)
+		{
+			fprintf(stderr, "Limiter: quiet signal modified at frame %u.\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static BenchResult bench_limiter(const BenchArguments &args, unsigned block_frames)
+{
+	Limiter limiter;
+	limiter.init(args.sample_rate, block_frames, Limiter::Options());
+
+	std::vector<float> left(block_frames), right(block_frames);
+	float *channels[2] = { left.data(), right.data() };
+
+	enum { BlocksPerBatch = 64 };
+	auto num_batches = std::max<size_t>(1, size_t(args.seconds * args.sample_rate) / (block_frames * BlocksPerBatch));
+	int64_t total_time = 0;
+	int64_t worst_time = 0;
+	size_t frame = 0;
+
+	for (size_t i = 0; i < num_batches; i++)
+	{
+		int64_t batch_time = 0;
+		for (unsigned j = 0; j < BlocksPerBatch; j++)
+		{
+			// Loud enough that the limiter works all the time.
+			for (unsigned k = 0; k < block_frames; k++, frame++)
+			{
+				left[k] = 2.0f * sinf(float(frame) * 0.05f);
+				right[k] = 2.0f * cosf(float(frame) * 0.031f);
+			}
+
+			auto start_time = Util::get_current_time_nsecs();
+			limiter.process(channels, block_frames);
+			batch_time += Util::get_current_time_nsecs() - start_time;
+		}
+		total_time += batch_time;
+		worst_time = std::max(worst_time, batch_time);
+	}
+
+	BenchResult result = {};
+	result.name = "limiter";
+	result.block_frames = block_frames;
+	result.splits = 0;
+	result.voices = 0;
+
+	double frames = double(num_batches * BlocksPerBatch * block_frames);
+	result.ns_per_frame = double(total_time) / frames;
+	result.realtime_factor = total_time ? (1e9 * frames / args.sample_rate) / double(total_time) : 0.0;
+	result.worst_block_usec = 1e-3 * double(worst_time) / BlocksPerBatch;
+	return result;
+}
+
+static bool verify_convolver_case(unsigned response_channels, size_t response_frames,
+                                  unsigned partition_frames, float mix)
+{
+	// Long enough to drain, with the input cut off partway through.
+	const size_t input_frames = response_frames + 3000;
+	const size_t total_frames = input_frames + response_frames + 2 * partition_frames + 1000;
+	uint32_t seed = 1234;
+	const auto next_random = [&]() {
+		seed = seed * 1664525u + 1013904223u;
+		return float(seed >> 8) * (2.0f / 16777216.0f) - 1.0f;
+	};
+
+	std::vector<float> response(response_frames * response_channels);
+	for (size_t i = 0; i < response.size(); i++)
+		response[i] = next_random() * expf(-3.0f * float(i) / float(response.size()));
+
+	std::vector<float> input[2];
+	for (auto &channel : input)
+	{
+		channel.resize(total_frames);
+		for (size_t i = 0; i < input_frames; i++)
+			channel[i] = next_random();
+	}
+
+	Convolver::Options options;
+	options.partition_frames = partition_frames;
+	options.mix = mix;
+	Convolver convolver;
+	if (!convolver.set_response(response.data(), response_frames, response_channels, 48000) ||
+	    !convolver.init(48000.0f, options))
+	{
+		fprintf(stderr, "Convolver: failed to initialize.\n");
+		return false;
+	}
+
+	std::vector<float> output[2] = { input[0], input[1] };
+	static const size_t block_sizes_cycle[] = { 1, 37, 64, 200, 13, 256 };
+	size_t offset = 0;
+	for (unsigned block = 0; offset < total_frames; block++)
+	{
+		size_t to_process = std::min(block_sizes_cycle[block % 6], total_frames - offset);
+		float *channels[2] = { output[0].data() + offset, output[1].data() + offset };
+		if (offset < input_frames)
+		{
+			to_process = std::min(to_process, input_frames - offset);
+			convolver.process(channels, to_process);
+		}
+		else
+			convolver.drain(channels, to_process);
+		offset += to_process;
+	}
+
+	if (!convolver.is_drained())
+	{
+		fprintf(stderr, "Convolver: tail did not drain.\n");
+		return false;
+	}
+
+	for (unsigned c = 0; c < 2; c++)
+	{
+		unsigned r = response_channels == 1 ? 0 : c;
+		double max_error = 0.0;
+		double max_value = 0.0;
+		for (size_t i = 0; i < total_frames; i++)
+		{
+			double sum = 0.0;
+			for (size_t k = 0; k < response_frames && k <= i; k++)
+				sum += double(response[k * response_channels + r]) * double(input[c][i - k]);
+			double expected = double(1.0f - mix) * double(input[c][i]) + double(mix) * sum;
+			max_error = std::max(max_error, std::abs(expected - double(output[c][i])));
+			max_value = std::max(max_value, std::abs(expected));
+		}
+
+		if (max_error > 1e-4 * max_value)
+		{
+			fprintf(stderr, "Convolver (%u channels, %zu frames, partition %u): error %g against %g peak.\n",
+			        response_channels, response_frames, partition_frames, max_error, max_value);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool verify_convolver()
+{
+	enum { Count = 1027 };
+	std::vector<float> a(Count), b(Count), c(Count), d(Count);
+	std::vector<float> acc_re(Count), acc_im(Count), ref_re(Count), ref_im(Count);
+	for (unsigned i = 0; i < Count; i++)
+	{
+		a[i] = sinf(float(i) * 0.13f);
+		b[i] = cosf(float(i) * 0.71f);
+		c[i] = sinf(float(i) * 0.29f + 1.0f);
+		d[i] = cosf(float(i) * 0.05f);
+		acc_re[i] = ref_re[i] = float(i % 7) * 0.1f;
+		acc_im[i] = ref_im[i] = float(i % 3) * -0.2f;
+	}
+
+	DSP::complex_mac(acc_re.data(), acc_im.data(), a.data(), b.data(), c.data(), d.data(), Count);
+	DSP::complex_mac_scalar(ref_re.data(), ref_im.data(), a.data(), b.data(), c.data(), d.data(), 0, Count);
+	for (unsigned i = 0; i < Count; i++)
+	{
+		if (fabsf(acc_re[i] - ref_re[i]) > 1e-5f || fabsf(acc_im[i] - ref_im[i]) > 1e-5f)
+		{
+			fprintf(stderr, "complex_mac: mismatch at %u.\n", i);
+			return false;
+		}
+	}
+
+	enum { Taps = 37 };
+	std::vector<float> out(Count - Taps), ref(Count - Taps);
+	for (unsigned i = 0; i < out.size(); i++)
+		out[i] = ref[i] = d[i];
+	DSP::fir_add(out.data(), a.data() + Taps, b.data(), Taps, out.size());
+	DSP::fir_add_scalar(ref.data(), a.data() + Taps, b.data(), Taps, 0, ref.size());
+	for (unsigned i = 0; i < out.size(); i++)
+	{
+		if (fabsf(out[i] - ref[i]) > 1e-4f)
+		{
+			fprintf(stderr, "fir_add: mismatch at %u.\n", i);
+			return false;
+		}
+	}
+
+	bool ok = verify_convolver_case(2, 1000, 64, 0.75f);
+	ok = verify_convolver_case(1, 1000, 128, 1.0f) && ok;
+	// A response shorter than the head, and one just past a partition boundary.
+	ok = verify_convolver_case(2, 40, 64, 1.0f) && ok;
+	ok = verify_convolver_case(1, 65, 16, 0.5f) && ok;
+	return ok;
+}
+
+static BenchResult bench_convolver(const BenchArguments &args, unsigned block_frames, unsigned partition_frames)
+{
+	// A long decaying room, stereo so that both channels have their own response.
+	auto response_frames = size_t(3.0f * args.sample_rate);
+	std::vector<float> response(2 * response_frames);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < response.size(); i++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		float noise = float(seed >> 8) * (2.0f / 16777216.0f) - 1.0f;
+		response[i] = 0.1f * noise * expf(-6.0f * float(i) / float(response.size()));
+	}
+
+	Convolver::Options options;
+	options.partition_frames = partition_frames;
+	Convolver convolver;
+	convolver.set_response(response.data(), response_frames, 2, unsigned(args.sample_rate));
+	convolver.init(args.sample_rate, options);
+
+	std::vector<float> left(block_frames), right(block_frames);
+	float *channels[2] = { left.data(), right.data() };
+
+	enum { BlocksPerBatch = 64 };
+	auto num_batches = std::max<size_t>(1, size_t(args.seconds * args.sample_rate) / (block_frames * BlocksPerBatch));
+	int64_t total_time = 0;
+	int64_t worst_time = 0;
+	size_t frame = 0;
+
+	for (size_t i = 0; i < num_batches; i++)
+	{
+		int64_t batch_time = 0;
+		for (unsigned j = 0; j < BlocksPerBatch; j++)
+		{
+			for (unsigned k = 0; k < block_frames; k++, frame++)
+			{
+				left[k] = sinf(float(frame) * 0.05f);
+				right[k] = cosf(float(frame) * 0.031f);
+			}
+
+			auto start_time = Util::get_current_time_nsecs();
+			convolver.process(channels, block_frames);
+			batch_time += Util::get_current_time_nsecs() - start_time;
+		}
+		total_time += batch_time;
+		worst_time = std::max(worst_time, batch_time);
+	}
+
+	BenchResult result = {};
+	char name[64];
+	snprintf(name, sizeof(name), "convolver_3s_partition_%u", partition_frames);
+	result.name = name;
+	result.block_frames = block_frames;
+	result.splits = 0;
+	result.voices = 0;
+
+	double frames = double(num_batches * BlocksPerBatch * block_frames);
+	result.ns_per_frame = double(total_time) / frames;
+	result.realtime_factor = total_time ? (1e9 * frames / args.sample_rate) / double(total_time) : 0.0;
+	result.worst_block_usec = 1e-3 * double(worst_time) / BlocksPerBatch;
+	return result;
+}
+
+// Writes a constant, or silence.
+struct ConstantNode final : AudioNode
+{
+	explicit ConstantNode(float value_)
+		: value(value_)
+	{
+	}
+
+	unsigned get_num_inputs() const noexcept override
+	{
+		return 0;
+	}
+
+	unsigned get_num_outputs() const noexcept override
+	{
+		return 1;
+	}
+
+	void prepare(float, size_t) override
+	{
+	}
+
+	void process(const AudioBus * const *, AudioBus * const *outputs, size_t num_frames) noexcept override
+	{
+		std::fill(outputs[0]->channels[0], outputs[0]->channels[0] + num_frames, value);
+		std::fill(outputs[0]->channels[1], outputs[0]->channels[1] + num_frames, -value);
+		outputs[0]->silent = value == 0.0f;
+		processed += num_frames;
+	}
+
+	bool is_silent() noexcept override
+	{
+		return value == 0.0f;
+	}
+
+	void skip(size_t num_frames) noexcept override
+	{
+		skipped += num_frames;
+	}
+
+	float value;
+	size_t processed = 0;
+	size_t skipped = 0;
+};
+
+static bool verify_graph_output(AudioGraph &graph, size_t num_frames, unsigned delay, float expected)
+{
+	std::vector<float> left(num_frames, 1.0f), right(num_frames, 1.0f);
+	float *channels[2] = { left.data(), right.data() };
+	graph.mix_samples(channels, num_frames);
+
+	for (size_t i = 0; i < num_frames; i++)
+	{
+		float value = i < delay ? 0.0f : expected;
+		if (fabsf(left[i] - value) > 1e-6f || fabsf(right[i] + value) > 1e-6f)
+		{
+			fprintf(stderr, "AudioGraph: frame %zu is (%g, %g), expected (%g, %g).\n",
+			        i, left[i], right[i], value, -value);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool verify_graph()
+{
+	// A split into two gains, one of which can run in place, mixed and scaled again in place.
+	// An unreachable node must not run.
+	ConstantNode source(1.0f);
+	GainNode gain_a(2.0f), gain_b(0.5f), gain_c(3.0f), unused(1.0f);
+	MixerNode mixer(2);
+
+	AudioGraph graph;
+	unsigned gain_c_node = graph.add_node(&gain_c);
+	unsigned mixer_node = graph.add_node(&mixer);
+	unsigned source_node = graph.add_node(&source);
+	unsigned gain_a_node = graph.add_node(&gain_a);
+	unsigned gain_b_node = graph.add_node(&gain_b);
+	unsigned unused_node = graph.add_node(&unused);
+	bool ok = graph.connect(source_node, 0, gain_a_node, 0) &&
+	          graph.connect(source_node, 0, gain_b_node, 0) &&
+	          graph.connect(source_node, 0, unused_node, 0) &&
+	          graph.connect(gain_a_node, 0, mixer_node, 0) &&
+	          graph.connect(gain_b_node, 0, mixer_node, 1) &&
+	          graph.connect(mixer_node, 0, gain_c_node, 0) &&
+	          graph.set_output(gain_c_node, 0) &&
+	          graph.compile();
+	if (!ok)
+		return false;
+
+	// gain_b takes over the source's buffer, the mixer writes the backend's.
+	if (graph.get_num_scheduled_nodes() != 5 || graph.get_num_buffers() != 2)
+	{
+		fprintf(stderr, "AudioGraph: %u nodes scheduled on %u buffers, expected 5 on 2.\n",
+		        graph.get_num_scheduled_nodes(), graph.get_num_buffers());
+		return false;
+	}
+
+	graph.set_backend_parameters(48000.0f, 2, 64);
+	graph.on_backend_start();
+	// Larger than a block, so that it's split up.
+	if (!verify_graph_output(graph, 100, 0, 7.5f))
+		return false;
+
+	source.value = 0.0f;
+	if (!verify_graph_output(graph, 100, 0, 0.0f))
+		return false;
+	if (source.processed != 100 || source.skipped != 100)
+	{
+		fprintf(stderr, "AudioGraph: silent blocks were processed.\n");
+		return false;
+	}
+
+	// Latency of the lookahead shows up in the graph, and delays the output.
+	ConstantNode quiet_source(0.25f);
+	LimiterNode limiter{Limiter::Options()};
+	AudioGraph delayed;
+	unsigned quiet_node = delayed.add_node(&quiet_source);
+	unsigned limiter_node = delayed.add_node(&limiter);
+	delayed.connect(quiet_node, 0, limiter_node, 0);
+	delayed.set_output(limiter_node, 0);
+	if (!delayed.compile())
+		return false;
+	delayed.set_backend_parameters(48000.0f, 2, 64);
+	delayed.on_backend_start();
+
+	unsigned delay = limiter.get_latency_frames();
+	auto expected_usec = uint32_t(1e6 * double(delay) / 48000.0);
+	if (delay == 0 || delayed.get_processing_latency_usec() != expected_usec || delayed.get_num_buffers() != 0)
+	{
+		fprintf(stderr, "AudioGraph: latency of %u usec, expected %u.\n",
+		        delayed.get_processing_latency_usec(), expected_usec);
+		return false;
+	}
+
+	if (!verify_graph_output(delayed, 64, delay, 0.25f))
+		return false;
+
+	// Silence the backend writes itself still reaches every node, and a tap keeps the backend awake.
+	ConstantNode tapped_source(0.0f);
+	TapNode tap(1.0f);
+	AudioGraph recorded;
+	unsigned tapped_node = recorded.add_node(&tapped_source);
+	unsigned tap_node = recorded.add_node(&tap);
+	recorded.connect(tapped_node, 0, tap_node, 0);
+	recorded.set_output(tap_node, 0);
+	if (!recorded.compile())
+		return false;
+	if (!graph.allows_idle() || recorded.allows_idle())
+	{
+		fprintf(stderr, "AudioGraph: idle is allowed with a tap, or not without one.\n");
+		return false;
+	}
+
+	// The resampler hands on the silence at its internal rate.
+	Resampler resampler(&recorded, 32000.0f, Resampler::Quality::Low);
+	resampler.set_backend_parameters(48000.0f, 2, 64);
+	resampler.on_backend_start();
+	resampler.skip_samples(4800);
+
+	std::vector<float> captured(2 * 4000);
+	size_t captured_frames = tap.read(captured.data(), 4000);
+	size_t expected_frames = 3200 - (16 / 2 - 1);
+	if (tapped_source.skipped != expected_frames || captured_frames != expected_frames || tapped_source.processed)
+	{
+		fprintf(stderr, "AudioGraph: skipped %zu frames and captured %zu, expected %zu.\n",
+		        tapped_source.skipped, captured_frames, expected_frames);
+		return false;
+	}
+
+	// Cycles are rejected.
+	GainNode loop_a, loop_b;
+	AudioGraph cyclic;
+	unsigned loop_a_node = cyclic.add_node(&loop_a);
+	unsigned loop_b_node = cyclic.add_node(&loop_b);
+	cyclic.connect(loop_a_node, 0, loop_b_node, 0);
+	cyclic.connect(loop_b_node, 0, loop_a_node, 0);
+	cyclic.set_output(loop_b_node, 0);
+	if (cyclic.compile())
+	{
+		fprintf(stderr, "AudioGraph: accepted a cycle.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool verify_play_samples()
+{
+	// The kernel against the scalar reference, across steps which do and don't land on whole frames.
+	enum { Frames = 4000, Count = 1027 };
+	std::vector<int16_t> left(Frames + 2), right(Frames + 2);
+	for (size_t i = 0; i < left.size(); i++)
+	{
+		left[i] = int16_t(20000.0f * sinf(float(i) * 0.05f));
+		right[i] = int16_t(i * 7919u);
+	}
+
+	static const double steps[] = { 1.0, 0.7317, 1.5, 2.913 };
+	for (double step : steps)
+	{
+		for (unsigned stereo = 0; stereo < 2; stereo++)
+		{
+			auto fixed_step = uint64_t(step * 4294967296.0);
+			DSP::SampleVoice voice = {};
+			voice.left = left.data();
+			voice.right = stereo ? right.data() : left.data();
+			voice.index = 3;
+			voice.fraction = 0x9e3779b9u;
+			voice.step_index = uint32_t(fixed_step >> 32);
+			voice.step_fraction = uint32_t(fixed_step);
+			voice.gain = 1.0f / 32768.0f;
+			voice.gain_factor = 0.9995f;
+			auto reference_voice = voice;
+
+			// Stays clear of the end of the data at the largest step.
+			size_t count = std::min<size_t>(Count, size_t(double(Frames - 8) / step));
+			std::vector<float> out_l(count, 0.25f), out_r(count, -0.25f);
+			std::vector<float> ref_l(count, 0.25f), ref_r(count, -0.25f);
+			DSP::play_samples(out_l.data(), out_r.data(), voice, count);
+			DSP::play_samples_scalar(ref_l.data(), ref_r.data(), reference_voice, count);
+
+			bool ok = voice.index == reference_voice.index && voice.fraction == reference_voice.fraction &&
+			          fabsf(voice.gain - reference_voice.gain) <= 1e-4f * reference_voice.gain &&
+			          fabsf(voice.peak - reference_voice.peak) <= 1e-5f;
+			for (size_t i = 0; ok && i < count; i++)
+				ok = fabsf(out_l[i] - ref_l[i]) <= 1e-5f && fabsf(out_r[i] - ref_r[i]) <= 1e-5f;
+
+			if (!ok)
+			{
+				fprintf(stderr, "play_samples: mismatch at step %.4f, %s.\n", step, stereo ? "stereo" : "mono");
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static const char bench_bank_prefix[] = "sussybard-bench-bank";
+
+// A mono one shot for the low keys, and a looped stereo tone at another rate for the high keys.
+static bool write_bench_bank(const std::string &path, std::vector<float> &one_shot, std::vector<float> &looped)
+{
+	std::string one_shot_path = path + "-low.wav";
+	std::string looped_path = path + "-high.wav";
+	std::string mapping_path = path + ".txt";
+
+	one_shot.resize(4 * 44100);
+	for (size_t i = 0; i < one_shot.size(); i++)
+		one_shot[i] = 0.5f * sinf(float(i) * 0.0377f) * expf(-float(i) / 44100.0f);
+
+	looped.resize(2 * 48000);
+	for (size_t i = 0; i < looped.size() / 2; i++)
+	{
+		looped[2 * i + 0] = 0.8f * sinf(float(i) * 0.0296f);
+		looped[2 * i + 1] = 0.4f * cosf(float(i) * 0.0296f);
+	}
+
+	bool ok;
+	{
+		WAVWriter low, high;
+		ok = low.init(one_shot_path.c_str(), 44100, 1) && low.write(one_shot.data(), one_shot.size()) &&
+		     high.init(looped_path.c_str(), 48000, 2) && high.write(looped.data(), looped.size() / 2);
+	}
+
+	FILE *mapping = ok ? fopen(mapping_path.c_str(), "w") : nullptr;
+	if (mapping)
+	{
+		// Paths are relative to the mapping file, so strip any directory.
+		auto name = [](const std::string &p) { return p.substr(p.find_last_of('/') + 1); };
+		fprintf(mapping, "# Test bank\nrelease 0.2\n\"%s\" 60 0 63\n%s 72 64 127 loop 1000 41000\n",
+		        name(one_shot_path).c_str(), name(looped_path).c_str());
+		fclose(mapping);
+	}
+
+	ok = mapping && SampleBank::pack(mapping_path.c_str(), path.c_str());
+	remove(one_shot_path.c_str());
+	remove(looped_path.c_str());
+	remove(mapping_path.c_str());
+	return ok;
+}
+
+static bool verify_sample_bank_contents(const SampleBank &bank,
+                                        const std::vector<float> &one_shot, const std::vector<float> &looped)
+{
+	const auto *low = bank.find_zone(30);
+	const auto *high = bank.find_zone(100);
+	if (!low || !high || low != bank.find_zone(63) || high != bank.find_zone(64) ||
+	    low->root_note != 60 || low->channels != 1 || low->loop_end != 0 || low->sample_rate != 44100 ||
+	    high->channels != 2 || high->frames != 41000 || high->loop_start != 1000 || high->sample_rate != 48000)
+	{
+		fprintf(stderr, "SampleBank: zones don't match the mapping.\n");
+		return false;
+	}
+
+	// Mapped data matches the source within a step, and the loop padding repeats the loop start.
+	const int16_t *samples = bank.get_samples(*low, 0);
+	for (uint32_t i = 0; i < low->frames; i++)
+	{
+		if (fabsf(float(samples[i]) * low->scale - one_shot[i]) > low->scale)
+		{
+			fprintf(stderr, "SampleBank: sample %u differs.\n", i);
+			return false;
+		}
+	}
+
+	for (unsigned c = 0; c < 2; c++)
+	{
+		samples = bank.get_samples(*high, c);
+		if (samples[high->frames] != samples[high->loop_start] ||
+		    fabsf(float(samples[5]) * high->scale - looped[2 * 5 + c]) > high->scale)
+		{
+			fprintf(stderr, "SampleBank: channel %u of the loop is wrong.\n", c);
+			return false;
+		}
+	}
+
+	size_t expected = (low->frames + SampleBank::PaddingFrames + 2 * (high->frames + SampleBank::PaddingFrames)) *
+	                  sizeof(int16_t);
+	if (bank.prefault(0, 128) != expected || bank.prefault(0, 64) != (low->frames + SampleBank::PaddingFrames) * 2)
+	{
+		fprintf(stderr, "SampleBank: prefault touched the wrong zones.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool verify_sample_bank()
+{
+	std::string path = std::string(bench_bank_prefix) + "-verify.bin";
+	std::vector<float> one_shot, looped;
+	bool ok;
+	{
+		SampleBank bank;
+		ok = write_bench_bank(path, one_shot, looped) && bank.load(path.c_str()) &&
+		     verify_sample_bank_contents(bank, one_shot, looped);
+	}
+	remove(path.c_str());
+	return ok;
+}
+
+static bool verify_fm_voices()
+{
+	// The kernel against the scalar reference, with a sparse set of lanes and strong modulation.
+	enum { Count = 1027, NumOperators = DSP::FMVoiceLanes::NumOperators };
+	DSP::FMVoiceLanes voices = {};
+	for (unsigned lane = 0; lane < DSP::FMVoiceLanes::MaxLanes; lane++)
+	{
+		if (lane % 3 == 1)
+			continue;
+
+		voices.active_lanes |= 1u << lane;
+		for (unsigned o = 0; o < NumOperators; o++)
+		{
+			voices.phase[o][lane] = fmodf(float(lane * 7 + o) * 0.137f, 1.0f);
+			voices.step[o][lane] = float(lane + 1) * float(o + 1) * 0.0013f;
+			voices.gain[o][lane] = 0.5f + 0.1f * float(o);
+			voices.gain_step[o][lane] = -0.0001f * float(lane);
+		}
+	}
+
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		for (unsigned j = 0; j < NumOperators; j++)
+			voices.mod_to_carriers[o][j] = j > o ? 0.8f / float(j) : 0.0f;
+		voices.carrier_left[o] = o == 0 ? 0.25f : 0.0f;
+		voices.carrier_right[o] = o == 0 ? 0.2f : 0.05f;
+	}
+
+	auto reference_voices = voices;
+	std::vector<float> left(Count), right(Count), reference_left(Count), reference_right(Count);
+	DSP::render_fm_voices(left.data(), right.data(), voices, Count);
+	DSP::render_fm_voices_scalar(reference_left.data(), reference_right.data(), reference_voices, Count);
+
+	for (unsigned i = 0; i < Count; i++)
+	{
+		if (fabsf(left[i] - reference_left[i]) > 1e-3f || fabsf(right[i] - reference_right[i]) > 1e-3f)
+		{
+			fprintf(stderr, "render_fm_voices: mismatch at %u.\n", i);
+			return false;
+		}
+	}
+
+	for (unsigned lane = 0; lane < DSP::FMVoiceLanes::MaxLanes; lane++)
+	{
+		if ((voices.active_lanes & (1u << lane)) &&
+		    fabsf(voices.peak[lane] - reference_voices.peak[lane]) > 1e-3f)
+		{
+			fprintf(stderr, "render_fm_voices: peak mismatch for lane %u.\n", lane);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Measures short term RMS in dB, windows which are silent in the reference are skipped.
+static bool compare_rms_envelopes(const char *name, const std::vector<float> &output,
+                                  const std::vector<float> &reference, unsigned window_frames, float tolerance_db)
+{
+	for (size_t start = 0; start + window_frames <= reference.size(); start += window_frames)
+	{
+		double sum = 0.0, reference_sum = 0.0;
+		for (size_t i = start; i < start + window_frames; i++)
+		{
+			sum += double(output[i]) * double(output[i]);
+			reference_sum += double(reference[i]) * double(reference[i]);
+		}
+
+		double rms = sqrt(sum / window_frames);
+		double reference_rms = sqrt(reference_sum / window_frames);
+		if (reference_rms < 1e-3)
+			continue;
+
+		double diff_db = 20.0 * log10(std::max(rms, 1e-9) / reference_rms);
+		if (fabs(diff_db) > double(tolerance_db))
+		{
+			fprintf(stderr, "%s: level differs by %.2f dB at frame %zu (%.4f vs %.4f RMS).\n",
+			        name, diff_db, start, rms, reference_rms);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Magnitude of each harmonic of frequency per window, Hann windowed, in dB against the reference.
+// Harmonics more than 40 dB below the strongest one in the reference window are too quiet to judge.
+// Windows span several periods, so neighbouring harmonics stay apart after windowing.
+static bool compare_harmonics(const char *name, const std::vector<float> &output,
+                              const std::vector<float> &reference, float sample_rate, float frequency,
+                              float tolerance_db)
+{
+	enum { MaxHarmonics = 16, WindowPeriods = 8 };
+	const double pi = 3.14159265358979323846;
+	auto window_frames = size_t(WindowPeriods * sample_rate / frequency);
+	unsigned num_harmonics = std::min(unsigned(MaxHarmonics), unsigned(0.45f * sample_rate / frequency));
+
+	for (size_t start = 0; start + window_frames <= reference.size(); start += window_frames)
+	{
+		double magnitudes[MaxHarmonics], reference_magnitudes[MaxHarmonics];
+		double strongest = 0.0;
+
+		for (unsigned h = 0; h < num_harmonics; h++)
+		{
+			// Goertzel at exactly the harmonic, which needn't fall on a DFT bin.
+			double coeff = 2.0 * cos(2.0 * pi * double(h + 1) * frequency / sample_rate);
+			double s1 = 0.0, s2 = 0.0, r1 = 0.0, r2 = 0.0;
+			for (size_t i = 0; i < window_frames; i++)
+			{
+				double w = 0.5 - 0.5 * cos(2.0 * pi * double(i) / double(window_frames));
+				double s0 = w * output[start + i] + coeff * s1 - s2;
+				double r0 = w * reference[start + i] + coeff * r1 - r2;
+				s2 = s1;
+				s1 = s0;
+				r2 = r1;
+				r1 = r0;
+			}
+
+			magnitudes[h] = sqrt(std::max(s1 * s1 + s2 * s2 - coeff * s1 * s2, 0.0));
+			reference_magnitudes[h] = sqrt(std::max(r1 * r1 + r2 * r2 - coeff * r1 * r2, 0.0));
+			strongest = std::max(strongest, reference_magnitudes[h]);
+		}
+
+		// Same silence threshold as the RMS comparison, a Hann window has a coherent gain of one half.
+		if (strongest < 1e-3 * 0.5 * double(window_frames))
+			continue;
+
+		for (unsigned h = 0; h < num_harmonics; h++)
+		{
+			if (reference_magnitudes[h] < 0.01 * strongest)
+				continue;
+
+			double diff_db = 20.0 * log10(std::max(magnitudes[h], 1e-9) / reference_magnitudes[h]);
+			if (fabs(diff_db) > double(tolerance_db))
+			{
+				fprintf(stderr, "%s: harmonic %u differs by %.2f dB at frame %zu.\n", name, h + 1, diff_db, start);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool verify_fm_engine(float sample_rate)
+{
+	// The native engine against fmsynth with the built-in presets, held and released.
+	// Phases drift apart through the modulation, so compare levels and spectra rather than waveforms.
+	static const unsigned notes[] = { 36, 48, 60, 72, 84 };
+	auto held_frames = size_t(0.5f * sample_rate);
+	auto total_frames = held_frames + size_t(1.5f * sample_rate);
+	auto window_frames = unsigned(0.02f * sample_rate);
+	enum { BlockFrames = 256 };
+
+	for (unsigned split = 0; split < 2; split++)
+	{
+		FMPreset preset = create_default_preset(split);
+		fmsynth_t *fm = fmsynth_new(sample_rate, 1);
+		FMEngine engine;
+		engine.init(sample_rate, 1);
+		engine.set_preset(preset);
+
+		for (unsigned note : notes)
+		{
+			std::vector<float> left(total_frames), right(total_frames);
+			std::vector<float> reference_left(total_frames), reference_right(total_frames);
+
+			apply_preset(fm, preset);
+			fmsynth_note_on(fm, uint8_t(note), 255);
+			engine.note_on(0, note, 255);
+
+			for (size_t offset = 0; offset < total_frames; offset += BlockFrames)
+			{
+				if (offset == held_frames)
+				{
+					fmsynth_note_off(fm, uint8_t(note));
+					engine.note_off(0);
+				}
+
+				auto to_render = std::min<size_t>(BlockFrames, total_frames - offset);
+				fmsynth_render(fm, reference_left.data() + offset, reference_right.data() + offset, unsigned(to_render));
+				engine.render(left.data() + offset, right.data() + offset, to_render);
+			}
+
+			char name[64];
+			snprintf(name, sizeof(name), "fm_native (%s, note %u)", preset.name, note);
+			float frequency = 440.0f * exp2f((float(note) - 69.0f) * (1.0f / 12.0f));
+			if (!compare_rms_envelopes(name, left, reference_left, window_frames, 1.5f) ||
+			    !compare_rms_envelopes(name, right, reference_right, window_frames, 1.5f) ||
+			    !compare_harmonics(name, left, reference_left, sample_rate, frequency, 3.0f) ||
+			    !compare_harmonics(name, right, reference_right, sample_rate, frequency, 3.0f))
+			{
+				fmsynth_free(fm);
+				return false;
+			}
+		}
+
+		fmsynth_free(fm);
+	}
+
+	return true;
+}
+
+static bool verify_native_preset_swap(float sample_rate)
+{
+	// Once prepared, a native split must turn down presets it can't render rather than play them wrong.
+	Synth synth;
+	synth.set_num_splits(1);
+	synth.set_split_engine(0, Synth::Engine::NativeFM);
+	synth.prepare(sample_rate, 256);
+
+	FMPreset preset = create_default_preset(0);
+	if (!synth.set_split_preset(0, preset))
+	{
+		fprintf(stderr, "native preset swap: the default preset was rejected.\n");
+		return false;
+	}
+
+	snprintf(preset.name, sizeof(preset.name), "bench-%u-operators", unsigned(FMEngine::NumOperators) + 1);
+	preset.set(FMSYNTH_PARAM_ENABLE, FMEngine::NumOperators, 1.0f);
+	preset.set(FMSYNTH_PARAM_CARRIERS, FMEngine::NumOperators, 1.0f);
+	if (synth.set_split_preset(0, preset))
+	{
+		fprintf(stderr, "native preset swap: a preset with too many operators was accepted.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void reference_interleave_stereo_f32(float *target, const float *left, const float *right, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		target[2 * i + 0] = left[i];
+		target[2 * i + 1] = right[i];
+	}
+}
+
+static void reference_interleave_stereo_f32_i16(int16_t *target, const float *left, const float *right, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		target[2 * i + 0] = DSP::f32_to_i16(left[i]);
+		target[2 * i + 1] = DSP::f32_to_i16(right[i]);
+	}
+}
+
+template <unsigned bits>
+static void reference_interleave_stereo_f32_i32(int32_t *target, const float *left, const float *right, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		target[2 * i + 0] = DSP::f32_to_int(left[i], bits);
+		target[2 * i + 1] = DSP::f32_to_int(right[i], bits);
+	}
+}
+
+template <typename T, typename Func>
+static BenchResult bench_kernel(const BenchArguments &args, const char *name, unsigned block_frames, const Func &func)
+{
+	std::vector<float> left(block_frames), right(block_frames);
+	std::vector<T> target(2 * block_frames);
+
+	// Deterministic noise in [-1.25, 1.25] so that clipping paths are exercised too.
+	uint32_t seed = 1;
+	for (unsigned i = 0; i < block_frames; i++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		left[i] = 2.5f * (float(seed >> 8) / float(1 << 24)) - 1.25f;
+		seed = seed * 1664525u + 1013904223u;
+		right[i] = 2.5f * (float(seed >> 8) / float(1 << 24)) - 1.25f;
+	}
+
+	// Kernels are very cheap, so time batches of blocks to get above timer resolution.
+	enum { BlocksPerBatch = 64 };
+	auto num_batches = std::max<size_t>(1, size_t(args.seconds * args.sample_rate) / (block_frames * BlocksPerBatch));
+	int64_t total_time = 0;
+	int64_t worst_time = 0;
+
+	for (size_t i = 0; i < num_batches; i++)
+	{
+		auto start_time = Util::get_current_time_nsecs();
+		for (unsigned j = 0; j < BlocksPerBatch; j++)
+			func(target.data(), left.data(), right.data(), block_frames);
+		auto batch_time = Util::get_current_time_nsecs() - start_time;
+		total_time += batch_time;
+		worst_time = std::max(worst_time, batch_time);
+	}
+
+	BenchResult result = {};
+	result.name = name;
+	result.block_frames = block_frames;
+	result.splits = 0;
+	result.voices = 0;
+
+	double frames = double(num_batches * BlocksPerBatch * block_frames);
+	result.ns_per_frame = double(total_time) / frames;
+	result.realtime_factor = total_time ? (1e9 * frames / args.sample_rate) / double(total_time) : 0.0;
+	result.worst_block_usec = 1e-3 * double(worst_time) / BlocksPerBatch;
+	return result;
+}
+
+static BenchResult bench_mixer(const BenchArguments &args, unsigned block_frames, unsigned num_inputs)
+{
+	std::vector<float> inputs_data(2 * num_inputs * block_frames);
+	std::vector<float> left(block_frames), right(block_frames);
+	for (size_t i = 0; i < inputs_data.size(); i++)
+		inputs_data[i] = sinf(float(i) * 0.001f);
+
+	DSP::MixInput inputs[DSP::MaxMixInputs] = {};
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		inputs[j].left = inputs_data.data() + 2 * j * block_frames;
+		inputs[j].right = inputs[j].left + block_frames;
+		inputs[j].gain_left = 0.5f;
+		inputs[j].gain_right = 0.75f;
+		inputs[j].step_left = 0.001f;
+		inputs[j].step_right = -0.001f;
+	}
+
+	enum { BlocksPerBatch = 64 };
+	auto num_batches = std::max<size_t>(1, size_t(args.seconds * args.sample_rate) / (block_frames * BlocksPerBatch));
+	int64_t total_time = 0;
+	int64_t worst_time = 0;
+
+	for (size_t i = 0; i < num_batches; i++)
+	{
+		auto start_time = Util::get_current_time_nsecs();
+		for (unsigned j = 0; j < BlocksPerBatch; j++)
+			DSP::mix_stereo_inputs(left.data(), right.data(), inputs, num_inputs, block_frames);
+		auto batch_time = Util::get_current_time_nsecs() - start_time;
+		total_time += batch_time;
+		worst_time = std::max(worst_time, batch_time);
+	}
+
+	BenchResult result = {};
+	result.name = "mix_stereo_inputs";
+	result.block_frames = block_frames;
+	result.splits = num_inputs;
+	result.voices = 0;
+
+	double frames = double(num_batches * BlocksPerBatch * block_frames);
+	result.ns_per_frame = double(total_time) / frames;
+	result.realtime_factor = total_time ? (1e9 * frames / args.sample_rate) / double(total_time) : 0.0;
+	result.worst_block_usec = 1e-3 * double(worst_time) / BlocksPerBatch;
+	return result;
+}
+
+static bool verify_mixer()
+{
+	enum { Count = 1027, NumInputs = 3 };
+	std::vector<float> inputs_data(2 * NumInputs * Count);
+	for (size_t i = 0; i < inputs_data.size(); i++)
+		inputs_data[i] = sinf(float(i) * 0.0137f);
+
+	DSP::MixInput inputs[NumInputs] = {};
+	DSP::MixInput reference_inputs[NumInputs] = {};
+	for (unsigned j = 0; j < NumInputs; j++)
+	{
+		inputs[j].left = inputs_data.data() + 2 * j * Count;
+		inputs[j].right = inputs[j].left + Count;
+		inputs[j].gain_left = 0.25f * float(j + 1);
+		inputs[j].gain_right = 0.5f;
+		inputs[j].step_left = 0.0001f;
+		inputs[j].step_right = -0.0002f;
+		reference_inputs[j] = inputs[j];
+	}
+
+	std::vector<float> left(Count), right(Count), reference_left(Count), reference_right(Count);
+	DSP::mix_stereo_inputs(left.data(), right.data(), inputs, NumInputs, Count);
+	DSP::mix_stereo_inputs_scalar(reference_left.data(), reference_right.data(), reference_inputs, NumInputs, 0, Count);
+
+	for (unsigned i = 0; i < Count; i++)
+	{
+		if (fabsf(left[i] - reference_left[i]) > 1e-5f || fabsf(right[i] - reference_right[i]) > 1e-5f)
+		{
+			fprintf(stderr, "mix_stereo_inputs: mismatch at %u.\n", i);
+			return false;
+		}
+	}
+
+	for (unsigned j = 0; j < NumInputs; j++)
+	{
+		if (inputs[j].peak != reference_inputs[j].peak ||
+		    fabsf(inputs[j].sum_squares - reference_inputs[j].sum_squares) > 1e-3f * reference_inputs[j].sum_squares)
+		{
+			fprintf(stderr, "mix_stereo_inputs: meter mismatch for input %u.\n", j);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+template <typename T, typename Func, typename RefFunc>
+static bool verify_kernel(const char *name, const Func &func, const RefFunc &ref, T tolerance)
+{
+	// Odd size to exercise the scalar tail.
+	enum { Count = 1027 };
+	std::vector<float> left(Count), right(Count);
+	std::vector<T> target(2 * Count), reference(2 * Count);
+
+	for (unsigned i = 0; i < Count; i++)
+	{
+		left[i] = sinf(float(i) * 0.01f) * 1.1f;
+		right[i] = cosf(float(i) * 0.013f) * 1.1f;
+	}
+
+	func(target.data(), left.data(), right.data(), Count);
+	ref(reference.data(), left.data(), right.data(), Count);
+
+	for (unsigned i = 0; i < 2 * Count; i++)
+	{
+		T diff = target[i] > reference[i] ? T(target[i] - reference[i]) : T(reference[i] - target[i]);
+		if (diff > tolerance)
+		{
+			fprintf(stderr, "%s: mismatch at %u, got %f, expected %f.\n",
+			        name, i, double(target[i]), double(reference[i]));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void print_help()
+{
+	fprintf(stderr, "sussybard-bench\n"
+	                "\t[--output <CSV output path> (default = stdout)]\n"
+	                "\t[--filter <only run benchmarks whose name contains this string>]\n"
+	                "\t[--seconds <seconds of audio to render per case> (default = 2.0)]\n"
+	                "\t[--sample-rate <Hz> (default = 48000)]\n"
+	                "\t[--simd-level <auto|scalar|sse3|avx2|avx512|neon> (default = auto, or SUSSYBARD_SIMD env)]\n"
+	                "\t[--render-threads <worker threads for the synth_threaded cases> (default = 1)]\n"
+	                "\t[--help]\n");
+}
+
+int main(int argc, char **argv)
+{
+	BenchArguments args;
+	Util::CLICallbacks cbs;
+
+	cbs.add("--output", [&](Util::CLIParser &parser) { args.output = parser.next_string(); });
+	cbs.add("--filter", [&](Util::CLIParser &parser) { args.filter = parser.next_string(); });
+	cbs.add("--seconds", [&](Util::CLIParser &parser) { args.seconds = parser.next_double(); });
+	cbs.add("--sample-rate", [&](Util::CLIParser &parser) { args.sample_rate = float(parser.next_double()); });
+	cbs.add("--simd-level", [&](Util::CLIParser &parser) { args.simd_level = parser.next_string(); });
+	cbs.add("--render-threads", [&](Util::CLIParser &parser) { args.render_threads = parser.next_uint(); });
+	cbs.add("--help", [&](Util::CLIParser &parser) { parser.end(); });
+
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+	{
+		print_help();
+		return EXIT_SUCCESS;
+	}
+
+	DSP::init_simd_level(args.simd_level.empty() ? nullptr : args.simd_level.c_str());
+	const char *simd = DSP::simd_level_to_string(DSP::get_simd_level());
+	fprintf(stderr, "Using %s DSP kernels.\n", simd);
+
+	const auto interleave_f32 = [](float *target, const float *left, const float *right, size_t count) {
+		DSP::interleave_stereo_f32(target, left, right, count);
+	};
+	const auto interleave_f32_i16 = [](int16_t *target, const float *left, const float *right, size_t count) {
+		DSP::interleave_stereo_f32_i16(target, left, right, count);
+	};
+	const auto interleave_f32_s24 = [](int32_t *target, const float *left, const float *right, size_t count) {
+		DSP::interleave_stereo_f32_i32(target, left, right, count, 24);
+	};
+	const auto interleave_f32_s32 = [](int32_t *target, const float *left, const float *right, size_t count) {
+		DSP::interleave_stereo_f32_i32(target, left, right, count, 32);
+	};
+
+	DSP::Dither dither;
+	DSP::init_dither(dither, 1);
+	const auto interleave_f32_i16_dither = [&](int16_t *target, const float *left, const float *right, size_t count) {
+		DSP::interleave_stereo_f32_i16(target, left, right, count, &dither);
+	};
+	const auto interleave_f32_s24_dither = [&](int32_t *target, const float *left, const float *right, size_t count) {
+		DSP::interleave_stereo_f32_i32(target, left, right, count, 24, &dither);
+	};
+
+	bool ok = true;
+	ok = verify_kernel<float>("interleave_stereo_f32", interleave_f32, reference_interleave_stereo_f32, 0.0f) && ok;
+	// SIMD conversion may round differently from roundf() on exact halves.
+	ok = verify_kernel<int16_t>("interleave_stereo_f32_i16", interleave_f32_i16, reference_interleave_stereo_f32_i16, 1) && ok;
+	ok = verify_kernel<int32_t>("interleave_stereo_f32_s24_32", interleave_f32_s24,
+	                            reference_interleave_stereo_f32_i32<24>, 1) && ok;
+	ok = verify_kernel<int32_t>("interleave_stereo_f32_s32", interleave_f32_s32,
+	                            reference_interleave_stereo_f32_i32<32>, 1) && ok;
+	// TPDF dither is below 1 LSB in magnitude, so it can only move the result by one step.
+	ok = verify_kernel<int16_t>("interleave_stereo_f32_i16_dither", interleave_f32_i16_dither,
+	                            reference_interleave_stereo_f32_i16, 1) && ok;
+	// Near full scale, float only has half a LSB of precision at 24 bits, so allow one more step.
+	ok = verify_kernel<int32_t>("interleave_stereo_f32_s24_32_dither", interleave_f32_s24_dither,
+	                            reference_interleave_stereo_f32_i32<24>, 2) && ok;
+	ok = verify_mixer() && ok;
+	ok = verify_resampler() && ok;
+	ok = verify_fm_voices() && ok;
+	ok = verify_limiter() && ok;
+	ok = verify_convolver() && ok;
+	ok = verify_graph() && ok;
+	ok = verify_play_samples() && ok;
+	ok = verify_sample_bank() && ok;
+	ok = verify_fm_engine(args.sample_rate) && ok;
+	ok = verify_native_preset_swap(args.sample_rate) && ok;
+
+	const auto want = [&](const char *name) {
+		return args.filter.empty() || strstr(name, args.filter.c_str()) != nullptr;
+	};
+
+	std::vector<BenchResult> results;
+
+	for (unsigned block_frames : block_sizes)
+	{
+		if (want("interleave_stereo_f32"))
+		{
+			results.push_back(bench_kernel<float>(args, "interleave_stereo_f32", block_frames, interleave_f32));
+			results.push_back(bench_kernel<float>(args, "interleave_stereo_f32_ref", block_frames,
+			                                      reference_interleave_stereo_f32));
+		}
+
+		if (want("interleave_stereo_f32_i16"))
+		{
+			results.push_back(bench_kernel<int16_t>(args, "interleave_stereo_f32_i16", block_frames, interleave_f32_i16));
+			results.push_back(bench_kernel<int16_t>(args, "interleave_stereo_f32_i16_ref", block_frames,
+			                                        reference_interleave_stereo_f32_i16));
+		}
+
+		if (want("interleave_stereo_f32_i16_dither"))
+		{
+			results.push_back(bench_kernel<int16_t>(args, "interleave_stereo_f32_i16_dither", block_frames,
+			                                        interleave_f32_i16_dither));
+		}
+
+		if (want("interleave_stereo_f32_s24_32"))
+		{
+			results.push_back(bench_kernel<int32_t>(args, "interleave_stereo_f32_s24_32", block_frames, interleave_f32_s24));
+			results.push_back(bench_kernel<int32_t>(args, "interleave_stereo_f32_s24_32_dither", block_frames,
+			                                        interleave_f32_s24_dither));
+			results.push_back(bench_kernel<int32_t>(args, "interleave_stereo_f32_s24_32_ref", block_frames,
+			                                        reference_interleave_stereo_f32_i32<24>));
+		}
+
+		if (want("interleave_stereo_f32_s32"))
+		{
+			results.push_back(bench_kernel<int32_t>(args, "interleave_stereo_f32_s32", block_frames, interleave_f32_s32));
+			results.push_back(bench_kernel<int32_t>(args, "interleave_stereo_f32_s32_ref", block_frames,
+			                                        reference_interleave_stereo_f32_i32<32>));
+		}
+	}
+
+	if (want("resample"))
+	{
+		static const Resampler::Quality qualities[] = {
+			Resampler::Quality::Low, Resampler::Quality::Medium, Resampler::Quality::High,
+		};
+		static const unsigned resampler_block_sizes[] = { 64, 256 };
+		for (unsigned block_frames : resampler_block_sizes)
+			for (auto quality : qualities)
+				results.push_back(bench_resampler(args, quality, block_frames));
+	}
+
+	if (want("limiter"))
+	{
+		for (unsigned block_frames : block_sizes)
+			results.push_back(bench_limiter(args, block_frames));
+	}
+
+	if (want("convolver"))
+	{
+		static const unsigned convolver_block_sizes[] = { 64, 256 };
+		static const unsigned partition_sizes[] = { 64, 128, 256, 512 };
+		for (unsigned block_frames : convolver_block_sizes)
+			for (unsigned partition_frames : partition_sizes)
+				results.push_back(bench_convolver(args, block_frames, partition_frames));
+	}
+
+	if (want("mix_stereo_inputs"))
+	{
+		for (unsigned block_frames : block_sizes)
+			for (unsigned num_inputs = 1; num_inputs <= 8; num_inputs *= 2)
+				results.push_back(bench_mixer(args, block_frames, num_inputs));
+	}
+
+	if (want("synth"))
+	{
+		static const unsigned voice_counts[] = { 0, 1, 2, 8 };
+		static const unsigned split_counts[] = { 1, 2, 8 };
+		for (unsigned block_frames : block_sizes)
+			for (unsigned splits : split_counts)
+				for (unsigned voices : voice_counts)
+					results.push_back(bench_synth(args, Synth::Engine::FM, block_frames, splits, voices));
+	}
+
+	// Splits spread over the render pool, compare against the synth cases with the same split count.
+	if (want("synth_threaded") && args.render_threads)
+	{
+		static const unsigned voice_counts[] = { 2, 8 };
+		static const unsigned split_counts[] = { 2, 8 };
+		static const unsigned threaded_block_sizes[] = { 64, 256 };
+		for (unsigned block_frames : threaded_block_sizes)
+			for (unsigned splits : split_counts)
+				for (unsigned voices : voice_counts)
+					results.push_back(bench_synth(args, Synth::Engine::FM, block_frames, splits, voices, args.render_threads));
+	}
+
+	if (want("synth_fm_native"))
+	{
+		static const unsigned voice_counts[] = { 1, 2, 8 };
+		static const unsigned split_counts[] = { 1, 2, 8 };
+		for (unsigned block_frames : block_sizes)
+			for (unsigned splits : split_counts)
+				for (unsigned voices : voice_counts)
+					results.push_back(bench_synth(args, Synth::Engine::NativeFM, block_frames, splits, voices));
+	}
+
+	// Every run pre-renders the wavetables, so only cover typical block sizes.
+	if (want("synth_wavetable"))
+	{
+		static const unsigned voice_counts[] = { 1, 2, 8 };
+		static const unsigned wavetable_block_sizes[] = { 64, 256 };
+		for (unsigned block_frames : wavetable_block_sizes)
+			for (unsigned splits = 1; splits <= 2; splits++)
+				for (unsigned voices : voice_counts)
+					results.push_back(bench_synth(args, Synth::Engine::Wavetable, block_frames, splits, voices));
+	}
+
+	if (want("synth_sample_bank"))
+	{
+		std::string path = std::string(bench_bank_prefix) + ".bin";
+		std::vector<float> one_shot, looped;
+		{
+			SampleBank bank;
+			if (write_bench_bank(path, one_shot, looped) && bank.load(path.c_str()))
+			{
+				static const unsigned voice_counts[] = { 1, 2, 8 };
+				static const unsigned sample_bank_block_sizes[] = { 64, 256 };
+				for (unsigned block_frames : sample_bank_block_sizes)
+					for (unsigned splits = 1; splits <= 2; splits++)
+						for (unsigned voices : voice_counts)
+							results.push_back(bench_synth(args, Synth::Engine::SampleBank, block_frames, splits, voices,
+							                              0, &bank));
+			}
+			else
+				ok = false;
+		}
+		remove(path.c_str());
+	}
+
+	FILE *file = stdout;
+	if (!args.output.empty())
+	{
+		file = fopen(args.output.c_str(), "w");
+		if (!file)
+		{
+			fprintf(stderr, "Failed to open %s.\n", args.output.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+
+	fprintf(file, "name,simd,block_frames,splits,voices,ns_per_frame,realtime_factor,worst_block_usec\n");
+	for (auto &result : results)
+	{
+		fprintf(file, "%s,%s,%u,%u,%u,%.3f,%.2f,%.3f\n",
+		        result.name.c_str(), simd, result.block_frames, result.splits, result.voices,
+		        result.ns_per_frame, result.realtime_factor, result.worst_block_usec);
+
+		fprintf(stderr, "%-32s block %4u, splits %u, voices %2u: %9.3f ns / frame, %10.1fx realtime, worst block %9.3f us\n",
+		        result.name.c_str(), result.block_frames, result.splits, result.voices,
+		        result.ns_per_frame, result.realtime_factor, result.worst_block_usec);
+	}
+
+	if (file != stdout)
+		fclose(file);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
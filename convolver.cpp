@@ -0,0 +1,299 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "convolver.hpp"
+#include "dsp.hpp"
+#include "wav.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static constexpr size_t BufferAlignment = 64;
+static constexpr double Pi = 3.14159265358979323846;
+
+bool Convolver::load(const char *path)
+{
+	std::vector<float> samples;
+	unsigned sample_rate, channels;
+	if (!load_wav(path, samples, sample_rate, channels))
+		return false;
+
+	if (!set_response(samples.data(), samples.size() / channels, channels, sample_rate))
+	{
+		fprintf(stderr, "%s: impulse response must be mono or stereo and not empty.\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+bool Convolver::set_response(const float *interleaved, size_t num_frames, unsigned channels, unsigned sample_rate)
+{
+	if (channels < 1 || channels > 2 || num_frames == 0 || sample_rate == 0)
+		return false;
+
+	response.assign(interleaved, interleaved + num_frames * channels);
+	response_frames = num_frames;
+	response_channels = channels;
+	response_rate = sample_rate;
+	return true;
+}
+
+// Offline windowed sinc conversion, only runs when the response is loaded.
+static std::vector<float> resample_response(const std::vector<float> &input, unsigned channels,
+                                            unsigned input_rate, unsigned output_rate)
+{
+	size_t input_frames = input.size() / channels;
+	double ratio = double(output_rate) / double(input_rate);
+	auto output_frames = size_t(ceil(double(input_frames) * ratio));
+	std::vector<float> output(output_frames * channels);
+
+	// Cut at the lower of the two Nyquist rates, with the window widened to match.
+	double cutoff = std::min(1.0, ratio);
+	double half_span = 32.0 / cutoff;
+
+	for (size_t i = 0; i < output_frames; i++)
+	{
+		double t = double(i) / ratio;
+		auto first = ptrdiff_t(ceil(t - half_span));
+		auto last = ptrdiff_t(floor(t + half_span));
+		first = std::max<ptrdiff_t>(first, 0);
+		last = std::min<ptrdiff_t>(last, ptrdiff_t(input_frames) - 1);
+
+		for (unsigned c = 0; c < channels; c++)
+		{
+			double sum = 0.0;
+			for (ptrdiff_t k = first; k <= last; k++)
+			{
+				double x = t - double(k);
+				double arg = Pi * cutoff * x;
+				double sinc = std::abs(arg) < 1e-9 ? 1.0 : sin(arg) / arg;
+				double w = x / half_span;
+				double window = 0.42 + 0.5 * cos(Pi * w) + 0.08 * cos(2.0 * Pi * w);
+				sum += double(input[size_t(k) * channels + c]) * cutoff * sinc * window;
+			}
+			output[i * channels + c] = float(sum);
+		}
+	}
+
+	return output;
+}
+
+bool Convolver::init(float sample_rate, const Options &options)
+{
+	unsigned p = options.partition_frames;
+	if (response.empty() || p < MinPartitionFrames || p > MaxPartitionFrames || (p & (p - 1)) != 0 ||
+	    options.mix < 0.0f || options.mix > 1.0f)
+	{
+		return false;
+	}
+
+	auto rate = unsigned(lrintf(sample_rate));
+	std::vector<float> resampled;
+	const std::vector<float> *source = &response;
+	if (rate != response_rate)
+	{
+		resampled = resample_response(response, response_channels, response_rate, rate);
+		source = &resampled;
+	}
+	size_t frames = source->size() / response_channels;
+
+	partition_frames = p;
+	num_partitions = frames > p ? unsigned((frames - p + p - 1) / p) : 0;
+	stride = (p + 1 + 15) & ~15u;
+	dry = 1.0f - options.mix;
+	if (!fft.init(2 * p))
+		return false;
+
+	size_t spectrum_floats = size_t(num_partitions) * stride;
+	size_t total = response_channels * (p + 2 * spectrum_floats) +
+	               2 * (2 * spectrum_floats + 2 * stride + 2 * p + p) + 2 * p;
+	buffer.reset(static_cast<float *>(Util::memalign_calloc(BufferAlignment, total * sizeof(float))));
+	if (!buffer)
+		return false;
+
+	float *ptr = buffer.get();
+	for (unsigned c = 0; c < response_channels; c++)
+	{
+		head[c] = ptr;
+		ptr += p;
+		spectrum_re[c] = ptr;
+		ptr += spectrum_floats;
+		spectrum_im[c] = ptr;
+		ptr += spectrum_floats;
+	}
+
+	for (unsigned c = 0; c < 2; c++)
+	{
+		delay_re[c] = ptr;
+		ptr += spectrum_floats;
+		delay_im[c] = ptr;
+		ptr += spectrum_floats;
+		sum_re[c] = ptr;
+		ptr += stride;
+		sum_im[c] = ptr;
+		ptr += stride;
+		input[c] = ptr;
+		ptr += 2 * p;
+		tail[c] = ptr;
+		ptr += p;
+	}
+	scratch = ptr;
+
+	// The inverse transform isn't normalized, fold that into the spectra along with the wet gain.
+	float wet = options.mix;
+	float spectrum_scale = wet / float(2 * p);
+	for (unsigned c = 0; c < response_channels; c++)
+	{
+		for (size_t i = 0; i < std::min<size_t>(p, frames); i++)
+			head[c][i] = wet * (*source)[i * response_channels + c];
+
+		for (unsigned k = 0; k < num_partitions; k++)
+		{
+			memset(scratch, 0, 2 * p * sizeof(float));
+			size_t base = size_t(k + 1) * p;
+			for (size_t i = 0; i < p && base + i < frames; i++)
+				scratch[i] = spectrum_scale * (*source)[(base + i) * response_channels + c];
+			fft.forward(spectrum_re[c] + size_t(k) * stride, spectrum_im[c] + size_t(k) * stride, scratch);
+		}
+	}
+
+	fprintf(stderr, "Convolver: %.2f s response, %u frame head and %u partitions.\n",
+	        double(frames) / double(rate), p, num_partitions);
+
+	reset();
+	return true;
+}
+
+void Convolver::reset() noexcept
+{
+	if (!buffer)
+		return;
+
+	size_t spectrum_floats = size_t(num_partitions) * stride;
+	for (unsigned c = 0; c < 2; c++)
+	{
+		memset(delay_re[c], 0, spectrum_floats * sizeof(float));
+		memset(delay_im[c], 0, spectrum_floats * sizeof(float));
+		memset(sum_re[c], 0, stride * sizeof(float));
+		memset(sum_im[c], 0, stride * sizeof(float));
+		memset(input[c], 0, 2 * partition_frames * sizeof(float));
+		memset(tail[c], 0, partition_frames * sizeof(float));
+	}
+
+	position = 0;
+	newest_slot = 0;
+	accumulated = 0;
+	tail_frames_left = 0;
+}
+
+void Convolver::accumulate(unsigned target) noexcept
+{
+	// Partition k of the response meets the input from k partitions ago.
+	// The current partition is still coming in, so partition 0 waits for finish_partition().
+	for (; accumulated < target; accumulated++)
+	{
+		unsigned k = accumulated + 1;
+		unsigned slot = (newest_slot + num_partitions - (k - 1)) % num_partitions;
+		for (unsigned c = 0; c < 2; c++)
+		{
+			unsigned r = response_channels == 1 ? 0 : c;
+			DSP::complex_mac(sum_re[c], sum_im[c],
+			                 delay_re[c] + size_t(slot) * stride, delay_im[c] + size_t(slot) * stride,
+			                 spectrum_re[r] + size_t(k) * stride, spectrum_im[r] + size_t(k) * stride,
+			                 stride);
+		}
+	}
+}
+
+void Convolver::finish_partition() noexcept
+{
+	if (num_partitions)
+	{
+		// The oldest slot dropped out of the sums above, reuse it for the newest input.
+		unsigned slot = (newest_slot + 1) % num_partitions;
+		for (unsigned c = 0; c < 2; c++)
+		{
+			unsigned r = response_channels == 1 ? 0 : c;
+			float *re = delay_re[c] + size_t(slot) * stride;
+			float *im = delay_im[c] + size_t(slot) * stride;
+			fft.forward(re, im, input[c]);
+			DSP::complex_mac(sum_re[c], sum_im[c], re, im, spectrum_re[r], spectrum_im[r], stride);
+
+			// Overlap-save, only the second half is free of circular wrap-around.
+			fft.inverse(scratch, sum_re[c], sum_im[c]);
+			memcpy(tail[c], scratch + partition_frames, partition_frames * sizeof(float));
+			memset(sum_re[c], 0, stride * sizeof(float));
+			memset(sum_im[c], 0, stride * sizeof(float));
+		}
+		newest_slot = slot;
+	}
+
+	for (unsigned c = 0; c < 2; c++)
+		memcpy(input[c], input[c] + partition_frames, partition_frames * sizeof(float));
+
+	accumulated = 0;
+	position = 0;
+}
+
+void Convolver::run(float * const *channels, size_t num_frames) noexcept
+{
+	size_t offset = 0;
+	while (offset < num_frames)
+	{
+		auto to_process = unsigned(std::min<size_t>(num_frames - offset, partition_frames - position));
+		for (unsigned c = 0; c < 2; c++)
+		{
+			float *x = input[c] + partition_frames + position;
+			float *out = channels[c] + offset;
+			memcpy(x, out, to_process * sizeof(float));
+			const float *t = tail[c] + position;
+			for (unsigned i = 0; i < to_process; i++)
+				out[i] = dry * x[i] + t[i];
+			DSP::fir_add(out, x, get_head(c), partition_frames, to_process);
+		}
+
+		position += to_process;
+		offset += to_process;
+
+		if (num_partitions)
+			accumulate(unsigned(uint64_t(num_partitions - 1) * position / partition_frames));
+		if (position == partition_frames)
+			finish_partition();
+	}
+}
+
+void Convolver::process(float * const *channels, size_t num_frames) noexcept
+{
+	run(channels, num_frames);
+	// Once the input is silent, this much output is left before every buffer is back to zero.
+	tail_frames_left = size_t(num_partitions + 2) * partition_frames;
+}
+
+void Convolver::drain(float * const *channels, size_t num_frames) noexcept
+{
+	for (unsigned c = 0; c < 2; c++)
+		memset(channels[c], 0, num_frames * sizeof(float));
+	run(channels, num_frames);
+	tail_frames_left -= std::min(tail_frames_left, num_frames);
+}
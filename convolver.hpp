@@ -0,0 +1,118 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "aligned_alloc.hpp"
+#include "fft.hpp"
+
+// Convolves planar stereo in place with a mono or stereo impulse response, without added latency.
+// The first partition of the response runs as a direct form FIR. The rest is uniformly partitioned
+// FFT convolution over a frequency domain delay line. That part of the output only depends on
+// input from earlier partitions, so it is computed one partition ahead. The spectrum sums are
+// spread evenly over the blocks of a partition, which keeps the cost per block flat.
+class Convolver
+{
+public:
+	struct Options
+	{
+		// Length of the direct form head and of every FFT partition. Power of two.
+		unsigned partition_frames = 512;
+		// 1 outputs only the convolved signal, 0 only the dry input.
+		float mix = 1.0f;
+	};
+
+	enum { MinPartitionFrames = 16, MaxPartitionFrames = 4096 };
+
+	// Mono responses are applied to both channels, stereo responses per channel.
+	bool load(const char *path);
+	bool set_response(const float *interleaved, size_t num_frames, unsigned channels, unsigned sample_rate);
+
+	// Resamples the response to sample_rate if needed and precomputes every partition spectrum.
+	bool init(float sample_rate, const Options &options);
+	void reset() noexcept;
+
+	void process(float * const *channels, size_t num_frames) noexcept;
+
+	// Continues the tail with silent input, overwriting channels.
+	void drain(float * const *channels, size_t num_frames) noexcept;
+
+	// The tail has fully rung out since the last process(), output stays silent.
+	bool is_drained() const noexcept
+	{
+		return tail_frames_left == 0;
+	}
+
+	size_t get_response_frames() const noexcept
+	{
+		return response_frames;
+	}
+
+private:
+	// Interleaved response as loaded.
+	std::vector<float> response;
+	unsigned response_rate = 0;
+	unsigned response_channels = 0;
+	size_t response_frames = 0;
+
+	RealFFT fft;
+	unsigned partition_frames = 0;
+	unsigned num_partitions = 0;
+	// Bins of one spectrum, padded to a multiple of the widest vector.
+	unsigned stride = 0;
+	float dry = 0.0f;
+
+	std::unique_ptr<float, Util::AlignedDeleter> buffer;
+	// Per response channel, already scaled by the wet gain.
+	float *head[2] = {};
+	float *spectrum_re[2] = {};
+	float *spectrum_im[2] = {};
+
+	// Per input channel. The delay line holds the spectra of the last num_partitions input partitions.
+	float *delay_re[2] = {};
+	float *delay_im[2] = {};
+	float *sum_re[2] = {};
+	float *sum_im[2] = {};
+	// The previous partition followed by the current one, the input of the next forward transform.
+	float *input[2] = {};
+	// Output of the FFT part for the current partition.
+	float *tail[2] = {};
+	float *scratch = nullptr;
+
+	unsigned position = 0;
+	unsigned newest_slot = 0;
+	unsigned accumulated = 0;
+	size_t tail_frames_left = 0;
+
+	void run(float * const *channels, size_t num_frames) noexcept;
+	void accumulate(unsigned target) noexcept;
+	void finish_partition() noexcept;
+
+	const float *get_head(unsigned channel) const noexcept
+	{
+		return head[response_channels == 1 ? 0 : channel];
+	}
+};
@@ -0,0 +1,353 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "dsp.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(SUSSYBARD_DSP_X86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(SUSSYBARD_DSP_NEON) && defined(__linux__) && !defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+namespace DSP
+{
+// Each variant lives in dsp_<isa>.cpp.
+namespace Scalar { void fill_kernels(Kernels &kernels); }
+#if defined(SUSSYBARD_DSP_X86)
+namespace SSE3 { void fill_kernels(Kernels &kernels); }
+namespace AVX2 { void fill_kernels(Kernels &kernels); }
+namespace AVX512 { void fill_kernels(Kernels &kernels); }
+#elif defined(SUSSYBARD_DSP_NEON)
+namespace NEON { void fill_kernels(Kernels &kernels); }
+#endif
+
+#if defined(SUSSYBARD_DSP_X86)
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuidex(info, int(leaf), int(subleaf));
+	for (unsigned i = 0; i < 4; i++)
+		regs[i] = uint32_t(info[i]);
+#else
+	if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]))
+		regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#endif
+}
+
+static uint64_t xgetbv()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (uint64_t(edx) << 32) | eax;
+#endif
+}
+
+static SIMDLevel detect_simd_level()
+{
+	uint32_t regs[4];
+	cpuid(0, 0, regs);
+	uint32_t max_leaf = regs[0];
+
+	cpuid(1, 0, regs);
+	bool sse3 = (regs[2] & (1u << 0)) != 0;
+	bool fma = (regs[2] & (1u << 12)) != 0;
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+
+	if (!sse3)
+		return SIMDLevel::Scalar;
+
+	// The OS must save YMM / ZMM state for us, or using them will fault.
+	uint64_t xcr0 = osxsave ? xgetbv() : 0;
+	bool os_avx = (xcr0 & 0x6) == 0x6;
+	bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+	bool avx2 = false;
+	bool avx512 = false;
+	if (max_leaf >= 7)
+	{
+		cpuid(7, 0, regs);
+		avx2 = (regs[1] & (1u << 5)) != 0;
+		avx512 = (regs[1] & (1u << 16)) != 0;
+	}
+
+	if (avx && avx2 && fma && os_avx512 && avx512)
+		return SIMDLevel::AVX512;
+	else if (avx && avx2 && fma && os_avx)
+		return SIMDLevel::AVX2;
+	else
+		return SIMDLevel::SSE3;
+}
+#elif defined(SUSSYBARD_DSP_NEON)
+static SIMDLevel detect_simd_level()
+{
+#if defined(__aarch64__) || defined(_M_ARM64)
+	return SIMDLevel::NEON;
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_NEON) ? SIMDLevel::NEON : SIMDLevel::Scalar;
+#else
+	return SIMDLevel::Scalar;
+#endif
+}
+#else
+static SIMDLevel detect_simd_level()
+{
+	return SIMDLevel::Scalar;
+}
+#endif
+
+static SIMDLevel best_level = detect_simd_level();
+static SIMDLevel current_level = SIMDLevel::Scalar;
+
+static Kernels create_kernels(SIMDLevel level)
+{
+	Kernels k = {};
+	switch (level)
+	{
+#if defined(SUSSYBARD_DSP_X86)
+	case SIMDLevel::SSE3:
+		SSE3::fill_kernels(k);
+		break;
+
+	case SIMDLevel::AVX2:
+		AVX2::fill_kernels(k);
+		break;
+
+	case SIMDLevel::AVX512:
+		AVX512::fill_kernels(k);
+		break;
+#elif defined(SUSSYBARD_DSP_NEON)
+	case SIMDLevel::NEON:
+		NEON::fill_kernels(k);
+		break;
+#endif
+
+	default:
+		Scalar::fill_kernels(k);
+		break;
+	}
+
+	current_level = level;
+	return k;
+}
+
+Kernels kernels = create_kernels(best_level);
+
+SIMDLevel get_best_simd_level()
+{
+	return best_level;
+}
+
+SIMDLevel get_simd_level()
+{
+	return current_level;
+}
+
+bool simd_level_is_supported(SIMDLevel level)
+{
+	switch (level)
+	{
+	case SIMDLevel::Scalar:
+		return true;
+
+	case SIMDLevel::SSE3:
+	case SIMDLevel::AVX2:
+	case SIMDLevel::AVX512:
+		return best_level != SIMDLevel::NEON && unsigned(level) <= unsigned(best_level);
+
+	case SIMDLevel::NEON:
+		return best_level == SIMDLevel::NEON;
+
+	default:
+		return false;
+	}
+}
+
+const char *simd_level_to_string(SIMDLevel level)
+{
+	switch (level)
+	{
+	case SIMDLevel::Scalar:
+		return "scalar";
+	case SIMDLevel::SSE3:
+		return "sse3";
+	case SIMDLevel::AVX2:
+		return "avx2";
+	case SIMDLevel::AVX512:
+		return "avx512";
+	case SIMDLevel::NEON:
+		return "neon";
+	default:
+		return "unknown";
+	}
+}
+
+bool string_to_simd_level(const char *str, SIMDLevel &level)
+{
+	static const SIMDLevel levels[] = {
+		SIMDLevel::Scalar, SIMDLevel::SSE3, SIMDLevel::AVX2, SIMDLevel::AVX512, SIMDLevel::NEON,
+	};
+
+	if (strcmp(str, "auto") == 0)
+	{
+		level = best_level;
+		return true;
+	}
+
+	for (auto l : levels)
+	{
+		if (strcmp(str, simd_level_to_string(l)) == 0)
+		{
+			level = l;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void set_simd_level(SIMDLevel level)
+{
+	if (!simd_level_is_supported(level))
+	{
+		fprintf(stderr, "SIMD level %s is not supported on this CPU, using %s.\n",
+		        simd_level_to_string(level), simd_level_to_string(best_level));
+		level = best_level;
+	}
+
+	kernels = create_kernels(level);
+}
+
+void init_simd_level(const char *override_level)
+{
+	const char *env = getenv("SUSSYBARD_SIMD");
+	if (!override_level && env && *env != '\0')
+		override_level = env;
+
+	if (!override_level)
+		return;
+
+	SIMDLevel level;
+	if (string_to_simd_level(override_level, level))
+		set_simd_level(level);
+	else
+		fprintf(stderr, "Unknown SIMD level %s, using %s.\n", override_level, simd_level_to_string(current_level));
+}
+
+void init_dither(Dither &dither, uint32_t seed)
+{
+	// xorshift32 gets stuck at zero, and identical lanes would correlate.
+	for (unsigned i = 0; i < Dither::NumLanes; i++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		dither.state[i] = seed ? seed : 1;
+	}
+}
+
+void init_true_peak_filters(float *filters)
+{
+	// Blackman windowed sinc, each phase normalized to unity gain at DC.
+	const double pi = 3.14159265358979323846;
+	const double half_span = 0.5 * TruePeakTaps + 1.0;
+
+	for (unsigned p = 0; p < TruePeakPhases; p++)
+	{
+		float *filter = filters + p * TruePeakTaps;
+		double sum = 0.0;
+		for (unsigned k = 0; k < TruePeakTaps; k++)
+		{
+			double x = double(k) - double(TruePeakDelay) + double(p) / double(TruePeakPhases);
+			double sinc = x != 0.0 ? sin(pi * x) / (pi * x) : 1.0;
+			double w = x / half_span;
+			double window = 0.42 + 0.5 * cos(pi * w) + 0.08 * cos(2.0 * pi * w);
+			filter[k] = float(sinc * window);
+			sum += double(filter[k]);
+		}
+
+		for (unsigned k = 0; k < TruePeakTaps; k++)
+			filter[k] = float(double(filter[k]) / sum);
+	}
+}
+
+unsigned get_sample_format_size(SampleFormat format)
+{
+	switch (format)
+	{
+	case SampleFormat::S16:
+		return sizeof(int16_t);
+	case SampleFormat::S24_32:
+	case SampleFormat::S32:
+		return sizeof(int32_t);
+	default:
+		return sizeof(float);
+	}
+}
+
+const char *sample_format_to_string(SampleFormat format)
+{
+	switch (format)
+	{
+	case SampleFormat::F32:
+		return "f32";
+	case SampleFormat::S16:
+		return "s16";
+	case SampleFormat::S24_32:
+		return "s24_32";
+	case SampleFormat::S32:
+		return "s32";
+	default:
+		return "unknown";
+	}
+}
+
+bool string_to_sample_format(const char *str, SampleFormat &format)
+{
+	static const SampleFormat formats[] = {
+		SampleFormat::F32, SampleFormat::S16, SampleFormat::S24_32, SampleFormat::S32,
+	};
+
+	for (auto f : formats)
+	{
+		if (strcmp(str, sample_format_to_string(f)) == 0)
+		{
+			format = f;
+			return true;
+		}
+	}
+
+	return false;
+}
+}
@@ -23,12 +23,15 @@
 #pragma once
 
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
-#include "simd_headers.hpp"
+
+// Kernels are compiled in several ISA variants (see dsp_kernels.hpp)
+// and selected at startup based on what the CPU supports.
 
 namespace DSP
 {
-static int16_t f32_to_i16(float v) noexcept
+static inline int16_t f32_to_i16(float v) noexcept
 {
 	auto i = int32_t(roundf(v * 0x8000));
 	if (i > 0x7fff)
@@ -39,78 +42,590 @@ static int16_t f32_to_i16(float v) noexcept
 		return int16_t(i);
 }
 
-static inline void interleave_stereo_f32(float * __restrict target,
-                                         const float * __restrict left,
-                                         const float * __restrict right,
-                                         size_t count) noexcept
+// TPDF dither, one xorshift32 state per SIMD lane so that vector kernels
+// can step all lanes in parallel. Scalar code only uses lane 0.
+struct Dither
+{
+	enum { NumLanes = 16 };
+	uint32_t state[NumLanes];
+};
+
+void init_dither(Dither &dither, uint32_t seed);
+
+static inline uint32_t xorshift32(uint32_t x) noexcept
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+// Difference of two uniform 16-bit values, triangular distribution in (-1, 1) LSB.
+static inline float tpdf_noise(uint32_t &state) noexcept
 {
-#ifdef __SSE__
-	size_t rounded_count = count & ~3;
-	for (size_t i = 0; i < rounded_count; i += 4)
+	state = xorshift32(state);
+	return float(int32_t(state & 0xffff) - int32_t(state >> 16)) * (1.0f / 65536.0f);
+}
+
+static inline int16_t f32_to_i16_dither(float v, uint32_t &state) noexcept
+{
+	auto i = int32_t(roundf(v * 0x8000 + tpdf_noise(state)));
+	if (i > 0x7fff)
+		return 0x7fff;
+	else if (i < -0x8000)
+		return -0x8000;
+	else
+		return int16_t(i);
+}
+
+// Largest float below 2^(bits - 1) which still converts without overflow.
+static inline float get_int_max_value(unsigned bits) noexcept
+{
+	float scale = ldexpf(1.0f, int(bits) - 1);
+	return scale - fmaxf(1.0f, ldexpf(scale, -24));
+}
+
+// bits is 24 (S24_32, sign extended in the low bits) or 32.
+static inline int32_t f32_to_int(float v, unsigned bits, float noise = 0.0f) noexcept
+{
+	float scale = ldexpf(1.0f, int(bits) - 1);
+	float max_value = get_int_max_value(bits);
+	return int32_t(lrintf(fminf(fmaxf(v * scale + noise, -scale), max_value)));
+}
+
+struct MixInput
+{
+	const float *left;
+	const float *right;
+	// Gains ramp linearly over the block, frame i uses gain + i * step.
+	float gain_left;
+	float gain_right;
+	float step_left;
+	float step_right;
+	// Written by mix_stereo_inputs(), measured after gain is applied.
+	float peak;
+	float sum_squares;
+};
+
+enum { MaxMixInputs = 16 };
+
+static inline void mix_stereo_inputs_scalar(float * __restrict left,
+                                            float * __restrict right,
+                                            MixInput *inputs, unsigned num_inputs,
+                                            size_t start, size_t count) noexcept
+{
+	for (size_t i = start; i < count; i++)
 	{
-		__m128 l = _mm_loadu_ps(left);
-		__m128 r = _mm_loadu_ps(right);
-		left += 4;
-		right += 4;
-		__m128 interleaved0 = _mm_unpacklo_ps(l, r);
-		__m128 interleaved1 = _mm_unpackhi_ps(l, r);
-		_mm_storeu_ps(target, interleaved0);
-		_mm_storeu_ps(target + 4, interleaved1);
-		target += 8;
+		float l = 0.0f;
+		float r = 0.0f;
+
+		for (unsigned j = 0; j < num_inputs; j++)
+		{
+			auto &input = inputs[j];
+			float sl = input.left[i] * (input.gain_left + float(i) * input.step_left);
+			float sr = input.right[i] * (input.gain_right + float(i) * input.step_right);
+			input.peak = fmaxf(input.peak, fmaxf(fabsf(sl), fabsf(sr)));
+			input.sum_squares += sl * sl + sr * sr;
+			l += sl;
+			r += sr;
+		}
+
+		left[i] = l;
+		right[i] = r;
 	}
+}
+
+// Rational polyphase resampler state, num_phases output frames are produced for every step input frames.
+// Output frame j is filtered from the input around time j * step / num_phases.
+struct PolyphaseState
+{
+	// num_phases filters of taps coefficients each. taps must be a multiple of 16.
+	const float *filters;
+	unsigned taps;
+	unsigned num_phases;
+	unsigned step;
+
+	// Updated by resample_stereo().
+	unsigned phase;
+	// First input frame under the filter for the next output frame.
+	size_t position;
+};
+
+static inline void advance_polyphase(PolyphaseState &state, unsigned &phase, size_t &position) noexcept
+{
+	phase += state.step;
+	position += phase / state.num_phases;
+	phase %= state.num_phases;
+}
 
-	for (size_t i = rounded_count; i < count; i++)
+static inline void resample_stereo_scalar(float * __restrict left,
+                                          float * __restrict right,
+                                          const float * __restrict in_left,
+                                          const float * __restrict in_right,
+                                          PolyphaseState &state, size_t count) noexcept
+{
+	unsigned phase = state.phase;
+	size_t position = state.position;
+
+	for (size_t i = 0; i < count; i++)
 	{
-		*target++ = *left++;
-		*target++ = *right++;
+		const float *filter = state.filters + phase * state.taps;
+		const float *l = in_left + position;
+		const float *r = in_right + position;
+
+		float sum_l = 0.0f;
+		float sum_r = 0.0f;
+		for (unsigned k = 0; k < state.taps; k++)
+		{
+			sum_l += filter[k] * l[k];
+			sum_r += filter[k] * r[k];
+		}
+
+		left[i] = sum_l;
+		right[i] = sum_r;
+		advance_polyphase(state, phase, position);
 	}
-#else
-	for (size_t i = 0; i < count; i++)
+
+	state.phase = phase;
+	state.position = position;
+}
+
+// Structure-of-arrays state for up to MaxLanes voices of a 3-operator FM instrument.
+// Every voice is a SIMD lane, so the kernels step 4, 8 or 16 voices at once.
+// Operators phase modulate each other with a one frame delay. Envelopes are run
+// by the caller at control rate and only show up here as a linear gain ramp.
+struct FMVoiceLanes
+{
+	enum { NumOperators = 3, MaxLanes = 16 };
+
+	// Phase in cycles, [0, 1).
+	float phase[NumOperators][MaxLanes];
+	float step[NumOperators][MaxLanes];
+	// Operator output amplitude, incremented by gain_step every frame.
+	float gain[NumOperators][MaxLanes];
+	float gain_step[NumOperators][MaxLanes];
+	// Phase offset every operator receives from the others on the next frame.
+	float modulation[NumOperators][MaxLanes];
+	// Raised by render_fm_voices() to the peak of each lane's output. The caller resets it.
+	float peak[MaxLanes];
+
+	// Shared by every lane, mod_to_carriers[o][j] is how much operator j modulates operator o.
+	float mod_to_carriers[NumOperators][NumOperators];
+	float carrier_left[NumOperators];
+	float carrier_right[NumOperators];
+
+	// Inactive lanes must have zero gain and gain_step. Kernels skip groups of lanes
+	// with no bit set in the mask, but may still step inactive lanes in other groups.
+	uint32_t active_lanes;
+};
+
+// Sine over one cycle of phase. Folds phase into a quarter wave on either side of
+// the zero crossings and evaluates a 7th order polynomial, the same way fmsynth does.
+static inline float fm_oscillator(float phase) noexcept
+{
+	float x = fminf(phase - 0.25f, 0.75f - phase);
+	float x2 = x * x;
+	return x * (6.28318531f + x2 * (-41.3417022f + x2 * (81.6052493f + x2 * -76.7058598f)));
+}
+
+static inline void render_fm_voices_scalar(float * __restrict left,
+                                           float * __restrict right,
+                                           FMVoiceLanes &voices, size_t count) noexcept
+{
+	enum { NumOperators = FMVoiceLanes::NumOperators };
+
+	for (unsigned lane = 0; lane < FMVoiceLanes::MaxLanes; lane++)
+	{
+		if (!(voices.active_lanes & (1u << lane)))
+			continue;
+
+		float peak = voices.peak[lane];
+		for (size_t i = 0; i < count; i++)
+		{
+			float value[NumOperators];
+			for (unsigned o = 0; o < NumOperators; o++)
+			{
+				float phase = voices.phase[o][lane] + voices.modulation[o][lane];
+				value[o] = voices.gain[o][lane] * fm_oscillator(phase - floorf(phase));
+			}
+
+			float l = 0.0f;
+			float r = 0.0f;
+			for (unsigned o = 0; o < NumOperators; o++)
+			{
+				float mod = 0.0f;
+				for (unsigned j = 0; j < NumOperators; j++)
+					mod += voices.mod_to_carriers[o][j] * value[j];
+				voices.modulation[o][lane] = mod;
+
+				l += voices.carrier_left[o] * value[o];
+				r += voices.carrier_right[o] * value[o];
+
+				float phase = voices.phase[o][lane] + voices.step[o][lane];
+				voices.phase[o][lane] = phase - floorf(phase);
+				voices.gain[o][lane] += voices.gain_step[o][lane];
+			}
+
+			left[i] += l;
+			right[i] += r;
+			peak = fmaxf(peak, fmaxf(fabsf(l), fabsf(r)));
+		}
+		voices.peak[lane] = peak;
+	}
+}
+
+// 4x oversampled peak detection, along the lines of ITU-R BS.1770 annex 2.
+// Filter p interpolates at input frame i - TruePeakDelay + p / TruePeakPhases from the
+// TruePeakTaps frames up to i, so peak i covers the span after frame i - TruePeakDelay.
+enum { TruePeakPhases = 4, TruePeakTaps = 12, TruePeakDelay = TruePeakTaps / 2 - 1 };
+
+// filters holds TruePeakPhases * TruePeakTaps coefficients.
+void init_true_peak_filters(float *filters);
+
+// left / right must be valid from frame -(TruePeakTaps - 1).
+static inline void true_peak_stereo_scalar(float * __restrict peak,
+                                           const float * __restrict left,
+                                           const float * __restrict right,
+                                           const float * __restrict filters,
+                                           size_t start, size_t count) noexcept
+{
+	for (size_t i = start; i < count; i++)
 	{
-		*target++ = *left++;
-		*target++ = *right++;
+		float m = 0.0f;
+		for (unsigned p = 0; p < TruePeakPhases; p++)
+		{
+			const float *filter = filters + p * TruePeakTaps;
+			float l = 0.0f;
+			float r = 0.0f;
+			for (unsigned k = 0; k < TruePeakTaps; k++)
+			{
+				l += filter[k] * left[ptrdiff_t(i) - ptrdiff_t(k)];
+				r += filter[k] * right[ptrdiff_t(i) - ptrdiff_t(k)];
+			}
+			m = fmaxf(m, fmaxf(fabsf(l), fabsf(r)));
+		}
+		peak[i] = m;
 	}
-#endif
 }
 
-static inline void interleave_stereo_f32_i16(int16_t * __restrict target,
-                                             const float * __restrict left,
-                                             const float * __restrict right,
-                                             size_t count) noexcept
+// Gain which keeps the loudest peak within the last window frames at the ceiling, never above 1.
+// peak must be valid from frame -(window - 1).
+static inline void limiter_gain_scalar(float * __restrict gain,
+                                       const float * __restrict peak,
+                                       size_t start, size_t count,
+                                       unsigned window, float ceiling) noexcept
 {
-#ifdef __ARM_NEON
-	size_t rounded_count = count & ~3;
-	for (size_t i = 0; i < rounded_count; i += 4)
+	for (size_t i = start; i < count; i++)
 	{
-		float32x4_t l = vld1q_f32(left);
-		float32x4_t r = vld1q_f32(right);
-
-		l = vmulq_n_f32(l, float(0x8000));
-		r = vmulq_n_f32(r, float(0x8000));
-
-		int32x4_t il = vcvtq_s32_f32(l);
-		int32x4_t ir = vcvtq_s32_f32(r);
-		int16x4_t sl = vqmovn_s32(il);
-		int16x4_t sr = vqmovn_s32(ir);
-		int16x4x2_t stereo = { sl, sr };
-		vst2_s16(target, stereo);
-
-		left += 4;
-		right += 4;
-		target += 8;
+		float m = ceiling;
+		for (unsigned k = 0; k < window; k++)
+			m = fmaxf(m, peak[ptrdiff_t(i) - ptrdiff_t(k)]);
+		gain[i] = ceiling / m;
 	}
+}
 
-	for (size_t i = rounded_count; i < count; i++)
+// acc += x * h over count complex values, each held as separate real and imaginary arrays.
+static inline void complex_mac_scalar(float * __restrict acc_re, float * __restrict acc_im,
+                                      const float * __restrict x_re, const float * __restrict x_im,
+                                      const float * __restrict h_re, const float * __restrict h_im,
+                                      size_t start, size_t count) noexcept
+{
+	for (size_t i = start; i < count; i++)
 	{
-		*target++ = f32_to_i16(*left++);
-		*target++ = f32_to_i16(*right++);
+		acc_re[i] += x_re[i] * h_re[i] - x_im[i] * h_im[i];
+		acc_im[i] += x_re[i] * h_im[i] + x_im[i] * h_re[i];
 	}
-#else
+}
+
+// Direct form FIR added on top of output. input must be valid from frame -(taps - 1).
+static inline void fir_add_scalar(float * __restrict output,
+                                  const float * __restrict input,
+                                  const float * __restrict taps, unsigned num_taps,
+                                  size_t start, size_t count) noexcept
+{
+	for (size_t i = start; i < count; i++)
+	{
+		float sum = 0.0f;
+		for (unsigned k = 0; k < num_taps; k++)
+			sum += taps[k] * input[ptrdiff_t(i) - ptrdiff_t(k)];
+		output[i] += sum;
+	}
+}
+
+// One voice reading 16-bit planar samples at a fractional rate.
+struct SampleVoice
+{
+	// right == left for mono samples.
+	const int16_t *left;
+	const int16_t *right;
+	// Read position and step in frames, as 32.32 fixed point.
+	uint32_t index;
+	uint32_t fraction;
+	uint32_t step_index;
+	uint32_t step_fraction;
+	// Includes the sample scale, multiplied by gain_factor after every frame.
+	float gain;
+	float gain_factor;
+	// Largest output magnitude, kept across calls.
+	float peak;
+};
+
+static inline float sample_fraction(uint32_t fraction) noexcept
+{
+	return float(fraction >> 8) * (1.0f / 16777216.0f);
+}
+
+// Linear interpolation added into left / right. Frame index + 1 is read for every output frame,
+// so the caller must stop at the end of the sample data and handle loops.
+static inline void play_samples_scalar(float * __restrict left,
+                                       float * __restrict right,
+                                       SampleVoice &voice, size_t count) noexcept
+{
+	uint32_t index = voice.index;
+	uint32_t fraction = voice.fraction;
+	float gain = voice.gain;
+	float peak = voice.peak;
+
 	for (size_t i = 0; i < count; i++)
 	{
-		*target++ = f32_to_i16(*left++);
-		*target++ = f32_to_i16(*right++);
+		float t = sample_fraction(fraction);
+		float l0 = float(voice.left[index]);
+		float l1 = float(voice.left[index + 1]);
+		float r0 = float(voice.right[index]);
+		float r1 = float(voice.right[index + 1]);
+		float l = (l0 + (l1 - l0) * t) * gain;
+		float r = (r0 + (r1 - r0) * t) * gain;
+		left[i] += l;
+		right[i] += r;
+		peak = fmaxf(peak, fmaxf(fabsf(l), fabsf(r)));
+		gain *= voice.gain_factor;
+
+		uint32_t next = fraction + voice.step_fraction;
+		index += voice.step_index + (next < fraction ? 1u : 0u);
+		fraction = next;
+	}
+
+	voice.index = index;
+	voice.fraction = fraction;
+	voice.gain = gain;
+	voice.peak = peak;
+}
+
+enum class SIMDLevel
+{
+	Scalar,
+	SSE3,
+	AVX2,
+	AVX512,
+	NEON
+};
+
+enum class SampleFormat
+{
+	F32,
+	S16,
+	S24_32,
+	S32
+};
+
+unsigned get_sample_format_size(SampleFormat format);
+const char *sample_format_to_string(SampleFormat format);
+bool string_to_sample_format(const char *str, SampleFormat &format);
+
+struct Kernels
+{
+	void (*interleave_stereo_f32)(float * __restrict target,
+	                              const float * __restrict left,
+	                              const float * __restrict right,
+	                              size_t count) noexcept;
+
+	// dither may be null.
+	void (*interleave_stereo_f32_i16)(int16_t * __restrict target,
+	                                  const float * __restrict left,
+	                                  const float * __restrict right,
+	                                  size_t count, Dither *dither) noexcept;
+
+	// bits is 24 or 32, see f32_to_int(). dither may be null.
+	void (*interleave_stereo_f32_i32)(int32_t * __restrict target,
+	                                  const float * __restrict left,
+	                                  const float * __restrict right,
+	                                  size_t count, unsigned bits, Dither *dither) noexcept;
+
+	// Sums up to MaxMixInputs stereo inputs into left / right with per-input gain,
+	// and measures per-input peak and energy in the same pass.
+	void (*mix_stereo_inputs)(float * __restrict left,
+	                          float * __restrict right,
+	                          MixInput *inputs, unsigned num_inputs,
+	                          size_t count) noexcept;
+
+	// Produces count frames of resampled output. in_left / in_right must hold every
+	// input frame up to the last one under the filter, see PolyphaseState.
+	void (*resample_stereo)(float * __restrict left,
+	                        float * __restrict right,
+	                        const float * __restrict in_left,
+	                        const float * __restrict in_right,
+	                        PolyphaseState &state, size_t count) noexcept;
+
+	// Renders every active lane and adds the sum of all lanes into left / right.
+	void (*render_fm_voices)(float * __restrict left,
+	                         float * __restrict right,
+	                         FMVoiceLanes &voices, size_t count) noexcept;
+
+	// Per frame true peak of both channels, see true_peak_stereo_scalar().
+	void (*true_peak_stereo)(float * __restrict peak,
+	                         const float * __restrict left,
+	                         const float * __restrict right,
+	                         const float * __restrict filters,
+	                         size_t count) noexcept;
+
+	// Sliding window max of peak and the gain it calls for, see limiter_gain_scalar().
+	void (*limiter_gain)(float * __restrict gain,
+	                     const float * __restrict peak,
+	                     size_t count, unsigned window, float ceiling) noexcept;
+
+	// Spectrum multiply-accumulate for partitioned convolution, see complex_mac_scalar().
+	void (*complex_mac)(float * __restrict acc_re, float * __restrict acc_im,
+	                    const float * __restrict x_re, const float * __restrict x_im,
+	                    const float * __restrict h_re, const float * __restrict h_im,
+	                    size_t count) noexcept;
+
+	// See fir_add_scalar().
+	void (*fir_add)(float * __restrict output,
+	                const float * __restrict input,
+	                const float * __restrict taps, unsigned num_taps,
+	                size_t count) noexcept;
+
+	// See play_samples_scalar().
+	void (*play_samples)(float * __restrict left,
+	                     float * __restrict right,
+	                     SampleVoice &voice, size_t count) noexcept;
+};
+
+// Defaults to the best level the CPU supports.
+extern Kernels kernels;
+
+SIMDLevel get_best_simd_level();
+SIMDLevel get_simd_level();
+bool simd_level_is_supported(SIMDLevel level);
+const char *simd_level_to_string(SIMDLevel level);
+bool string_to_simd_level(const char *str, SIMDLevel &level);
+
+// Must be called before any audio processing starts.
+// Falls back to the best supported level if the requested one isn't available.
+void set_simd_level(SIMDLevel level);
+
+// Applies the SUSSYBARD_SIMD environment variable if set, or override if not null.
+// Either can be "auto", "scalar", "sse3", "avx2", "avx512" or "neon".
+void init_simd_level(const char *override_level);
+
+static inline void interleave_stereo_f32(float * __restrict target,
+                                         const float * __restrict left,
+                                         const float * __restrict right,
+                                         size_t count) noexcept
+{
+	kernels.interleave_stereo_f32(target, left, right, count);
+}
+
+static inline void interleave_stereo_f32_i16(int16_t * __restrict target,
+                                             const float * __restrict left,
+                                             const float * __restrict right,
+                                             size_t count, Dither *dither = nullptr) noexcept
+{
+	kernels.interleave_stereo_f32_i16(target, left, right, count, dither);
+}
+
+static inline void interleave_stereo_f32_i32(int32_t * __restrict target,
+                                             const float * __restrict left,
+                                             const float * __restrict right,
+                                             size_t count, unsigned bits, Dither *dither = nullptr) noexcept
+{
+	kernels.interleave_stereo_f32_i32(target, left, right, count, bits, dither);
+}
+
+// Interleaves and converts to any SampleFormat.
+// target must have room for count * 2 * get_sample_format_size(format) bytes.
+static inline void interleave_stereo(void *target, SampleFormat format,
+                                     const float * __restrict left,
+                                     const float * __restrict right,
+                                     size_t count, Dither *dither = nullptr) noexcept
+{
+	switch (format)
+	{
+	case SampleFormat::F32:
+		interleave_stereo_f32(static_cast<float *>(target), left, right, count);
+		break;
+	case SampleFormat::S16:
+		interleave_stereo_f32_i16(static_cast<int16_t *>(target), left, right, count, dither);
+		break;
+	case SampleFormat::S24_32:
+		interleave_stereo_f32_i32(static_cast<int32_t *>(target), left, right, count, 24, dither);
+		break;
+	case SampleFormat::S32:
+		interleave_stereo_f32_i32(static_cast<int32_t *>(target), left, right, count, 32, dither);
+		break;
 	}
-#endif
+}
+
+static inline void mix_stereo_inputs(float * __restrict left,
+                                     float * __restrict right,
+                                     MixInput *inputs, unsigned num_inputs,
+                                     size_t count) noexcept
+{
+	kernels.mix_stereo_inputs(left, right, inputs, num_inputs, count);
+}
+
+static inline void resample_stereo(float * __restrict left,
+                                   float * __restrict right,
+                                   const float * __restrict in_left,
+                                   const float * __restrict in_right,
+                                   PolyphaseState &state, size_t count) noexcept
+{
+	kernels.resample_stereo(left, right, in_left, in_right, state, count);
+}
+
+static inline void render_fm_voices(float * __restrict left,
+                                    float * __restrict right,
+                                    FMVoiceLanes &voices, size_t count) noexcept
+{
+	kernels.render_fm_voices(left, right, voices, count);
+}
+
+static inline void true_peak_stereo(float * __restrict peak,
+                                    const float * __restrict left,
+                                    const float * __restrict right,
+                                    const float * __restrict filters,
+                                    size_t count) noexcept
+{
+	kernels.true_peak_stereo(peak, left, right, filters, count);
+}
+
+static inline void limiter_gain(float * __restrict gain,
+                                const float * __restrict peak,
+                                size_t count, unsigned window, float ceiling) noexcept
+{
+	kernels.limiter_gain(gain, peak, count, window, ceiling);
+}
+
+static inline void complex_mac(float * __restrict acc_re, float * __restrict acc_im,
+                               const float * __restrict x_re, const float * __restrict x_im,
+                               const float * __restrict h_re, const float * __restrict h_im,
+                               size_t count) noexcept
+{
+	kernels.complex_mac(acc_re, acc_im, x_re, x_im, h_re, h_im, count);
+}
+
+static inline void fir_add(float * __restrict output,
+                           const float * __restrict input,
+                           const float * __restrict taps, unsigned num_taps,
+                           size_t count) noexcept
+{
+	kernels.fir_add(output, input, taps, num_taps, count);
+}
+
+static inline void play_samples(float * __restrict left,
+                                float * __restrict right,
+                                SampleVoice &voice, size_t count) noexcept
+{
+	kernels.play_samples(left, right, voice, count);
 }
 }
@@ -0,0 +1,1467 @@
+/* Copyright (c) 2017-2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Kernel implementations. This header is included once per ISA variant
+// by dsp_<isa>.cpp, each of which is compiled with different target flags
+// and defines DSP_KERNEL_NAMESPACE. Don't include it anywhere else.
+
+#ifndef DSP_KERNEL_NAMESPACE
+#error "DSP_KERNEL_NAMESPACE must be defined."
+#endif
+
+#include "dsp.hpp"
+#include "simd_headers.hpp"
+
+#ifndef DSP_KERNEL_SCALAR
+#if defined(__AVX512F__)
+#define DSP_KERNEL_AVX512 1
+#endif
+#if defined(__AVX2__)
+#define DSP_KERNEL_AVX2 1
+#endif
+#if defined(__AVX__)
+#define DSP_KERNEL_AVX 1
+#endif
+#if defined(__SSE2__)
+#define DSP_KERNEL_SSE2 1
+#endif
+#if defined(__SSE__)
+#define DSP_KERNEL_SSE 1
+#endif
+#if defined(__ARM_NEON)
+#define DSP_KERNEL_NEON 1
+#endif
+#endif
+
+namespace DSP
+{
+namespace DSP_KERNEL_NAMESPACE
+{
+static void interleave_stereo_f32(float * __restrict target,
+                                  const float * __restrict left,
+                                  const float * __restrict right,
+                                  size_t count) noexcept
+{
+	size_t rounded_count = 0;
+
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	const __m512i index0 = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+	const __m512i index1 = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 l = _mm512_loadu_ps(left + i);
+		__m512 r = _mm512_loadu_ps(right + i);
+		_mm512_storeu_ps(target + 2 * i, _mm512_permutex2var_ps(l, index0, r));
+		_mm512_storeu_ps(target + 2 * i + 16, _mm512_permutex2var_ps(l, index1, r));
+	}
+#elif defined(DSP_KERNEL_AVX)
+	rounded_count = count & ~size_t(7);
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 l = _mm256_loadu_ps(left + i);
+		__m256 r = _mm256_loadu_ps(right + i);
+		__m256 lo = _mm256_unpacklo_ps(l, r);
+		__m256 hi = _mm256_unpackhi_ps(l, r);
+		_mm256_storeu_ps(target + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(target + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+#elif defined(DSP_KERNEL_SSE)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 l = _mm_loadu_ps(left + i);
+		__m128 r = _mm_loadu_ps(right + i);
+		__m128 interleaved0 = _mm_unpacklo_ps(l, r);
+		__m128 interleaved1 = _mm_unpackhi_ps(l, r);
+		_mm_storeu_ps(target + 2 * i, interleaved0);
+		_mm_storeu_ps(target + 2 * i + 4, interleaved1);
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4x2_t stereo = { vld1q_f32(left + i), vld1q_f32(right + i) };
+		vst2q_f32(target + 2 * i, stereo);
+	}
+#endif
+
+	for (size_t i = rounded_count; i < count; i++)
+	{
+		target[2 * i + 0] = left[i];
+		target[2 * i + 1] = right[i];
+	}
+}
+
+// Vector versions of tpdf_noise(), stepping one xorshift32 state per lane.
+#if defined(DSP_KERNEL_AVX512)
+static inline __m512 tpdf_noise_lanes(__m512i &state) noexcept
+{
+	state = _mm512_xor_si512(state, _mm512_slli_epi32(state, 13));
+	state = _mm512_xor_si512(state, _mm512_srli_epi32(state, 17));
+	state = _mm512_xor_si512(state, _mm512_slli_epi32(state, 5));
+	__m512i diff = _mm512_sub_epi32(_mm512_and_si512(state, _mm512_set1_epi32(0xffff)),
+	                                _mm512_srli_epi32(state, 16));
+	return _mm512_mul_ps(_mm512_cvtepi32_ps(diff), _mm512_set1_ps(1.0f / 65536.0f));
+}
+#elif defined(DSP_KERNEL_AVX2)
+static inline __m256 tpdf_noise_lanes(__m256i &state) noexcept
+{
+	state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+	state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+	state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+	__m256i diff = _mm256_sub_epi32(_mm256_and_si256(state, _mm256_set1_epi32(0xffff)),
+	                                _mm256_srli_epi32(state, 16));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(diff), _mm256_set1_ps(1.0f / 65536.0f));
+}
+#elif defined(DSP_KERNEL_SSE2)
+static inline __m128 tpdf_noise_lanes(__m128i &state) noexcept
+{
+	state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+	state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+	state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+	__m128i diff = _mm_sub_epi32(_mm_and_si128(state, _mm_set1_epi32(0xffff)),
+	                             _mm_srli_epi32(state, 16));
+	return _mm_mul_ps(_mm_cvtepi32_ps(diff), _mm_set1_ps(1.0f / 65536.0f));
+}
+#elif defined(DSP_KERNEL_NEON)
+static inline float32x4_t tpdf_noise_lanes(uint32x4_t &state) noexcept
+{
+	state = veorq_u32(state, vshlq_n_u32(state, 13));
+	state = veorq_u32(state, vshrq_n_u32(state, 17));
+	state = veorq_u32(state, vshlq_n_u32(state, 5));
+	int32x4_t diff = vsubq_s32(vreinterpretq_s32_u32(vandq_u32(state, vdupq_n_u32(0xffff))),
+	                           vreinterpretq_s32_u32(vshrq_n_u32(state, 16)));
+	return vmulq_n_f32(vcvtq_f32_s32(diff), 1.0f / 65536.0f);
+}
+#endif
+
+static void interleave_stereo_f32_i16(int16_t * __restrict target,
+                                      const float * __restrict left,
+                                      const float * __restrict right,
+                                      size_t count, Dither *dither) noexcept
+{
+	size_t rounded_count = 0;
+
+	// Clamp before converting, out of range conversions return INT_MIN on x86.
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	const __m512 scale = _mm512_set1_ps(float(0x8000));
+	const __m512 max_value = _mm512_set1_ps(float(0x7fff));
+	const __m512 min_value = _mm512_set1_ps(-float(0x8000));
+	const __m512i index0 = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+	const __m512i index1 = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+	__m512i state = dither ? _mm512_loadu_si512(dither->state) : _mm512_setzero_si512();
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 l = _mm512_mul_ps(_mm512_loadu_ps(left + i), scale);
+		__m512 r = _mm512_mul_ps(_mm512_loadu_ps(right + i), scale);
+		if (dither)
+		{
+			l = _mm512_add_ps(l, tpdf_noise_lanes(state));
+			r = _mm512_add_ps(r, tpdf_noise_lanes(state));
+		}
+		__m512i il = _mm512_cvtps_epi32(_mm512_max_ps(_mm512_min_ps(l, max_value), min_value));
+		__m512i ir = _mm512_cvtps_epi32(_mm512_max_ps(_mm512_min_ps(r, max_value), min_value));
+		__m256i lo = _mm512_cvtsepi32_epi16(_mm512_permutex2var_epi32(il, index0, ir));
+		__m256i hi = _mm512_cvtsepi32_epi16(_mm512_permutex2var_epi32(il, index1, ir));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(target + 2 * i), lo);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(target + 2 * i + 16), hi);
+	}
+	if (dither)
+		_mm512_storeu_si512(dither->state, state);
+#elif defined(DSP_KERNEL_AVX2)
+	rounded_count = count & ~size_t(7);
+	const __m256 scale = _mm256_set1_ps(float(0x8000));
+	const __m256 max_value = _mm256_set1_ps(float(0x7fff));
+	const __m256 min_value = _mm256_set1_ps(-float(0x8000));
+	__m256i state = dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dither->state)) :
+	                _mm256_setzero_si256();
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 l = _mm256_mul_ps(_mm256_loadu_ps(left + i), scale);
+		__m256 r = _mm256_mul_ps(_mm256_loadu_ps(right + i), scale);
+		if (dither)
+		{
+			l = _mm256_add_ps(l, tpdf_noise_lanes(state));
+			r = _mm256_add_ps(r, tpdf_noise_lanes(state));
+		}
+		__m256i il = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(l, max_value), min_value));
+		__m256i ir = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(r, max_value), min_value));
+		// Unpack and pack both operate within 128-bit lanes, so the frame order works out.
+		__m256i lo = _mm256_unpacklo_epi32(il, ir);
+		__m256i hi = _mm256_unpackhi_epi32(il, ir);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(target + 2 * i), _mm256_packs_epi32(lo, hi));
+	}
+	if (dither)
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dither->state), state);
+#elif defined(DSP_KERNEL_SSE2)
+	rounded_count = count & ~size_t(3);
+	const __m128 scale = _mm_set1_ps(float(0x8000));
+	const __m128 max_value = _mm_set1_ps(float(0x7fff));
+	const __m128 min_value = _mm_set1_ps(-float(0x8000));
+	__m128i state = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(dither->state)) :
+	                _mm_setzero_si128();
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 l = _mm_mul_ps(_mm_loadu_ps(left + i), scale);
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(right + i), scale);
+		if (dither)
+		{
+			l = _mm_add_ps(l, tpdf_noise_lanes(state));
+			r = _mm_add_ps(r, tpdf_noise_lanes(state));
+		}
+		__m128i il = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(l, max_value), min_value));
+		__m128i ir = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(r, max_value), min_value));
+		__m128i lo = _mm_unpacklo_epi32(il, ir);
+		__m128i hi = _mm_unpackhi_epi32(il, ir);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 2 * i), _mm_packs_epi32(lo, hi));
+	}
+	if (dither)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dither->state), state);
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	uint32x4_t state = dither ? vld1q_u32(dither->state) : vdupq_n_u32(0);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t l = vld1q_f32(left + i);
+		float32x4_t r = vld1q_f32(right + i);
+
+		l = vmulq_n_f32(l, float(0x8000));
+		r = vmulq_n_f32(r, float(0x8000));
+
+		if (dither)
+		{
+			l = vaddq_f32(l, tpdf_noise_lanes(state));
+			r = vaddq_f32(r, tpdf_noise_lanes(state));
+		}
+
+		int32x4_t il = vcvtq_s32_f32(l);
+		int32x4_t ir = vcvtq_s32_f32(r);
+		int16x4_t sl = vqmovn_s32(il);
+		int16x4_t sr = vqmovn_s32(ir);
+		int16x4x2_t stereo = { sl, sr };
+		vst2_s16(target + 2 * i, stereo);
+	}
+	if (dither)
+		vst1q_u32(dither->state, state);
+#endif
+
+	if (dither)
+	{
+		for (size_t i = rounded_count; i < count; i++)
+		{
+			target[2 * i + 0] = f32_to_i16_dither(left[i], dither->state[0]);
+			target[2 * i + 1] = f32_to_i16_dither(right[i], dither->state[0]);
+		}
+	}
+	else
+	{
+		for (size_t i = rounded_count; i < count; i++)
+		{
+			target[2 * i + 0] = f32_to_i16(left[i]);
+			target[2 * i + 1] = f32_to_i16(right[i]);
+		}
+	}
+}
+
+static void interleave_stereo_f32_i32(int32_t * __restrict target,
+                                      const float * __restrict left,
+                                      const float * __restrict right,
+                                      size_t count, unsigned bits, Dither *dither) noexcept
+{
+	size_t rounded_count = 0;
+
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	const float scale_value = ldexpf(1.0f, int(bits) - 1);
+	const float max_value_scalar = get_int_max_value(bits);
+	const __m512 scale = _mm512_set1_ps(scale_value);
+	const __m512 max_value = _mm512_set1_ps(max_value_scalar);
+	const __m512 min_value = _mm512_set1_ps(-scale_value);
+	const __m512i index0 = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+	const __m512i index1 = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+	__m512i state = dither ? _mm512_loadu_si512(dither->state) : _mm512_setzero_si512();
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 l = _mm512_mul_ps(_mm512_loadu_ps(left + i), scale);
+		__m512 r = _mm512_mul_ps(_mm512_loadu_ps(right + i), scale);
+		if (dither)
+		{
+			l = _mm512_add_ps(l, tpdf_noise_lanes(state));
+			r = _mm512_add_ps(r, tpdf_noise_lanes(state));
+		}
+		__m512i il = _mm512_cvtps_epi32(_mm512_max_ps(_mm512_min_ps(l, max_value), min_value));
+		__m512i ir = _mm512_cvtps_epi32(_mm512_max_ps(_mm512_min_ps(r, max_value), min_value));
+		_mm512_storeu_si512(target + 2 * i, _mm512_permutex2var_epi32(il, index0, ir));
+		_mm512_storeu_si512(target + 2 * i + 16, _mm512_permutex2var_epi32(il, index1, ir));
+	}
+	if (dither)
+		_mm512_storeu_si512(dither->state, state);
+#elif defined(DSP_KERNEL_AVX2)
+	rounded_count = count & ~size_t(7);
+	const float scale_value = ldexpf(1.0f, int(bits) - 1);
+	const float max_value_scalar = get_int_max_value(bits);
+	const __m256 scale = _mm256_set1_ps(scale_value);
+	const __m256 max_value = _mm256_set1_ps(max_value_scalar);
+	const __m256 min_value = _mm256_set1_ps(-scale_value);
+	__m256i state = dither ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dither->state)) :
+	                _mm256_setzero_si256();
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 l = _mm256_mul_ps(_mm256_loadu_ps(left + i), scale);
+		__m256 r = _mm256_mul_ps(_mm256_loadu_ps(right + i), scale);
+		if (dither)
+		{
+			l = _mm256_add_ps(l, tpdf_noise_lanes(state));
+			r = _mm256_add_ps(r, tpdf_noise_lanes(state));
+		}
+		__m256i il = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(l, max_value), min_value));
+		__m256i ir = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(r, max_value), min_value));
+		__m256i lo = _mm256_unpacklo_epi32(il, ir);
+		__m256i hi = _mm256_unpackhi_epi32(il, ir);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(target + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(target + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	if (dither)
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dither->state), state);
+#elif defined(DSP_KERNEL_SSE2)
+	rounded_count = count & ~size_t(3);
+	const float scale_value = ldexpf(1.0f, int(bits) - 1);
+	const float max_value_scalar = get_int_max_value(bits);
+	const __m128 scale = _mm_set1_ps(scale_value);
+	const __m128 max_value = _mm_set1_ps(max_value_scalar);
+	const __m128 min_value = _mm_set1_ps(-scale_value);
+	__m128i state = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(dither->state)) :
+	                _mm_setzero_si128();
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 l = _mm_mul_ps(_mm_loadu_ps(left + i), scale);
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(right + i), scale);
+		if (dither)
+		{
+			l = _mm_add_ps(l, tpdf_noise_lanes(state));
+			r = _mm_add_ps(r, tpdf_noise_lanes(state));
+		}
+		__m128i il = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(l, max_value), min_value));
+		__m128i ir = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(r, max_value), min_value));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 2 * i), _mm_unpacklo_epi32(il, ir));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(target + 2 * i + 4), _mm_unpackhi_epi32(il, ir));
+	}
+	if (dither)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dither->state), state);
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	const float scale_value = ldexpf(1.0f, int(bits) - 1);
+	const float max_value_scalar = get_int_max_value(bits);
+	const float32x4_t max_value = vdupq_n_f32(max_value_scalar);
+	const float32x4_t min_value = vdupq_n_f32(-scale_value);
+	uint32x4_t state = dither ? vld1q_u32(dither->state) : vdupq_n_u32(0);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t l = vmulq_n_f32(vld1q_f32(left + i), scale_value);
+		float32x4_t r = vmulq_n_f32(vld1q_f32(right + i), scale_value);
+		if (dither)
+		{
+			l = vaddq_f32(l, tpdf_noise_lanes(state));
+			r = vaddq_f32(r, tpdf_noise_lanes(state));
+		}
+		int32x4x2_t stereo = {
+			vcvtq_s32_f32(vmaxq_f32(vminq_f32(l, max_value), min_value)),
+			vcvtq_s32_f32(vmaxq_f32(vminq_f32(r, max_value), min_value)),
+		};
+		vst2q_s32(target + 2 * i, stereo);
+	}
+	if (dither)
+		vst1q_u32(dither->state, state);
+#endif
+
+	if (dither)
+	{
+		for (size_t i = rounded_count; i < count; i++)
+		{
+			target[2 * i + 0] = f32_to_int(left[i], bits, tpdf_noise(dither->state[0]));
+			target[2 * i + 1] = f32_to_int(right[i], bits, tpdf_noise(dither->state[0]));
+		}
+	}
+	else
+	{
+		for (size_t i = rounded_count; i < count; i++)
+		{
+			target[2 * i + 0] = f32_to_int(left[i], bits);
+			target[2 * i + 1] = f32_to_int(right[i], bits);
+		}
+	}
+}
+
+static void mix_stereo_inputs(float * __restrict left,
+                              float * __restrict right,
+                              MixInput *inputs, unsigned num_inputs,
+                              size_t count) noexcept
+{
+	if (num_inputs > MaxMixInputs)
+		num_inputs = MaxMixInputs;
+
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		inputs[j].peak = 0.0f;
+		inputs[j].sum_squares = 0.0f;
+	}
+
+	size_t rounded_count = 0;
+
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	__m512 peak[MaxMixInputs];
+	__m512 sum_squares[MaxMixInputs];
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		peak[j] = _mm512_setzero_ps();
+		sum_squares[j] = _mm512_setzero_ps();
+	}
+
+	const __m512 lane_index = _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f,
+	                                         8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f);
+
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 acc_l = _mm512_setzero_ps();
+		__m512 acc_r = _mm512_setzero_ps();
+		__m512 frame_index = _mm512_add_ps(_mm512_set1_ps(float(i)), lane_index);
+
+		for (unsigned j = 0; j < num_inputs; j++)
+		{
+			const auto &input = inputs[j];
+			__m512 gl = _mm512_fmadd_ps(frame_index, _mm512_set1_ps(input.step_left), _mm512_set1_ps(input.gain_left));
+			__m512 gr = _mm512_fmadd_ps(frame_index, _mm512_set1_ps(input.step_right), _mm512_set1_ps(input.gain_right));
+			__m512 l = _mm512_mul_ps(_mm512_loadu_ps(input.left + i), gl);
+			__m512 r = _mm512_mul_ps(_mm512_loadu_ps(input.right + i), gr);
+			acc_l = _mm512_add_ps(acc_l, l);
+			acc_r = _mm512_add_ps(acc_r, r);
+			peak[j] = _mm512_max_ps(_mm512_max_ps(peak[j], _mm512_max_ps(l, r)),
+			                        _mm512_sub_ps(_mm512_setzero_ps(), _mm512_min_ps(l, r)));
+			sum_squares[j] = _mm512_fmadd_ps(l, l, _mm512_fmadd_ps(r, r, sum_squares[j]));
+		}
+
+		_mm512_storeu_ps(left + i, acc_l);
+		_mm512_storeu_ps(right + i, acc_r);
+	}
+
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		inputs[j].peak = _mm512_reduce_max_ps(peak[j]);
+		inputs[j].sum_squares = _mm512_reduce_add_ps(sum_squares[j]);
+	}
+#elif defined(DSP_KERNEL_AVX)
+	rounded_count = count & ~size_t(7);
+	__m256 peak[MaxMixInputs];
+	__m256 sum_squares[MaxMixInputs];
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		peak[j] = _mm256_setzero_ps();
+		sum_squares[j] = _mm256_setzero_ps();
+	}
+
+	const __m256 lane_index = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 acc_l = _mm256_setzero_ps();
+		__m256 acc_r = _mm256_setzero_ps();
+		__m256 frame_index = _mm256_add_ps(_mm256_set1_ps(float(i)), lane_index);
+
+		for (unsigned j = 0; j < num_inputs; j++)
+		{
+			const auto &input = inputs[j];
+			__m256 gl = _mm256_add_ps(_mm256_set1_ps(input.gain_left),
+			                          _mm256_mul_ps(frame_index, _mm256_set1_ps(input.step_left)));
+			__m256 gr = _mm256_add_ps(_mm256_set1_ps(input.gain_right),
+			                          _mm256_mul_ps(frame_index, _mm256_set1_ps(input.step_right)));
+			__m256 l = _mm256_mul_ps(_mm256_loadu_ps(input.left + i), gl);
+			__m256 r = _mm256_mul_ps(_mm256_loadu_ps(input.right + i), gr);
+			acc_l = _mm256_add_ps(acc_l, l);
+			acc_r = _mm256_add_ps(acc_r, r);
+			peak[j] = _mm256_max_ps(_mm256_max_ps(peak[j], _mm256_max_ps(l, r)),
+			                        _mm256_sub_ps(_mm256_setzero_ps(), _mm256_min_ps(l, r)));
+			sum_squares[j] = _mm256_add_ps(sum_squares[j], _mm256_add_ps(_mm256_mul_ps(l, l), _mm256_mul_ps(r, r)));
+		}
+
+		_mm256_storeu_ps(left + i, acc_l);
+		_mm256_storeu_ps(right + i, acc_r);
+	}
+
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		float peak_lanes[8], sum_lanes[8];
+		_mm256_storeu_ps(peak_lanes, peak[j]);
+		_mm256_storeu_ps(sum_lanes, sum_squares[j]);
+		for (unsigned k = 0; k < 8; k++)
+		{
+			inputs[j].peak = fmaxf(inputs[j].peak, peak_lanes[k]);
+			inputs[j].sum_squares += sum_lanes[k];
+		}
+	}
+#elif defined(DSP_KERNEL_SSE)
+	rounded_count = count & ~size_t(3);
+	__m128 peak[MaxMixInputs];
+	__m128 sum_squares[MaxMixInputs];
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		peak[j] = _mm_setzero_ps();
+		sum_squares[j] = _mm_setzero_ps();
+	}
+
+	const __m128 lane_index = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 acc_l = _mm_setzero_ps();
+		__m128 acc_r = _mm_setzero_ps();
+		__m128 frame_index = _mm_add_ps(_mm_set1_ps(float(i)), lane_index);
+
+		for (unsigned j = 0; j < num_inputs; j++)
+		{
+			const auto &input = inputs[j];
+			__m128 gl = _mm_add_ps(_mm_set1_ps(input.gain_left), _mm_mul_ps(frame_index, _mm_set1_ps(input.step_left)));
+			__m128 gr = _mm_add_ps(_mm_set1_ps(input.gain_right), _mm_mul_ps(frame_index, _mm_set1_ps(input.step_right)));
+			__m128 l = _mm_mul_ps(_mm_loadu_ps(input.left + i), gl);
+			__m128 r = _mm_mul_ps(_mm_loadu_ps(input.right + i), gr);
+			acc_l = _mm_add_ps(acc_l, l);
+			acc_r = _mm_add_ps(acc_r, r);
+			peak[j] = _mm_max_ps(_mm_max_ps(peak[j], _mm_max_ps(l, r)),
+			                     _mm_sub_ps(_mm_setzero_ps(), _mm_min_ps(l, r)));
+			sum_squares[j] = _mm_add_ps(sum_squares[j], _mm_add_ps(_mm_mul_ps(l, l), _mm_mul_ps(r, r)));
+		}
+
+		_mm_storeu_ps(left + i, acc_l);
+		_mm_storeu_ps(right + i, acc_r);
+	}
+
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		float peak_lanes[4], sum_lanes[4];
+		_mm_storeu_ps(peak_lanes, peak[j]);
+		_mm_storeu_ps(sum_lanes, sum_squares[j]);
+		for (unsigned k = 0; k < 4; k++)
+		{
+			inputs[j].peak = fmaxf(inputs[j].peak, peak_lanes[k]);
+			inputs[j].sum_squares += sum_lanes[k];
+		}
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	float32x4_t peak[MaxMixInputs];
+	float32x4_t sum_squares[MaxMixInputs];
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		peak[j] = vdupq_n_f32(0.0f);
+		sum_squares[j] = vdupq_n_f32(0.0f);
+	}
+
+	static const float lane_index_data[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+	const float32x4_t lane_index = vld1q_f32(lane_index_data);
+
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t acc_l = vdupq_n_f32(0.0f);
+		float32x4_t acc_r = vdupq_n_f32(0.0f);
+		float32x4_t frame_index = vaddq_f32(vdupq_n_f32(float(i)), lane_index);
+
+		for (unsigned j = 0; j < num_inputs; j++)
+		{
+			const auto &input = inputs[j];
+			float32x4_t gl = vmlaq_n_f32(vdupq_n_f32(input.gain_left), frame_index, input.step_left);
+			float32x4_t gr = vmlaq_n_f32(vdupq_n_f32(input.gain_right), frame_index, input.step_right);
+			float32x4_t l = vmulq_f32(vld1q_f32(input.left + i), gl);
+			float32x4_t r = vmulq_f32(vld1q_f32(input.right + i), gr);
+			acc_l = vaddq_f32(acc_l, l);
+			acc_r = vaddq_f32(acc_r, r);
+			peak[j] = vmaxq_f32(peak[j], vmaxq_f32(vabsq_f32(l), vabsq_f32(r)));
+			sum_squares[j] = vmlaq_f32(vmlaq_f32(sum_squares[j], l, l), r, r);
+		}
+
+		vst1q_f32(left + i, acc_l);
+		vst1q_f32(right + i, acc_r);
+	}
+
+	for (unsigned j = 0; j < num_inputs; j++)
+	{
+		float peak_lanes[4], sum_lanes[4];
+		vst1q_f32(peak_lanes, peak[j]);
+		vst1q_f32(sum_lanes, sum_squares[j]);
+		for (unsigned k = 0; k < 4; k++)
+		{
+			inputs[j].peak = fmaxf(inputs[j].peak, peak_lanes[k]);
+			inputs[j].sum_squares += sum_lanes[k];
+		}
+	}
+#endif
+
+	mix_stereo_inputs_scalar(left, right, inputs, num_inputs, rounded_count, count);
+}
+
+static void resample_stereo(float * __restrict left,
+                            float * __restrict right,
+                            const float * __restrict in_left,
+                            const float * __restrict in_right,
+                            PolyphaseState &state, size_t count) noexcept
+{
+#if defined(DSP_KERNEL_AVX512) || defined(DSP_KERNEL_AVX) || defined(DSP_KERNEL_SSE) || defined(DSP_KERNEL_NEON)
+	unsigned phase = state.phase;
+	size_t position = state.position;
+	unsigned taps = state.taps;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const float *filter = state.filters + phase * taps;
+		const float *l = in_left + position;
+		const float *r = in_right + position;
+
+#if defined(DSP_KERNEL_AVX512)
+		__m512 acc_l = _mm512_setzero_ps();
+		__m512 acc_r = _mm512_setzero_ps();
+		for (unsigned k = 0; k < taps; k += 16)
+		{
+			__m512 h = _mm512_loadu_ps(filter + k);
+			acc_l = _mm512_fmadd_ps(h, _mm512_loadu_ps(l + k), acc_l);
+			acc_r = _mm512_fmadd_ps(h, _mm512_loadu_ps(r + k), acc_r);
+		}
+		left[i] = _mm512_reduce_add_ps(acc_l);
+		right[i] = _mm512_reduce_add_ps(acc_r);
+#elif defined(DSP_KERNEL_AVX) || defined(DSP_KERNEL_SSE)
+#if defined(DSP_KERNEL_AVX)
+		__m256 acc_l8 = _mm256_setzero_ps();
+		__m256 acc_r8 = _mm256_setzero_ps();
+		for (unsigned k = 0; k < taps; k += 8)
+		{
+			__m256 h = _mm256_loadu_ps(filter + k);
+			acc_l8 = _mm256_add_ps(acc_l8, _mm256_mul_ps(h, _mm256_loadu_ps(l + k)));
+			acc_r8 = _mm256_add_ps(acc_r8, _mm256_mul_ps(h, _mm256_loadu_ps(r + k)));
+		}
+		__m128 acc_l = _mm_add_ps(_mm256_castps256_ps128(acc_l8), _mm256_extractf128_ps(acc_l8, 1));
+		__m128 acc_r = _mm_add_ps(_mm256_castps256_ps128(acc_r8), _mm256_extractf128_ps(acc_r8, 1));
+#else
+		__m128 acc_l = _mm_setzero_ps();
+		__m128 acc_r = _mm_setzero_ps();
+		for (unsigned k = 0; k < taps; k += 4)
+		{
+			__m128 h = _mm_loadu_ps(filter + k);
+			acc_l = _mm_add_ps(acc_l, _mm_mul_ps(h, _mm_loadu_ps(l + k)));
+			acc_r = _mm_add_ps(acc_r, _mm_mul_ps(h, _mm_loadu_ps(r + k)));
+		}
+#endif
+		// Reduce both channels at once, ending up with left in lane 0 and right in lane 1.
+		__m128 sums = _mm_add_ps(_mm_unpacklo_ps(acc_l, acc_r), _mm_unpackhi_ps(acc_l, acc_r));
+		sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+		left[i] = _mm_cvtss_f32(sums);
+		right[i] = _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, _MM_SHUFFLE(1, 1, 1, 1)));
+#elif defined(DSP_KERNEL_NEON)
+		float32x4_t acc_l = vdupq_n_f32(0.0f);
+		float32x4_t acc_r = vdupq_n_f32(0.0f);
+		for (unsigned k = 0; k < taps; k += 4)
+		{
+			float32x4_t h = vld1q_f32(filter + k);
+			acc_l = vmlaq_f32(acc_l, h, vld1q_f32(l + k));
+			acc_r = vmlaq_f32(acc_r, h, vld1q_f32(r + k));
+		}
+		float32x2_t sums = vpadd_f32(vadd_f32(vget_low_f32(acc_l), vget_high_f32(acc_l)),
+		                             vadd_f32(vget_low_f32(acc_r), vget_high_f32(acc_r)));
+		left[i] = vget_lane_f32(sums, 0);
+		right[i] = vget_lane_f32(sums, 1);
+#endif
+
+		advance_polyphase(state, phase, position);
+	}
+
+	state.phase = phase;
+	state.position = position;
+#else
+	resample_stereo_scalar(left, right, in_left, in_right, state, count);
+#endif
+}
+
+static void true_peak_stereo(float * __restrict peak,
+                             const float * __restrict left,
+                             const float * __restrict right,
+                             const float * __restrict filters,
+                             size_t count) noexcept
+{
+	size_t rounded_count = 0;
+
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 m = _mm512_setzero_ps();
+		for (unsigned p = 0; p < TruePeakPhases; p++)
+		{
+			const float *filter = filters + p * TruePeakTaps;
+			__m512 l = _mm512_setzero_ps();
+			__m512 r = _mm512_setzero_ps();
+			for (unsigned k = 0; k < TruePeakTaps; k++)
+			{
+				__m512 h = _mm512_set1_ps(filter[k]);
+				l = _mm512_fmadd_ps(h, _mm512_loadu_ps(left + i - k), l);
+				r = _mm512_fmadd_ps(h, _mm512_loadu_ps(right + i - k), r);
+			}
+			m = _mm512_max_ps(m, _mm512_max_ps(_mm512_abs_ps(l), _mm512_abs_ps(r)));
+		}
+		_mm512_storeu_ps(peak + i, m);
+	}
+#elif defined(DSP_KERNEL_AVX)
+	rounded_count = count & ~size_t(7);
+	const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 m = _mm256_setzero_ps();
+		for (unsigned p = 0; p < TruePeakPhases; p++)
+		{
+			const float *filter = filters + p * TruePeakTaps;
+			__m256 l = _mm256_setzero_ps();
+			__m256 r = _mm256_setzero_ps();
+			for (unsigned k = 0; k < TruePeakTaps; k++)
+			{
+				__m256 h = _mm256_set1_ps(filter[k]);
+				l = _mm256_add_ps(l, _mm256_mul_ps(h, _mm256_loadu_ps(left + i - k)));
+				r = _mm256_add_ps(r, _mm256_mul_ps(h, _mm256_loadu_ps(right + i - k)));
+			}
+			m = _mm256_max_ps(m, _mm256_max_ps(_mm256_andnot_ps(sign_mask, l), _mm256_andnot_ps(sign_mask, r)));
+		}
+		_mm256_storeu_ps(peak + i, m);
+	}
+#elif defined(DSP_KERNEL_SSE)
+	rounded_count = count & ~size_t(3);
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 m = _mm_setzero_ps();
+		for (unsigned p = 0; p < TruePeakPhases; p++)
+		{
+			const float *filter = filters + p * TruePeakTaps;
+			__m128 l = _mm_setzero_ps();
+			__m128 r = _mm_setzero_ps();
+			for (unsigned k = 0; k < TruePeakTaps; k++)
+			{
+				__m128 h = _mm_set1_ps(filter[k]);
+				l = _mm_add_ps(l, _mm_mul_ps(h, _mm_loadu_ps(left + i - k)));
+				r = _mm_add_ps(r, _mm_mul_ps(h, _mm_loadu_ps(right + i - k)));
+			}
+			m = _mm_max_ps(m, _mm_max_ps(_mm_andnot_ps(sign_mask, l), _mm_andnot_ps(sign_mask, r)));
+		}
+		_mm_storeu_ps(peak + i, m);
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t m = vdupq_n_f32(0.0f);
+		for (unsigned p = 0; p < TruePeakPhases; p++)
+		{
+			const float *filter = filters + p * TruePeakTaps;
+			float32x4_t l = vdupq_n_f32(0.0f);
+			float32x4_t r = vdupq_n_f32(0.0f);
+			for (unsigned k = 0; k < TruePeakTaps; k++)
+			{
+				l = vmlaq_n_f32(l, vld1q_f32(left + i - k), filter[k]);
+				r = vmlaq_n_f32(r, vld1q_f32(right + i - k), filter[k]);
+			}
+			m = vmaxq_f32(m, vmaxq_f32(vabsq_f32(l), vabsq_f32(r)));
+		}
+		vst1q_f32(peak + i, m);
+	}
+#endif
+
+	true_peak_stereo_scalar(peak, left, right, filters, rounded_count, count);
+}
+
+static void limiter_gain(float * __restrict gain,
+                         const float * __restrict peak,
+                         size_t count, unsigned window, float ceiling) noexcept
+{
+	size_t rounded_count = 0;
+
+	// The window is short, a max over every offset is cheaper than a monotonic queue
+	// and vectorizes across frames.
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	const __m512 c = _mm512_set1_ps(ceiling);
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 m = c;
+		for (unsigned k = 0; k < window; k++)
+			m = _mm512_max_ps(m, _mm512_loadu_ps(peak + i - k));
+		_mm512_storeu_ps(gain + i, _mm512_div_ps(c, m));
+	}
+#elif defined(DSP_KERNEL_AVX)
+	rounded_count = count & ~size_t(7);
+	const __m256 c = _mm256_set1_ps(ceiling);
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 m = c;
+		for (unsigned k = 0; k < window; k++)
+			m = _mm256_max_ps(m, _mm256_loadu_ps(peak + i - k));
+		_mm256_storeu_ps(gain + i, _mm256_div_ps(c, m));
+	}
+#elif defined(DSP_KERNEL_SSE)
+	rounded_count = count & ~size_t(3);
+	const __m128 c = _mm_set1_ps(ceiling);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 m = c;
+		for (unsigned k = 0; k < window; k++)
+			m = _mm_max_ps(m, _mm_loadu_ps(peak + i - k));
+		_mm_storeu_ps(gain + i, _mm_div_ps(c, m));
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	const float32x4_t c = vdupq_n_f32(ceiling);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t m = c;
+		for (unsigned k = 0; k < window; k++)
+			m = vmaxq_f32(m, vld1q_f32(peak + i - k));
+
+		// No divide on ARMv7, refine the reciprocal estimate twice.
+		float32x4_t inv = vrecpeq_f32(m);
+		inv = vmulq_f32(inv, vrecpsq_f32(m, inv));
+		inv = vmulq_f32(inv, vrecpsq_f32(m, inv));
+		vst1q_f32(gain + i, vminq_f32(vdupq_n_f32(1.0f), vmulq_f32(c, inv)));
+	}
+#endif
+
+	limiter_gain_scalar(gain, peak, rounded_count, count, window, ceiling);
+}
+
+static void complex_mac(float * __restrict acc_re, float * __restrict acc_im,
+                        const float * __restrict x_re, const float * __restrict x_im,
+                        const float * __restrict h_re, const float * __restrict h_im,
+                        size_t count) noexcept
+{
+	size_t rounded_count = 0;
+
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 xr = _mm512_loadu_ps(x_re + i);
+		__m512 xi = _mm512_loadu_ps(x_im + i);
+		__m512 hr = _mm512_loadu_ps(h_re + i);
+		__m512 hi = _mm512_loadu_ps(h_im + i);
+		__m512 re = _mm512_fnmadd_ps(xi, hi, _mm512_fmadd_ps(xr, hr, _mm512_loadu_ps(acc_re + i)));
+		__m512 im = _mm512_fmadd_ps(xi, hr, _mm512_fmadd_ps(xr, hi, _mm512_loadu_ps(acc_im + i)));
+		_mm512_storeu_ps(acc_re + i, re);
+		_mm512_storeu_ps(acc_im + i, im);
+	}
+#elif defined(DSP_KERNEL_AVX)
+	rounded_count = count & ~size_t(7);
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 xr = _mm256_loadu_ps(x_re + i);
+		__m256 xi = _mm256_loadu_ps(x_im + i);
+		__m256 hr = _mm256_loadu_ps(h_re + i);
+		__m256 hi = _mm256_loadu_ps(h_im + i);
+		__m256 re = _mm256_sub_ps(_mm256_mul_ps(xr, hr), _mm256_mul_ps(xi, hi));
+		__m256 im = _mm256_add_ps(_mm256_mul_ps(xr, hi), _mm256_mul_ps(xi, hr));
+		_mm256_storeu_ps(acc_re + i, _mm256_add_ps(_mm256_loadu_ps(acc_re + i), re));
+		_mm256_storeu_ps(acc_im + i, _mm256_add_ps(_mm256_loadu_ps(acc_im + i), im));
+	}
+#elif defined(DSP_KERNEL_SSE)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 xr = _mm_loadu_ps(x_re + i);
+		__m128 xi = _mm_loadu_ps(x_im + i);
+		__m128 hr = _mm_loadu_ps(h_re + i);
+		__m128 hi = _mm_loadu_ps(h_im + i);
+		__m128 re = _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi));
+		__m128 im = _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr));
+		_mm_storeu_ps(acc_re + i, _mm_add_ps(_mm_loadu_ps(acc_re + i), re));
+		_mm_storeu_ps(acc_im + i, _mm_add_ps(_mm_loadu_ps(acc_im + i), im));
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t xr = vld1q_f32(x_re + i);
+		float32x4_t xi = vld1q_f32(x_im + i);
+		float32x4_t hr = vld1q_f32(h_re + i);
+		float32x4_t hi = vld1q_f32(h_im + i);
+		float32x4_t re = vmlsq_f32(vmlaq_f32(vld1q_f32(acc_re + i), xr, hr), xi, hi);
+		float32x4_t im = vmlaq_f32(vmlaq_f32(vld1q_f32(acc_im + i), xr, hi), xi, hr);
+		vst1q_f32(acc_re + i, re);
+		vst1q_f32(acc_im + i, im);
+	}
+#endif
+
+	complex_mac_scalar(acc_re, acc_im, x_re, x_im, h_re, h_im, rounded_count, count);
+}
+
+static void fir_add(float * __restrict output,
+                    const float * __restrict input,
+                    const float * __restrict taps, unsigned num_taps,
+                    size_t count) noexcept
+{
+	size_t rounded_count = 0;
+
+	// Vectorized across output frames, so any number of taps works.
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	for (size_t i = 0; i < rounded_count; i += 16)
+	{
+		__m512 sum = _mm512_setzero_ps();
+		for (unsigned k = 0; k < num_taps; k++)
+			sum = _mm512_fmadd_ps(_mm512_set1_ps(taps[k]), _mm512_loadu_ps(input + i - k), sum);
+		_mm512_storeu_ps(output + i, _mm512_add_ps(_mm512_loadu_ps(output + i), sum));
+	}
+#elif defined(DSP_KERNEL_AVX)
+	rounded_count = count & ~size_t(7);
+	for (size_t i = 0; i < rounded_count; i += 8)
+	{
+		__m256 sum = _mm256_setzero_ps();
+		for (unsigned k = 0; k < num_taps; k++)
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(taps[k]), _mm256_loadu_ps(input + i - k)));
+		_mm256_storeu_ps(output + i, _mm256_add_ps(_mm256_loadu_ps(output + i), sum));
+	}
+#elif defined(DSP_KERNEL_SSE)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (unsigned k = 0; k < num_taps; k++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(taps[k]), _mm_loadu_ps(input + i - k)));
+		_mm_storeu_ps(output + i, _mm_add_ps(_mm_loadu_ps(output + i), sum));
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	for (size_t i = 0; i < rounded_count; i += 4)
+	{
+		float32x4_t sum = vdupq_n_f32(0.0f);
+		for (unsigned k = 0; k < num_taps; k++)
+			sum = vmlaq_n_f32(sum, vld1q_f32(input + i - k), taps[k]);
+		vst1q_f32(output + i, vaddq_f32(vld1q_f32(output + i), sum));
+	}
+#endif
+
+	fir_add_scalar(output, input, taps, num_taps, rounded_count, count);
+}
+
+// Lane k starts at frame k of the run. Every lane then advances by lanes * step per iteration,
+// carrying from the fraction into the index by hand, so positions match the scalar path exactly.
+static inline void init_sample_lanes(const SampleVoice &voice, unsigned lanes,
+                                     uint32_t *index, uint32_t *fraction, float *gain,
+                                     uint32_t &stride_index, uint32_t &stride_fraction, float &stride_gain) noexcept
+{
+	uint64_t position = (uint64_t(voice.index) << 32) | voice.fraction;
+	uint64_t step = (uint64_t(voice.step_index) << 32) | voice.step_fraction;
+	float g = voice.gain;
+	for (unsigned k = 0; k < lanes; k++)
+	{
+		uint64_t p = position + k * step;
+		index[k] = uint32_t(p >> 32);
+		fraction[k] = uint32_t(p);
+		gain[k] = g;
+		g *= voice.gain_factor;
+	}
+
+	uint64_t stride = lanes * step;
+	stride_index = uint32_t(stride >> 32);
+	stride_fraction = uint32_t(stride);
+	stride_gain = 1.0f;
+	for (unsigned k = 0; k < lanes; k++)
+		stride_gain *= voice.gain_factor;
+}
+
+static inline void advance_sample_voice(SampleVoice &voice, size_t frames, float gain, float peak) noexcept
+{
+	uint64_t position = (uint64_t(voice.index) << 32) | voice.fraction;
+	uint64_t step = (uint64_t(voice.step_index) << 32) | voice.step_fraction;
+	position += frames * step;
+	voice.index = uint32_t(position >> 32);
+	voice.fraction = uint32_t(position);
+	voice.gain = gain;
+	voice.peak = fmaxf(voice.peak, peak);
+}
+
+static void play_samples(float * __restrict left,
+                         float * __restrict right,
+                         SampleVoice &voice, size_t count) noexcept
+{
+	size_t rounded_count = 0;
+
+	// Gathering 32 bits at a frame picks up that frame and the next one in a single load.
+#if defined(DSP_KERNEL_AVX512)
+	rounded_count = count & ~size_t(15);
+	if (rounded_count)
+	{
+		alignas(64) uint32_t index_lanes[16], fraction_lanes[16];
+		alignas(64) float gain_lanes[16];
+		uint32_t stride_index, stride_fraction;
+		float stride_gain;
+		bool stereo = voice.left != voice.right;
+		init_sample_lanes(voice, 16, index_lanes, fraction_lanes, gain_lanes, stride_index, stride_fraction, stride_gain);
+
+		__m512i index = _mm512_load_si512(index_lanes);
+		__m512i fraction = _mm512_load_si512(fraction_lanes);
+		__m512 gain = _mm512_load_ps(gain_lanes);
+		const __m512i step_index = _mm512_set1_epi32(int(stride_index));
+		const __m512i step_fraction = _mm512_set1_epi32(int(stride_fraction));
+		const __m512 step_gain = _mm512_set1_ps(stride_gain);
+		const __m512 fraction_scale = _mm512_set1_ps(1.0f / 16777216.0f);
+		const __m512i one = _mm512_set1_epi32(1);
+		__m512 peak = _mm512_setzero_ps();
+
+		for (size_t i = 0; i < rounded_count; i += 16)
+		{
+			__m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(fraction, 8)), fraction_scale);
+			__m512i lw = _mm512_i32gather_epi32(index, voice.left, 2);
+			__m512 l0 = _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(lw, 16), 16));
+			__m512 l1 = _mm512_cvtepi32_ps(_mm512_srai_epi32(lw, 16));
+			__m512 l = _mm512_mul_ps(_mm512_fmadd_ps(_mm512_sub_ps(l1, l0), t, l0), gain);
+			__m512 r = l;
+			if (stereo)
+			{
+				__m512i rw = _mm512_i32gather_epi32(index, voice.right, 2);
+				__m512 r0 = _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(rw, 16), 16));
+				__m512 r1 = _mm512_cvtepi32_ps(_mm512_srai_epi32(rw, 16));
+				r = _mm512_mul_ps(_mm512_fmadd_ps(_mm512_sub_ps(r1, r0), t, r0), gain);
+			}
+
+			_mm512_storeu_ps(left + i, _mm512_add_ps(_mm512_loadu_ps(left + i), l));
+			_mm512_storeu_ps(right + i, _mm512_add_ps(_mm512_loadu_ps(right + i), r));
+			peak = _mm512_max_ps(peak, _mm512_max_ps(_mm512_abs_ps(l), _mm512_abs_ps(r)));
+			gain = _mm512_mul_ps(gain, step_gain);
+
+			__m512i next = _mm512_add_epi32(fraction, step_fraction);
+			__mmask16 carry = _mm512_cmplt_epu32_mask(next, step_fraction);
+			index = _mm512_add_epi32(index, step_index);
+			index = _mm512_mask_add_epi32(index, carry, index, one);
+			fraction = next;
+		}
+
+		_mm512_store_ps(gain_lanes, gain);
+		advance_sample_voice(voice, rounded_count, gain_lanes[0], _mm512_reduce_max_ps(peak));
+	}
+#elif defined(DSP_KERNEL_AVX2)
+	rounded_count = count & ~size_t(7);
+	if (rounded_count)
+	{
+		alignas(32) uint32_t index_lanes[8], fraction_lanes[8];
+		alignas(32) float gain_lanes[8];
+		uint32_t stride_index, stride_fraction;
+		float stride_gain;
+		bool stereo = voice.left != voice.right;
+		init_sample_lanes(voice, 8, index_lanes, fraction_lanes, gain_lanes, stride_index, stride_fraction, stride_gain);
+
+		__m256i index = _mm256_load_si256(reinterpret_cast<const __m256i *>(index_lanes));
+		__m256i fraction = _mm256_load_si256(reinterpret_cast<const __m256i *>(fraction_lanes));
+		__m256 gain = _mm256_load_ps(gain_lanes);
+		const __m256i step_index = _mm256_set1_epi32(int(stride_index));
+		const __m256i step_fraction = _mm256_set1_epi32(int(stride_fraction));
+		const __m256 step_gain = _mm256_set1_ps(stride_gain);
+		const __m256 fraction_scale = _mm256_set1_ps(1.0f / 16777216.0f);
+		const __m256 sign = _mm256_set1_ps(-0.0f);
+		const auto *left_words = reinterpret_cast<const int *>(voice.left);
+		const auto *right_words = reinterpret_cast<const int *>(voice.right);
+		__m256 peak = _mm256_setzero_ps();
+
+		for (size_t i = 0; i < rounded_count; i += 8)
+		{
+			__m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(fraction, 8)), fraction_scale);
+			__m256i lw = _mm256_i32gather_epi32(left_words, index, 2);
+			__m256 l0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(lw, 16), 16));
+			__m256 l1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(lw, 16));
+			__m256 l = _mm256_mul_ps(_mm256_add_ps(l0, _mm256_mul_ps(_mm256_sub_ps(l1, l0), t)), gain);
+			__m256 r = l;
+			if (stereo)
+			{
+				__m256i rw = _mm256_i32gather_epi32(right_words, index, 2);
+				__m256 r0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(rw, 16), 16));
+				__m256 r1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(rw, 16));
+				r = _mm256_mul_ps(_mm256_add_ps(r0, _mm256_mul_ps(_mm256_sub_ps(r1, r0), t)), gain);
+			}
+
+			_mm256_storeu_ps(left + i, _mm256_add_ps(_mm256_loadu_ps(left + i), l));
+			_mm256_storeu_ps(right + i, _mm256_add_ps(_mm256_loadu_ps(right + i), r));
+			peak = _mm256_max_ps(peak, _mm256_max_ps(_mm256_andnot_ps(sign, l), _mm256_andnot_ps(sign, r)));
+			gain = _mm256_mul_ps(gain, step_gain);
+
+			// The add wrapped around iff the result is below what was added.
+			__m256i next = _mm256_add_epi32(fraction, step_fraction);
+			__m256i no_carry = _mm256_cmpeq_epi32(_mm256_max_epu32(next, step_fraction), next);
+			index = _mm256_add_epi32(index, step_index);
+			index = _mm256_sub_epi32(index, _mm256_andnot_si256(no_carry, _mm256_set1_epi32(-1)));
+			fraction = next;
+		}
+
+		float peak_lanes[8];
+		_mm256_store_ps(gain_lanes, gain);
+		_mm256_storeu_ps(peak_lanes, peak);
+		float max_peak = 0.0f;
+		for (unsigned k = 0; k < 8; k++)
+			max_peak = fmaxf(max_peak, peak_lanes[k]);
+		advance_sample_voice(voice, rounded_count, gain_lanes[0], max_peak);
+	}
+#elif defined(DSP_KERNEL_SSE2)
+	// No gathers, the loads stay scalar while the interpolation runs four frames wide.
+	rounded_count = count & ~size_t(3);
+	if (rounded_count)
+	{
+		alignas(16) uint32_t index_lanes[4], fraction_lanes[4];
+		alignas(16) float gain_lanes[4];
+		uint32_t stride_index, stride_fraction;
+		float stride_gain;
+		bool stereo = voice.left != voice.right;
+		init_sample_lanes(voice, 4, index_lanes, fraction_lanes, gain_lanes, stride_index, stride_fraction, stride_gain);
+
+		__m128i index = _mm_load_si128(reinterpret_cast<const __m128i *>(index_lanes));
+		__m128i fraction = _mm_load_si128(reinterpret_cast<const __m128i *>(fraction_lanes));
+		__m128 gain = _mm_load_ps(gain_lanes);
+		const __m128i step_index = _mm_set1_epi32(int(stride_index));
+		const __m128i step_fraction = _mm_set1_epi32(int(stride_fraction));
+		const __m128 step_gain = _mm_set1_ps(stride_gain);
+		const __m128 fraction_scale = _mm_set1_ps(1.0f / 16777216.0f);
+		const __m128 sign = _mm_set1_ps(-0.0f);
+		const __m128i bias = _mm_set1_epi32(int(0x80000000u));
+		const int16_t *l_samples = voice.left;
+		const int16_t *r_samples = voice.right;
+		__m128 peak = _mm_setzero_ps();
+
+		for (size_t i = 0; i < rounded_count; i += 4)
+		{
+			_mm_store_si128(reinterpret_cast<__m128i *>(index_lanes), index);
+			const uint32_t *x = index_lanes;
+
+			__m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(fraction, 8)), fraction_scale);
+			__m128 l0 = _mm_setr_ps(l_samples[x[0]], l_samples[x[1]], l_samples[x[2]], l_samples[x[3]]);
+			__m128 l1 = _mm_setr_ps(l_samples[x[0] + 1], l_samples[x[1] + 1], l_samples[x[2] + 1], l_samples[x[3] + 1]);
+			__m128 l = _mm_mul_ps(_mm_add_ps(l0, _mm_mul_ps(_mm_sub_ps(l1, l0), t)), gain);
+			__m128 r = l;
+			if (stereo)
+			{
+				__m128 r0 = _mm_setr_ps(r_samples[x[0]], r_samples[x[1]], r_samples[x[2]], r_samples[x[3]]);
+				__m128 r1 = _mm_setr_ps(r_samples[x[0] + 1], r_samples[x[1] + 1], r_samples[x[2] + 1], r_samples[x[3] + 1]);
+				r = _mm_mul_ps(_mm_add_ps(r0, _mm_mul_ps(_mm_sub_ps(r1, r0), t)), gain);
+			}
+
+			_mm_storeu_ps(left + i, _mm_add_ps(_mm_loadu_ps(left + i), l));
+			_mm_storeu_ps(right + i, _mm_add_ps(_mm_loadu_ps(right + i), r));
+			peak = _mm_max_ps(peak, _mm_max_ps(_mm_andnot_ps(sign, l), _mm_andnot_ps(sign, r)));
+			gain = _mm_mul_ps(gain, step_gain);
+
+			// Unsigned compare through a signed one, with both sides biased.
+			__m128i next = _mm_add_epi32(fraction, step_fraction);
+			__m128i carry = _mm_cmpgt_epi32(_mm_xor_si128(step_fraction, bias), _mm_xor_si128(next, bias));
+			index = _mm_sub_epi32(_mm_add_epi32(index, step_index), carry);
+			fraction = next;
+		}
+
+		float peak_lanes[4];
+		_mm_store_ps(gain_lanes, gain);
+		_mm_storeu_ps(peak_lanes, peak);
+		float max_peak = 0.0f;
+		for (unsigned k = 0; k < 4; k++)
+			max_peak = fmaxf(max_peak, peak_lanes[k]);
+		advance_sample_voice(voice, rounded_count, gain_lanes[0], max_peak);
+	}
+#elif defined(DSP_KERNEL_NEON)
+	rounded_count = count & ~size_t(3);
+	if (rounded_count)
+	{
+		uint32_t index_lanes[4], fraction_lanes[4];
+		float gain_lanes[4];
+		uint32_t stride_index, stride_fraction;
+		float stride_gain;
+		bool stereo = voice.left != voice.right;
+		init_sample_lanes(voice, 4, index_lanes, fraction_lanes, gain_lanes, stride_index, stride_fraction, stride_gain);
+
+		uint32x4_t index = vld1q_u32(index_lanes);
+		uint32x4_t fraction = vld1q_u32(fraction_lanes);
+		float32x4_t gain = vld1q_f32(gain_lanes);
+		const uint32x4_t step_index = vdupq_n_u32(stride_index);
+		const uint32x4_t step_fraction = vdupq_n_u32(stride_fraction);
+		const float32x4_t step_gain = vdupq_n_f32(stride_gain);
+		const int16_t *l_samples = voice.left;
+		const int16_t *r_samples = voice.right;
+		float32x4_t peak = vdupq_n_f32(0.0f);
+
+		for (size_t i = 0; i < rounded_count; i += 4)
+		{
+			vst1q_u32(index_lanes, index);
+			const uint32_t *x = index_lanes;
+			float l0_lanes[4] = { float(l_samples[x[0]]), float(l_samples[x[1]]), float(l_samples[x[2]]), float(l_samples[x[3]]) };
+			float l1_lanes[4] = { float(l_samples[x[0] + 1]), float(l_samples[x[1] + 1]),
+			                      float(l_samples[x[2] + 1]), float(l_samples[x[3] + 1]) };
+
+			float32x4_t t = vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(fraction, 8)), 1.0f / 16777216.0f);
+			float32x4_t l0 = vld1q_f32(l0_lanes);
+			float32x4_t l = vmulq_f32(vmlaq_f32(l0, vsubq_f32(vld1q_f32(l1_lanes), l0), t), gain);
+			float32x4_t r = l;
+			if (stereo)
+			{
+				float r0_lanes[4] = { float(r_samples[x[0]]), float(r_samples[x[1]]), float(r_samples[x[2]]), float(r_samples[x[3]]) };
+				float r1_lanes[4] = { float(r_samples[x[0] + 1]), float(r_samples[x[1] + 1]),
+				                      float(r_samples[x[2] + 1]), float(r_samples[x[3] + 1]) };
+				float32x4_t r0 = vld1q_f32(r0_lanes);
+				r = vmulq_f32(vmlaq_f32(r0, vsubq_f32(vld1q_f32(r1_lanes), r0), t), gain);
+			}
+
+			vst1q_f32(left + i, vaddq_f32(vld1q_f32(left + i), l));
+			vst1q_f32(right + i, vaddq_f32(vld1q_f32(right + i), r));
+			peak = vmaxq_f32(peak, vmaxq_f32(vabsq_f32(l), vabsq_f32(r)));
+			gain = vmulq_f32(gain, step_gain);
+
+			uint32x4_t next = vaddq_u32(fraction, step_fraction);
+			uint32x4_t carry = vcltq_u32(next, step_fraction);
+			index = vsubq_u32(vaddq_u32(index, step_index), carry);
+			fraction = next;
+		}
+
+		float peak_lanes[4];
+		vst1q_f32(gain_lanes, gain);
+		vst1q_f32(peak_lanes, peak);
+		float max_peak = 0.0f;
+		for (unsigned k = 0; k < 4; k++)
+			max_peak = fmaxf(max_peak, peak_lanes[k]);
+		advance_sample_voice(voice, rounded_count, gain_lanes[0], max_peak);
+	}
+#endif
+
+	play_samples_scalar(left + rounded_count, right + rounded_count, voice, count - rounded_count);
+}
+
+// The FM kernel is long enough that it's written once against a handful of vector helpers.
+#if defined(DSP_KERNEL_AVX512)
+typedef __m512 FMVector;
+enum { FMVectorLanes = 16 };
+static inline FMVector fm_load(const float *ptr) noexcept { return _mm512_loadu_ps(ptr); }
+static inline void fm_store(float *ptr, FMVector v) noexcept { _mm512_storeu_ps(ptr, v); }
+static inline FMVector fm_splat(float v) noexcept { return _mm512_set1_ps(v); }
+static inline FMVector fm_add(FMVector a, FMVector b) noexcept { return _mm512_add_ps(a, b); }
+static inline FMVector fm_sub(FMVector a, FMVector b) noexcept { return _mm512_sub_ps(a, b); }
+static inline FMVector fm_mul(FMVector a, FMVector b) noexcept { return _mm512_mul_ps(a, b); }
+static inline FMVector fm_madd(FMVector a, FMVector b, FMVector c) noexcept { return _mm512_fmadd_ps(a, b, c); }
+static inline FMVector fm_min(FMVector a, FMVector b) noexcept { return _mm512_min_ps(a, b); }
+static inline FMVector fm_max(FMVector a, FMVector b) noexcept { return _mm512_max_ps(a, b); }
+
+static inline FMVector fm_fract(FMVector v) noexcept
+{
+	return _mm512_sub_ps(v, _mm512_roundscale_ps(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+}
+
+static inline void fm_reduce(FMVector l, FMVector r, float &sum_l, float &sum_r) noexcept
+{
+	sum_l = _mm512_reduce_add_ps(l);
+	sum_r = _mm512_reduce_add_ps(r);
+}
+#elif defined(DSP_KERNEL_AVX)
+typedef __m256 FMVector;
+enum { FMVectorLanes = 8 };
+static inline FMVector fm_load(const float *ptr) noexcept { return _mm256_loadu_ps(ptr); }
+static inline void fm_store(float *ptr, FMVector v) noexcept { _mm256_storeu_ps(ptr, v); }
+static inline FMVector fm_splat(float v) noexcept { return _mm256_set1_ps(v); }
+static inline FMVector fm_add(FMVector a, FMVector b) noexcept { return _mm256_add_ps(a, b); }
+static inline FMVector fm_sub(FMVector a, FMVector b) noexcept { return _mm256_sub_ps(a, b); }
+static inline FMVector fm_mul(FMVector a, FMVector b) noexcept { return _mm256_mul_ps(a, b); }
+static inline FMVector fm_madd(FMVector a, FMVector b, FMVector c) noexcept { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+static inline FMVector fm_min(FMVector a, FMVector b) noexcept { return _mm256_min_ps(a, b); }
+static inline FMVector fm_max(FMVector a, FMVector b) noexcept { return _mm256_max_ps(a, b); }
+static inline FMVector fm_fract(FMVector v) noexcept { return _mm256_sub_ps(v, _mm256_floor_ps(v)); }
+
+static inline void fm_reduce(FMVector l, FMVector r, float &sum_l, float &sum_r) noexcept
+{
+	__m128 l4 = _mm_add_ps(_mm256_castps256_ps128(l), _mm256_extractf128_ps(l, 1));
+	__m128 r4 = _mm_add_ps(_mm256_castps256_ps128(r), _mm256_extractf128_ps(r, 1));
+	__m128 sums = _mm_add_ps(_mm_unpacklo_ps(l4, r4), _mm_unpackhi_ps(l4, r4));
+	sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+	sum_l = _mm_cvtss_f32(sums);
+	sum_r = _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, _MM_SHUFFLE(1, 1, 1, 1)));
+}
+#elif defined(DSP_KERNEL_SSE2)
+typedef __m128 FMVector;
+enum { FMVectorLanes = 4 };
+static inline FMVector fm_load(const float *ptr) noexcept { return _mm_loadu_ps(ptr); }
+static inline void fm_store(float *ptr, FMVector v) noexcept { _mm_storeu_ps(ptr, v); }
+static inline FMVector fm_splat(float v) noexcept { return _mm_set1_ps(v); }
+static inline FMVector fm_add(FMVector a, FMVector b) noexcept { return _mm_add_ps(a, b); }
+static inline FMVector fm_sub(FMVector a, FMVector b) noexcept { return _mm_sub_ps(a, b); }
+static inline FMVector fm_mul(FMVector a, FMVector b) noexcept { return _mm_mul_ps(a, b); }
+static inline FMVector fm_madd(FMVector a, FMVector b, FMVector c) noexcept { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+static inline FMVector fm_min(FMVector a, FMVector b) noexcept { return _mm_min_ps(a, b); }
+static inline FMVector fm_max(FMVector a, FMVector b) noexcept { return _mm_max_ps(a, b); }
+
+// No floor before SSE4.1. Truncate and step down where that rounded up,
+// phases stay far away from the int32 range.
+static inline FMVector fm_fract(FMVector v) noexcept
+{
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0f)));
+	return _mm_sub_ps(v, t);
+}
+
+static inline void fm_reduce(FMVector l, FMVector r, float &sum_l, float &sum_r) noexcept
+{
+	__m128 sums = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+	sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+	sum_l = _mm_cvtss_f32(sums);
+	sum_r = _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, _MM_SHUFFLE(1, 1, 1, 1)));
+}
+#elif defined(DSP_KERNEL_NEON)
+typedef float32x4_t FMVector;
+enum { FMVectorLanes = 4 };
+static inline FMVector fm_load(const float *ptr) noexcept { return vld1q_f32(ptr); }
+static inline void fm_store(float *ptr, FMVector v) noexcept { vst1q_f32(ptr, v); }
+static inline FMVector fm_splat(float v) noexcept { return vdupq_n_f32(v); }
+static inline FMVector fm_add(FMVector a, FMVector b) noexcept { return vaddq_f32(a, b); }
+static inline FMVector fm_sub(FMVector a, FMVector b) noexcept { return vsubq_f32(a, b); }
+static inline FMVector fm_mul(FMVector a, FMVector b) noexcept { return vmulq_f32(a, b); }
+static inline FMVector fm_madd(FMVector a, FMVector b, FMVector c) noexcept { return vmlaq_f32(c, a, b); }
+static inline FMVector fm_min(FMVector a, FMVector b) noexcept { return vminq_f32(a, b); }
+static inline FMVector fm_max(FMVector a, FMVector b) noexcept { return vmaxq_f32(a, b); }
+
+// ARMv7 has no rounding to minus infinity, same trick as SSE2.
+static inline FMVector fm_fract(FMVector v) noexcept
+{
+	float32x4_t t = vcvtq_f32_s32(vcvtq_s32_f32(v));
+	uint32x4_t one = vreinterpretq_u32_f32(vdupq_n_f32(1.0f));
+	t = vsubq_f32(t, vreinterpretq_f32_u32(vandq_u32(vcgtq_f32(t, v), one)));
+	return vsubq_f32(v, t);
+}
+
+static inline void fm_reduce(FMVector l, FMVector r, float &sum_l, float &sum_r) noexcept
+{
+	float32x2_t sums = vpadd_f32(vadd_f32(vget_low_f32(l), vget_high_f32(l)),
+	                             vadd_f32(vget_low_f32(r), vget_high_f32(r)));
+	sum_l = vget_lane_f32(sums, 0);
+	sum_r = vget_lane_f32(sums, 1);
+}
+#endif
+
+static void render_fm_voices(float * __restrict left,
+                             float * __restrict right,
+                             FMVoiceLanes &voices, size_t count) noexcept
+{
+#if defined(DSP_KERNEL_AVX512) || defined(DSP_KERNEL_AVX) || defined(DSP_KERNEL_SSE2) || defined(DSP_KERNEL_NEON)
+	enum { NumOperators = FMVoiceLanes::NumOperators };
+	static_assert(FMVoiceLanes::MaxLanes % FMVectorLanes == 0, "Lanes must fill whole vectors.");
+
+	const FMVector zero = fm_splat(0.0f);
+	const FMVector quarter = fm_splat(0.25f);
+	const FMVector three_quarters = fm_splat(0.75f);
+	const FMVector c1 = fm_splat(6.28318531f);
+	const FMVector c3 = fm_splat(-41.3417022f);
+	const FMVector c5 = fm_splat(81.6052493f);
+	const FMVector c7 = fm_splat(-76.7058598f);
+
+	FMVector mod_to_carriers[NumOperators][NumOperators];
+	FMVector carrier_left[NumOperators];
+	FMVector carrier_right[NumOperators];
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		for (unsigned j = 0; j < NumOperators; j++)
+			mod_to_carriers[o][j] = fm_splat(voices.mod_to_carriers[o][j]);
+		carrier_left[o] = fm_splat(voices.carrier_left[o]);
+		carrier_right[o] = fm_splat(voices.carrier_right[o]);
+	}
+
+	for (unsigned base = 0; base < FMVoiceLanes::MaxLanes; base += FMVectorLanes)
+	{
+		if (!((voices.active_lanes >> base) & ((1u << FMVectorLanes) - 1u)))
+			continue;
+
+		// Keep the whole group in registers over the block.
+		FMVector phase[NumOperators], step[NumOperators], gain[NumOperators];
+		FMVector gain_step[NumOperators], modulation[NumOperators];
+		for (unsigned o = 0; o < NumOperators; o++)
+		{
+			phase[o] = fm_load(voices.phase[o] + base);
+			step[o] = fm_load(voices.step[o] + base);
+			gain[o] = fm_load(voices.gain[o] + base);
+			gain_step[o] = fm_load(voices.gain_step[o] + base);
+			modulation[o] = fm_load(voices.modulation[o] + base);
+		}
+		FMVector peak = fm_load(voices.peak + base);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			FMVector value[NumOperators];
+			for (unsigned o = 0; o < NumOperators; o++)
+			{
+				FMVector p = fm_fract(fm_add(phase[o], modulation[o]));
+				FMVector x = fm_min(fm_sub(p, quarter), fm_sub(three_quarters, p));
+				FMVector x2 = fm_mul(x, x);
+				FMVector poly = fm_madd(x2, fm_madd(x2, fm_madd(x2, c7, c5), c3), c1);
+				value[o] = fm_mul(gain[o], fm_mul(x, poly));
+			}
+
+			FMVector l = zero;
+			FMVector r = zero;
+			for (unsigned o = 0; o < NumOperators; o++)
+			{
+				FMVector mod = zero;
+				for (unsigned j = 0; j < NumOperators; j++)
+					mod = fm_madd(mod_to_carriers[o][j], value[j], mod);
+				modulation[o] = mod;
+
+				l = fm_madd(carrier_left[o], value[o], l);
+				r = fm_madd(carrier_right[o], value[o], r);
+
+				phase[o] = fm_fract(fm_add(phase[o], step[o]));
+				gain[o] = fm_add(gain[o], gain_step[o]);
+			}
+
+			peak = fm_max(peak, fm_max(fm_max(l, r), fm_sub(zero, fm_min(l, r))));
+
+			float sum_l, sum_r;
+			fm_reduce(l, r, sum_l, sum_r);
+			left[i] += sum_l;
+			right[i] += sum_r;
+		}
+
+		for (unsigned o = 0; o < NumOperators; o++)
+		{
+			fm_store(voices.phase[o] + base, phase[o]);
+			fm_store(voices.gain[o] + base, gain[o]);
+			fm_store(voices.modulation[o] + base, modulation[o]);
+		}
+		fm_store(voices.peak + base, peak);
+	}
+#else
+	render_fm_voices_scalar(left, right, voices, count);
+#endif
+}
+
+void fill_kernels(Kernels &kernels)
+{
+	kernels.interleave_stereo_f32 = interleave_stereo_f32;
+	kernels.interleave_stereo_f32_i16 = interleave_stereo_f32_i16;
+	kernels.interleave_stereo_f32_i32 = interleave_stereo_f32_i32;
+	kernels.mix_stereo_inputs = mix_stereo_inputs;
+	kernels.resample_stereo = resample_stereo;
+	kernels.render_fm_voices = render_fm_voices;
+	kernels.true_peak_stereo = true_peak_stereo;
+	kernels.limiter_gain = limiter_gain;
+	kernels.complex_mac = complex_mac;
+	kernels.fir_add = fir_add;
+	kernels.play_samples = play_samples;
+}
+}
+}
@@ -0,0 +1,154 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+namespace Util
+{
+struct QueueStats
+{
+	uint64_t pushed;
+	uint64_t dropped;
+	uint32_t high_water;
+};
+
+// Bounded lock-free multi-producer, single-consumer queue.
+// Based on Dmitry Vyukov's bounded MPMC queue, with the consumer side simplified.
+// When full, the newest element is dropped and counted.
+template <typename T, uint32_t Size>
+class MPSCQueue
+{
+public:
+	static_assert((Size & (Size - 1)) == 0, "Size must be POT.");
+
+	MPSCQueue()
+		: slots(new Slot[Size])
+	{
+		for (uint32_t i = 0; i < Size; i++)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	void operator=(const MPSCQueue &) = delete;
+
+	// Safe to call from any number of threads.
+	bool push(const T &value) noexcept
+	{
+		uint32_t pos = producer.tail.load(std::memory_order_relaxed);
+		Slot *slot;
+
+		for (;;)
+		{
+			slot = &slots[pos & (Size - 1)];
+			uint32_t seq = slot->sequence.load(std::memory_order_acquire);
+			auto diff = int32_t(seq - pos);
+
+			if (diff == 0)
+			{
+				if (producer.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			else
+				pos = producer.tail.load(std::memory_order_relaxed);
+		}
+
+		slot->value = value;
+		slot->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Returns nullptr if the queue is empty.
+	// The element stays valid until pop().
+	const T *front() noexcept
+	{
+		auto &slot = slots[consumer.head & (Size - 1)];
+		uint32_t seq = slot.sequence.load(std::memory_order_acquire);
+		if (int32_t(seq - (consumer.head + 1)) < 0)
+			return nullptr;
+		return &slot.value;
+	}
+
+	// Consumer only. Samples the depth for the stats, once before each drain.
+	// Reading the tail pulls in the producers' cache line, so this stays out of front().
+	void update_high_water() noexcept
+	{
+		uint32_t depth = producer.tail.load(std::memory_order_relaxed) - consumer.head;
+		if (depth > high_water.load(std::memory_order_relaxed))
+			high_water.store(depth, std::memory_order_relaxed);
+	}
+
+	// Consumer only. Must only be called after front() returned non-null.
+	void pop() noexcept
+	{
+		slots[consumer.head & (Size - 1)].sequence.store(consumer.head + Size, std::memory_order_release);
+		consumer.head++;
+	}
+
+	QueueStats get_stats() const noexcept
+	{
+		QueueStats stats = {};
+		// A full queue drops before taking a slot, so the tail only counts pushes. It wraps at 2^32.
+		stats.pushed = producer.tail.load(std::memory_order_relaxed);
+		stats.dropped = dropped.load(std::memory_order_relaxed);
+		stats.high_water = high_water.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	enum { CacheLineSize = 64 };
+
+	struct Slot
+	{
+		std::atomic<uint32_t> sequence;
+		T value;
+	};
+	std::unique_ptr<Slot[]> slots;
+
+	// Producers and consumer hammer on different indices, keep them on separate cache lines.
+	// Explicit padding rather than alignas, since C++14 new does not respect over-alignment.
+	struct Producer
+	{
+		char padding[CacheLineSize];
+		std::atomic<uint32_t> tail{0};
+	};
+
+	struct Consumer
+	{
+		char padding[CacheLineSize];
+		uint32_t head = 0;
+		char padding_end[CacheLineSize];
+	};
+
+	Producer producer;
+	Consumer consumer;
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint32_t> high_water{0};
+};
+}
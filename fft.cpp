@@ -0,0 +1,176 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fft.hpp"
+#include <math.h>
+
+static constexpr double Pi = 3.14159265358979323846;
+
+bool RealFFT::init(unsigned size_)
+{
+	if (size_ < 4 || (size_ & (size_ - 1)) != 0)
+		return false;
+
+	size = size_;
+	half = size / 2;
+
+	unsigned bits = 0;
+	while ((1u << bits) < half)
+		bits++;
+
+	bit_reverse.resize(half);
+	for (unsigned i = 0; i < half; i++)
+	{
+		unsigned r = 0;
+		for (unsigned b = 0; b < bits; b++)
+			if (i & (1u << b))
+				r |= 1u << (bits - 1 - b);
+		bit_reverse[i] = r;
+	}
+
+	twiddle_re.resize(half / 2);
+	twiddle_im.resize(half / 2);
+	for (unsigned k = 0; k < half / 2; k++)
+	{
+		twiddle_re[k] = float(cos(2.0 * Pi * k / half));
+		twiddle_im[k] = float(-sin(2.0 * Pi * k / half));
+	}
+
+	split_re.resize(half);
+	split_im.resize(half);
+	for (unsigned k = 0; k < half; k++)
+	{
+		split_re[k] = float(cos(2.0 * Pi * k / size));
+		split_im[k] = float(-sin(2.0 * Pi * k / size));
+	}
+
+	work_re.resize(half);
+	work_im.resize(half);
+	return true;
+}
+
+void RealFFT::transform(bool inverse) noexcept
+{
+	float *re = work_re.data();
+	float *im = work_im.data();
+	float sign = inverse ? -1.0f : 1.0f;
+
+	for (unsigned i = 0; i < half; i++)
+	{
+		unsigned r = bit_reverse[i];
+		if (r > i)
+		{
+			float t = re[i];
+			re[i] = re[r];
+			re[r] = t;
+			t = im[i];
+			im[i] = im[r];
+			im[r] = t;
+		}
+	}
+
+	for (unsigned len = 2; len <= half; len *= 2)
+	{
+		unsigned stride = half / len;
+		unsigned h = len / 2;
+		for (unsigned base = 0; base < half; base += len)
+		{
+			for (unsigned j = 0; j < h; j++)
+			{
+				float wr = twiddle_re[j * stride];
+				float wi = sign * twiddle_im[j * stride];
+				unsigned a = base + j;
+				unsigned b = a + h;
+				float tr = re[b] * wr - im[b] * wi;
+				float ti = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+void RealFFT::forward(float *re, float *im, const float *input) noexcept
+{
+	// Even samples go in the real part, odd samples in the imaginary part.
+	for (unsigned i = 0; i < half; i++)
+	{
+		work_re[i] = input[2 * i];
+		work_im[i] = input[2 * i + 1];
+	}
+
+	transform(false);
+
+	// Untangle the two interleaved half size spectra, Z[half] wraps around to Z[0].
+	for (unsigned k = 0; k <= half; k++)
+	{
+		unsigned a = k == half ? 0 : k;
+		unsigned b = k == 0 ? 0 : half - k;
+		float zr = work_re[a], zi = work_im[a];
+		float cr = work_re[b], ci = -work_im[b];
+
+		float even_re = 0.5f * (zr + cr);
+		float even_im = 0.5f * (zi + ci);
+		// (Z[k] - conj(Z[half - k])) / 2i
+		float odd_re = 0.5f * (zi - ci);
+		float odd_im = -0.5f * (zr - cr);
+
+		float wr = k == half ? -1.0f : split_re[k];
+		float wi = k == half ? 0.0f : split_im[k];
+		re[k] = even_re + wr * odd_re - wi * odd_im;
+		im[k] = even_im + wr * odd_im + wi * odd_re;
+	}
+}
+
+void RealFFT::inverse(float *output, const float *re, const float *im) noexcept
+{
+	for (unsigned k = 0; k < half; k++)
+	{
+		float xr = re[k], xi = im[k];
+		float cr = re[half - k], ci = -im[half - k];
+
+		float even_re = xr + cr;
+		float even_im = xi + ci;
+		float diff_re = xr - cr;
+		float diff_im = xi - ci;
+
+		// Undo the twiddle by multiplying with its conjugate.
+		float wr = split_re[k];
+		float wi = -split_im[k];
+		float odd_re = diff_re * wr - diff_im * wi;
+		float odd_im = diff_re * wi + diff_im * wr;
+
+		// Z = even + i * odd
+		work_re[k] = even_re - odd_im;
+		work_im[k] = even_im + odd_re;
+	}
+
+	transform(true);
+
+	for (unsigned i = 0; i < half; i++)
+	{
+		output[2 * i] = work_re[i];
+		output[2 * i + 1] = work_im[i];
+	}
+}
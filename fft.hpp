@@ -0,0 +1,55 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Real FFT of a power of two size, computed as a half size complex FFT.
+// Spectra are in split format, real and imaginary parts in separate arrays of size / 2 + 1 bins.
+// Only meant for moderate sizes, where a plain radix-2 transform is fast enough.
+class RealFFT
+{
+public:
+	bool init(unsigned size);
+	unsigned get_size() const noexcept
+	{
+		return size;
+	}
+
+	void forward(float *re, float *im, const float *input) noexcept;
+
+	// Unnormalized, inverse(forward(x)) is size * x.
+	void inverse(float *output, const float *re, const float *im) noexcept;
+
+private:
+	unsigned size = 0;
+	unsigned half = 0;
+	std::vector<unsigned> bit_reverse;
+	// exp(-2 pi i k / half) for the complex transform, exp(-2 pi i k / size) for the real split.
+	std::vector<float> twiddle_re, twiddle_im;
+	std::vector<float> split_re, split_im;
+	std::vector<float> work_re, work_im;
+
+	void transform(bool inverse) noexcept;
+};
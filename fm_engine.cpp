@@ -0,0 +1,376 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fm_engine.hpp"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+// Release runs down to -60 dB over the release time, like fmsynth.
+static constexpr float ReleaseLevel = 0.001f;
+
+struct ParameterTable
+{
+	float values[FMSYNTH_OPERATORS][FMSYNTH_PARAM_END];
+	float globals[FMSYNTH_GLOBAL_PARAM_END];
+};
+
+// Mirrors fmsynth_reset(), then applies the preset on top.
+static void build_parameter_table(ParameterTable &table, const FMPreset &preset)
+{
+	for (unsigned o = 0; o < FMSYNTH_OPERATORS; o++)
+	{
+		auto *values = table.values[o];
+		for (unsigned i = 0; i < FMSYNTH_PARAM_END; i++)
+			values[i] = 0.0f;
+
+		values[FMSYNTH_PARAM_AMP] = 1.0f;
+		values[FMSYNTH_PARAM_FREQ_MOD] = 1.0f;
+		values[FMSYNTH_PARAM_ENVELOPE_TARGET0] = 1.0f;
+		values[FMSYNTH_PARAM_ENVELOPE_TARGET1] = 0.5f;
+		values[FMSYNTH_PARAM_ENVELOPE_TARGET2] = 0.25f;
+		values[FMSYNTH_PARAM_DELAY0] = 0.05f;
+		values[FMSYNTH_PARAM_DELAY1] = 0.05f;
+		values[FMSYNTH_PARAM_DELAY2] = 0.25f;
+		values[FMSYNTH_PARAM_RELEASE_TIME] = 0.50f;
+		values[FMSYNTH_PARAM_KEYBOARD_SCALING_MID_POINT] = 440.0f;
+		values[FMSYNTH_PARAM_VELOCITY_SENSITIVITY] = 1.0f;
+		values[FMSYNTH_PARAM_ENABLE] = 1.0f;
+		values[FMSYNTH_PARAM_CARRIERS] = o == 0 ? 1.0f : 0.0f;
+	}
+
+	table.globals[FMSYNTH_GLOBAL_PARAM_VOLUME] = 0.2f;
+	table.globals[FMSYNTH_GLOBAL_PARAM_LFO_FREQ] = 0.1f;
+
+	for (uint32_t i = 0; i < preset.num_parameters; i++)
+	{
+		auto &param = preset.parameters[i];
+		if (param.global)
+		{
+			if (param.parameter < FMSYNTH_GLOBAL_PARAM_END)
+				table.globals[param.parameter] = param.value;
+		}
+		else if (param.parameter < FMSYNTH_PARAM_END && param.operator_index < FMSYNTH_OPERATORS)
+			table.values[param.operator_index][param.parameter] = param.value;
+	}
+}
+
+bool FMEngine::supports(const FMPreset &preset)
+{
+	ParameterTable table;
+	build_parameter_table(table, preset);
+
+	// An operator matters if it's heard directly, or modulates one which is.
+	for (unsigned o = NumOperators; o < FMSYNTH_OPERATORS; o++)
+	{
+		if (table.values[o][FMSYNTH_PARAM_ENABLE] <= 0.5f)
+			continue;
+		if (table.values[o][FMSYNTH_PARAM_CARRIERS] != 0.0f)
+			return false;
+		for (unsigned j = 0; j < NumOperators; j++)
+			if (table.values[j][FMSYNTH_PARAM_MOD_TO_CARRIERS0 + o] != 0.0f)
+				return false;
+	}
+
+	return true;
+}
+
+void FMEngine::init(float sample_rate_, unsigned num_voices_)
+{
+	sample_rate = sample_rate_;
+	num_voices = num_voices_;
+	num_blocks = (num_voices + Lanes - 1) / Lanes;
+	blocks.reset(static_cast<VoiceBlock *>(Util::memalign_calloc(64, num_blocks * sizeof(VoiceBlock))));
+	reset();
+}
+
+void FMEngine::set_preset(const FMPreset &preset) noexcept
+{
+	ParameterTable table;
+	build_parameter_table(table, preset);
+
+	lfo_freq = table.globals[FMSYNTH_GLOBAL_PARAM_LFO_FREQ];
+	float volume = table.globals[FMSYNTH_GLOBAL_PARAM_VOLUME];
+
+	float mod_to_carriers[NumOperators][NumOperators];
+	float carrier_left[NumOperators];
+	float carrier_right[NumOperators];
+
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		const auto *values = table.values[o];
+		auto &op = operators[o];
+		op.amp = values[FMSYNTH_PARAM_AMP];
+		op.freq_mod = values[FMSYNTH_PARAM_FREQ_MOD];
+		op.freq_offset = values[FMSYNTH_PARAM_FREQ_OFFSET];
+		for (unsigned i = 0; i < 3; i++)
+		{
+			op.targets[i] = values[FMSYNTH_PARAM_ENVELOPE_TARGET0 + i];
+			op.delays[i] = values[FMSYNTH_PARAM_DELAY0 + i];
+		}
+		op.release_time = values[FMSYNTH_PARAM_RELEASE_TIME];
+		op.keyboard_mid = values[FMSYNTH_PARAM_KEYBOARD_SCALING_MID_POINT];
+		op.keyboard_low = values[FMSYNTH_PARAM_KEYBOARD_SCALING_LOW_FACTOR];
+		op.keyboard_high = values[FMSYNTH_PARAM_KEYBOARD_SCALING_HIGH_FACTOR];
+		op.velocity_sensitivity = values[FMSYNTH_PARAM_VELOCITY_SENSITIVITY];
+		op.wheel_sensitivity = values[FMSYNTH_PARAM_MOD_WHEEL_SENSITIVITY];
+		op.lfo_amp_depth = values[FMSYNTH_PARAM_LFO_AMP_DEPTH];
+		op.lfo_freq_depth = values[FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH];
+		op.enabled = values[FMSYNTH_PARAM_ENABLE] > 0.5f;
+
+		// Disabled operators neither sound nor modulate.
+		for (unsigned j = 0; j < NumOperators; j++)
+		{
+			bool source_enabled = table.values[j][FMSYNTH_PARAM_ENABLE] > 0.5f;
+			mod_to_carriers[o][j] = source_enabled ? values[FMSYNTH_PARAM_MOD_TO_CARRIERS0 + j] : 0.0f;
+		}
+
+		float pan = values[FMSYNTH_PARAM_PAN];
+		float carrier = op.enabled ? values[FMSYNTH_PARAM_CARRIERS] * volume : 0.0f;
+		carrier_left[o] = carrier * std::min(1.0f, 1.0f - pan);
+		carrier_right[o] = carrier * std::min(1.0f, 1.0f + pan);
+	}
+
+	for (unsigned b = 0; b < num_blocks; b++)
+	{
+		auto &block = blocks.get()[b];
+		memcpy(block.lanes.mod_to_carriers, mod_to_carriers, sizeof(mod_to_carriers));
+		memcpy(block.lanes.carrier_left, carrier_left, sizeof(carrier_left));
+		memcpy(block.lanes.carrier_right, carrier_right, sizeof(carrier_right));
+
+		for (unsigned lane = 0; lane < Lanes; lane++)
+			if (block.lanes.active_lanes & (1u << lane))
+				update_voice_parameters(block, lane);
+	}
+}
+
+void FMEngine::update_voice_parameters(VoiceBlock &block, unsigned lane) noexcept
+{
+	float freq = 440.0f * exp2f((float(block.note[lane]) - 69.0f) * (1.0f / 12.0f));
+	float velocity = block.velocity[lane];
+
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		auto &op = operators[o];
+		float amp = op.amp * ((1.0f - op.velocity_sensitivity) + op.velocity_sensitivity * velocity);
+		// Nothing drives the mod wheel, it stays at zero.
+		amp *= 1.0f - op.wheel_sensitivity;
+		float ratio = freq / op.keyboard_mid;
+		amp *= powf(ratio, ratio < 1.0f ? op.keyboard_low : op.keyboard_high);
+
+		block.amp[o][lane] = amp;
+		block.base_step[o][lane] = (freq * op.freq_mod + op.freq_offset) / sample_rate;
+	}
+}
+
+float FMEngine::get_envelope(const Operator &op, float time) const noexcept
+{
+	if (time < op.delays[0])
+		return op.targets[0] * time / op.delays[0];
+	time -= op.delays[0];
+
+	if (time < op.delays[1])
+		return op.targets[0] + (op.targets[1] - op.targets[0]) * time / op.delays[1];
+	time -= op.delays[1];
+
+	if (time < op.delays[2])
+		return op.targets[1] + (op.targets[2] - op.targets[1]) * time / op.delays[2];
+
+	return op.targets[2];
+}
+
+// Sets up the gain ramps for the next num_frames.
+void FMEngine::update_control(VoiceBlock &block, unsigned lane, unsigned num_frames) noexcept
+{
+	uint32_t bit = 1u << lane;
+	if (block.ending_lanes & bit)
+	{
+		stop_lane(block, lane);
+		return;
+	}
+
+	auto &lanes = block.lanes;
+	bool released = (block.released_lanes & bit) != 0;
+	float dt = float(num_frames) / sample_rate;
+	float time = block.time[lane] + dt;
+	float inv_frames = 1.0f / float(num_frames);
+	bool sounding = false;
+
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		auto &op = operators[o];
+		float level = 0.0f;
+
+		if (!op.enabled)
+			level = 0.0f;
+		else if (!released)
+		{
+			level = get_envelope(op, time);
+			sounding = true;
+		}
+		else if (time < op.release_time)
+		{
+			level = block.envelope[o][lane] * expf(logf(ReleaseLevel) * dt / op.release_time);
+			sounding = true;
+		}
+
+		block.envelope[o][lane] = level;
+		float target = level * block.amp[o][lane] * (1.0f + op.lfo_amp_depth * lfo_value);
+		lanes.gain_step[o][lane] = (target - lanes.gain[o][lane]) * inv_frames;
+		lanes.step[o][lane] = block.base_step[o][lane] * (1.0f + op.lfo_freq_depth * lfo_value);
+	}
+
+	block.time[lane] = time;
+	if (!sounding)
+		block.ending_lanes |= bit;
+}
+
+void FMEngine::stop_lane(VoiceBlock &block, unsigned lane) noexcept
+{
+	uint32_t bit = 1u << lane;
+	auto &lanes = block.lanes;
+	lanes.active_lanes &= ~bit;
+	block.released_lanes &= ~bit;
+	block.ending_lanes &= ~bit;
+
+	// Inactive lanes may still be stepped by the kernels, they must stay silent.
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		lanes.gain[o][lane] = 0.0f;
+		lanes.gain_step[o][lane] = 0.0f;
+		lanes.modulation[o][lane] = 0.0f;
+	}
+}
+
+void FMEngine::note_on(unsigned voice, unsigned note, unsigned velocity) noexcept
+{
+	if (voice >= num_voices)
+		return;
+
+	auto &block = blocks.get()[voice / Lanes];
+	unsigned lane = voice % Lanes;
+	stop_lane(block, lane);
+
+	// Like fmsynth, start every operator on the rising zero crossing of fm_oscillator().
+	auto &lanes = block.lanes;
+	for (unsigned o = 0; o < NumOperators; o++)
+	{
+		lanes.phase[o][lane] = 0.25f;
+		block.envelope[o][lane] = 0.0f;
+	}
+	lanes.peak[lane] = 0.0f;
+	block.time[lane] = 0.0f;
+	block.note[lane] = uint8_t(note);
+	block.velocity[lane] = float(velocity) / 127.0f;
+	lanes.active_lanes |= 1u << lane;
+
+	update_voice_parameters(block, lane);
+
+	// Start the attack right away rather than at the next control period.
+	if (control_frames_left)
+		update_control(block, lane, control_frames_left);
+}
+
+void FMEngine::note_off(unsigned voice) noexcept
+{
+	if (voice >= num_voices)
+		return;
+
+	auto &block = blocks.get()[voice / Lanes];
+	unsigned lane = voice % Lanes;
+	uint32_t bit = 1u << lane;
+	if ((block.lanes.active_lanes & bit) && !(block.released_lanes & bit))
+	{
+		block.released_lanes |= bit;
+		block.time[lane] = 0.0f;
+	}
+}
+
+void FMEngine::stop(unsigned voice) noexcept
+{
+	if (voice < num_voices)
+		stop_lane(blocks.get()[voice / Lanes], voice % Lanes);
+}
+
+void FMEngine::reset() noexcept
+{
+	for (unsigned b = 0; b < num_blocks; b++)
+		for (unsigned lane = 0; lane < Lanes; lane++)
+			stop_lane(blocks.get()[b], lane);
+
+	lfo_phase = 0.0f;
+	lfo_value = 0.0f;
+	control_frames_left = 0;
+}
+
+void FMEngine::render(float *left, float *right, size_t num_frames) noexcept
+{
+	for (unsigned b = 0; b < num_blocks; b++)
+		for (auto &peak : blocks.get()[b].lanes.peak)
+			peak = 0.0f;
+
+	while (num_frames)
+	{
+		if (!control_frames_left)
+		{
+			control_frames_left = ControlFrames;
+			lfo_phase += lfo_freq * float(ControlFrames) / sample_rate;
+			lfo_phase -= floorf(lfo_phase);
+			lfo_value = DSP::fm_oscillator(lfo_phase);
+
+			for (unsigned b = 0; b < num_blocks; b++)
+			{
+				auto &block = blocks.get()[b];
+				for (unsigned lane = 0; lane < Lanes; lane++)
+					if (block.lanes.active_lanes & (1u << lane))
+						update_control(block, lane, ControlFrames);
+			}
+		}
+
+		size_t to_render = std::min<size_t>(num_frames, control_frames_left);
+		for (unsigned b = 0; b < num_blocks; b++)
+		{
+			auto &block = blocks.get()[b];
+			if (block.lanes.active_lanes)
+				DSP::render_fm_voices(left, right, block.lanes, to_render);
+		}
+
+		left += to_render;
+		right += to_render;
+		num_frames -= to_render;
+		control_frames_left -= unsigned(to_render);
+	}
+}
+
+bool FMEngine::is_active(unsigned voice) const noexcept
+{
+	if (voice >= num_voices)
+		return false;
+	return (blocks.get()[voice / Lanes].lanes.active_lanes & (1u << (voice % Lanes))) != 0;
+}
+
+float FMEngine::get_level(unsigned voice) const noexcept
+{
+	if (voice >= num_voices)
+		return 0.0f;
+	return blocks.get()[voice / Lanes].lanes.peak[voice % Lanes];
+}
@@ -0,0 +1,118 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include "dsp.hpp"
+#include "preset.hpp"
+#include "aligned_alloc.hpp"
+
+// Native renderer for the 3-operator instruments the presets describe.
+// Preset parameters are interpreted the way fmsynth does, on top of fmsynth_reset() defaults.
+// Voices are laid out structure-of-arrays, one voice per SIMD lane (see DSP::FMVoiceLanes),
+// and envelopes, LFO and keyboard scaling run at control rate.
+class FMEngine
+{
+public:
+	enum { NumOperators = DSP::FMVoiceLanes::NumOperators, ControlFrames = 32 };
+
+	// Operators beyond the first three are ignored. This is true if ignoring them doesn't change the sound.
+	static bool supports(const FMPreset &preset);
+
+	void init(float sample_rate, unsigned num_voices);
+
+	// Sounding voices continue with the new parameters.
+	void set_preset(const FMPreset &preset) noexcept;
+
+	// Restarts the voice, whatever state it was in.
+	void note_on(unsigned voice, unsigned note, unsigned velocity) noexcept;
+	void note_off(unsigned voice) noexcept;
+	// Silences the voice immediately.
+	void stop(unsigned voice) noexcept;
+	void reset() noexcept;
+
+	// Adds every sounding voice into left / right.
+	void render(float *left, float *right, size_t num_frames) noexcept;
+
+	// False once every operator of a released voice has run through its release.
+	bool is_active(unsigned voice) const noexcept;
+
+	// Output peak of the voice over the last render() call.
+	float get_level(unsigned voice) const noexcept;
+
+private:
+	enum { Lanes = DSP::FMVoiceLanes::MaxLanes };
+
+	struct Operator
+	{
+		float amp;
+		float freq_mod;
+		float freq_offset;
+		float targets[3];
+		float delays[3];
+		float release_time;
+		float keyboard_mid;
+		float keyboard_low;
+		float keyboard_high;
+		float velocity_sensitivity;
+		float wheel_sensitivity;
+		float lfo_amp_depth;
+		float lfo_freq_depth;
+		bool enabled;
+	};
+	Operator operators[NumOperators] = {};
+
+	// Sample rate state is in lanes, control rate state is kept next to it in the same layout.
+	struct VoiceBlock
+	{
+		DSP::FMVoiceLanes lanes;
+		// Envelope level the gain ramp ends at in the current control period.
+		float envelope[NumOperators][Lanes];
+		// Velocity and keyboard scaling applied.
+		float amp[NumOperators][Lanes];
+		float base_step[NumOperators][Lanes];
+		// Seconds since note on, or since note off once released.
+		float time[Lanes];
+		float velocity[Lanes];
+		uint8_t note[Lanes];
+		uint32_t released_lanes;
+		// Every operator has reached the end of its release, the lane stops after the final ramp.
+		uint32_t ending_lanes;
+	};
+	std::unique_ptr<VoiceBlock, Util::AlignedDeleter> blocks;
+	unsigned num_blocks = 0;
+	unsigned num_voices = 0;
+
+	float sample_rate = 0.0f;
+	float lfo_phase = 0.0f;
+	float lfo_freq = 0.0f;
+	float lfo_value = 0.0f;
+	unsigned control_frames_left = 0;
+
+	void update_voice_parameters(VoiceBlock &block, unsigned lane) noexcept;
+	void update_control(VoiceBlock &block, unsigned lane, unsigned num_frames) noexcept;
+	void stop_lane(VoiceBlock &block, unsigned lane) noexcept;
+	float get_envelope(const Operator &op, float time) const noexcept;
+};
@@ -0,0 +1,133 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "limiter.hpp"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static constexpr size_t BufferAlignment = 64;
+
+bool Limiter::init(float sample_rate, size_t max_frames_, const Options &options)
+{
+	if (options.lookahead_ms < 0.0f || options.lookahead_ms > MaxLookaheadMs || options.release_ms <= 0.0f)
+		return false;
+
+	lookahead_frames = unsigned(lroundf(options.lookahead_ms * 1e-3f * sample_rate));
+	ceiling = powf(10.0f, options.ceiling_db / 20.0f);
+	release_factor = expf(-1.0f / (options.release_ms * 1e-3f * sample_rate));
+	max_frames = max_frames_;
+	DSP::init_true_peak_filters(filters);
+
+	history_frames = std::max<size_t>(get_latency_frames(), DSP::TruePeakTaps - 1);
+	size_t input_frames = history_frames + max_frames;
+	size_t peak_frames = lookahead_frames + max_frames;
+	// The moving average needs one more frame of history than the window it slides over.
+	size_t smoothed_frames = lookahead_frames + 1 + max_frames;
+
+	buffer.reset(static_cast<float *>(Util::memalign_calloc(
+			BufferAlignment, (2 * input_frames + peak_frames + max_frames + smoothed_frames) * sizeof(float))));
+	if (!buffer)
+		return false;
+
+	input[0] = buffer.get();
+	input[1] = input[0] + input_frames;
+	peaks = input[1] + input_frames;
+	gains = peaks + peak_frames;
+	smoothed = gains + max_frames;
+
+	reset();
+	return true;
+}
+
+void Limiter::reset() noexcept
+{
+	if (!buffer)
+		return;
+
+	for (auto *channel : input)
+		memset(channel, 0, history_frames * sizeof(float));
+	memset(peaks, 0, lookahead_frames * sizeof(float));
+	for (unsigned i = 0; i <= lookahead_frames; i++)
+		smoothed[i] = 1.0f;
+	release_gain = 1.0f;
+}
+
+void Limiter::process(float * const *channels, size_t num_frames) noexcept
+{
+	for (unsigned c = 0; c < 2; c++)
+		memcpy(input[c] + history_frames, channels[c], num_frames * sizeof(float));
+
+	float *block_peaks = peaks + lookahead_frames;
+	DSP::true_peak_stereo(block_peaks, input[0] + history_frames, input[1] + history_frames, filters, num_frames);
+	DSP::limiter_gain(gains, block_peaks, num_frames, lookahead_frames + 1, ceiling);
+
+	// Attack is instant here and release is exponential. The moving average over the lookahead
+	// window then turns the attack into a ramp which completes by the time the peak comes out.
+	// Every gain it averages is at or below the gain the peak needs, so there is no overshoot.
+	unsigned window = lookahead_frames + 1;
+	float inv_window = 1.0f / float(window);
+	float *block_smoothed = smoothed + window;
+	const float *delayed_left = input[0] + history_frames - get_latency_frames();
+	const float *delayed_right = input[1] + history_frames - get_latency_frames();
+
+	float sum = 0.0f;
+	for (unsigned i = 1; i <= lookahead_frames; i++)
+		sum += smoothed[i];
+
+	float gain = release_gain;
+	float block_min_gain = 1.0f;
+	for (size_t i = 0; i < num_frames; i++)
+	{
+		float target = gains[i];
+		gain = target < gain ? target : target + (gain - target) * release_factor;
+		block_smoothed[i] = gain;
+		sum += gain;
+
+		float applied = sum * inv_window;
+		channels[0][i] = delayed_left[i] * applied;
+		channels[1][i] = delayed_right[i] * applied;
+		block_min_gain = std::min(block_min_gain, applied);
+
+		sum -= block_smoothed[ptrdiff_t(i) - ptrdiff_t(lookahead_frames)];
+	}
+	release_gain = gain;
+
+	for (auto *channel : input)
+		memmove(channel, channel + num_frames, history_frames * sizeof(float));
+	memmove(peaks, peaks + num_frames, lookahead_frames * sizeof(float));
+	memmove(smoothed, smoothed + num_frames, window * sizeof(float));
+
+	if (block_min_gain < 1.0f)
+	{
+		float current = min_gain.load(std::memory_order_relaxed);
+		while (block_min_gain < current &&
+		       !min_gain.compare_exchange_weak(current, block_min_gain, std::memory_order_relaxed))
+		{
+		}
+	}
+}
+
+float Limiter::consume_min_gain() noexcept
+{
+	return min_gain.exchange(1.0f, std::memory_order_relaxed);
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include "aligned_alloc.hpp"
+#include "dsp.hpp"
+
+// Lookahead limiter on true (4x oversampled) peaks, applied to planar stereo in place.
+// Gain reduction ramps in over the lookahead window ahead of every peak, so the output
+// stays below the ceiling without clipping, and recovers exponentially afterwards.
+// The signal is delayed by get_latency_frames().
+class Limiter
+{
+public:
+	struct Options
+	{
+		float lookahead_ms = 0.5f;
+		float ceiling_db = -1.0f;
+		float release_ms = 50.0f;
+	};
+
+	// Limits the lookahead so that the sliding window stays cheap.
+	static constexpr float MaxLookaheadMs = 2.0f;
+
+	bool init(float sample_rate, size_t max_frames, const Options &options);
+	void reset() noexcept;
+
+	// num_frames must not exceed max_frames.
+	void process(float * const *channels, size_t num_frames) noexcept;
+
+	unsigned get_latency_frames() const noexcept
+	{
+		return lookahead_frames + DSP::TruePeakDelay;
+	}
+
+	// Lowest gain applied since the last call, 1 if the limiter didn't have to act.
+	// Safe to call from any thread.
+	float consume_min_gain() noexcept;
+
+private:
+	unsigned lookahead_frames = 0;
+	float ceiling = 1.0f;
+	float release_factor = 0.0f;
+	size_t max_frames = 0;
+
+	float filters[DSP::TruePeakPhases * DSP::TruePeakTaps] = {};
+	std::unique_ptr<float, Util::AlignedDeleter> buffer;
+
+	// Input history followed by the current block, per channel.
+	// Holds enough history for both the detector filter and the output delay.
+	float *input[2] = {};
+	size_t history_frames = 0;
+
+	// Peaks and smoothed gains keep a window of history in front of the current block.
+	float *peaks = nullptr;
+	float *gains = nullptr;
+	float *smoothed = nullptr;
+
+	float release_gain = 1.0f;
+	std::atomic<float> min_gain{1.0f};
+};
@@ -0,0 +1,193 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "load_monitor.hpp"
+#include "timer.hpp"
+#include <algorithm>
+
+static void update_max(std::atomic<uint32_t> &worst, uint32_t value) noexcept
+{
+	// Single writer, a concurrent reset may only lose one sample.
+	if (value > worst.load(std::memory_order_relaxed))
+		worst.store(value, std::memory_order_relaxed);
+}
+
+LoadMonitor::LoadMonitor(BackendCallback *callback_)
+	: callback(callback_)
+{
+	for (auto &bucket : load_buckets)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+void LoadMonitor::mix_samples(float * const *channels, size_t num_frames) noexcept
+{
+	int64_t start_nsecs = Util::get_current_time_nsecs();
+	callback->mix_samples(channels, num_frames);
+	int64_t end_nsecs = Util::get_current_time_nsecs();
+
+	if (sample_rate <= 0.0f || num_frames == 0)
+		return;
+
+	int64_t budget_nsecs = int64_t(1e9 * double(num_frames) / double(sample_rate));
+	int64_t elapsed_nsecs = end_nsecs - start_nsecs;
+	uint32_t load_permille = uint32_t(std::min<int64_t>(1000 * elapsed_nsecs / std::max<int64_t>(budget_nsecs, 1),
+	                                                    UINT32_MAX));
+
+	unsigned bucket;
+	if (load_permille < 1000)
+		bucket = load_permille / 100;
+	else if (load_permille < 1500)
+		bucket = 10;
+	else if (load_permille < 2000)
+		bucket = 11;
+	else
+		bucket = 12;
+
+	load_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	callbacks.fetch_add(1, std::memory_order_relaxed);
+	frames.fetch_add(num_frames, std::memory_order_relaxed);
+	busy_nsecs.fetch_add(uint64_t(elapsed_nsecs), std::memory_order_relaxed);
+	if (load_permille >= 1000)
+		overruns.fetch_add(1, std::memory_order_relaxed);
+
+	update_max(worst_load_permille, load_permille);
+	update_max(worst_callback_usecs, uint32_t(elapsed_nsecs / 1000));
+
+	// The first callback after start has nothing to compare against.
+	if (next_due_nsecs != 0 && start_nsecs > next_due_nsecs)
+	{
+		int64_t late_nsecs = start_nsecs - next_due_nsecs;
+		update_max(worst_late_usecs, uint32_t(std::min<int64_t>(late_nsecs / 1000, UINT32_MAX)));
+		if (late_nsecs > budget_nsecs)
+			late.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Blocks rendered ahead of time, e.g. when a backend prefills, are buffered and push the due time out.
+	next_due_nsecs = std::max(next_due_nsecs, start_nsecs) + budget_nsecs;
+}
+
+void LoadMonitor::set_backend_parameters(float sample_rate_, unsigned channels, size_t max_num_frames)
+{
+	sample_rate = sample_rate_;
+	callback->set_backend_parameters(sample_rate_, channels, max_num_frames);
+}
+
+void LoadMonitor::on_backend_start()
+{
+	next_due_nsecs = 0;
+	callback->on_backend_start();
+}
+
+void LoadMonitor::on_backend_stop()
+{
+	callback->on_backend_stop();
+}
+
+void LoadMonitor::on_backend_xrun() noexcept
+{
+	xruns.fetch_add(1, std::memory_order_relaxed);
+	callback->on_backend_xrun();
+}
+
+bool LoadMonitor::is_silent() noexcept
+{
+	bool silent = callback->is_silent();
+	// The backend may skip calling us while silent, so the next call is not late.
+	if (silent)
+		next_due_nsecs = 0;
+	return silent;
+}
+
+void LoadMonitor::skip_samples(size_t num_frames) noexcept
+{
+	callback->skip_samples(num_frames);
+}
+
+bool LoadMonitor::allows_idle() noexcept
+{
+	return callback->allows_idle();
+}
+
+uint32_t LoadMonitor::get_processing_latency_usec() noexcept
+{
+	return callback->get_processing_latency_usec();
+}
+
+void LoadMonitor::set_latency_usec(uint32_t usec)
+{
+	callback->set_latency_usec(usec);
+}
+
+LoadMonitor::Stats LoadMonitor::get_stats(bool reset_worst) noexcept
+{
+	Stats stats = {};
+	stats.sample_rate = sample_rate;
+	for (unsigned i = 0; i < NumLoadBuckets; i++)
+		stats.load_buckets[i] = load_buckets[i].load(std::memory_order_relaxed);
+	stats.callbacks = callbacks.load(std::memory_order_relaxed);
+	stats.overruns = overruns.load(std::memory_order_relaxed);
+	stats.late = late.load(std::memory_order_relaxed);
+	stats.xruns = xruns.load(std::memory_order_relaxed);
+	stats.frames = frames.load(std::memory_order_relaxed);
+	stats.busy_nsecs = busy_nsecs.load(std::memory_order_relaxed);
+
+	if (reset_worst)
+	{
+		stats.worst_load_permille = worst_load_permille.exchange(0, std::memory_order_relaxed);
+		stats.worst_callback_usecs = worst_callback_usecs.exchange(0, std::memory_order_relaxed);
+		stats.worst_late_usecs = worst_late_usecs.exchange(0, std::memory_order_relaxed);
+	}
+	else
+	{
+		stats.worst_load_permille = worst_load_permille.load(std::memory_order_relaxed);
+		stats.worst_callback_usecs = worst_callback_usecs.load(std::memory_order_relaxed);
+		stats.worst_late_usecs = worst_late_usecs.load(std::memory_order_relaxed);
+	}
+
+	return stats;
+}
+
+void LoadMonitor::print_stats(FILE *file, const Stats &stats)
+{
+	double audio_seconds = stats.sample_rate > 0.0f ? double(stats.frames) / double(stats.sample_rate) : 0.0;
+	double average_load = audio_seconds > 0.0 ? 100.0 * 1e-9 * double(stats.busy_nsecs) / audio_seconds : 0.0;
+
+	fprintf(file, "Load: %llu callbacks, %.1f s audio, average %.1f%%, worst %.1f%% (%.2f ms).\n",
+	        static_cast<unsigned long long>(stats.callbacks), audio_seconds, average_load,
+	        0.1 * double(stats.worst_load_permille), 1e-3 * double(stats.worst_callback_usecs));
+	fprintf(file, "  overruns %llu, late callbacks %llu (worst %.2f ms late), backend xruns %llu.\n",
+	        static_cast<unsigned long long>(stats.overruns), static_cast<unsigned long long>(stats.late),
+	        1e-3 * double(stats.worst_late_usecs), static_cast<unsigned long long>(stats.xruns));
+
+	static const char *labels[NumLoadBuckets] = {
+		"   0-10%", "  10-20%", "  20-30%", "  30-40%", "  40-50%", "  50-60%", "  60-70%",
+		"  70-80%", "  80-90%", " 90-100%", "100-150%", "150-200%", "   >200%",
+	};
+
+	for (unsigned i = 0; i < NumLoadBuckets; i++)
+	{
+		if (!stats.load_buckets[i])
+			continue;
+		fprintf(file, "  %s: %llu (%.2f%%)\n", labels[i], static_cast<unsigned long long>(stats.load_buckets[i]),
+		        100.0 * double(stats.load_buckets[i]) / double(std::max<uint64_t>(stats.callbacks, 1)));
+	}
+}
@@ -0,0 +1,94 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include "audio_backend.hpp"
+
+// Sits between a backend and its callback and times every mix_samples() call against
+// the wall time of the frames it produced. Only the audio thread writes the counters,
+// any other thread can take a snapshot without blocking it.
+class LoadMonitor final : public BackendCallback
+{
+public:
+	// 10% wide buckets up to 100% load, then [100%, 150%), [150%, 200%) and everything beyond.
+	enum { NumLoadBuckets = 13 };
+
+	struct Stats
+	{
+		uint64_t load_buckets[NumLoadBuckets];
+		float sample_rate;
+		uint64_t callbacks;
+		// Callbacks which took longer than the audio they rendered.
+		uint64_t overruns;
+		// Callbacks which started more than a block late, the previous block's duration past when it was due.
+		uint64_t late;
+		// Underruns reported by the backend.
+		uint64_t xruns;
+		uint64_t frames;
+		uint64_t busy_nsecs;
+		// Since the previous snapshot which reset them.
+		uint32_t worst_load_permille;
+		uint32_t worst_callback_usecs;
+		// How much later than the previous block's duration a callback started.
+		// A stalled server or machine shows up here while the load stays low.
+		uint32_t worst_late_usecs;
+	};
+
+	explicit LoadMonitor(BackendCallback *callback);
+
+	void mix_samples(float * const *channels, size_t num_frames) noexcept override;
+	void set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames) override;
+	void on_backend_stop() override;
+	void on_backend_start() override;
+	void on_backend_xrun() noexcept override;
+	bool is_silent() noexcept override;
+	void skip_samples(size_t num_frames) noexcept override;
+	bool allows_idle() noexcept override;
+	uint32_t get_processing_latency_usec() noexcept override;
+	void set_latency_usec(uint32_t usec) override;
+
+	// Worst case values are reset when reset_worst is set, so periodic dumps show the worst of each interval.
+	Stats get_stats(bool reset_worst) noexcept;
+	static void print_stats(FILE *file, const Stats &stats);
+
+private:
+	BackendCallback *callback;
+	float sample_rate = 0.0f;
+	// When the next callback is due, the previous start plus the duration of its block.
+	int64_t next_due_nsecs = 0;
+
+	std::atomic<uint64_t> load_buckets[NumLoadBuckets];
+	std::atomic<uint64_t> callbacks{0};
+	std::atomic<uint64_t> overruns{0};
+	std::atomic<uint64_t> late{0};
+	std::atomic<uint64_t> xruns{0};
+	std::atomic<uint64_t> frames{0};
+	std::atomic<uint64_t> busy_nsecs{0};
+	std::atomic<uint32_t> worst_load_permille{0};
+	std::atomic<uint32_t> worst_callback_usecs{0};
+	std::atomic<uint32_t> worst_late_usecs{0};
+};
@@ -29,6 +29,8 @@ public:
 	{
 		int note;
 		bool pressed;
+		// MIDI program change if >= 0, note and pressed are unused then.
+		int program;
 	};
 
 	virtual ~MIDISource() = default;
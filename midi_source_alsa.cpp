@@ -40,12 +40,21 @@ bool MIDISourceALSA::wait_next_note_event(NoteEvent &event)
 		{
 			event.note = ev->data.note.note;
 			event.pressed = true;
+			event.program = -1;
 			got_event = true;
 		}
 		else if (ev->type == SND_SEQ_EVENT_NOTEOFF || (ev->type == SND_SEQ_EVENT_NOTEON && ev->data.note.velocity == 0))
 		{
 			event.note = ev->data.note.note;
 			event.pressed = false;
+			event.program = -1;
+			got_event = true;
+		}
+		else if (ev->type == SND_SEQ_EVENT_PGMCHANGE)
+		{
+			event.note = 0;
+			event.pressed = false;
+			event.program = int(ev->data.control.value);
 			got_event = true;
 		}
 
@@ -69,6 +69,7 @@ bool MIDISourceUDP::wait_next_note_event(NoteEvent &event)
 
 	event.pressed = (buf[0] & 0x80) != 0;
 	event.note = buf[0] & 0x7f;
+	event.program = -1;
 	return true;
 }
 
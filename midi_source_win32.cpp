@@ -50,14 +50,21 @@ MIDISourceMM::~MIDISourceMM()
 void MIDISourceMM::key_on(int note)
 {
 	std::lock_guard<std::mutex> holder{lock};
-	note_queue.push({ note, true });
+	note_queue.push({ note, true, -1 });
 	cond.notify_one();
 }
 
 void MIDISourceMM::key_off(int note)
 {
 	std::lock_guard<std::mutex> holder{lock};
-	note_queue.push({ note, false });
+	note_queue.push({ note, false, -1 });
+	cond.notify_one();
+}
+
+void MIDISourceMM::program_change(int program)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	note_queue.push({ 0, false, program });
 	cond.notify_one();
 }
 
@@ -83,11 +90,14 @@ static void CALLBACK midi_callback(HMIDIIN, UINT wMsg, DWORD_PTR dwInstance, DWO
 
 		bool note_on = (code & 0xf0) == 0x90;
 		bool note_off = (code & 0xf0) == 0x80;
+		bool program_change = (code & 0xf0) == 0xc0;
 
 		if (note_on && vel > 0)
 			source->key_on(note);
 		else if (note_off || (note_on && vel == 0))
 			source->key_off(note);
+		else if (program_change)
+			source->program_change(note);
 	}
 }
 
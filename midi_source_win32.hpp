@@ -38,6 +38,7 @@ public:
 
 	void key_on(int note);
 	void key_off(int note);
+	void program_change(int program);
 
 private:
 	HMIDIIN handle = {};
@@ -0,0 +1,73 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "sample_bank.hpp"
+#include "cli_parser.hpp"
+
+// Packs a directory of WAV files and a mapping file into a sample bank, see SampleBank::pack().
+
+static void print_help()
+{
+	fprintf(stderr, "sussybard-pack-bank\n"
+	                "\t--mapping <mapping file, WAV paths are relative to it>\n"
+	                "\t--output <sample bank to write>\n"
+	                "\t[--help]\n");
+}
+
+int main(int argc, char **argv)
+{
+	std::string mapping;
+	std::string output;
+	Util::CLICallbacks cbs;
+
+	cbs.add("--mapping", [&](Util::CLIParser &parser) { mapping = parser.next_string(); });
+	cbs.add("--output", [&](Util::CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--help", [&](Util::CLIParser &parser) { parser.end(); });
+
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+	{
+		print_help();
+		return EXIT_SUCCESS;
+	}
+
+	if (mapping.empty() || output.empty())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	if (!SampleBank::pack(mapping.c_str(), output.c_str()))
+		return EXIT_FAILURE;
+
+	// Catch anything the loader would reject right away.
+	SampleBank bank;
+	return bank.load(output.c_str()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
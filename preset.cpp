@@ -0,0 +1,439 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "preset.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <string>
+
+bool FMPreset::set(unsigned parameter, unsigned operator_index, float value)
+{
+	if (num_parameters >= MaxParameters)
+		return false;
+
+	auto &param = parameters[num_parameters++];
+	param.parameter = uint16_t(parameter);
+	param.operator_index = uint8_t(operator_index);
+	param.global = 0;
+	param.value = value;
+	return true;
+}
+
+bool FMPreset::set_global(unsigned parameter, float value)
+{
+	if (num_parameters >= MaxParameters)
+		return false;
+
+	auto &param = parameters[num_parameters++];
+	param.parameter = uint16_t(parameter);
+	param.operator_index = 0;
+	param.global = 1;
+	param.value = value;
+	return true;
+}
+
+FMPreset create_default_preset(unsigned split)
+{
+	FMPreset preset = {};
+	strcpy(preset.name, split ? "default-remote" : "default");
+
+	preset.set_global(FMSYNTH_GLOBAL_PARAM_VOLUME, 0.1f);
+
+	float delay_time_mod = split ? 0.75f : 1.0f;
+
+	preset.set(FMSYNTH_PARAM_DELAY0, 0, 0.01f);
+	preset.set(FMSYNTH_PARAM_DELAY1, 0, delay_time_mod * 1.0f);
+	preset.set(FMSYNTH_PARAM_DELAY2, 0, delay_time_mod * 1.0f);
+	preset.set(FMSYNTH_PARAM_RELEASE_TIME, 0, delay_time_mod * 1.5f);
+	preset.set(FMSYNTH_PARAM_ENVELOPE_TARGET0, 0, 1.0f);
+	preset.set(FMSYNTH_PARAM_ENVELOPE_TARGET1, 0, 0.2f);
+	preset.set(FMSYNTH_PARAM_ENVELOPE_TARGET2, 0, 0.03f);
+
+	preset.set(FMSYNTH_PARAM_DELAY0, 1, delay_time_mod * 0.005f);
+	preset.set(FMSYNTH_PARAM_DELAY1, 1, delay_time_mod * 0.25f);
+	preset.set(FMSYNTH_PARAM_DELAY2, 1, delay_time_mod * 0.25f);
+	preset.set(FMSYNTH_PARAM_RELEASE_TIME, 1, delay_time_mod * 0.85f);
+	preset.set(FMSYNTH_PARAM_ENVELOPE_TARGET0, 1, 1.0f);
+	preset.set(FMSYNTH_PARAM_ENVELOPE_TARGET1, 1, 0.2f);
+	preset.set(FMSYNTH_PARAM_ENVELOPE_TARGET2, 1, 0.10f);
+
+	for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+	{
+		preset.set(FMSYNTH_PARAM_ENABLE, i, i < 3 ? 1.0f : 0.0f);
+		preset.set(FMSYNTH_PARAM_CARRIERS, i, i == 0 ? 1.0f : 0.0f);
+	}
+
+	preset.set(FMSYNTH_PARAM_FREQ_MOD, 1, split ? 2.0f : 1.0f);
+	preset.set(FMSYNTH_PARAM_KEYBOARD_SCALING_HIGH_FACTOR, 1, -0.5f);
+	preset.set(FMSYNTH_PARAM_KEYBOARD_SCALING_LOW_FACTOR, 1, -0.5f);
+	preset.set(FMSYNTH_PARAM_MOD_TO_CARRIERS0 + 1, 0, 0.8f);
+	preset.set(FMSYNTH_PARAM_AMP, 1, 1.0f);
+
+	preset.set(FMSYNTH_PARAM_FREQ_MOD, 2, 12.00f);
+	preset.set(FMSYNTH_PARAM_KEYBOARD_SCALING_HIGH_FACTOR, 2, -1.0f);
+	preset.set(FMSYNTH_PARAM_KEYBOARD_SCALING_LOW_FACTOR, 2, -1.0f);
+	preset.set(FMSYNTH_PARAM_MOD_TO_CARRIERS0 + 2, 1, 0.5f);
+	preset.set(FMSYNTH_PARAM_AMP, 2, 0.6f);
+
+	return preset;
+}
+
+void apply_preset_parameters(fmsynth_t *fm, const FMPreset &preset)
+{
+	for (uint32_t i = 0; i < preset.num_parameters; i++)
+	{
+		auto &param = preset.parameters[i];
+		if (param.global)
+			fmsynth_set_global_parameter(fm, param.parameter, param.value);
+		else
+			fmsynth_set_parameter(fm, param.parameter, param.operator_index, param.value);
+	}
+}
+
+void apply_preset(fmsynth_t *fm, const FMPreset &preset)
+{
+	fmsynth_reset(fm);
+	apply_preset_parameters(fm, preset);
+}
+
+struct ParameterName
+{
+	const char *name;
+	unsigned parameter;
+};
+
+static const ParameterName global_parameter_names[] = {
+	{ "volume", FMSYNTH_GLOBAL_PARAM_VOLUME },
+	{ "lfo_freq", FMSYNTH_GLOBAL_PARAM_LFO_FREQ },
+};
+
+static const ParameterName parameter_names[] = {
+	{ "amp", FMSYNTH_PARAM_AMP },
+	{ "pan", FMSYNTH_PARAM_PAN },
+	{ "freq_mod", FMSYNTH_PARAM_FREQ_MOD },
+	{ "freq_offset", FMSYNTH_PARAM_FREQ_OFFSET },
+	{ "envelope_target0", FMSYNTH_PARAM_ENVELOPE_TARGET0 },
+	{ "envelope_target1", FMSYNTH_PARAM_ENVELOPE_TARGET1 },
+	{ "envelope_target2", FMSYNTH_PARAM_ENVELOPE_TARGET2 },
+	{ "delay0", FMSYNTH_PARAM_DELAY0 },
+	{ "delay1", FMSYNTH_PARAM_DELAY1 },
+	{ "delay2", FMSYNTH_PARAM_DELAY2 },
+	{ "release_time", FMSYNTH_PARAM_RELEASE_TIME },
+	{ "keyboard_scaling_mid_point", FMSYNTH_PARAM_KEYBOARD_SCALING_MID_POINT },
+	{ "keyboard_scaling_low_factor", FMSYNTH_PARAM_KEYBOARD_SCALING_LOW_FACTOR },
+	{ "keyboard_scaling_high_factor", FMSYNTH_PARAM_KEYBOARD_SCALING_HIGH_FACTOR },
+	{ "velocity_sensitivity", FMSYNTH_PARAM_VELOCITY_SENSITIVITY },
+	{ "mod_wheel_sensitivity", FMSYNTH_PARAM_MOD_WHEEL_SENSITIVITY },
+	{ "lfo_amp_depth", FMSYNTH_PARAM_LFO_AMP_DEPTH },
+	{ "lfo_freq_mod_depth", FMSYNTH_PARAM_LFO_FREQ_MOD_DEPTH },
+	{ "enable", FMSYNTH_PARAM_ENABLE },
+	{ "carriers", FMSYNTH_PARAM_CARRIERS },
+};
+
+static bool find_parameter(const ParameterName *names, size_t count, const std::string &name, unsigned &parameter)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (name == names[i].name)
+		{
+			parameter = names[i].parameter;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parse_operator_parameter(const std::string &key, unsigned &operator_index, unsigned &parameter)
+{
+	// opN.<name>
+	if (key.size() < 5 || key.compare(0, 2, "op") != 0 || !isdigit(key[2]) || key[3] != '.')
+		return false;
+
+	operator_index = unsigned(key[2] - '0');
+	if (operator_index >= FMSYNTH_OPERATORS)
+		return false;
+
+	auto name = key.substr(4);
+	if (find_parameter(parameter_names, sizeof(parameter_names) / sizeof(parameter_names[0]), name, parameter))
+		return true;
+
+	// mod_to_carriersN, how much operator N modulates this one.
+	static const char mod_prefix[] = "mod_to_carriers";
+	if (name.size() == sizeof(mod_prefix) && name.compare(0, sizeof(mod_prefix) - 1, mod_prefix) == 0 &&
+	    isdigit(name.back()))
+	{
+		unsigned target = unsigned(name.back() - '0');
+		if (target >= FMSYNTH_OPERATORS)
+			return false;
+		parameter = FMSYNTH_PARAM_MOD_TO_CARRIERS0 + target;
+		return true;
+	}
+
+	return false;
+}
+
+static std::string trim(const std::string &str)
+{
+	size_t start = 0;
+	size_t end = str.size();
+	while (start < end && isspace(uint8_t(str[start])))
+		start++;
+	while (end > start && isspace(uint8_t(str[end - 1])))
+		end--;
+	return str.substr(start, end - start);
+}
+
+bool PresetBank::parse(const char *path, const char *text)
+{
+	presets.clear();
+	FMPreset *current = nullptr;
+	unsigned line_number = 0;
+
+	while (*text != '\0')
+	{
+		const char *end = strchr(text, '\n');
+		if (!end)
+			end = text + strlen(text);
+
+		std::string line(text, end);
+		text = *end != '\0' ? end + 1 : end;
+		line_number++;
+
+		auto comment = line.find_first_of("#;");
+		if (comment != std::string::npos)
+			line.resize(comment);
+		line = trim(line);
+		if (line.empty())
+			continue;
+
+		if (line.front() == '[')
+		{
+			if (line.back() != ']' || line.size() < 3 || line.size() - 2 >= FMPreset::MaxNameLength)
+			{
+				fprintf(stderr, "%s:%u: Invalid preset name.\n", path, line_number);
+				return false;
+			}
+
+			auto name = line.substr(1, line.size() - 2);
+			if (find(name.c_str()))
+			{
+				fprintf(stderr, "%s:%u: Duplicate preset %s.\n", path, line_number, name.c_str());
+				return false;
+			}
+
+			presets.emplace_back();
+			current = &presets.back();
+			*current = {};
+			memcpy(current->name, name.data(), name.size());
+			continue;
+		}
+
+		auto equals = line.find('=');
+		if (equals == std::string::npos)
+		{
+			fprintf(stderr, "%s:%u: Expected key = value.\n", path, line_number);
+			return false;
+		}
+
+		if (!current)
+		{
+			fprintf(stderr, "%s:%u: Parameter outside of a [preset] section.\n", path, line_number);
+			return false;
+		}
+
+		auto key = trim(line.substr(0, equals));
+		auto value_str = trim(line.substr(equals + 1));
+		char *value_end = nullptr;
+		float value = strtof(value_str.c_str(), &value_end);
+		if (value_str.empty() || *value_end != '\0')
+		{
+			fprintf(stderr, "%s:%u: Invalid value \"%s\".\n", path, line_number, value_str.c_str());
+			return false;
+		}
+
+		unsigned parameter = 0;
+		unsigned operator_index = 0;
+		bool ok;
+		if (find_parameter(global_parameter_names, sizeof(global_parameter_names) / sizeof(global_parameter_names[0]),
+		                   key, parameter))
+		{
+			ok = current->set_global(parameter, value);
+		}
+		else if (parse_operator_parameter(key, operator_index, parameter))
+		{
+			ok = current->set(parameter, operator_index, value);
+		}
+		else
+		{
+			fprintf(stderr, "%s:%u: Unknown parameter \"%s\".\n", path, line_number, key.c_str());
+			return false;
+		}
+
+		if (!ok)
+		{
+			fprintf(stderr, "%s:%u: Too many parameters in preset %s.\n", path, line_number, current->name);
+			return false;
+		}
+	}
+
+	if (presets.empty())
+	{
+		fprintf(stderr, "%s: No presets found.\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+struct PresetCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t preset_size;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t num_presets;
+};
+
+static const char preset_cache_magic[8] = { 'S', 'U', 'S', 'P', 'R', 'S', 'E', 'T' };
+enum { PresetCacheVersion = 1 };
+
+static std::string get_cache_path(const char *path)
+{
+	return std::string(path) + ".cache";
+}
+
+bool PresetBank::load_cache(const char *path, uint64_t source_size, int64_t source_mtime)
+{
+	auto cache_path = get_cache_path(path);
+	FILE *file = fopen(cache_path.c_str(), "rb");
+	if (!file)
+		return false;
+
+	PresetCacheHeader header = {};
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+	          memcmp(header.magic, preset_cache_magic, sizeof(preset_cache_magic)) == 0 &&
+	          header.version == PresetCacheVersion &&
+	          header.preset_size == sizeof(FMPreset) &&
+	          header.source_size == source_size &&
+	          header.source_mtime == source_mtime &&
+	          header.num_presets != 0 && header.num_presets < 0x10000;
+
+	if (ok)
+	{
+		presets.resize(size_t(header.num_presets));
+		ok = fread(presets.data(), sizeof(FMPreset), presets.size(), file) == presets.size();
+	}
+
+	if (ok)
+	{
+		for (auto &preset : presets)
+		{
+			if (preset.num_parameters > FMPreset::MaxParameters)
+				ok = false;
+			preset.name[FMPreset::MaxNameLength - 1] = '\0';
+		}
+	}
+
+	if (!ok)
+		presets.clear();
+
+	fclose(file);
+	return ok;
+}
+
+void PresetBank::write_cache(const char *path, uint64_t source_size, int64_t source_mtime) const
+{
+	auto cache_path = get_cache_path(path);
+	FILE *file = fopen(cache_path.c_str(), "wb");
+	if (!file)
+		return;
+
+	PresetCacheHeader header = {};
+	memcpy(header.magic, preset_cache_magic, sizeof(preset_cache_magic));
+	header.version = PresetCacheVersion;
+	header.preset_size = sizeof(FMPreset);
+	header.source_size = source_size;
+	header.source_mtime = source_mtime;
+	header.num_presets = presets.size();
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          fwrite(presets.data(), sizeof(FMPreset), presets.size(), file) == presets.size();
+	fclose(file);
+
+	// Don't leave a truncated cache behind.
+	if (!ok)
+		remove(cache_path.c_str());
+}
+
+bool PresetBank::load(const char *path)
+{
+	struct stat st = {};
+	if (stat(path, &st) != 0)
+	{
+		fprintf(stderr, "Failed to open preset bank %s.\n", path);
+		return false;
+	}
+
+	auto source_size = uint64_t(st.st_size);
+	auto source_mtime = int64_t(st.st_mtime);
+
+	if (load_cache(path, source_size, source_mtime))
+		return true;
+
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open preset bank %s.\n", path);
+		return false;
+	}
+
+	std::string text(size_t(source_size), '\0');
+	bool ok = fread(&text[0], 1, text.size(), file) == text.size();
+	fclose(file);
+
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to read preset bank %s.\n", path);
+		return false;
+	}
+
+	if (!parse(path, text.c_str()))
+	{
+		presets.clear();
+		return false;
+	}
+
+	write_cache(path, source_size, source_mtime);
+	return true;
+}
+
+const FMPreset *PresetBank::find(const char *name) const
+{
+	for (auto &preset : presets)
+		if (strcmp(preset.name, name) == 0)
+			return &preset;
+	return nullptr;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "fmsynth.h"
+
+// A preset is the list of fmsynth parameter writes applied on top of fmsynth_reset().
+// Fixed size and trivially copyable so it can be handed to the audio thread as is,
+// and stored in the binary cache as raw bytes.
+struct FMPreset
+{
+	enum { MaxNameLength = 32, MaxParameters = 192 };
+
+	struct Parameter
+	{
+		uint16_t parameter;
+		uint8_t operator_index;
+		// Global parameters ignore operator_index.
+		uint8_t global;
+		float value;
+	};
+
+	char name[MaxNameLength];
+	uint32_t num_parameters;
+	Parameter parameters[MaxParameters];
+
+	bool set(unsigned parameter, unsigned operator_index, float value);
+	bool set_global(unsigned parameter, float value);
+};
+
+// The built-in instrument which was used before preset files existed.
+// The remote split uses a variant with shorter envelopes, an octave up on the modulator.
+FMPreset create_default_preset(unsigned split);
+
+// Resets fm and applies every parameter.
+void apply_preset(fmsynth_t *fm, const FMPreset &preset);
+
+// Applies parameters without a reset, so sounding notes continue with the new timbre.
+// Parameters the preset doesn't set keep their previous values.
+void apply_preset_parameters(fmsynth_t *fm, const FMPreset &preset);
+
+// A set of presets parsed from a text file, e.g.
+//
+// [harp]
+// volume = 0.1
+// op0.delay0 = 0.01
+// op1.freq_mod = 2.0
+//
+// Top level keys are global parameters, opN.<name> keys are operator parameters.
+// Parsing happens once, the result is cached in binary form next to the source file
+// and reused as long as the source file is unchanged.
+class PresetBank
+{
+public:
+	bool load(const char *path);
+
+	const FMPreset *find(const char *name) const;
+	size_t size() const
+	{
+		return presets.size();
+	}
+
+	const FMPreset &get(size_t index) const
+	{
+		return presets[index];
+	}
+
+private:
+	std::vector<FMPreset> presets;
+
+	bool parse(const char *path, const char *text);
+	bool load_cache(const char *path, uint64_t source_size, int64_t source_mtime);
+	void write_cache(const char *path, uint64_t source_size, int64_t source_mtime) const;
+};
@@ -0,0 +1,302 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "realtime.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef SUSSYBARD_HAVE_DBUS
+#include <dbus/dbus.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define REALTIME_X86 1
+#endif
+
+namespace Util
+{
+// The deepest we expect an audio callback to go, touched once so that it's resident.
+static constexpr size_t StackPrefaultBytes = 64 * 1024;
+
+// rtkit's default limit. It refuses threads of processes without RLIMIT_RTTIME,
+// and the kernel sends SIGXCPU to a realtime thread which spins for longer than this without blocking.
+static constexpr unsigned RTTimeUsecs = 200000;
+
+static RealtimeOptions realtime_options;
+
+void set_realtime_options(const RealtimeOptions &options)
+{
+	realtime_options = options;
+}
+
+bool string_to_thread_role(const char *str, ThreadRole &role)
+{
+	if (strcmp(str, "audio") == 0)
+		role = ThreadRole::Audio;
+	else if (strcmp(str, "render") == 0)
+		role = ThreadRole::Render;
+	else if (strcmp(str, "input") == 0)
+		role = ThreadRole::Input;
+	else
+		return false;
+
+	return true;
+}
+
+const char *thread_role_to_string(ThreadRole role)
+{
+	switch (role)
+	{
+	case ThreadRole::Audio:
+		return "audio";
+	case ThreadRole::Render:
+		return "render";
+	case ThreadRole::Input:
+		return "input";
+	default:
+		return "unknown";
+	}
+}
+
+void set_flush_denormals(bool enable) noexcept
+{
+#if defined(REALTIME_X86)
+	// FTZ and DAZ.
+	const unsigned bits = 0x8040;
+	unsigned csr = _mm_getcsr();
+	_mm_setcsr(enable ? (csr | bits) : (csr & ~bits));
+#elif defined(__aarch64__)
+	// FZ, which on AArch64 also treats denormal inputs as zero.
+	const uint64_t bits = uint64_t(1) << 24;
+	uint64_t fpcr;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+	fpcr = enable ? (fpcr | bits) : (fpcr & ~bits);
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#else
+	(void)enable;
+#endif
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#elif defined(_MSC_VER)
+__declspec(noinline)
+#endif
+static void prefault_stack() noexcept
+{
+	uint8_t stack[StackPrefaultBytes];
+	// Volatile stores so the compiler can't drop the unused array.
+	volatile uint8_t *pages = stack;
+	for (size_t i = 0; i < StackPrefaultBytes; i += 4096)
+		pages[i] = 0;
+}
+
+#ifdef SUSSYBARD_HAVE_DBUS
+static int rtkit_get_max_priority(DBusConnection *bus, int fallback)
+{
+	const char *interface = "org.freedesktop.RealtimeKit1";
+	const char *property = "MaxRealtimePriority";
+
+	DBusMessage *msg = dbus_message_new_method_call("org.freedesktop.RealtimeKit1", "/org/freedesktop/RealtimeKit1",
+	                                                "org.freedesktop.DBus.Properties", "Get");
+	if (!msg)
+		return fallback;
+
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+	DBusMessage *reply = dbus_connection_send_with_reply_and_block(bus, msg, -1, nullptr);
+	dbus_message_unref(msg);
+	if (!reply)
+		return fallback;
+
+	int value = fallback;
+	DBusMessageIter iter, variant;
+	if (dbus_message_iter_init(reply, &iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT)
+	{
+		dbus_message_iter_recurse(&iter, &variant);
+		if (dbus_message_iter_get_arg_type(&variant) == DBUS_TYPE_INT32)
+		{
+			dbus_int32_t v;
+			dbus_message_iter_get_basic(&variant, &v);
+			value = v;
+		}
+	}
+
+	dbus_message_unref(reply);
+	return value;
+}
+
+static bool rtkit_make_thread_realtime(int &priority)
+{
+	rlimit limit = {};
+	if (getrlimit(RLIMIT_RTTIME, &limit) == 0 && (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > RTTimeUsecs))
+	{
+		limit.rlim_cur = RTTimeUsecs;
+		limit.rlim_max = RTTimeUsecs;
+		setrlimit(RLIMIT_RTTIME, &limit);
+	}
+
+	DBusError error;
+	dbus_error_init(&error);
+
+	// Private connection, so we never interfere with whatever else in the process talks to the system bus.
+	DBusConnection *bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
+	if (!bus)
+	{
+		fprintf(stderr, "rtkit: failed to connect to the system bus: %s.\n", error.message);
+		dbus_error_free(&error);
+		return false;
+	}
+	dbus_connection_set_exit_on_disconnect(bus, FALSE);
+
+	priority = std::min(priority, rtkit_get_max_priority(bus, priority));
+
+	bool ret = false;
+	DBusMessage *msg = dbus_message_new_method_call("org.freedesktop.RealtimeKit1", "/org/freedesktop/RealtimeKit1",
+	                                                "org.freedesktop.RealtimeKit1", "MakeThreadRealtime");
+	if (msg)
+	{
+		dbus_uint64_t tid = dbus_uint64_t(syscall(SYS_gettid));
+		dbus_uint32_t prio = dbus_uint32_t(priority);
+		dbus_message_append_args(msg, DBUS_TYPE_UINT64, &tid, DBUS_TYPE_UINT32, &prio, DBUS_TYPE_INVALID);
+
+		DBusMessage *reply = dbus_connection_send_with_reply_and_block(bus, msg, -1, &error);
+		dbus_message_unref(msg);
+
+		if (reply)
+		{
+			ret = !dbus_set_error_from_message(&error, reply);
+			dbus_message_unref(reply);
+		}
+
+		if (!ret)
+			fprintf(stderr, "rtkit: %s.\n", error.message ? error.message : "request failed");
+	}
+
+	dbus_error_free(&error);
+	dbus_connection_close(bus);
+	dbus_connection_unref(bus);
+	return ret;
+}
+#endif
+
+static void set_current_thread_priority(ThreadRole role, int priority) noexcept
+{
+#ifdef _WIN32
+	// MMCSS already handles the audio thread, this mostly matters for the input thread.
+	if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+		fprintf(stderr, "Failed to raise priority of %s thread.\n", thread_role_to_string(role));
+	(void)priority;
+#else
+	sched_param param = {};
+	param.sched_priority = priority;
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err == 0)
+		return;
+
+#ifdef SUSSYBARD_HAVE_DBUS
+	if (err == EPERM && realtime_options.use_rtkit)
+	{
+		int granted = priority;
+		if (rtkit_make_thread_realtime(granted))
+		{
+			if (granted != priority)
+				fprintf(stderr, "rtkit: %s thread got priority %d instead of %d.\n",
+				        thread_role_to_string(role), granted, priority);
+			return;
+		}
+	}
+#endif
+
+	fprintf(stderr, "Failed to make %s thread realtime (%s), expect scheduling latency under load.\n",
+	        thread_role_to_string(role), strerror(err));
+#endif
+}
+
+static void pin_current_thread(ThreadRole role, unsigned core) noexcept
+{
+#ifdef _WIN32
+	if (core < 8 * sizeof(DWORD_PTR))
+		SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "Failed to pin %s thread to core %u.\n", thread_role_to_string(role), core);
+#else
+	(void)role;
+	(void)core;
+#endif
+}
+
+void setup_current_thread(ThreadRole role, unsigned index) noexcept
+{
+	int first_core = realtime_options.core[int(role)];
+	unsigned num_cores = std::thread::hardware_concurrency();
+	if (first_core >= 0 && unsigned(first_core) < num_cores)
+		pin_current_thread(role, unsigned(first_core) + index % (num_cores - unsigned(first_core)));
+
+	int priority = realtime_options.priority[int(role)];
+	if (priority > 0)
+		set_current_thread_priority(role, priority);
+
+	if (realtime_options.flush_denormals && role != ThreadRole::Input)
+		set_flush_denormals(true);
+
+	prefault_stack();
+}
+
+bool lock_memory()
+{
+#ifdef _WIN32
+	fprintf(stderr, "Locking memory is not supported on Windows.\n");
+	return false;
+#else
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		fprintf(stderr, "mlockall() failed (%s), check RLIMIT_MEMLOCK.\n", strerror(errno));
+		return false;
+	}
+
+	// The calling thread's stack is locked by now, but make sure the pages we'll use exist.
+	prefault_stack();
+	return true;
+#endif
+}
+}
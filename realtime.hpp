@@ -0,0 +1,66 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+namespace Util
+{
+enum class ThreadRole
+{
+	// Backend thread which calls into the synth.
+	Audio,
+	// Render pool workers, they run on the audio thread's deadline.
+	Render,
+	// Waits for MIDI events and dispatches the key presses they map to.
+	Input,
+	Count
+};
+
+struct RealtimeOptions
+{
+	// SCHED_FIFO priority per role, 0 leaves the role at normal priority.
+	int priority[int(ThreadRole::Count)] = {};
+	// First core per role, threads of the same role take consecutive cores from there. -1 lets the OS decide.
+	// Render workers default to cores 1 and up, leaving core 0 to the rest of the system.
+	int core[int(ThreadRole::Count)] = { -1, 1, -1 };
+	// Ask rtkit over D-Bus when we're not allowed to raise the priority ourselves.
+	bool use_rtkit = true;
+	// FM release tails decay into subnormals, which are very slow on x86.
+	bool flush_denormals = false;
+};
+
+// Applies to every thread which calls setup_current_thread() afterwards,
+// so set this before the backend and render pool create their threads.
+void set_realtime_options(const RealtimeOptions &options);
+
+// Applies priority, core affinity and denormal flushing of the role to the calling thread, and prefaults its stack.
+// index picks the core among threads of the same role. Failures are reported, but not fatal.
+void setup_current_thread(ThreadRole role, unsigned index = 0) noexcept;
+
+// Locks current and future pages, so the audio path never takes a page fault.
+bool lock_memory();
+
+void set_flush_denormals(bool enable) noexcept;
+
+bool string_to_thread_role(const char *str, ThreadRole &role);
+const char *thread_role_to_string(ThreadRole role);
+}
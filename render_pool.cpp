@@ -0,0 +1,213 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "render_pool.hpp"
+#include "realtime.hpp"
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() std::this_thread::yield()
+#endif
+
+namespace Util
+{
+// Roughly tens of microseconds. Blocks are a few milliseconds apart,
+// so this only avoids the wakeup latency when jobs come back to back.
+static constexpr unsigned SpinIterations = 4096;
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex needs a plain 32-bit word.");
+
+static void wait_on_value(std::atomic<uint32_t> &value, uint32_t expected) noexcept
+{
+#ifdef _WIN32
+	WaitOnAddress(&value, &expected, sizeof(expected), INFINITE);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&value), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+	while (value.load(std::memory_order_acquire) == expected)
+		std::this_thread::yield();
+#endif
+}
+
+static void wake_all(std::atomic<uint32_t> &value) noexcept
+{
+#ifdef _WIN32
+	WakeByAddressAll(&value);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&value), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+	(void)value;
+#endif
+}
+
+RenderPool::~RenderPool()
+{
+	shutdown();
+}
+
+void RenderPool::shutdown()
+{
+	if (workers.empty())
+		return;
+
+	stopping = true;
+	generation.fetch_add(1, std::memory_order_seq_cst);
+	wake_all(generation);
+
+	for (auto &worker : workers)
+		worker.join();
+	workers.clear();
+	stopping = false;
+}
+
+void RenderPool::init(unsigned num_workers)
+{
+	shutdown();
+
+	unsigned num_cores = std::thread::hardware_concurrency();
+	// More workers than spare cores only adds context switches to the audio deadline.
+	if (num_cores && num_workers >= num_cores)
+	{
+		fprintf(stderr, "Clamping render workers from %u to %u.\n", num_workers, num_cores - 1);
+		num_workers = num_cores - 1;
+	}
+
+	workers.reserve(num_workers);
+	for (unsigned i = 0; i < num_workers; i++)
+		workers.emplace_back(&RenderPool::worker_loop, this, i);
+}
+
+unsigned RenderPool::get_num_workers() const noexcept
+{
+	return unsigned(workers.size());
+}
+
+void RenderPool::run_tasks(uint32_t job_generation) noexcept
+{
+	uint64_t current = work.load(std::memory_order_acquire);
+	for (;;)
+	{
+		unsigned task = unsigned(current & 0xffff);
+		unsigned count = unsigned((current >> 16) & 0xffff);
+		if (uint32_t(current >> 32) != job_generation || task >= count)
+			return;
+
+		if (!work.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_acquire))
+			continue;
+
+		func(userdata, task);
+
+		if (pending.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+		    caller_sleeping.load(std::memory_order_seq_cst))
+		{
+			wake_all(pending);
+		}
+
+		current = work.load(std::memory_order_acquire);
+	}
+}
+
+void RenderPool::worker_loop(unsigned index) noexcept
+{
+	setup_current_thread(ThreadRole::Render, index);
+
+	uint32_t seen = generation.load(std::memory_order_acquire);
+	for (;;)
+	{
+		uint32_t current = seen;
+		for (unsigned i = 0; i < SpinIterations && current == seen; i++)
+		{
+			cpu_relax();
+			current = generation.load(std::memory_order_acquire);
+		}
+
+		while (current == seen)
+		{
+			// Re-check after announcing ourselves, so that run() either sees us sleeping or we see its job.
+			sleeping_workers.fetch_add(1, std::memory_order_seq_cst);
+			if (generation.load(std::memory_order_seq_cst) == seen)
+				wait_on_value(generation, seen);
+			sleeping_workers.fetch_sub(1, std::memory_order_relaxed);
+			current = generation.load(std::memory_order_acquire);
+		}
+
+		seen = current;
+		if (stopping)
+			break;
+
+		run_tasks(seen);
+	}
+}
+
+void RenderPool::run(TaskFunc func_, void *userdata_, unsigned num_tasks) noexcept
+{
+	if (num_tasks == 0)
+		return;
+
+	if (workers.empty() || num_tasks == 1 || num_tasks > MaxTasks)
+	{
+		for (unsigned i = 0; i < num_tasks; i++)
+			func_(userdata_, i);
+		return;
+	}
+
+	// The previous job has fully completed, so no worker reads these right now.
+	func = func_;
+	userdata = userdata_;
+	pending.store(num_tasks, std::memory_order_relaxed);
+
+	uint32_t job_generation = generation.load(std::memory_order_relaxed) + 1;
+	work.store((uint64_t(job_generation) << 32) | (uint64_t(num_tasks) << 16), std::memory_order_release);
+	generation.store(job_generation, std::memory_order_seq_cst);
+	if (sleeping_workers.load(std::memory_order_seq_cst))
+		wake_all(generation);
+
+	run_tasks(job_generation);
+
+	uint32_t remaining = pending.load(std::memory_order_acquire);
+	for (unsigned i = 0; i < SpinIterations && remaining; i++)
+	{
+		cpu_relax();
+		remaining = pending.load(std::memory_order_acquire);
+	}
+
+	if (remaining)
+	{
+		caller_sleeping.store(1, std::memory_order_seq_cst);
+		while ((remaining = pending.load(std::memory_order_seq_cst)) != 0)
+			wait_on_value(pending, remaining);
+		caller_sleeping.store(0, std::memory_order_relaxed);
+	}
+}
+}
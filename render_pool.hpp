@@ -0,0 +1,88 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Util
+{
+// Fork/join pool for work which has to finish within one audio block.
+// Workers run as ThreadRole::Render, pinned to their own cores by default. They spin briefly
+// between jobs and then sleep on a futex (WaitOnAddress on Windows). The calling thread takes
+// part in the job, so run() with no workers just runs every task inline.
+// run() never allocates or takes a lock.
+class RenderPool
+{
+public:
+	typedef void (*TaskFunc)(void *userdata, unsigned task);
+
+	RenderPool() = default;
+	~RenderPool();
+	void operator=(const RenderPool &) = delete;
+
+	// Spawns num_workers threads. Unless configured otherwise in RealtimeOptions, workers are pinned
+	// to cores 1 and up, leaving core 0 to the rest of the system. Must not be called while a job is running.
+	void init(unsigned num_workers);
+	unsigned get_num_workers() const noexcept;
+
+	// Runs func(userdata, i) for every i in [0, num_tasks) and returns when all of them have completed.
+	// Tasks may run in any order and on any thread, including the caller.
+	// Jobs with more than 65535 tasks run inline.
+	// Must only be called from one thread at a time.
+	void run(TaskFunc func, void *userdata, unsigned num_tasks) noexcept;
+
+private:
+	enum { CacheLineSize = 64, MaxTasks = 0xffff };
+
+	std::vector<std::thread> workers;
+
+	// Job parameters, only written while no job is running.
+	TaskFunc func = nullptr;
+	void *userdata = nullptr;
+
+	// Generation in the upper 32 bits, then the task count and the next task index, 16 bits each.
+	// Tasks are claimed with a CAS on the whole word, so that a worker which is
+	// late for one job can never claim a task from the next.
+	char padding_work[CacheLineSize];
+	std::atomic<uint64_t> work{0};
+
+	// Bumped for every job. Workers sleep on this.
+	char padding_generation[CacheLineSize];
+	std::atomic<uint32_t> generation{0};
+	std::atomic<uint32_t> sleeping_workers{0};
+	bool stopping = false;
+
+	// Tasks which have not completed yet. The caller sleeps on this.
+	char padding_pending[CacheLineSize];
+	std::atomic<uint32_t> pending{0};
+	std::atomic<uint32_t> caller_sleeping{0};
+	char padding_end[CacheLineSize];
+
+	void worker_loop(unsigned index) noexcept;
+	void run_tasks(uint32_t job_generation) noexcept;
+	void shutdown();
+};
+}
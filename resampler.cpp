@@ -0,0 +1,328 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "resampler.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static constexpr size_t HistoryAlignment = 64;
+static constexpr double Pi = 3.14159265358979323846;
+
+bool Resampler::string_to_quality(const char *str, Quality &quality)
+{
+	static const Quality qualities[] = { Quality::Low, Quality::Medium, Quality::High };
+	for (auto q : qualities)
+	{
+		if (strcmp(str, quality_to_string(q)) == 0)
+		{
+			quality = q;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *Resampler::quality_to_string(Quality quality)
+{
+	switch (quality)
+	{
+	case Quality::Low:
+		return "low";
+	case Quality::High:
+		return "high";
+	default:
+		return "medium";
+	}
+}
+
+Resampler::Resampler(BackendCallback *callback_, float internal_rate_, Quality quality_)
+	: callback(callback_), internal_rate(unsigned(lrintf(internal_rate_))), quality(quality_)
+{
+}
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b)
+	{
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+static double bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	for (unsigned k = 1; k < 32; k++)
+	{
+		term *= (0.5 * x / k) * (0.5 * x / k);
+		sum += term;
+	}
+	return sum;
+}
+
+void Resampler::design_filters(unsigned taps, float cutoff, float beta)
+{
+	filters.reset(static_cast<float *>(
+			Util::memalign_calloc(HistoryAlignment, state.num_phases * taps * sizeof(float))));
+
+	double half = 0.5 * double(taps);
+	double window_scale = 1.0 / bessel_i0(beta);
+
+	for (unsigned phase = 0; phase < state.num_phases; phase++)
+	{
+		float *filter = filters.get() + phase * taps;
+		double offset = double(phase) / double(state.num_phases);
+		double sum = 0.0;
+
+		for (unsigned k = 0; k < taps; k++)
+		{
+			// Distance from the output time, see set_latency_usec() for where the center lies.
+			double t = half - 1.0 + offset - double(k);
+			double x = t / half;
+			double window = std::abs(x) < 1.0 ? bessel_i0(beta * sqrt(1.0 - x * x)) * window_scale : 0.0;
+			double arg = 2.0 * Pi * cutoff * t;
+			double sinc = std::abs(arg) < 1e-9 ? 1.0 : sin(arg) / arg;
+			filter[k] = float(2.0 * cutoff * sinc * window);
+			sum += filter[k];
+		}
+
+		// Unity gain at DC for every phase, or the phases modulate a constant signal.
+		for (unsigned k = 0; k < taps; k++)
+			filter[k] = float(filter[k] / sum);
+	}
+
+	state.filters = filters.get();
+	state.taps = taps;
+}
+
+void Resampler::set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames)
+{
+	auto output_rate = unsigned(lrintf(sample_rate));
+	unsigned divisor = gcd(internal_rate, output_rate);
+	passthrough = internal_rate == 0 || output_rate == 0 || internal_rate == output_rate;
+
+	if (!passthrough && output_rate / divisor > MaxPhases)
+	{
+		fprintf(stderr, "Resampler: can't convert %u Hz to %u Hz, rendering at %u Hz instead.\n",
+		        internal_rate, output_rate, output_rate);
+		passthrough = true;
+	}
+
+	if (passthrough)
+	{
+		filters.reset();
+		history.reset();
+		callback->set_backend_parameters(sample_rate, channels, max_num_frames);
+		return;
+	}
+
+	state.num_phases = output_rate / divisor;
+	state.step = internal_rate / divisor;
+
+	unsigned taps;
+	float rolloff;
+	float beta;
+	switch (quality)
+	{
+	case Quality::Low:
+		taps = 16;
+		rolloff = 0.85f;
+		beta = 6.0f;
+		break;
+	case Quality::High:
+		taps = 64;
+		rolloff = 0.95f;
+		beta = 10.0f;
+		break;
+	default:
+		taps = 32;
+		rolloff = 0.91f;
+		beta = 8.0f;
+		break;
+	}
+
+	// Cut at the lower of the two Nyquist rates.
+	// When decimating, the band shrinks, so widen the filter to keep the same transition sharpness.
+	float ratio = float(state.num_phases) / float(state.step);
+	float cutoff = 0.5f * rolloff * std::min(1.0f, ratio);
+	if (ratio < 1.0f)
+		taps = (unsigned(ceilf(float(taps) / ratio)) + 15) & ~15u;
+	design_filters(taps, cutoff, beta);
+
+	// Worst case for one output block, when little input is left over from the previous one.
+	max_frames = max_num_frames;
+	size_t max_input_frames = size_t(ceil(double(max_num_frames) * double(state.step) / double(state.num_phases))) +
+	                          taps + 1;
+	history_frames = (taps + max_input_frames + 15) & ~size_t(15);
+	history.reset(static_cast<float *>(
+			Util::memalign_calloc(HistoryAlignment, 2 * history_frames * sizeof(float))));
+	history_channels[0] = history.get();
+	history_channels[1] = history.get() + history_frames;
+	reset();
+
+	fprintf(stderr, "Resampler: %u Hz to %u Hz, %u phases of %u taps, %.2f ms delay.\n",
+	        internal_rate, output_rate, state.num_phases, taps, 1e3 * double(taps / 2) / double(internal_rate));
+	callback->set_backend_parameters(float(internal_rate), channels, max_input_frames);
+}
+
+void Resampler::reset() noexcept
+{
+	if (!history)
+		return;
+
+	memset(history.get(), 0, 2 * history_frames * sizeof(float));
+	// The first output lands on the first rendered frame, with silence before it under the filter.
+	fill = state.taps / 2 - 1;
+	state.phase = 0;
+	state.position = 0;
+}
+
+void Resampler::resample(float * const *channels, size_t num_frames) noexcept
+{
+	// Last input frame under the filter for the final output frame.
+	size_t last_position = state.position + (state.phase + (num_frames - 1) * size_t(state.step)) / state.num_phases;
+	size_t needed = last_position + state.taps;
+
+	if (needed > fill)
+	{
+		float *render_channels[2] = { history_channels[0] + fill, history_channels[1] + fill };
+		callback->mix_samples(render_channels, needed - fill);
+		fill = needed;
+	}
+
+	DSP::resample_stereo(channels[0], channels[1], history_channels[0], history_channels[1], state, num_frames);
+
+	// Keep the frames still under the filter at the start of the history.
+	size_t consumed = std::min(state.position, fill);
+	for (auto *channel : history_channels)
+		memmove(channel, channel + consumed, (fill - consumed) * sizeof(float));
+	fill -= consumed;
+	state.position -= consumed;
+}
+
+void Resampler::mix_samples(float * const *channels, size_t num_frames) noexcept
+{
+	if (passthrough)
+	{
+		callback->mix_samples(channels, num_frames);
+		return;
+	}
+
+	// Backends should never ask for more than they promised, but stay safe.
+	size_t offset = 0;
+	while (offset < num_frames)
+	{
+		size_t to_render = std::min(num_frames - offset, max_frames);
+		float *block_channels[2] = { channels[0] + offset, channels[1] + offset };
+		resample(block_channels, to_render);
+		offset += to_render;
+	}
+}
+
+void Resampler::set_latency_usec(uint32_t usec)
+{
+	if (passthrough)
+	{
+		callback->set_latency_usec(usec);
+		return;
+	}
+
+	// The next output frame is centered at this position in the history,
+	// while the callback renders the next frame at fill.
+	double center = double(state.position) + 0.5 * double(state.taps) - 1.0 +
+	                double(state.phase) / double(state.num_phases);
+	double buffered_usec = 1e6 * (double(fill) - center) / double(internal_rate);
+	callback->set_latency_usec(usec + uint32_t(std::max(0.0, buffered_usec)));
+}
+
+void Resampler::on_backend_stop()
+{
+	callback->on_backend_stop();
+}
+
+void Resampler::on_backend_xrun() noexcept
+{
+	callback->on_backend_xrun();
+}
+
+bool Resampler::is_silent() noexcept
+{
+	// The filter history only holds the decayed tail of whatever played last, close enough to silence.
+	return callback->is_silent();
+}
+
+void Resampler::skip_samples(size_t num_frames) noexcept
+{
+	if (passthrough)
+	{
+		callback->skip_samples(num_frames);
+		return;
+	}
+
+	if (!history || num_frames == 0)
+		return;
+
+	// Step the filter over the silence as resample() would, without running it.
+	size_t total = state.phase + num_frames * size_t(state.step);
+	state.phase = unsigned(total % state.num_phases);
+	state.position += total / state.num_phases;
+
+	if (state.position <= fill)
+	{
+		for (auto *channel : history_channels)
+			memmove(channel, channel + state.position, (fill - state.position) * sizeof(float));
+		fill -= state.position;
+	}
+	else
+	{
+		// The whole history was passed over, the callback skips the rest up to the new position.
+		callback->skip_samples(state.position - fill);
+		fill = 0;
+	}
+	state.position = 0;
+}
+
+bool Resampler::allows_idle() noexcept
+{
+	return callback->allows_idle();
+}
+
+uint32_t Resampler::get_processing_latency_usec() noexcept
+{
+	uint32_t usec = callback->get_processing_latency_usec();
+	if (!passthrough)
+		usec += uint32_t(1e6 * double(state.taps / 2) / double(internal_rate));
+	return usec;
+}
+
+void Resampler::on_backend_start()
+{
+	reset();
+	callback->on_backend_start();
+}
@@ -0,0 +1,86 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include "audio_backend.hpp"
+#include "aligned_alloc.hpp"
+#include "dsp.hpp"
+
+// Sits between a backend and its callback. The callback renders at a fixed internal rate,
+// and the output is converted to whatever rate the backend runs at with a polyphase FIR.
+// The filter delay is added to the latency reported to the callback, so event scheduling stays accurate.
+class Resampler final : public BackendCallback
+{
+public:
+	enum class Quality
+	{
+		// Taps per phase trade stopband rejection and passband width for CPU time.
+		Low,
+		Medium,
+		High
+	};
+
+	static bool string_to_quality(const char *str, Quality &quality);
+	static const char *quality_to_string(Quality quality);
+
+	Resampler(BackendCallback *callback, float internal_rate, Quality quality);
+
+	void mix_samples(float * const *channels, size_t num_frames) noexcept override;
+	void set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames) override;
+	void on_backend_stop() override;
+	void on_backend_start() override;
+	void on_backend_xrun() noexcept override;
+	bool is_silent() noexcept override;
+	void skip_samples(size_t num_frames) noexcept override;
+	bool allows_idle() noexcept override;
+	uint32_t get_processing_latency_usec() noexcept override;
+	void set_latency_usec(uint32_t usec) override;
+
+private:
+	// Limits the filter bank size. Every pair of common audio rates needs far fewer.
+	enum { MaxPhases = 1024 };
+
+	BackendCallback *callback;
+	unsigned internal_rate;
+	Quality quality;
+
+	// The backend already runs at the internal rate, or the ratio is unsupported.
+	bool passthrough = true;
+	size_t max_frames = 0;
+
+	std::unique_ptr<float, Util::AlignedDeleter> filters;
+	DSP::PolyphaseState state = {};
+
+	// Input history in planar stereo, frames [0, fill) are valid.
+	std::unique_ptr<float, Util::AlignedDeleter> history;
+	float *history_channels[2] = {};
+	size_t history_frames = 0;
+	size_t fill = 0;
+
+	void design_filters(unsigned taps, float cutoff, float beta);
+	void reset() noexcept;
+	void resample(float * const *channels, size_t num_frames) noexcept;
+};
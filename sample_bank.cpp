@@ -0,0 +1,475 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sample_bank.hpp"
+#include "wav.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const char SampleBank::magic[8] = { 'S', 'U', 'S', 'B', 'A', 'N', 'K', '1' };
+
+static constexpr size_t PrefaultStride = 4096;
+
+SampleBank::~SampleBank()
+{
+	unmap();
+}
+
+void SampleBank::unmap()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file)
+		CloseHandle(file);
+	mapping = nullptr;
+	file = nullptr;
+#else
+	if (data)
+		munmap(const_cast<uint8_t *>(data), size);
+#endif
+
+	data = nullptr;
+	size = 0;
+	memset(zones_by_note, 0, sizeof(zones_by_note));
+}
+
+bool SampleBank::validate(const char *path)
+{
+	SampleBankHeader header;
+	if (size < sizeof(header))
+	{
+		fprintf(stderr, "Sample bank %s is truncated.\n", path);
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != Version)
+	{
+		fprintf(stderr, "%s is not a sample bank of version %u, pack it again.\n", path, unsigned(Version));
+		return false;
+	}
+
+	if (header.num_zones == 0 || header.num_zones > NumNotes ||
+	    sizeof(header) + header.num_zones * sizeof(SampleBankZone) > size)
+	{
+		fprintf(stderr, "Sample bank %s has an invalid zone table.\n", path);
+		return false;
+	}
+
+	auto *zones = reinterpret_cast<const SampleBankZone *>(data + sizeof(header));
+	for (unsigned i = 0; i < header.num_zones; i++)
+	{
+		auto &zone = zones[i];
+		bool ok = zone.low_note <= zone.high_note && zone.high_note < NumNotes && zone.root_note < NumNotes &&
+		          (zone.channels == 1 || zone.channels == 2) && zone.sample_rate != 0 &&
+		          zone.frames != 0 && zone.frames < 0x7fffffffu - PaddingFrames &&
+		          (zone.loop_end == 0 || (zone.loop_start < zone.loop_end && zone.loop_end == zone.frames)) &&
+		          zone.scale > 0.0f;
+
+		for (unsigned c = 0; ok && c < zone.channels; c++)
+		{
+			uint64_t offset = zone.offsets[c];
+			uint64_t bytes = uint64_t(zone.frames + PaddingFrames) * sizeof(int16_t);
+			ok = (offset % DataAlignment) == 0 && offset <= size && bytes <= size - offset;
+		}
+
+		if (!ok)
+		{
+			fprintf(stderr, "Sample bank %s: zone %u is invalid.\n", path, i);
+			return false;
+		}
+
+		for (unsigned note = zone.low_note; note <= zone.high_note; note++)
+		{
+			if (zones_by_note[note])
+			{
+				fprintf(stderr, "Sample bank %s: note %u is mapped twice.\n", path, note);
+				return false;
+			}
+			zones_by_note[note] = &zone;
+		}
+	}
+
+	release_seconds = header.release_seconds > 0.0f ? header.release_seconds : 0.0f;
+	return true;
+}
+
+bool SampleBank::load(const char *path)
+{
+	unmap();
+
+#ifdef _WIN32
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = nullptr;
+		fprintf(stderr, "Failed to open sample bank %s.\n", path);
+		return false;
+	}
+
+	LARGE_INTEGER file_size = {};
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		fprintf(stderr, "Sample bank %s is empty.\n", path);
+		unmap();
+		return false;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view)
+	{
+		fprintf(stderr, "Failed to map sample bank %s.\n", path);
+		unmap();
+		return false;
+	}
+
+	data = static_cast<const uint8_t *>(view);
+	size = size_t(file_size.QuadPart);
+#else
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Failed to open sample bank %s.\n", path);
+		return false;
+	}
+
+	struct stat st = {};
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		fprintf(stderr, "Sample bank %s is empty.\n", path);
+		close(fd);
+		return false;
+	}
+
+	// The mapping keeps the file alive.
+	void *view = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map sample bank %s.\n", path);
+		return false;
+	}
+
+	data = static_cast<const uint8_t *>(view);
+	size = size_t(st.st_size);
+#endif
+
+	if (!validate(path))
+	{
+		unmap();
+		return false;
+	}
+
+	return true;
+}
+
+size_t SampleBank::prefault(unsigned first_note, unsigned num_notes) const
+{
+	const SampleBankZone *done[NumNotes];
+	unsigned num_done = 0;
+	size_t touched = 0;
+	volatile uint8_t sink = 0;
+
+	for (unsigned note = first_note; note < first_note + num_notes && note < NumNotes; note++)
+	{
+		auto *zone = zones_by_note[note];
+		bool seen = !zone;
+		for (unsigned i = 0; !seen && i < num_done; i++)
+			seen = done[i] == zone;
+		if (seen)
+			continue;
+		done[num_done++] = zone;
+
+		for (unsigned c = 0; c < zone->channels; c++)
+		{
+			const uint8_t *begin = data + zone->offsets[c];
+			size_t bytes = size_t(zone->frames + PaddingFrames) * sizeof(int16_t);
+
+#ifndef _WIN32
+			// Lets the kernel read ahead in large chunks before the loop below faults page by page.
+			auto page_mask = uintptr_t(sysconf(_SC_PAGESIZE)) - 1;
+			auto *page = reinterpret_cast<uint8_t *>(reinterpret_cast<uintptr_t>(begin) & ~page_mask);
+			madvise(page, bytes + size_t(begin - page), MADV_WILLNEED);
+#endif
+
+			for (size_t offset = 0; offset < bytes; offset += PrefaultStride)
+				sink = sink + begin[offset];
+			sink = sink + begin[bytes - 1];
+			touched += bytes;
+		}
+	}
+
+	(void)sink;
+	return touched;
+}
+
+static size_t align_offset(size_t offset)
+{
+	return (offset + SampleBank::DataAlignment - 1) & ~size_t(SampleBank::DataAlignment - 1);
+}
+
+// Splits a line into whitespace separated tokens, double quotes group a token with spaces.
+static std::vector<std::string> tokenize(const char *line)
+{
+	std::vector<std::string> tokens;
+	while (*line)
+	{
+		while (*line == ' ' || *line == '\t' || *line == '\r' || *line == '\n')
+			line++;
+		if (!*line || *line == '#')
+			break;
+
+		std::string token;
+		if (*line == '"')
+		{
+			line++;
+			while (*line && *line != '"')
+				token += *line++;
+			if (*line == '"')
+				line++;
+		}
+		else
+		{
+			while (*line && *line != ' ' && *line != '\t' && *line != '\r' && *line != '\n')
+				token += *line++;
+		}
+		tokens.push_back(std::move(token));
+	}
+	return tokens;
+}
+
+static bool parse_uint(const std::string &str, unsigned &value)
+{
+	char *end = nullptr;
+	unsigned long v = strtoul(str.c_str(), &end, 0);
+	if (str.empty() || *end != '\0' || v > 0xffffffffu)
+		return false;
+	value = unsigned(v);
+	return true;
+}
+
+static std::string resolve_path(const char *mapping_path, const std::string &path)
+{
+	bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+	if (absolute)
+		return path;
+
+	std::string base = mapping_path;
+	auto slash = base.find_last_of("/\\");
+	return slash == std::string::npos ? path : base.substr(0, slash + 1) + path;
+}
+
+static bool write_zone_samples(FILE *file, SampleBankZone &zone, const std::vector<float> &samples,
+                               unsigned channels, size_t &cursor)
+{
+	float peak = 0.0f;
+	for (size_t i = 0; i < size_t(zone.frames) * channels; i++)
+		peak = std::max(peak, fabsf(samples[i]));
+	zone.scale = peak > 0.0f ? peak / 32767.0f : 1.0f / 32767.0f;
+	float inv_scale = 1.0f / zone.scale;
+
+	std::vector<int16_t> data;
+	for (unsigned c = 0; c < channels; c++)
+	{
+		data.assign(align_offset((zone.frames + SampleBank::PaddingFrames) * sizeof(int16_t)) / sizeof(int16_t), 0);
+		for (uint32_t i = 0; i < zone.frames; i++)
+		{
+			long v = lrintf(samples[size_t(i) * channels + c] * inv_scale);
+			data[i] = int16_t(std::max(-32768l, std::min(32767l, v)));
+		}
+
+		// Interpolating across the loop end reads from the loop start.
+		if (zone.loop_end)
+			for (unsigned k = 0; k < SampleBank::PaddingFrames; k++)
+				data[zone.frames + k] = data[zone.loop_start + k % (zone.loop_end - zone.loop_start)];
+
+		zone.offsets[c] = cursor;
+		if (fwrite(data.data(), sizeof(int16_t), data.size(), file) != data.size())
+			return false;
+		cursor += data.size() * sizeof(int16_t);
+	}
+
+	if (channels == 1)
+		zone.offsets[1] = zone.offsets[0];
+	return true;
+}
+
+bool SampleBank::pack(const char *mapping_path, const char *output_path)
+{
+	FILE *mapping = fopen(mapping_path, "r");
+	if (!mapping)
+	{
+		fprintf(stderr, "Failed to open mapping file %s.\n", mapping_path);
+		return false;
+	}
+
+	SampleBankHeader header = {};
+	memcpy(header.magic, magic, sizeof(magic));
+	header.version = Version;
+
+	struct Entry
+	{
+		std::string path;
+		SampleBankZone zone;
+	};
+	std::vector<Entry> entries;
+	bool mapped[NumNotes] = {};
+
+	char line[4096];
+	unsigned line_number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), mapping))
+	{
+		line_number++;
+		auto tokens = tokenize(line);
+		if (tokens.empty())
+			continue;
+
+		if (tokens[0] == "release")
+		{
+			header.release_seconds = tokens.size() == 2 ? strtof(tokens[1].c_str(), nullptr) : -1.0f;
+			ok = header.release_seconds >= 0.0f;
+		}
+		else
+		{
+			Entry entry = {};
+			entry.path = resolve_path(mapping_path, tokens[0]);
+			unsigned root = 0, low = 0, high = 0, loop_start = 0, loop_end = 0;
+			ok = (tokens.size() == 4 || (tokens.size() == 7 && tokens[4] == "loop")) &&
+			     parse_uint(tokens[1], root) && parse_uint(tokens[2], low) && parse_uint(tokens[3], high) &&
+			     root < NumNotes && low <= high && high < NumNotes;
+			if (ok && tokens.size() == 7)
+				ok = parse_uint(tokens[5], loop_start) && parse_uint(tokens[6], loop_end) && loop_start < loop_end;
+
+			for (unsigned note = low; ok && note <= high; note++)
+			{
+				if (mapped[note])
+				{
+					fprintf(stderr, "%s:%u: note %u is already mapped.\n", mapping_path, line_number, note);
+					ok = false;
+				}
+				mapped[note] = true;
+			}
+
+			entry.zone.root_note = uint8_t(root);
+			entry.zone.low_note = uint8_t(low);
+			entry.zone.high_note = uint8_t(high);
+			entry.zone.loop_start = loop_start;
+			entry.zone.loop_end = loop_end;
+			entries.push_back(std::move(entry));
+		}
+
+		if (!ok)
+			fprintf(stderr, "%s:%u: invalid line.\n", mapping_path, line_number);
+	}
+	fclose(mapping);
+
+	if (!ok)
+		return false;
+	if (entries.empty())
+	{
+		fprintf(stderr, "%s maps no samples.\n", mapping_path);
+		return false;
+	}
+
+	FILE *file = fopen(output_path, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open %s for writing.\n", output_path);
+		return false;
+	}
+
+	// The zone table is written again at the end, once the offsets are known.
+	header.num_zones = uint32_t(entries.size());
+	size_t table_size = sizeof(header) + entries.size() * sizeof(SampleBankZone);
+	size_t cursor = align_offset(table_size);
+	std::vector<uint8_t> prologue(cursor);
+	ok = fwrite(prologue.data(), 1, prologue.size(), file) == prologue.size();
+
+	std::vector<float> samples;
+	for (auto &entry : entries)
+	{
+		if (!ok)
+			break;
+
+		auto &zone = entry.zone;
+		unsigned sample_rate = 0, channels = 0;
+		if (!load_wav(entry.path.c_str(), samples, sample_rate, channels))
+		{
+			ok = false;
+			break;
+		}
+
+		size_t frames = channels ? samples.size() / channels : 0;
+		if (channels < 1 || channels > 2 || frames == 0 || frames >= 0x7fffffffu - PaddingFrames ||
+		    zone.loop_end > frames)
+		{
+			fprintf(stderr, "%s: needs a mono or stereo sample which contains the loop.\n", entry.path.c_str());
+			ok = false;
+			break;
+		}
+
+		// Nothing after the loop is ever played.
+		zone.frames = zone.loop_end ? zone.loop_end : uint32_t(frames);
+		zone.channels = uint8_t(channels);
+		zone.sample_rate = sample_rate;
+		ok = write_zone_samples(file, zone, samples, channels, cursor);
+	}
+
+	if (ok)
+	{
+		ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+		for (auto &entry : entries)
+			ok = ok && fwrite(&entry.zone, sizeof(entry.zone), 1, file) == 1;
+	}
+
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write sample bank %s.\n", output_path);
+		remove(output_path);
+		return false;
+	}
+
+	fprintf(stderr, "Packed %u zones into %s, %.1f MiB.\n", header.num_zones, output_path,
+	        double(cursor) / (1024.0 * 1024.0));
+	return true;
+}
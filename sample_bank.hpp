@@ -0,0 +1,126 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Multisampled instrument packed into one file by sussybard-pack-bank.
+// The file is memory mapped and played in place: nothing is decoded or copied at load time,
+// so loading costs the same for any bank size, and every running instance shares the same pages.
+//
+// Layout, little endian: a SampleBankHeader, num_zones SampleBankZones, then 16-bit sample data.
+// Every channel starts on a cache line and is followed by at least SampleBank::PaddingFrames frames,
+// so that interpolation can read one frame past the last one played. Looped zones end at the loop end,
+// and their padding repeats the loop start.
+struct SampleBankHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_zones;
+	float release_seconds;
+	uint32_t reserved[3];
+};
+
+struct SampleBankZone
+{
+	// Notes [low_note, high_note] play this zone, transposed from root_note.
+	uint8_t low_note;
+	uint8_t high_note;
+	uint8_t root_note;
+	uint8_t channels;
+	uint32_t sample_rate;
+	uint32_t frames;
+	// loop_end is 0 for one shots, and equal to frames otherwise.
+	uint32_t loop_start;
+	uint32_t loop_end;
+	// Converts samples to float.
+	float scale;
+	// Byte offsets from the start of the file. Mono zones use the same data for both.
+	uint64_t offsets[2];
+};
+
+class SampleBank
+{
+public:
+	enum { Version = 1, PaddingFrames = 2, DataAlignment = 64, NumNotes = 128 };
+	static const char magic[8];
+
+	SampleBank() = default;
+	~SampleBank();
+	SampleBank(const SampleBank &) = delete;
+	void operator=(const SampleBank &) = delete;
+
+	// Maps the file and validates the zone table. The sample data isn't touched.
+	bool load(const char *path);
+
+	// Builds a bank from a mapping file, with one zone per line and WAV paths relative to the mapping file:
+	//
+	// # Seconds from the note off to silence.
+	// release 0.3
+	// # <WAV file> <root note> <lowest note> <highest note> [loop <first frame> <end frame>]
+	// harp_c3.wav 48 36 59
+	// "harp c5.wav" 72 60 96 loop 12000 40000
+	//
+	// Samples are normalized per zone and stored as 16-bit. Zones without a loop play once.
+	static bool pack(const char *mapping_path, const char *output_path);
+
+	// Returns nullptr if no zone covers the note.
+	const SampleBankZone *find_zone(unsigned note) const noexcept
+	{
+		return note < NumNotes ? zones_by_note[note] : nullptr;
+	}
+
+	const int16_t *get_samples(const SampleBankZone &zone, unsigned channel) const noexcept
+	{
+		return reinterpret_cast<const int16_t *>(data + zone.offsets[channel < zone.channels ? channel : 0]);
+	}
+
+	float get_release_seconds() const noexcept
+	{
+		return release_seconds;
+	}
+
+	size_t get_size_bytes() const noexcept
+	{
+		return size;
+	}
+
+	// Faults in the sample data of every zone which plays a note in [first_note, first_note + num_notes),
+	// so that the audio thread doesn't wait for the disk the first time one plays. Returns the bytes touched.
+	size_t prefault(unsigned first_note, unsigned num_notes) const;
+
+private:
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+	float release_seconds = 0.0f;
+	const SampleBankZone *zones_by_note[NumNotes] = {};
+
+#ifdef _WIN32
+	void *file = nullptr;
+	void *mapping = nullptr;
+#endif
+
+	void unmap();
+	bool validate(const char *path);
+};
@@ -31,14 +31,17 @@
 #if !defined(__SSE__)
 #define __SSE__ 1
 #endif
-#if defined(_INCLUDED_IMM) && !defined(__AVX__)
-#define __AVX__ 1
+#if !defined(__SSE2__) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define __SSE2__ 1
 #endif
+// MSVC defines __AVX__, __AVX2__ and __AVX512F__ itself based on /arch, don't infer them from intrin.h.
 
 #elif defined(__AVX__)
 #include <immintrin.h>
 #elif defined(__SSE3__)
 #include <pmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
 #elif defined(__SSE__)
 #include <xmmintrin.h>
 #elif defined(__ARM_NEON)
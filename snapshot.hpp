@@ -0,0 +1,71 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+namespace Util
+{
+// Lock-free snapshot handoff from one writer thread to one reader thread.
+// The writer fills write_slot() and publishes it, the reader picks up the latest
+// published value whenever it is ready. Neither side ever waits or allocates.
+// Three slots, so that the writer can publish again while the reader still
+// holds on to the previous snapshot.
+template <typename T>
+class Snapshot
+{
+public:
+	void operator=(const Snapshot &) = delete;
+
+	// Writer only.
+	T &write_slot() noexcept
+	{
+		return slots[write_index];
+	}
+
+	// Writer only. Hands write_slot() over to the reader.
+	void publish() noexcept
+	{
+		write_index = middle.exchange(write_index | DirtyBit, std::memory_order_acq_rel) & IndexMask;
+	}
+
+	// Reader only. Returns the newest published value, or nullptr if nothing
+	// was published since the last call. The value stays valid until the next acquire().
+	const T *acquire() noexcept
+	{
+		if ((middle.load(std::memory_order_relaxed) & DirtyBit) == 0)
+			return nullptr;
+
+		read_index = middle.exchange(read_index, std::memory_order_acq_rel) & IndexMask;
+		return &slots[read_index];
+	}
+
+private:
+	enum { IndexMask = 3, DirtyBit = 4 };
+	T slots[3];
+	std::atomic<uint32_t> middle{1};
+	uint32_t write_index = 0;
+	uint32_t read_index = 2;
+};
+}
@@ -24,15 +24,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
 #include <memory>
 #include <vector>
 #include <string>
 #include <utility>
 #include <algorithm>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include "synth.hpp"
+#include "audio_graph.hpp"
+#include "audio_nodes.hpp"
 #include "cli_parser.hpp"
 #include "midi_source_udp.hpp"
 #include "udp_sink.hpp"
+#include "audio_null.hpp"
+#include "timer.hpp"
+#include "dsp.hpp"
+#include "preset.hpp"
+#include "resampler.hpp"
+#include "load_monitor.hpp"
+#include "realtime.hpp"
+#include "wav.hpp"
+#include "sample_bank.hpp"
 
 #ifdef _WIN32
 #include "midi_source_win32.hpp"
@@ -42,6 +58,11 @@
 #include "midi_source_alsa.hpp"
 #include "key_sink_xcb.hpp"
 #include "audio_pulse.hpp"
+#include "audio_alsa.hpp"
+#include <signal.h>
+#ifdef SUSSYBARD_HAVE_PIPEWIRE
+#include "audio_pipewire.hpp"
+#endif
 #endif
 
 // 3 octave range for Bard.
@@ -72,6 +93,17 @@ static std::vector<uint32_t> initialize_bind_table(const KeySink *key)
 	return code_table;
 }
 
+static Util::RealtimeOptions default_realtime_options()
+{
+	Util::RealtimeOptions options;
+	// Key presses should preempt rendering, they only take microseconds.
+	options.priority[int(Util::ThreadRole::Input)] = 20;
+	options.priority[int(Util::ThreadRole::Audio)] = 19;
+	options.priority[int(Util::ThreadRole::Render)] = 19;
+	options.flush_denormals = true;
+	return options;
+}
+
 struct Arguments
 {
 	std::string client;
@@ -87,8 +119,73 @@ struct Arguments
 	int synth_transpose_udp = 0;
 	int base_key_udp = 72;
 	int num_active_octaves_udp = 3;
+
+	std::string audio_backend;
+	NullAudio::Options null_audio;
+#ifndef _WIN32
+	Pulse::Options pulse;
+	ALSAAudio::Options alsa;
+#endif
+#ifdef SUSSYBARD_HAVE_PIPEWIRE
+	PipeWireAudio::Options pipewire;
+#endif
+	std::string simd_level;
+	unsigned voices_per_split = 8;
+	unsigned render_threads = 0;
+	bool limiter = true;
+	Limiter::Options limiter_options;
+	std::string impulse_response;
+	Convolver::Options convolver_options;
+	float output_gain_db = 0.0f;
+	std::string record_path;
+	float internal_rate = 0.0f;
+	double stats_interval = 0.0;
+	Util::RealtimeOptions realtime = default_realtime_options();
+	bool lock_memory = false;
+	Resampler::Quality resampler_quality = Resampler::Quality::Medium;
+	std::string preset_bank;
+	std::vector<std::string> split_presets;
+	std::vector<Synth::Engine> split_engines;
+	std::string sample_bank;
+
+	struct SplitLevel
+	{
+		float gain_db = 0.0f;
+		float pan = 0.0f;
+	};
+	std::vector<SplitLevel> split_levels;
+
+	SplitLevel &get_split_level(unsigned split)
+	{
+		if (split >= split_levels.size())
+			split_levels.resize(split + 1);
+		return split_levels[split];
+	}
+
+	unsigned num_splits = 2;
+
+	// Overrides the key range and transpose options above, or sets up splits beyond the first two.
+	struct SplitKeys
+	{
+		bool has_range = false;
+		int base_key = 0;
+		int num_active_octaves = 0;
+		bool has_transpose = false;
+		int synth_transpose = 0;
+	};
+	std::vector<SplitKeys> split_keys;
+
+	SplitKeys &get_split_keys(unsigned split)
+	{
+		if (split >= split_keys.size())
+			split_keys.resize(split + 1);
+		return split_keys[split];
+	}
 };
 
+// Split 0 drives the key sink, split 1 is sent to the UDP sink. Any others are only heard locally.
+enum { LocalSplit = 0, RemoteSplit = 1 };
+
 static std::unique_ptr<MIDISource> create_midi_source(const Arguments &args)
 {
 	std::unique_ptr<MIDISource> source;
@@ -111,6 +208,46 @@ static std::unique_ptr<MIDISource> create_midi_source(const Arguments &args)
 	return source;
 }
 
+static std::unique_ptr<AudioBackend> create_audio_backend(const Arguments &args, BackendCallback *callback)
+{
+	std::unique_ptr<AudioBackend> backend;
+
+	if (args.audio_backend == "null")
+	{
+		backend = std::make_unique<NullAudio>(callback, args.null_audio);
+	}
+#ifndef _WIN32
+	else if (args.audio_backend == "alsa")
+	{
+		backend = std::make_unique<ALSAAudio>(callback, args.alsa);
+	}
+#endif
+#ifdef SUSSYBARD_HAVE_PIPEWIRE
+	else if (args.audio_backend == "pipewire")
+	{
+		backend = std::make_unique<PipeWireAudio>(callback, args.pipewire);
+	}
+#endif
+	else if (args.audio_backend.empty() || args.audio_backend == "default")
+	{
+#ifdef _WIN32
+		backend = std::make_unique<WASAPI>(callback);
+#else
+		backend = std::make_unique<Pulse>(callback, args.pulse);
+#endif
+	}
+	else
+	{
+		fprintf(stderr, "Unknown audio backend: %s.\n", args.audio_backend.c_str());
+		return {};
+	}
+
+	if (!backend->init(48000.0f, 2))
+		return {};
+
+	return backend;
+}
+
 static void print_help()
 {
 	fprintf(stderr, "sussybard\n"
@@ -125,6 +262,67 @@ static void print_help()
 	                "\t[--synth-transpose-udp <semitones when playing back UDP mirror> (default = 0)]\n"
 	                "\t[--base-key-udp <MIDI key which maps to lowest C on Bard instrument for UDP coop> (default = 72 / C5)]\n"
 	                "\t[--active-octaves-udp <Number of octaves which trigger keys remotely> (default = 3, max = 3)]\n"
+	                "\t[--splits <number of splits, 0 = local, 1 = UDP, others only monitored> (default = 2, max = 16)]\n"
+	                "\t[--split-range <split index> <lowest MIDI key> <octaves, max = 3> (default = --base-key / --active-octaves for split 0, the UDP options for split 1, silent for others)]\n"
+	                "\t[--split-transpose <split index> <semitones> (default = --synth-transpose for split 0, --synth-transpose-udp for split 1, 0 for others)]\n"
+	                "\t[--split-gain <split index, 0 = local, 1 = UDP> <gain in dB> (default = 0)]\n"
+	                "\t[--split-pan <split index> <balance in [-1, 1]> (default = 0)]\n"
+	                "\t[--preset-bank <path to preset file, MIDI program changes select presets for the local split>]\n"
+	                "\t[--split-preset <split index> <preset name from --preset-bank>]\n"
+	                "\t[--split-engine <split index> <fm|fm-native|wavetable|sample-bank> (default = fm, fm-native renders voices in SIMD lanes, wavetable pre-renders the split preset, sample-bank plays --sample-bank)]\n"
+	                "\t[--sample-bank <bank packed by sussybard-pack-bank, memory mapped and shared by sample-bank splits>]\n"
+	                "\t[--voices-per-split <voice budget of each split> (default = 8)]\n"
+	                "\t[--render-threads <worker threads rendering splits in parallel> (default = 0, render on the audio thread)]\n"
+	                "\t[--no-limiter (output the raw mix, without true peak limiting)]\n"
+	                "\t[--limiter-ceiling-db <highest true peak level in dBFS> (default = -1)]\n"
+	                "\t[--limiter-lookahead-ms <lookahead, adds latency, at most 2> (default = 0.5)]\n"
+	                "\t[--limiter-release-ms <gain recovery time constant> (default = 50)]\n"
+	                "\t[--impulse-response <mono or stereo WAV file the output is convolved with, e.g. an instrument body or room>]\n"
+	                "\t[--impulse-response-mix <wet amount, 0 = dry, 1 = only the convolved signal> (default = 1)]\n"
+	                "\t[--impulse-response-partition <FFT partition and direct head length in frames, power of two> (default = 512)]\n"
+	                "\t[--output-gain-db <gain on the mix, ahead of the limiter> (default = 0)]\n"
+	                "\t[--record <WAV file the final output is written to, at the internal rate>]\n"
+	                "\t[--rt-priority <audio|render|input> <realtime priority, 0 = normal> (default = 19 / 19 / 20)]\n"
+	                "\t[--rt-core <audio|render|input> <first core for the role, -1 = any> (default = any, render = 1)]\n"
+#ifndef _WIN32
+	                "\t[--no-rtkit (don't ask rtkit for realtime priority when unprivileged)]\n"
+	                "\t[--lock-memory (mlockall() so the audio path never page faults, check RLIMIT_MEMLOCK)]\n"
+#endif
+	                "\t[--no-flush-denormals (keep denormal arithmetic on audio and render threads)]\n"
+	                "\t[--simd-level <auto|scalar|sse3|avx2|avx512|neon> (default = auto, or SUSSYBARD_SIMD env)]\n"
+	                "\t[--internal-rate <Hz the synth renders at, resampled to the device rate> (default = 0, render at the device rate)]\n"
+	                "\t[--resampler-quality <low|medium|high> (default = medium)]\n"
+#ifdef _WIN32
+	                "\t[--audio-backend <default|null> (default = default)]\n"
+#else
+	                "\t[--audio-backend <default|alsa|null> (default = default, which is PulseAudio)]\n"
+	                "\t[--pulse-min-latency-ms <lowest adaptive target latency> (default = 5)]\n"
+	                "\t[--pulse-max-latency-ms <highest adaptive target latency> (default = 100)]\n"
+	                "\t[--pulse-block-frames <frames per synth call> (default = 0 / whatever the server requests)]\n"
+	                "\t[--pulse-whole-blocks (render whole blocks only, carrying a partial block over to the next write)]\n"
+	                "\t[--pulse-idle-seconds <silence before the stream is corked, 0 = never> (default = 10)]\n"
+	                "\t[--alsa-device <ALSA PCM name, e.g. hw:0, or null for testing> (default = default)]\n"
+	                "\t[--alsa-period-frames <frames> (default = 128)]\n"
+	                "\t[--alsa-periods <periods in the ring buffer> (default = 3)]\n"
+#endif
+#ifdef SUSSYBARD_HAVE_PIPEWIRE
+	                "\t[--audio-backend pipewire (native PipeWire stream)]\n"
+	                "\t[--pipewire-target <node name to connect to, e.g. a null sink> (default = default sink)]\n"
+	                "\t[--pipewire-quantum <requested graph quantum in frames> (default = 128)]\n"
+#endif
+#ifdef _WIN32
+	                "\t[--stats-interval <seconds between audio load and xrun summaries> (default = 0 / never)]\n"
+#else
+	                "\t[--stats-interval <seconds between audio load and xrun summaries> (default = 0 / only on SIGUSR1)]\n"
+#endif
+	                "\t[--null-freerun (render as fast as possible instead of pacing to wall time)]\n"
+	                "\t[--null-block-frames <frames> (default = 256)]\n"
+	                "\t[--null-duration <seconds of audio to render> (default = 0 / unbounded)]\n"
+	                "\t[--null-wav <path to WAV file receiving the output of the null backend>]\n"
+#ifndef _WIN32
+	                "\t[--sample-format <f32|s16|s24_32|s32> (default = f32)]\n"
+	                "\t[--no-dither (disable TPDF dither when converting to integer formats)]\n"
+#endif
 	                "\t[--help]\n");
 }
 
@@ -144,6 +342,128 @@ int main(int argc, char **argv)
 	cbs.add("--base-key-udp", [&](Util::CLIParser &parser) { args.base_key_udp = parser.next_int(); });
 	cbs.add("--active-octaves-udp", [&](Util::CLIParser &parser) { args.num_active_octaves_udp = parser.next_int(); });
 	cbs.add("--synth-transpose-udp", [&](Util::CLIParser &parser) { args.synth_transpose_udp = parser.next_int(); });
+	cbs.add("--splits", [&](Util::CLIParser &parser) { args.num_splits = parser.next_uint(); });
+	cbs.add("--split-range", [&](Util::CLIParser &parser) {
+		auto &keys = args.get_split_keys(parser.next_uint());
+		keys.has_range = true;
+		keys.base_key = parser.next_int();
+		keys.num_active_octaves = parser.next_int();
+	});
+	cbs.add("--split-transpose", [&](Util::CLIParser &parser) {
+		auto &keys = args.get_split_keys(parser.next_uint());
+		keys.has_transpose = true;
+		keys.synth_transpose = parser.next_int();
+	});
+	cbs.add("--split-gain", [&](Util::CLIParser &parser) {
+		unsigned split = parser.next_uint();
+		args.get_split_level(split).gain_db = float(parser.next_double());
+	});
+	cbs.add("--split-pan", [&](Util::CLIParser &parser) {
+		unsigned split = parser.next_uint();
+		args.get_split_level(split).pan = float(parser.next_double());
+	});
+	cbs.add("--preset-bank", [&](Util::CLIParser &parser) { args.preset_bank = parser.next_string(); });
+	cbs.add("--split-preset", [&](Util::CLIParser &parser) {
+		unsigned split = parser.next_uint();
+		if (split >= args.split_presets.size())
+			args.split_presets.resize(split + 1);
+		args.split_presets[split] = parser.next_string();
+	});
+	cbs.add("--split-engine", [&](Util::CLIParser &parser) {
+		unsigned split = parser.next_uint();
+		if (split >= args.split_engines.size())
+			args.split_engines.resize(split + 1, Synth::Engine::FM);
+
+		std::string engine = parser.next_string();
+		if (engine == "fm")
+			args.split_engines[split] = Synth::Engine::FM;
+		else if (engine == "fm-native")
+			args.split_engines[split] = Synth::Engine::NativeFM;
+		else if (engine == "wavetable")
+			args.split_engines[split] = Synth::Engine::Wavetable;
+		else if (engine == "sample-bank")
+			args.split_engines[split] = Synth::Engine::SampleBank;
+		else
+			throw std::invalid_argument("Unknown synth engine");
+	});
+	cbs.add("--sample-bank", [&](Util::CLIParser &parser) { args.sample_bank = parser.next_string(); });
+	cbs.add("--voices-per-split", [&](Util::CLIParser &parser) { args.voices_per_split = parser.next_uint(); });
+	cbs.add("--render-threads", [&](Util::CLIParser &parser) { args.render_threads = parser.next_uint(); });
+	cbs.add("--no-limiter", [&](Util::CLIParser &) { args.limiter = false; });
+	cbs.add("--limiter-ceiling-db", [&](Util::CLIParser &parser) {
+		args.limiter_options.ceiling_db = float(parser.next_double());
+	});
+	cbs.add("--limiter-lookahead-ms", [&](Util::CLIParser &parser) {
+		args.limiter_options.lookahead_ms = float(parser.next_double());
+		if (args.limiter_options.lookahead_ms < 0.0f || args.limiter_options.lookahead_ms > Limiter::MaxLookaheadMs)
+			throw std::invalid_argument("Limiter lookahead out of range");
+	});
+	cbs.add("--limiter-release-ms", [&](Util::CLIParser &parser) {
+		args.limiter_options.release_ms = float(parser.next_double());
+		if (args.limiter_options.release_ms <= 0.0f)
+			throw std::invalid_argument("Limiter release must be positive");
+	});
+	cbs.add("--impulse-response", [&](Util::CLIParser &parser) { args.impulse_response = parser.next_string(); });
+	cbs.add("--impulse-response-mix", [&](Util::CLIParser &parser) {
+		args.convolver_options.mix = float(parser.next_double());
+		if (args.convolver_options.mix < 0.0f || args.convolver_options.mix > 1.0f)
+			throw std::invalid_argument("Impulse response mix out of range");
+	});
+	cbs.add("--impulse-response-partition", [&](Util::CLIParser &parser) {
+		unsigned frames = parser.next_uint();
+		if (frames < Convolver::MinPartitionFrames || frames > Convolver::MaxPartitionFrames || (frames & (frames - 1)) != 0)
+			throw std::invalid_argument("Impulse response partition must be a power of two from 16 to 4096");
+		args.convolver_options.partition_frames = frames;
+	});
+	cbs.add("--output-gain-db", [&](Util::CLIParser &parser) { args.output_gain_db = float(parser.next_double()); });
+	cbs.add("--record", [&](Util::CLIParser &parser) { args.record_path = parser.next_string(); });
+	cbs.add("--rt-priority", [&](Util::CLIParser &parser) {
+		Util::ThreadRole role;
+		if (!Util::string_to_thread_role(parser.next_string(), role))
+			throw std::invalid_argument("Unknown thread role");
+		args.realtime.priority[int(role)] = parser.next_int();
+	});
+	cbs.add("--rt-core", [&](Util::CLIParser &parser) {
+		Util::ThreadRole role;
+		if (!Util::string_to_thread_role(parser.next_string(), role))
+			throw std::invalid_argument("Unknown thread role");
+		args.realtime.core[int(role)] = parser.next_int();
+	});
+	cbs.add("--no-rtkit", [&](Util::CLIParser &) { args.realtime.use_rtkit = false; });
+	cbs.add("--lock-memory", [&](Util::CLIParser &) { args.lock_memory = true; });
+	cbs.add("--no-flush-denormals", [&](Util::CLIParser &) { args.realtime.flush_denormals = false; });
+	cbs.add("--simd-level", [&](Util::CLIParser &parser) { args.simd_level = parser.next_string(); });
+	cbs.add("--internal-rate", [&](Util::CLIParser &parser) { args.internal_rate = float(parser.next_double()); });
+	cbs.add("--resampler-quality", [&](Util::CLIParser &parser) {
+		if (!Resampler::string_to_quality(parser.next_string(), args.resampler_quality))
+			throw std::invalid_argument("Unknown resampler quality");
+	});
+	cbs.add("--stats-interval", [&](Util::CLIParser &parser) { args.stats_interval = parser.next_double(); });
+	cbs.add("--audio-backend", [&](Util::CLIParser &parser) { args.audio_backend = parser.next_string(); });
+	cbs.add("--null-freerun", [&](Util::CLIParser &) { args.null_audio.realtime = false; });
+	cbs.add("--null-block-frames", [&](Util::CLIParser &parser) { args.null_audio.block_frames = parser.next_uint(); });
+	cbs.add("--null-duration", [&](Util::CLIParser &parser) { args.null_audio.duration = parser.next_double(); });
+	cbs.add("--null-wav", [&](Util::CLIParser &parser) { args.null_audio.wav_path = parser.next_string(); });
+#ifndef _WIN32
+	cbs.add("--sample-format", [&](Util::CLIParser &parser) {
+		if (!DSP::string_to_sample_format(parser.next_string(), args.pulse.format))
+			throw std::invalid_argument("Unknown sample format");
+		args.alsa.format = args.pulse.format;
+	});
+	cbs.add("--no-dither", [&](Util::CLIParser &) { args.pulse.dither = false; args.alsa.dither = false; });
+	cbs.add("--pulse-min-latency-ms", [&](Util::CLIParser &parser) { args.pulse.min_latency_ms = parser.next_double(); });
+	cbs.add("--pulse-max-latency-ms", [&](Util::CLIParser &parser) { args.pulse.max_latency_ms = parser.next_double(); });
+	cbs.add("--pulse-block-frames", [&](Util::CLIParser &parser) { args.pulse.block_frames = parser.next_uint(); });
+	cbs.add("--pulse-whole-blocks", [&](Util::CLIParser &) { args.pulse.whole_blocks = true; });
+	cbs.add("--pulse-idle-seconds", [&](Util::CLIParser &parser) { args.pulse.idle_seconds = parser.next_double(); });
+	cbs.add("--alsa-device", [&](Util::CLIParser &parser) { args.alsa.device = parser.next_string(); });
+	cbs.add("--alsa-period-frames", [&](Util::CLIParser &parser) { args.alsa.period_frames = parser.next_uint(); });
+	cbs.add("--alsa-periods", [&](Util::CLIParser &parser) { args.alsa.periods = parser.next_uint(); });
+#endif
+#ifdef SUSSYBARD_HAVE_PIPEWIRE
+	cbs.add("--pipewire-target", [&](Util::CLIParser &parser) { args.pipewire.target = parser.next_string(); });
+	cbs.add("--pipewire-quantum", [&](Util::CLIParser &parser) { args.pipewire.quantum = parser.next_uint(); });
+#endif
 	cbs.add("--help", [&](Util::CLIParser &parser) { parser.end(); });
 
 	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
@@ -158,8 +478,29 @@ int main(int argc, char **argv)
 		return EXIT_SUCCESS;
 	}
 
-	args.num_active_octaves = std::max(std::min(args.num_active_octaves, num_octaves), 0);
-	args.num_active_octaves_udp = std::max(std::min(args.num_active_octaves_udp, num_octaves), 0);
+#ifndef _WIN32
+	// Only the stats thread takes SIGUSR1, with sigtimedwait(). Block it before any other thread is created,
+	// so that it inherits the mask and a signal never interrupts a blocking MIDI read.
+	sigset_t stats_signals;
+	sigemptyset(&stats_signals);
+	sigaddset(&stats_signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &stats_signals, nullptr);
+#endif
+
+	// Threads pick this up as they are created.
+	Util::set_realtime_options(args.realtime);
+
+	DSP::init_simd_level(args.simd_level.empty() ? nullptr : args.simd_level.c_str());
+	fprintf(stderr, "Using %s DSP kernels.\n", DSP::simd_level_to_string(DSP::get_simd_level()));
+
+	size_t highest_split = std::max(std::max(args.split_keys.size(), args.split_levels.size()),
+	                                std::max(args.split_presets.size(), args.split_engines.size()));
+	if (args.num_splits < 1 || args.num_splits > Synth::MaxSplits || highest_split > args.num_splits)
+	{
+		fprintf(stderr, "Split options must be within --splits, which must be between 1 and %u.\n",
+		        unsigned(Synth::MaxSplits));
+		return EXIT_FAILURE;
+	}
 
 	auto source = create_midi_source(args);
 	if (!source)
@@ -184,12 +525,209 @@ int main(int argc, char **argv)
 
 	auto code_table = initialize_bind_table(key.get());
 
+	PresetBank presets;
+	if (!args.preset_bank.empty() && !presets.load(args.preset_bank.c_str()))
+		return EXIT_FAILURE;
+
+	// Mapped, not read. Pages for the keys in use are faulted in once the split ranges are known.
+	SampleBank sample_bank;
+	bool uses_sample_bank = std::find(args.split_engines.begin(), args.split_engines.end(),
+	                                  Synth::Engine::SampleBank) != args.split_engines.end();
+	if (uses_sample_bank)
+	{
+		if (args.sample_bank.empty())
+		{
+			fprintf(stderr, "The sample-bank engine needs --sample-bank.\n");
+			return EXIT_FAILURE;
+		}
+		if (!sample_bank.load(args.sample_bank.c_str()))
+			return EXIT_FAILURE;
+	}
+
 	Synth synth;
-	AudioBackend pulse(&synth);
-	if (!pulse.init(48000.0f, 2))
+	if (uses_sample_bank)
+		synth.set_sample_bank(&sample_bank);
+	synth.set_num_splits(args.num_splits);
+	synth.set_voices_per_split(args.voices_per_split);
+	synth.set_render_threads(args.render_threads);
+	for (size_t i = 0; i < args.split_engines.size(); i++)
+		synth.set_split_engine(unsigned(i), args.split_engines[i]);
+
+	for (size_t i = 0; i < args.split_presets.size(); i++)
+	{
+		if (args.split_presets[i].empty())
+			continue;
+
+		const auto *preset = presets.find(args.split_presets[i].c_str());
+		if (!preset)
+		{
+			fprintf(stderr, "Preset %s not found in preset bank.\n", args.split_presets[i].c_str());
+			return EXIT_FAILURE;
+		}
+		synth.set_split_preset(unsigned(i), *preset);
+	}
+
+	// Splits -> mixer -> [convolver] -> [gain] -> [limiter] -> [recording tap] -> backend.
+	// Nodes and the graph must outlive the backend.
+	MixerNode mixer(args.num_splits);
+	for (size_t i = 0; i < args.split_levels.size(); i++)
+	{
+		auto &level = args.split_levels[i];
+		mixer.set_input_level(unsigned(i), powf(10.0f, level.gain_db / 20.0f), level.pan);
+	}
+
+	ConvolverNode convolver(args.convolver_options);
+	if (!args.impulse_response.empty() && !convolver.load(args.impulse_response.c_str()))
+		return EXIT_FAILURE;
+	GainNode output_gain(powf(10.0f, args.output_gain_db / 20.0f));
+	LimiterNode limiter(args.limiter_options);
+	TapNode recorder(1.0f);
+
+	AudioGraph graph;
+	unsigned synth_node = graph.add_node(&synth);
+	unsigned last_node = graph.add_node(&mixer);
+	for (unsigned i = 0; i < args.num_splits; i++)
+		graph.connect(synth_node, i, last_node, i);
+
+	const auto append_node = [&](AudioNode *node) {
+		unsigned index = graph.add_node(node);
+		graph.connect(last_node, 0, index, 0);
+		last_node = index;
+	};
+
+	if (!args.impulse_response.empty())
+		append_node(&convolver);
+	if (args.output_gain_db != 0.0f)
+		append_node(&output_gain);
+	if (args.limiter)
+		append_node(&limiter);
+	if (!args.record_path.empty())
+		append_node(&recorder);
+
+	if (!graph.set_output(last_node, 0) || !graph.compile())
+		return EXIT_FAILURE;
+
+	std::unique_ptr<Resampler> resampler;
+	BackendCallback *callback = &graph;
+	if (args.internal_rate > 0.0f)
+	{
+		resampler = std::make_unique<Resampler>(&graph, args.internal_rate, args.resampler_quality);
+		callback = resampler.get();
+	}
+
+	LoadMonitor monitor(callback);
+	auto audio = create_audio_backend(args, &monitor);
+	if (!audio)
 		return EXIT_FAILURE;
 
-	pulse.start();
+	const auto dump_stats = [&](bool reset_worst) {
+		LoadMonitor::print_stats(stderr, monitor.get_stats(reset_worst));
+		auto event_stats = synth.get_event_stats();
+		auto voice_stats = synth.get_voice_stats();
+		fprintf(stderr, "  dropped events %llu (queue high water mark %u), stolen voices %llu.\n",
+		        static_cast<unsigned long long>(event_stats.dropped), event_stats.high_water,
+		        static_cast<unsigned long long>(voice_stats.stolen));
+		float limiter_gain = limiter.consume_min_gain();
+		if (limiter_gain < 1.0f)
+			fprintf(stderr, "  limiter reduced gain by up to %.1f dB.\n", -20.0 * log10(double(limiter_gain)));
+
+		// Post-gain levels over the mixer's last meter window, to tell which split is hot.
+		fprintf(stderr, "  split levels (peak / RMS):");
+		for (unsigned i = 0; i < args.num_splits; i++)
+		{
+			float peak, rms;
+			mixer.get_input_meter(i, peak, rms);
+			if (peak > 0.0f)
+				fprintf(stderr, " %u: %.1f / %.1f dBFS", i,
+				        20.0 * log10(double(peak)), 20.0 * log10(double(std::max(rms, 1e-10f))));
+			else
+				fprintf(stderr, " %u: silent", i);
+			fputc(i + 1 < args.num_splits ? ',' : '.', stderr);
+		}
+		fputc('\n', stderr);
+	};
+
+	// Periodic and on-demand summaries, so there's data to look at when someone hears a crackle.
+	std::atomic<bool> stats_dead{false};
+	std::thread stats_thread;
+#ifdef _WIN32
+	if (args.stats_interval > 0.0)
+#endif
+	{
+		stats_thread = std::thread([&]() {
+			int64_t interval_nsecs = int64_t(args.stats_interval * 1e9);
+			int64_t next_dump_nsecs = Util::get_current_time_nsecs() + interval_nsecs;
+
+			while (!stats_dead.load(std::memory_order_relaxed))
+			{
+				bool requested = false;
+#ifdef _WIN32
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+#else
+				// Short timeout, so shutdown doesn't wait for long.
+				timespec timeout = { 0, 100 * 1000 * 1000 };
+				requested = sigtimedwait(&stats_signals, nullptr, &timeout) == SIGUSR1;
+#endif
+
+				if (requested)
+				{
+					dump_stats(false);
+				}
+				else if (interval_nsecs > 0 && Util::get_current_time_nsecs() >= next_dump_nsecs)
+				{
+					dump_stats(true);
+					next_dump_nsecs += interval_nsecs;
+				}
+			}
+		});
+	}
+
+	// Drains the tap off the audio thread. The graph learns its rate when the backend starts.
+	std::atomic<bool> record_dead{false};
+	std::thread record_thread;
+	if (!args.record_path.empty())
+	{
+		record_thread = std::thread([&]() {
+			WAVWriter writer;
+			std::vector<float> frames(2 * 4096);
+			bool opened = false;
+
+			for (;;)
+			{
+				bool dead = record_dead.load(std::memory_order_acquire);
+				if (!opened && recorder.get_sample_rate() > 0.0f)
+				{
+					if (!writer.init(args.record_path.c_str(), unsigned(lrintf(recorder.get_sample_rate())), 2))
+						return;
+					opened = true;
+				}
+
+				size_t count;
+				while (opened && (count = recorder.read(frames.data(), frames.size() / 2)) != 0)
+					writer.write(frames.data(), count);
+
+				if (dead)
+					break;
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			}
+
+			if (recorder.get_dropped_frames())
+			{
+				fprintf(stderr, "Recording dropped %llu frames.\n",
+				        static_cast<unsigned long long>(recorder.get_dropped_frames()));
+			}
+		});
+	}
+
+	// Everything is allocated by now, including the backend's threads.
+	if (args.lock_memory)
+		Util::lock_memory();
+
+	audio->start();
+
+	// After every other thread has been created, so that they don't inherit the input thread's priority.
+	Util::setup_current_thread(Util::ThreadRole::Input);
+
 	MIDISource::NoteEvent ev = {};
 
 	// Simulate the split polyphony we can get per player.
@@ -208,31 +746,76 @@ int main(int argc, char **argv)
 		}
 	};
 
-	MonophonyTracker local;
-	MonophonyTracker remote;
+	std::vector<MonophonyTracker> trackers(args.num_splits);
+	for (unsigned i = 0; i < args.num_splits; i++)
+	{
+		auto &tracker = trackers[i];
+		// Extra splits stay silent until they are given a range.
+		bool has_range = i == LocalSplit || i == RemoteSplit;
+		int octaves = 0;
+
+		if (i == LocalSplit)
+		{
+			tracker.base_key = args.base_key;
+			tracker.synth_transpose = args.synth_transpose;
+			octaves = args.num_active_octaves;
+		}
+		else if (i == RemoteSplit)
+		{
+			tracker.base_key = args.base_key_udp;
+			tracker.synth_transpose = args.synth_transpose_udp;
+			octaves = args.num_active_octaves_udp;
+		}
+
+		if (i < args.split_keys.size())
+		{
+			auto &keys = args.split_keys[i];
+			if (keys.has_range)
+			{
+				tracker.base_key = keys.base_key;
+				octaves = keys.num_active_octaves;
+				has_range = true;
+			}
+			if (keys.has_transpose)
+				tracker.synth_transpose = keys.synth_transpose;
+		}
+
+		if (has_range)
+			tracker.range = std::max(std::min(octaves, num_octaves), 0) * 12 + 1;
+
+		if (tracker.range && i < args.split_engines.size() && args.split_engines[i] == Synth::Engine::SampleBank)
+		{
+			int first_note = std::max(tracker.base_key + tracker.synth_transpose, 0);
+			size_t bytes = sample_bank.prefault(unsigned(first_note), unsigned(tracker.range));
+			fprintf(stderr, "Prefaulted %.1f MiB of samples for split %u.\n", double(bytes) / (1024.0 * 1024.0), i);
+		}
+	}
 
-	local.base_key = args.base_key;
-	local.range = args.num_active_octaves * 12 + 1;
-	local.synth_transpose = args.synth_transpose;
-	remote.base_key = args.base_key_udp;
-	remote.range = args.num_active_octaves_udp * 12 + 1;
-	remote.synth_transpose = args.synth_transpose_udp;
+	// Which splits play each MIDI key.
+	// With a UDP sink, keys in the remote range are only played remotely. Without one, overlapping splits all play.
+	uint32_t split_masks[128] = {};
+	for (int note = 0; note < 128; note++)
+	{
+		for (unsigned i = 0; i < args.num_splits; i++)
+			if (trackers[i].note_is_in_range(note))
+				split_masks[note] |= 1u << i;
 
-	const auto handle_note = [&](const MIDISource::NoteEvent &event,
-	                             MonophonyTracker &tracker, bool is_local) -> bool {
-		if (!tracker.note_is_in_range(event.note))
-			return false;
+		if (udp_sink && (split_masks[note] & (1u << RemoteSplit)))
+			split_masks[note] = 1u << RemoteSplit;
+	}
 
+	const auto handle_note = [&](const MIDISource::NoteEvent &event, int64_t time_nsecs,
+	                             MonophonyTracker &tracker, unsigned split) {
 		int note_offset_local = event.note - tracker.base_key;
 
 		// Ignore weird double taps.
 		if (event.pressed && tracker.pressed_note_offset == note_offset_local)
-			return true;
+			return;
 
 		if (event.pressed)
-			synth.post_note_on(is_local ? 0 : 1, event.note + tracker.synth_transpose);
+			synth.post_note_on(int(split), event.note + tracker.synth_transpose, time_nsecs);
 		else
-			synth.post_note_off(is_local ? 0 : 1, event.note + tracker.synth_transpose);
+			synth.post_note_off(int(split), event.note + tracker.synth_transpose, time_nsecs);
 
 		KeySink::Event key_events[2] = {};
 		unsigned event_count = 0;
@@ -246,7 +829,8 @@ int main(int argc, char **argv)
 			auto &e = key_events[event_count++];
 			e.code = code_table[tracker.pressed_note_offset];
 			e.press = false;
-			synth.post_note_off(is_local ? 0 : 1, tracker.pressed_note_offset + tracker.base_key + tracker.synth_transpose);
+			synth.post_note_off(int(split), tracker.pressed_note_offset + tracker.base_key + tracker.synth_transpose,
+			                    time_nsecs);
 			tracker.pressed_note_offset = -1;
 		}
 
@@ -258,29 +842,75 @@ int main(int argc, char **argv)
 			tracker.pressed_note_offset = note_offset_local;
 		}
 
-		if (is_local && key && event_count)
+		if (split == LocalSplit && key && event_count)
 			key->dispatch(key_events, event_count);
-
-		return true;
 	};
 
 	while (source->wait_next_note_event(ev))
 	{
+		// Timestamp as early as possible so the synth can schedule the note with sample accuracy.
+		auto time_nsecs = Util::get_current_time_nsecs();
+
+		if (ev.program >= 0)
+		{
+			if (presets.size())
+			{
+				auto &preset = presets.get(size_t(ev.program) % presets.size());
+				if (synth.set_split_preset(0, preset))
+					fprintf(stderr, "Local split switched to preset %s.\n", preset.name);
+			}
+			continue;
+		}
+
 		ev.note += args.midi_transpose;
+		if (ev.note < 0 || ev.note >= 128)
+			continue;
 
-		if (remote.note_is_in_range(ev.note) && udp_sink && !udp_sink->send(ev.note, ev.pressed))
+		uint32_t splits = split_masks[ev.note];
+		if ((splits & (1u << RemoteSplit)) && udp_sink && !udp_sink->send(ev.note, ev.pressed))
 			break;
 
-		if (!handle_note(ev, remote, false) || !udp_sink)
-			handle_note(ev, local, true);
+		for (unsigned i = 0; i < args.num_splits; i++)
+			if (splits & (1u << i))
+				handle_note(ev, time_nsecs, trackers[i], i);
+
+		// The events are queued already, a backend which went idle on silence picks them up once it resumes.
+		if (splits)
+			audio->wake();
 	}
 
-	if (key && local.pressed_note_offset >= 0)
+	if (key && trackers[LocalSplit].pressed_note_offset >= 0)
 	{
 		KeySink::Event key_event = {};
-		key_event.code = code_table[local.pressed_note_offset];
+		key_event.code = code_table[trackers[LocalSplit].pressed_note_offset];
 		key->dispatch(&key_event, 1);
 	}
 
-	pulse.stop();
+	stats_dead.store(true, std::memory_order_relaxed);
+	if (stats_thread.joinable())
+		stats_thread.join();
+
+	audio->stop();
+
+	record_dead.store(true, std::memory_order_release);
+	if (record_thread.joinable())
+		record_thread.join();
+
+	auto load_stats = monitor.get_stats(false);
+	if (load_stats.xruns || load_stats.overruns || load_stats.late)
+		LoadMonitor::print_stats(stderr, load_stats);
+
+	auto event_stats = synth.get_event_stats();
+	if (event_stats.dropped)
+	{
+		fprintf(stderr, "Synth dropped %llu events, queue high water mark %u.\n",
+		        static_cast<unsigned long long>(event_stats.dropped), event_stats.high_water);
+	}
+
+	auto voice_stats = synth.get_voice_stats();
+	if (voice_stats.stolen)
+	{
+		fprintf(stderr, "Synth stole %llu voices, consider raising --voices-per-split.\n",
+		        static_cast<unsigned long long>(voice_stats.stolen));
+	}
 }
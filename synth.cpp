@@ -21,118 +21,726 @@
  */
 
 #include "synth.hpp"
+#include "timer.hpp"
+#include "dsp.hpp"
+#include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static_assert(unsigned(Synth::MaxSplits) <= unsigned(DSP::MaxMixInputs), "Every split takes one mixer input.");
+
+// Don't let a broken latency report delay notes indefinitely.
+static constexpr int64_t MaxScheduleDelayNsecs = 200 * 1000 * 1000;
+static constexpr size_t VoiceBufferAlignment = 64;
+// Released voices below this peak level (about -80 dBFS) are inaudible and stop rendering.
+static constexpr float VoiceRetireLevel = 1e-4f;
+// Range of notes pre-rendered for wavetable splits, C1 to C8.
+static constexpr unsigned WavetableFirstNote = 24;
+static constexpr unsigned WavetableNumNotes = 85;
+
+Synth::Synth()
+{
+	for (unsigned i = 0; i < MaxSplits; i++)
+	{
+		default_presets[i] = create_default_preset(i);
+		current_presets[i] = &default_presets[i];
+	}
+}
 
 Synth::~Synth()
 {
-	for (auto *fm : fms)
-		if (fm)
-			fmsynth_free(fm);
+	for (auto &split : voices)
+		for (auto &voice : split)
+			if (voice.fm)
+				fmsynth_free(voice.fm);
+}
+
+void Synth::set_num_splits(unsigned count)
+{
+	num_splits = std::max(1u, std::min(count, unsigned(MaxSplits)));
+}
+
+unsigned Synth::get_num_splits() const noexcept
+{
+	return num_splits;
+}
+
+void Synth::set_split_engine(unsigned split, Engine engine)
+{
+	if (split < MaxSplits)
+		engines[split] = engine;
+}
+
+void Synth::set_sample_bank(const ::SampleBank *bank)
+{
+	sample_bank = bank;
+}
+
+void Synth::set_render_threads(unsigned count)
+{
+	render_threads = count;
+}
+
+void Synth::set_voices_per_split(unsigned count)
+{
+	voices_per_split = std::max(1u, count);
+}
+
+Synth::VoiceStats Synth::get_voice_stats() const noexcept
+{
+	VoiceStats stats = {};
+	stats.stolen = voices_stolen.load(std::memory_order_relaxed);
+	stats.retired = voices_retired.load(std::memory_order_relaxed);
+	return stats;
+}
+
+unsigned Synth::get_num_inputs() const noexcept
+{
+	return 0;
 }
 
-void Synth::set_backend_parameters(float sample_rate, unsigned, size_t)
+unsigned Synth::get_num_outputs() const noexcept
 {
-	for (auto &fm : fms)
-		fm = fmsynth_new(sample_rate, 64);
+	return num_splits;
 }
 
-void Synth::mix_samples(float *const *channels, size_t num_frames) noexcept
+void Synth::prepare(float sample_rate_, size_t max_frames)
 {
-	uint32_t target = atomic_write_count.load(std::memory_order_acquire);
+	sample_rate = sample_rate_;
+	for (unsigned i = 0; i < MaxSplits; i++)
+	{
+		for (auto &voice : voices[i])
+			if (voice.fm)
+				fmsynth_free(voice.fm);
+
+		voices[i].clear();
+		if (i < num_splits)
+			voices[i].resize(voices_per_split);
+	}
+
+	// The audio thread isn't running yet, so pick up presets which were set up front.
+	update_presets();
 
-	for (; read_count < target; read_count++)
+	for (unsigned i = 0; i < num_splits; i++)
 	{
-		uint32_t note = ring[read_count % RingSize];
-		auto *fm = fms[(note >> 16) & (NumSplits - 1)];
-		if (note & 0x80000000u)
-			fmsynth_note_on(fm, uint8_t(note), 255);
+		if (engines[i] == Engine::Wavetable)
+		{
+			auto start_time = Util::get_current_time_nsecs();
+			if (wavetables[i].build(*current_presets[i], sample_rate, WavetableFirstNote, WavetableNumNotes))
+			{
+				// Decay to the retire level over the release time.
+				release_factors[i] = expf(logf(VoiceRetireLevel) /
+				                          (wavetables[i].get_release_seconds() * sample_rate));
+				fprintf(stderr, "Rendered wavetables for split %u (%s) in %.3f s, %.1f MiB.\n",
+				        i, current_presets[i]->name,
+				        1e-9 * double(Util::get_current_time_nsecs() - start_time),
+				        double(wavetables[i].get_size_bytes()) / (1024.0 * 1024.0));
+				continue;
+			}
+
+			fprintf(stderr, "Falling back to FM rendering for split %u.\n", i);
+			engines[i] = Engine::FM;
+		}
+		else if (engines[i] == Engine::SampleBank)
+		{
+			if (sample_bank)
+			{
+				float release_seconds = std::max(sample_bank->get_release_seconds(), 1e-3f);
+				release_factors[i] = expf(logf(VoiceRetireLevel) / (release_seconds * sample_rate));
+				continue;
+			}
+
+			fprintf(stderr, "No sample bank, falling back to FM rendering for split %u.\n", i);
+			engines[i] = Engine::FM;
+		}
+		else if (engines[i] == Engine::NativeFM)
+		{
+			if (FMEngine::supports(*current_presets[i]))
+			{
+				fm_engines[i].init(sample_rate, voices_per_split);
+				fm_engines[i].set_preset(*current_presets[i]);
+				continue;
+			}
+
+			fprintf(stderr, "Preset %s uses more than %u operators, falling back to fmsynth for split %u.\n",
+			        current_presets[i]->name, unsigned(FMEngine::NumOperators), i);
+			engines[i] = Engine::FM;
+		}
+
+		for (auto &voice : voices[i])
+			voice.fm = fmsynth_new(sample_rate, 1);
+	}
+
+	uint32_t native_mask = 0;
+	for (unsigned i = 0; i < num_splits; i++)
+		if (engines[i] == Engine::NativeFM)
+			native_mask |= 1u << i;
+	native_fm_splits.store(native_mask, std::memory_order_release);
+
+	// Keep every channel buffer aligned to a cache line.
+	size_t channel_frames = (max_frames + 15) & ~size_t(15);
+	voice_buffer.reset(static_cast<float *>(
+			Util::memalign_calloc(VoiceBufferAlignment, num_splits * 2 * channel_frames * sizeof(float))));
+
+	for (unsigned i = 0; i < num_splits; i++)
+		for (unsigned c = 0; c < 2; c++)
+			voice_channels[i][c] = voice_buffer.get() + (2 * i + c) * channel_frames;
+
+	if (render_threads != render_pool.get_num_workers())
+	{
+		render_pool.init(render_threads);
+		if (render_pool.get_num_workers())
+			fprintf(stderr, "Rendering splits on %u worker threads.\n", render_pool.get_num_workers());
+	}
+}
+
+void Synth::reset_voice(Voice &voice, unsigned split) noexcept
+{
+	if (voice.fm)
+		apply_preset(voice.fm, *current_presets[split]);
+	voice.needs_reset = false;
+}
+
+bool Synth::set_split_preset(unsigned split, const FMPreset &preset)
+{
+	if (split >= MaxSplits)
+		return false;
+
+	// Before prepare() an unsupported preset just moves the split to fmsynth.
+	// Afterwards that would mean allocating fmsynth voices on the audio thread, so keep the previous preset.
+	if ((native_fm_splits.load(std::memory_order_acquire) & (1u << split)) && !FMEngine::supports(preset))
+	{
+		fprintf(stderr, "Preset %s uses more than %u operators, keeping the previous preset on native FM split %u.\n",
+		        preset.name, unsigned(FMEngine::NumOperators), split);
+		return false;
+	}
+
+	auto &snapshot = preset_snapshots[split];
+	snapshot.write_slot() = preset;
+	snapshot.publish();
+	return true;
+}
+
+void Synth::update_presets() noexcept
+{
+	for (unsigned i = 0; i < num_splits; i++)
+	{
+		const auto *preset = preset_snapshots[i].acquire();
+		if (!preset)
+			continue;
+
+		current_presets[i] = preset;
+		// set_split_preset() filters these once prepared, but one may have slipped in while prepare() ran.
+		// The engine then keeps rendering the previous preset's parameters.
+		if (engines[i] == Engine::NativeFM && FMEngine::supports(*preset))
+			fm_engines[i].set_preset(*preset);
+
+		for (auto &voice : voices[i])
+		{
+			if (!voice.fm)
+				continue;
+
+			if (voice.active)
+				apply_preset_parameters(voice.fm, *preset);
+			voice.needs_reset = true;
+		}
+	}
+}
+
+Synth::Voice *Synth::allocate_voice(unsigned split) noexcept
+{
+	auto &pool = voices[split];
+	Voice *quietest_released = nullptr;
+	Voice *quietest = nullptr;
+
+	for (auto &voice : pool)
+	{
+		if (!voice.fm && engines[split] == Engine::FM)
+			continue;
+
+		if (!voice.active)
+			return &voice;
+
+		if (voice.released && (!quietest_released || voice.level < quietest_released->level))
+			quietest_released = &voice;
+		if (!quietest || voice.level < quietest->level)
+			quietest = &voice;
+	}
+
+	auto *stolen = quietest_released ? quietest_released : quietest;
+	if (stolen)
+	{
+		stolen->active = false;
+		stolen->needs_reset = true;
+		voices_stolen.fetch_add(1, std::memory_order_relaxed);
+	}
+	return stolen;
+}
+
+void Synth::apply_event(uint32_t note) noexcept
+{
+	unsigned split = (note >> 16) & 0x7fff;
+	auto key = uint8_t(note);
+
+	if (note & 0x80000000u)
+	{
+		auto *voice = allocate_voice(split);
+		if (!voice)
+			return;
+
+		if (engines[split] == Engine::Wavetable)
+		{
+			voice->table = wavetables[split].get_note(key);
+			if (!voice->table)
+				return;
+			voice->position = 0;
+			voice->release_gain = 1.0f;
+		}
+		else if (engines[split] == Engine::SampleBank)
+		{
+			if (!start_sample_voice(*voice, key))
+				return;
+		}
+		else if (engines[split] == Engine::NativeFM)
+		{
+			fm_engines[split].note_on(unsigned(voice - voices[split].data()), key, 255);
+		}
 		else
-			fmsynth_note_off(fm, uint8_t(note));
+		{
+			if (voice->needs_reset)
+				reset_voice(*voice, split);
+			fmsynth_note_on(voice->fm, key, 255);
+		}
+
+		voice->note = key;
+		voice->active = true;
+		voice->released = false;
+		voice->level = 1.0f;
+		// Not heard yet, so a release later in the block mustn't retire it on the previous note's peak.
+		voice->block_peak = 1.0f;
+	}
+	else
+	{
+		for (auto &voice : voices[split])
+		{
+			if (voice.active && !voice.released && voice.note == key)
+			{
+				if (voice.fm)
+					fmsynth_note_off(voice.fm, key);
+				else if (engines[split] == Engine::NativeFM)
+					fm_engines[split].note_off(unsigned(&voice - voices[split].data()));
+				voice.released = true;
+			}
+		}
 	}
+}
 
-	memset(channels[0], 0, num_frames * sizeof(float));
-	memset(channels[1], 0, num_frames * sizeof(float));
-	for (auto *fm : fms)
-		fmsynth_render(fm, channels[0], channels[1], num_frames);
+// Adds a rendered voice into its split and returns its peak level.
+static float accumulate_voice(float * __restrict left, float * __restrict right,
+                              const float * __restrict voice_left, const float * __restrict voice_right,
+                              size_t num_frames) noexcept
+{
+	float peak = 0.0f;
+	for (size_t i = 0; i < num_frames; i++)
+	{
+		float l = voice_left[i];
+		float r = voice_right[i];
+		left[i] += l;
+		right[i] += r;
+		peak = std::max(peak, std::max(std::max(l, r), -std::min(l, r)));
+	}
+	return peak;
 }
 
-void Synth::post_note_on(int channel, int note)
+void Synth::render_wavetable_voice(Voice &voice, unsigned split, size_t offset, size_t num_frames) noexcept
 {
-	ring[(write_count++) % RingSize] = note | 0x80000000u | (channel << 16);
-	atomic_write_count.store(write_count, std::memory_order_release);
+	auto *left = split_channels[split][0] + offset;
+	auto *right = split_channels[split][1] + offset;
+	const auto &table = *voice.table;
+	const int16_t *samples = table.samples;
+	uint32_t end = table.attack_frames + table.loop_frames;
+	uint32_t position = voice.position;
+	float gain = voice.release_gain * table.scale;
+	float factor = voice.released ? release_factors[split] : 1.0f;
+	float peak = 0.0f;
+
+	size_t i = 0;
+	while (i < num_frames)
+	{
+		if (position >= end)
+			position -= table.loop_frames;
+
+		// Copy runs up to the loop end without per-sample wrap checks.
+		size_t to_copy = std::min<size_t>(num_frames - i, end - position);
+		for (size_t j = 0; j < to_copy; j++)
+		{
+			float s = float(samples[position + j]) * gain;
+			left[i + j] += s;
+			right[i + j] += s;
+			peak = std::max(peak, std::max(s, -s));
+			gain *= factor;
+		}
+
+		i += to_copy;
+		position += uint32_t(to_copy);
+	}
+
+	voice.position = position;
+	voice.release_gain = gain / table.scale;
+	voice.level = peak;
+	voice.block_peak = std::max(voice.block_peak, peak);
 }
 
-void Synth::post_note_off(int channel, int note)
+bool Synth::start_sample_voice(Voice &voice, unsigned note) noexcept
 {
-	ring[(write_count++) % RingSize] = note | (channel << 16);
-	atomic_write_count.store(write_count, std::memory_order_release);
+	voice.zone = sample_bank->find_zone(note);
+	if (!voice.zone)
+		return false;
+
+	const auto &zone = *voice.zone;
+	double ratio = exp2(double(int(note) - int(zone.root_note)) / 12.0) * double(zone.sample_rate) / double(sample_rate);
+	auto step = std::max<uint64_t>(1, uint64_t(llround(ratio * 4294967296.0)));
+
+	auto &sample = voice.sample;
+	sample = {};
+	sample.left = sample_bank->get_samples(zone, 0);
+	sample.right = sample_bank->get_samples(zone, 1);
+	sample.step_index = uint32_t(step >> 32);
+	sample.step_fraction = uint32_t(step);
+	sample.gain = zone.scale;
+	sample.gain_factor = 1.0f;
+	return true;
 }
 
-void Synth::on_backend_stop()
+void Synth::render_sample_voice(Voice &voice, unsigned split, size_t offset, size_t num_frames) noexcept
 {
+	auto *left = split_channels[split][0] + offset;
+	auto *right = split_channels[split][1] + offset;
+	const auto &zone = *voice.zone;
+	auto &sample = voice.sample;
+	uint64_t step = (uint64_t(sample.step_index) << 32) | sample.step_fraction;
+	sample.gain_factor = voice.released ? release_factors[split] : 1.0f;
+	sample.peak = 0.0f;
+
+	size_t i = 0;
+	while (i < num_frames)
+	{
+		if (sample.index >= zone.frames)
+		{
+			// One shots end with their data.
+			if (!zone.loop_end)
+			{
+				voice.active = false;
+				break;
+			}
+			sample.index = zone.loop_start + (sample.index - zone.loop_start) % (zone.loop_end - zone.loop_start);
+		}
+
+		// Play runs up to the end of the data without per-frame wrap checks.
+		uint64_t position = (uint64_t(sample.index) << 32) | sample.fraction;
+		uint64_t remaining = (uint64_t(zone.frames) << 32) - position;
+		auto to_play = size_t(std::min<uint64_t>(num_frames - i, (remaining + step - 1) / step));
+		DSP::play_samples(left + i, right + i, sample, to_play);
+		i += to_play;
+	}
+
+	voice.level = sample.peak;
+	voice.block_peak = std::max(voice.block_peak, sample.peak);
 }
 
-void Synth::set_latency_usec(uint32_t)
+void Synth::render_native_voices(unsigned split, size_t offset, size_t num_frames) noexcept
 {
+	auto &engine = fm_engines[split];
+	engine.render(split_channels[split][0] + offset, split_channels[split][1] + offset, num_frames);
+
+	auto &pool = voices[split];
+	for (unsigned i = 0; i < pool.size(); i++)
+	{
+		auto &voice = pool[i];
+		if (!voice.active)
+			continue;
+
+		voice.level = engine.get_level(i);
+		voice.block_peak = std::max(voice.block_peak, voice.level);
+		if (!engine.is_active(i))
+			voice.active = false;
+	}
 }
 
-static void setup_fm_parameters(fmsynth_t *fm, int channel)
+void Synth::render(unsigned split, size_t offset, size_t num_frames) noexcept
 {
-	fmsynth_reset(fm);
-	fmsynth_set_global_parameter(fm, FMSYNTH_GLOBAL_PARAM_VOLUME, 0.1f);
+	if (engines[split] == Engine::NativeFM)
+	{
+		render_native_voices(split, offset, num_frames);
+		return;
+	}
+
+	auto *left = voice_channels[split][0];
+	auto *right = voice_channels[split][1];
+
+	for (auto &voice : voices[split])
+	{
+		if (!voice.active)
+			continue;
+
+		if (engines[split] == Engine::Wavetable)
+		{
+			render_wavetable_voice(voice, split, offset, num_frames);
+			continue;
+		}
+		else if (engines[split] == Engine::SampleBank)
+		{
+			render_sample_voice(voice, split, offset, num_frames);
+			continue;
+		}
 
-	float delay_time_mod = channel ? 0.75f : 1.0f;
+		memset(left, 0, num_frames * sizeof(float));
+		memset(right, 0, num_frames * sizeof(float));
+		unsigned active = fmsynth_render(voice.fm, left, right, unsigned(num_frames));
+		voice.level = accumulate_voice(split_channels[split][0] + offset, split_channels[split][1] + offset,
+		                               left, right, num_frames);
+		voice.block_peak = std::max(voice.block_peak, voice.level);
 
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_DELAY0, 0, 0.01f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_DELAY1, 0, delay_time_mod * 1.0f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_DELAY2, 0, delay_time_mod * 1.0f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_RELEASE_TIME, 0, delay_time_mod * 1.5f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENVELOPE_TARGET0, 0, 1.0f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENVELOPE_TARGET1, 0, 0.2f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENVELOPE_TARGET2, 0, 0.03f);
+		// The envelope ran out on its own, the instance is ready for reuse.
+		if (active == 0)
+			voice.active = false;
+	}
+}
 
-	for (unsigned i = 1; i < 2; i++)
+void Synth::retire_voices(unsigned split) noexcept
+{
+	auto &pool = voices[split];
+	for (unsigned i = 0; i < pool.size(); i++)
 	{
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_DELAY0, i, delay_time_mod * 0.005f);
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_DELAY1, i, delay_time_mod * (i == 1 ? 0.25f : 0.23f));
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_DELAY2, i, delay_time_mod * (i == 1 ? 0.25f : 0.15f));
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_RELEASE_TIME, i, delay_time_mod * (i == 1 ? 0.85f : 0.5f));
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENVELOPE_TARGET0, i, 1.0f);
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENVELOPE_TARGET1, i, 0.2f);
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENVELOPE_TARGET2, i, 0.10f);
+		auto &voice = pool[i];
+		if (!voice.active || !voice.released)
+			continue;
+
+		bool quiet = voice.block_peak < VoiceRetireLevel;
+		if (engines[split] == Engine::Wavetable)
+		{
+			if (quiet || voice.release_gain < VoiceRetireLevel)
+				voice.active = false;
+		}
+		else if (engines[split] == Engine::SampleBank)
+		{
+			if (quiet || voice.sample.gain < VoiceRetireLevel * voice.zone->scale)
+				voice.active = false;
+		}
+		else if (quiet)
+		{
+			if (engines[split] == Engine::NativeFM)
+				fm_engines[split].stop(i);
+			else
+				voice.needs_reset = true;
+			voice.active = false;
+			voices_retired.fetch_add(1, std::memory_order_relaxed);
+		}
 	}
+}
+
+void Synth::render_split(unsigned split) noexcept
+{
+	memset(split_channels[split][0], 0, block_frames * sizeof(float));
+	memset(split_channels[split][1], 0, block_frames * sizeof(float));
+
+	for (auto &voice : voices[split])
+		voice.block_peak = 0.0f;
 
-	for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+	bool audible = split_sounding[split];
+	size_t offset = 0;
+	for (unsigned i = 0; i < num_block_events; i++)
 	{
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_ENABLE, i, i < 3 ? 1.0f : 0.0f);
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_CARRIERS, i, i == 0 ? 1.0f : 0.0f);
+		auto &event = block_events[i];
+		if (((event.note >> 16) & 0x7fff) != split)
+			continue;
+
+		if (event.offset > offset)
+		{
+			render(split, offset, event.offset - offset);
+			offset = event.offset;
+		}
+
+		apply_event(event.note);
+		audible = true;
 	}
 
-	if (channel)
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_FREQ_MOD, 1, 2.0f);
+	if (offset < block_frames)
+		render(split, offset, block_frames - offset);
+	retire_voices(split);
+
+	bool sounding = false;
+	for (auto &voice : voices[split])
+		sounding = sounding || voice.active;
+	split_sounding[split] = sounding;
+	split_silent[split] = !audible && !sounding;
+}
+
+void Synth::render_split_task(void *userdata, unsigned split) noexcept
+{
+	static_cast<Synth *>(userdata)->render_split(split);
+}
+
+int64_t Synth::update_block_time(size_t num_frames) noexcept
+{
+	auto current_time = Util::get_current_time_nsecs();
+
+	// Figure out when the first frame of this block will be heard.
+	// Without latency information from the backend, assume it is heard right away.
+	int64_t block_time = current_time;
+	if (has_anchor)
+		block_time = anchor_time_nsecs + int64_t(1e9 * double(int64_t(rendered_frames - anchor_frame)) / sample_rate);
+
+	int64_t block_duration = int64_t(1e9 * double(num_frames) / sample_rate);
+	int64_t delay = block_time + block_duration - current_time;
+
+	// Jump up to the worst case immediately, but recover slowly
+	// so that the delay stays stable and timing doesn't jitter.
+	if (delay > schedule_delay_nsecs)
+		schedule_delay_nsecs = std::min(delay, MaxScheduleDelayNsecs);
 	else
-		fmsynth_set_parameter(fm, FMSYNTH_PARAM_FREQ_MOD, 1, 1.0f);
+		schedule_delay_nsecs -= (schedule_delay_nsecs - delay) >> 10;
 
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_KEYBOARD_SCALING_HIGH_FACTOR, 1, -0.5f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_KEYBOARD_SCALING_LOW_FACTOR, 1, -0.5f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_MOD_TO_CARRIERS0 + 1, 0, 0.8f);
-	fmsynth_set_parameter(fm, FMSYNTH_GLOBAL_PARAM_VOLUME, 1, 1.0f);
+	return block_time;
+}
 
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_FREQ_MOD, 2, 12.00f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_KEYBOARD_SCALING_HIGH_FACTOR, 2, -1.0f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_KEYBOARD_SCALING_LOW_FACTOR, 2, -1.0f);
-	fmsynth_set_parameter(fm, FMSYNTH_PARAM_MOD_TO_CARRIERS0 + 2, 1, 0.5f);
-	fmsynth_set_parameter(fm, FMSYNTH_GLOBAL_PARAM_VOLUME, 2, 0.6f);
+void Synth::skip(size_t num_frames) noexcept
+{
+	update_block_time(num_frames);
+	rendered_frames += num_frames;
 }
 
-void Synth::on_backend_start()
+void Synth::process(const AudioBus * const *, AudioBus * const *outputs, size_t num_frames) noexcept
 {
-	write_count = 0;
-	read_count = 0;
-	atomic_write_count = 0;
-	ring.resize(RingSize);
+	update_presets();
+	int64_t block_time = update_block_time(num_frames);
 
-	for (int i = 0; i < NumSplits; i++)
-		if (fms[i])
-			setup_fm_parameters(fms[i], i);
+	// Other stages are still running, but there is nothing to render here.
+	if (silent && !events.front())
+	{
+		for (unsigned i = 0; i < num_splits; i++)
+		{
+			memset(outputs[i]->channels[0], 0, num_frames * sizeof(float));
+			memset(outputs[i]->channels[1], 0, num_frames * sizeof(float));
+			outputs[i]->silent = true;
+		}
+		rendered_frames += num_frames;
+		return;
+	}
+
+	// Only pull out the events here, the splits apply their own events while rendering.
+	size_t offset = 0;
+	num_block_events = 0;
+	events.update_high_water();
+	while (const auto *event = events.front())
+	{
+		int64_t event_frame = 0;
+		int64_t relative_time = event->time_nsecs + schedule_delay_nsecs - block_time;
+		if (relative_time > 0)
+			event_frame = int64_t(1e-9 * double(relative_time) * sample_rate);
+
+		// Leave it for a later block.
+		if (event_frame >= int64_t(num_frames))
+			break;
+
+		// With multiple producers, timestamps are not strictly ordered.
+		// A late event is clamped to the current position.
+		offset = std::max<size_t>(offset, size_t(event_frame));
+		block_events[num_block_events].offset = uint32_t(offset);
+		block_events[num_block_events].note = event->note;
+		num_block_events++;
+		events.pop();
+
+		// The queue can't hold more than this, but a producer can refill it while we drain.
+		if (num_block_events == RingSize)
+			break;
+	}
+
+	for (unsigned i = 0; i < num_splits; i++)
+		for (unsigned c = 0; c < 2; c++)
+			split_channels[i][c] = outputs[i]->channels[c];
+
+	block_frames = num_frames;
+	render_pool.run(render_split_task, this, num_splits);
+	rendered_frames += num_frames;
+
+	silent = true;
+	for (unsigned i = 0; i < num_splits; i++)
+	{
+		outputs[i]->silent = split_silent[i];
+		silent = silent && !split_sounding[i];
+	}
+}
+
+bool Synth::is_silent() noexcept
+{
+	return silent && !events.front();
+}
+
+void Synth::post_event(uint32_t note, int64_t time_nsecs)
+{
+	Event event = {};
+	event.note = note;
+	event.time_nsecs = time_nsecs;
+	events.push(event);
+}
+
+Util::QueueStats Synth::get_event_stats() const noexcept
+{
+	return events.get_stats();
+}
+
+void Synth::post_note_on(int channel, int note, int64_t time_nsecs)
+{
+	if (unsigned(channel) >= num_splits)
+		return;
+	post_event(note | 0x80000000u | (channel << 16), time_nsecs);
+}
+
+void Synth::post_note_off(int channel, int note, int64_t time_nsecs)
+{
+	if (unsigned(channel) >= num_splits)
+		return;
+	post_event(note | (channel << 16), time_nsecs);
+}
+
+void Synth::post_note_on(int channel, int note)
+{
+	post_note_on(channel, note, Util::get_current_time_nsecs());
+}
+
+void Synth::post_note_off(int channel, int note)
+{
+	post_note_off(channel, note, Util::get_current_time_nsecs());
+}
+
+void Synth::set_latency_usec(uint32_t usec)
+{
+	anchor_frame = rendered_frames;
+	anchor_time_nsecs = Util::get_current_time_nsecs() + int64_t(usec) * 1000;
+	has_anchor = true;
+}
+
+void Synth::on_start()
+{
+	rendered_frames = 0;
+	has_anchor = false;
+	schedule_delay_nsecs = 0;
+	silent = true;
+
+	for (unsigned i = 0; i < num_splits; i++)
+	{
+		if (engines[i] == Engine::NativeFM)
+			fm_engines[i].reset();
+
+		for (auto &voice : voices[i])
+		{
+			voice.active = false;
+			voice.released = false;
+			voice.level = 0.0f;
+			if (voice.fm)
+				reset_voice(voice, i);
+		}
+	}
 }
@@ -27,40 +27,210 @@
 #include <atomic>
 #include <vector>
 #include "fmsynth.h"
+#include "audio_graph.hpp"
+#include "event_queue.hpp"
+#include "aligned_alloc.hpp"
+#include "preset.hpp"
+#include "snapshot.hpp"
+#include "wavetable.hpp"
+#include "fm_engine.hpp"
+#include "sample_bank.hpp"
+#include "dsp.hpp"
+#include "render_pool.hpp"
+#include <memory>
 
-class BackendCallback
+// Source node of the audio graph. Every split renders into its own output,
+// which is flagged silent while none of its voices sound.
+class Synth final : public AudioNode
 {
 public:
-	virtual ~BackendCallback() = default;
-	virtual void mix_samples(float * const *channels, size_t num_frames) noexcept = 0;
+	// Matches the number of inputs a MixerNode takes in one pass.
+	enum { MaxSplits = 16 };
 
-	virtual void set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames) = 0;
-	virtual void on_backend_stop() = 0;
-	virtual void on_backend_start() = 0;
-	virtual void set_latency_usec(uint32_t usec) = 0;
-};
-
-class Synth final : public BackendCallback
-{
-public:
+	Synth();
 	~Synth() override;
 
 	// FF XIV Bard doesn't have velocity or anything fancy, keep it simple.
 	// We just need performance guiding.
+	// time_nsecs is in the Util::get_current_time_nsecs() domain and should be
+	// the time the event was received. Events are triggered at a fixed delay
+	// after that time with sample accuracy rather than at the next block boundary.
+	void post_note_on(int channel, int note, int64_t time_nsecs);
+	void post_note_off(int channel, int note, int64_t time_nsecs);
 	void post_note_on(int channel, int note);
 	void post_note_off(int channel, int note);
 
-	void mix_samples(float * const *channels, size_t num_frames) noexcept override;
-	void set_backend_parameters(float sample_rate, unsigned channels, size_t max_num_frames) override;
-	void on_backend_stop() override;
-	void on_backend_start() override;
+	// Posting is lock-free and safe from any number of threads.
+	// If the audio thread stalls and the queue fills up, new events are dropped.
+	Util::QueueStats get_event_stats() const noexcept;
+
+	// Takes effect at the next block boundary without interrupting the stream.
+	// Sounding notes continue with the new parameters, new notes start from a clean reset.
+	// Must only be called from one thread, but that thread may differ from the audio thread.
+	// Once prepared, a split rendered by the native FM engine rejects presets it can't render and returns false.
+	bool set_split_preset(unsigned split, const FMPreset &preset);
+
+	enum class Engine
+	{
+		// fmsynth renders every voice live.
+		FM,
+		// Notes are pre-rendered from the split's preset when the backend is initialized,
+		// and played back from memory. Preset changes after that don't affect the split.
+		Wavetable,
+		// Voices render natively, several at once in SIMD lanes, see FMEngine.
+		// Splits whose preset needs more than three operators fall back to FM when the
+		// backend is initialized. Operators past the third in later presets are ignored.
+		NativeFM,
+		// Notes play from the sample bank set with set_sample_bank(), read in place from the mapped file.
+		// Splits fall back to FM if there is no bank.
+		SampleBank
+	};
+
+	// Number of splits, each with its own voice pool, preset and graph output.
+	// Must be set before the backend is initialized. Events for splits beyond the count are ignored.
+	void set_num_splits(unsigned count);
+	unsigned get_num_splits() const noexcept;
+
+	// Must be set before the backend is initialized.
+	void set_split_engine(unsigned split, Engine engine);
+
+	// Shared by every split with the SampleBank engine. Not owned, must outlive the synth.
+	// Must be set before the backend is initialized.
+	void set_sample_bank(const ::SampleBank *bank);
+
+	// Number of voices each split can ring at once. Must be set before the backend is initialized.
+	// When a split runs out, the quietest voice is stolen, preferring voices which are already released.
+	void set_voices_per_split(unsigned count);
+
+	struct VoiceStats
+	{
+		uint64_t stolen;
+		// Released voices cut early because they fell below audibility.
+		uint64_t retired;
+	};
+	VoiceStats get_voice_stats() const noexcept;
+
+	// Renders splits in parallel on this many worker threads plus the audio thread.
+	// 0 renders everything on the audio thread. Must be set before the backend is initialized.
+	void set_render_threads(unsigned count);
+
+	unsigned get_num_inputs() const noexcept override;
+	unsigned get_num_outputs() const noexcept override;
+	void prepare(float sample_rate, size_t max_frames) override;
+	void process(const AudioBus * const *inputs, AudioBus * const *outputs, size_t num_frames) noexcept override;
+	// While silent, the graph skips the voices and the render pool entirely.
+	bool is_silent() noexcept override;
+	void skip(size_t num_frames) noexcept override;
+	void on_start() override;
+	// The graph reports latency right after a block is written, including the stages after the synth,
+	// i.e. the next frame to be rendered is heard usec from now.
 	void set_latency_usec(uint32_t usec) override;
 
 private:
-	enum { RingSize = 4096, NumSplits = 2 };
-	fmsynth_t *fms[NumSplits] = {};
-	std::vector<uint32_t> ring;
-	std::atomic_uint32_t atomic_write_count;
-	uint32_t read_count = 0;
-	uint32_t write_count = 0;
+	enum { RingSize = 4096 };
+	unsigned num_splits = 2;
+
+	// Every voice is a single voice fmsynth instance, so that each one can be
+	// rendered, measured and cut off on its own.
+	struct Voice
+	{
+		fmsynth_t *fm = nullptr;
+		// Peak of the last rendered chunk, used as an envelope estimate.
+		float level = 0.0f;
+		// Peak over every chunk of the current block. Released voices are retired on it once the block is done,
+		// a short chunk between two events says little about how loud the voice still is.
+		float block_peak = 0.0f;
+		uint8_t note = 0;
+		bool active = false;
+		bool released = false;
+		// Instance was cut off while sounding and needs a reset before reuse.
+		bool needs_reset = false;
+
+		// Wavetable engine state.
+		const WavetableBank::Note *table = nullptr;
+		uint32_t position = 0;
+		float release_gain = 1.0f;
+
+		// Sample bank engine state.
+		const SampleBankZone *zone = nullptr;
+		DSP::SampleVoice sample = {};
+	};
+	std::vector<Voice> voices[MaxSplits];
+	unsigned voices_per_split = 8;
+
+	Engine engines[MaxSplits] = {};
+	WavetableBank wavetables[MaxSplits];
+	// Voice i of a native split is voice i of its engine.
+	FMEngine fm_engines[MaxSplits];
+	// Splits which ended up on the native FM engine after prepare(), for set_split_preset().
+	std::atomic<uint32_t> native_fm_splits{0};
+	const ::SampleBank *sample_bank = nullptr;
+	// Per-frame gain factor while a wavetable or sample voice is released.
+	float release_factors[MaxSplits] = {};
+	std::atomic<uint64_t> voices_stolen{0};
+	std::atomic<uint64_t> voices_retired{0};
+
+	// Owned by the audio thread, points either to a default preset or into the snapshot.
+	const FMPreset *current_presets[MaxSplits] = {};
+	FMPreset default_presets[MaxSplits];
+	Util::Snapshot<FMPreset> preset_snapshots[MaxSplits];
+
+	// Each split renders into its graph output, pointed to by split_channels for the current block.
+	// Voices render into their split's voice_channels first, then accumulate into the split.
+	// Splits share nothing while rendering, so they can be rendered on different threads.
+	std::unique_ptr<float, Util::AlignedDeleter> voice_buffer;
+	float *split_channels[MaxSplits][2] = {};
+	float *voice_channels[MaxSplits][2] = {};
+
+	struct Event
+	{
+		int64_t time_nsecs;
+		uint32_t note;
+	};
+	Util::MPSCQueue<Event, RingSize> events;
+
+	// Events due in the current block, with their frame offset.
+	// Each split walks the list on its own while rendering.
+	struct BlockEvent
+	{
+		uint32_t offset;
+		uint32_t note;
+	};
+	BlockEvent block_events[RingSize];
+	unsigned num_block_events = 0;
+	size_t block_frames = 0;
+
+	// Whether any voice was still sounding at the end of the last rendered block, per split.
+	bool split_sounding[MaxSplits] = {};
+	// Nothing sounded in the split during the last rendered block.
+	bool split_silent[MaxSplits] = {};
+	bool silent = true;
+
+	Util::RenderPool render_pool;
+	unsigned render_threads = 0;
+
+	// Audio clock <-> monotonic clock mapping. Only touched on the audio thread.
+	float sample_rate = 0.0f;
+	uint64_t rendered_frames = 0;
+	uint64_t anchor_frame = 0;
+	int64_t anchor_time_nsecs = 0;
+	bool has_anchor = false;
+	// Fixed delay between an event timestamp and when it is heard.
+	// Tracks the worst case latency so that events never have to be clamped.
+	int64_t schedule_delay_nsecs = 0;
+
+	void post_event(uint32_t note, int64_t time_nsecs);
+	void apply_event(uint32_t note) noexcept;
+	Voice *allocate_voice(unsigned split) noexcept;
+	void reset_voice(Voice &voice, unsigned split) noexcept;
+	void update_presets() noexcept;
+	void render_wavetable_voice(Voice &voice, unsigned split, size_t offset, size_t num_frames) noexcept;
+	bool start_sample_voice(Voice &voice, unsigned note) noexcept;
+	void render_sample_voice(Voice &voice, unsigned split, size_t offset, size_t num_frames) noexcept;
+	void render_native_voices(unsigned split, size_t offset, size_t num_frames) noexcept;
+	void render(unsigned split, size_t offset, size_t num_frames) noexcept;
+	void retire_voices(unsigned split) noexcept;
+	void render_split(unsigned split) noexcept;
+	static void render_split_task(void *userdata, unsigned split) noexcept;
+	int64_t update_block_time(size_t num_frames) noexcept;
 };
@@ -0,0 +1,217 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "wav.hpp"
+#include <string.h>
+#include <algorithm>
+
+static void write_u16(uint8_t *data, uint16_t v)
+{
+	data[0] = uint8_t(v >> 0);
+	data[1] = uint8_t(v >> 8);
+}
+
+static void write_u32(uint8_t *data, uint32_t v)
+{
+	data[0] = uint8_t(v >> 0);
+	data[1] = uint8_t(v >> 8);
+	data[2] = uint8_t(v >> 16);
+	data[3] = uint8_t(v >> 24);
+}
+
+static uint16_t read_u16(const uint8_t *data)
+{
+	return uint16_t(data[0] | (data[1] << 8));
+}
+
+static uint32_t read_u32(const uint8_t *data)
+{
+	return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+}
+
+enum { WAVHeaderSize = 44, WAVEFormatPCM = 1, WAVEFormatIEEEFloat = 3, WAVEFormatExtensible = 0xfffe };
+
+WAVWriter::~WAVWriter()
+{
+	close();
+}
+
+bool WAVWriter::init(const char *path, unsigned sample_rate, unsigned channels_)
+{
+	close();
+
+	file = fopen(path, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open %s for writing.\n", path);
+		return false;
+	}
+
+	channels = channels_;
+	data_bytes = 0;
+
+	uint8_t header[WAVHeaderSize];
+	memcpy(header + 0, "RIFF", 4);
+	write_u32(header + 4, 0);
+	memcpy(header + 8, "WAVE", 4);
+	memcpy(header + 12, "fmt ", 4);
+	write_u32(header + 16, 16);
+	write_u16(header + 20, WAVEFormatIEEEFloat);
+	write_u16(header + 22, uint16_t(channels));
+	write_u32(header + 24, sample_rate);
+	write_u32(header + 28, uint32_t(sample_rate * channels * sizeof(float)));
+	write_u16(header + 32, uint16_t(channels * sizeof(float)));
+	write_u16(header + 34, 32);
+	memcpy(header + 36, "data", 4);
+	write_u32(header + 40, 0);
+
+	if (fwrite(header, sizeof(header), 1, file) != 1)
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+bool WAVWriter::write(const float *interleaved, size_t num_frames)
+{
+	if (!file)
+		return false;
+
+	if (fwrite(interleaved, sizeof(float) * channels, num_frames, file) != num_frames)
+		return false;
+
+	data_bytes += num_frames * channels * sizeof(float);
+	return true;
+}
+
+void WAVWriter::close()
+{
+	if (!file)
+		return;
+
+	// RIFF can only describe 4 GiB, clamp rather than wrapping around.
+	auto data_size = uint32_t(data_bytes > 0xffffffffu - 36 ? 0xffffffffu - 36 : data_bytes);
+	uint8_t size[4];
+
+	write_u32(size, data_size + 36);
+	fseek(file, 4, SEEK_SET);
+	fwrite(size, sizeof(size), 1, file);
+
+	write_u32(size, data_size);
+	fseek(file, 40, SEEK_SET);
+	fwrite(size, sizeof(size), 1, file);
+
+	fclose(file);
+	file = nullptr;
+}
+
+bool load_wav(const char *path, std::vector<float> &samples, unsigned &sample_rate, unsigned &channels)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return false;
+	}
+
+	std::vector<uint8_t> data;
+	uint8_t chunk[4096];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) != 0)
+		data.insert(data.end(), chunk, chunk + read);
+	fclose(file);
+
+	if (data.size() < 12 || memcmp(data.data(), "RIFF", 4) != 0 || memcmp(data.data() + 8, "WAVE", 4) != 0)
+	{
+		fprintf(stderr, "%s is not a WAV file.\n", path);
+		return false;
+	}
+
+	unsigned format = 0;
+	unsigned bits = 0;
+	channels = 0;
+	sample_rate = 0;
+	const uint8_t *pcm = nullptr;
+	size_t pcm_size = 0;
+
+	// Chunks are padded to an even size.
+	size_t offset = 12;
+	while (offset + 8 <= data.size())
+	{
+		const uint8_t *header = data.data() + offset;
+		size_t chunk_size = read_u32(header + 4);
+		const uint8_t *payload = header + 8;
+		size_t available = std::min(chunk_size, data.size() - offset - 8);
+
+		if (memcmp(header, "fmt ", 4) == 0 && available >= 16)
+		{
+			format = read_u16(payload + 0);
+			channels = read_u16(payload + 2);
+			sample_rate = read_u32(payload + 4);
+			bits = read_u16(payload + 14);
+			// The real format is the first two bytes of the sub-format GUID.
+			if (format == WAVEFormatExtensible && available >= 26)
+				format = read_u16(payload + 24);
+		}
+		else if (memcmp(header, "data", 4) == 0)
+		{
+			pcm = payload;
+			pcm_size = available;
+		}
+
+		offset += 8 + chunk_size + (chunk_size & 1);
+	}
+
+	bool supported = (format == WAVEFormatPCM && (bits == 16 || bits == 24 || bits == 32)) ||
+	                 (format == WAVEFormatIEEEFloat && bits == 32);
+	if (!pcm || channels == 0 || sample_rate == 0 || !supported)
+	{
+		fprintf(stderr, "%s: unsupported WAV format %u with %u bits, %u channels.\n", path, format, bits, channels);
+		return false;
+	}
+
+	unsigned bytes = bits / 8;
+	size_t num_samples = pcm_size / bytes;
+	num_samples -= num_samples % channels;
+	samples.resize(num_samples);
+
+	for (size_t i = 0; i < num_samples; i++)
+	{
+		const uint8_t *sample = pcm + i * bytes;
+		if (format == WAVEFormatIEEEFloat)
+		{
+			uint32_t v = read_u32(sample);
+			memcpy(&samples[i], &v, sizeof(float));
+		}
+		else if (bits == 16)
+			samples[i] = float(int16_t(read_u16(sample))) * (1.0f / 32768.0f);
+		else if (bits == 24)
+			samples[i] = float(int32_t(uint32_t(sample[0] << 8) | uint32_t(sample[1] << 16) | uint32_t(sample[2]) << 24)) *
+			             (1.0f / 2147483648.0f);
+		else
+			samples[i] = float(int32_t(read_u32(sample))) * (1.0f / 2147483648.0f);
+	}
+
+	return true;
+}
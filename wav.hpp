@@ -0,0 +1,51 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Minimal WAV writer for 32-bit float interleaved PCM.
+class WAVWriter
+{
+public:
+	~WAVWriter();
+	void operator=(const WAVWriter &) = delete;
+
+	bool init(const char *path, unsigned sample_rate, unsigned channels);
+	bool write(const float *interleaved, size_t num_frames);
+
+	// Patches up the RIFF sizes. Called automatically on destruction.
+	void close();
+
+private:
+	FILE *file = nullptr;
+	unsigned channels = 0;
+	uint64_t data_bytes = 0;
+};
+
+// Reads a whole WAV file into interleaved floats. Accepts 16, 24 and 32-bit integer PCM
+// and 32-bit float, including WAVE_FORMAT_EXTENSIBLE headers.
+bool load_wav(const char *path, std::vector<float> &samples, unsigned &sample_rate, unsigned &channels);
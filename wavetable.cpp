@@ -0,0 +1,232 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "wavetable.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+static constexpr size_t StorageAlignment = 64;
+// Long enough that the rounding of the loop to whole samples is inaudible as detuning.
+static constexpr float MinLoopSeconds = 0.05f;
+static constexpr unsigned LoopCrossfadeFrames = 256;
+static constexpr float MaxAttackSeconds = 4.0f;
+// Used when the preset leaves envelope times at fmsynth defaults.
+static constexpr float FallbackEnvelopeSeconds = 0.5f;
+
+struct EnvelopeTimes
+{
+	float attack_seconds;
+	float release_seconds;
+};
+
+// The sustain phase starts when every operator has finished its delay stages,
+// and the audible release is governed by the carriers.
+static EnvelopeTimes get_envelope_times(const FMPreset &preset)
+{
+	float delays[FMSYNTH_OPERATORS] = {};
+	float release[FMSYNTH_OPERATORS] = {};
+	bool carrier[FMSYNTH_OPERATORS] = {};
+	bool has_delays = false;
+	bool has_release = false;
+
+	for (uint32_t i = 0; i < preset.num_parameters; i++)
+	{
+		auto &param = preset.parameters[i];
+		if (param.global || param.operator_index >= FMSYNTH_OPERATORS)
+			continue;
+
+		switch (param.parameter)
+		{
+		case FMSYNTH_PARAM_DELAY0:
+		case FMSYNTH_PARAM_DELAY1:
+		case FMSYNTH_PARAM_DELAY2:
+			delays[param.operator_index] += param.value;
+			has_delays = true;
+			break;
+
+		case FMSYNTH_PARAM_RELEASE_TIME:
+			release[param.operator_index] = param.value;
+			break;
+
+		case FMSYNTH_PARAM_CARRIERS:
+			carrier[param.operator_index] = param.value != 0.0f;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	EnvelopeTimes times = {};
+	for (unsigned i = 0; i < FMSYNTH_OPERATORS; i++)
+	{
+		times.attack_seconds = std::max(times.attack_seconds, delays[i]);
+		if (carrier[i] && release[i] > 0.0f)
+		{
+			times.release_seconds = std::max(times.release_seconds, release[i]);
+			has_release = true;
+		}
+	}
+
+	if (!has_delays)
+		times.attack_seconds = FallbackEnvelopeSeconds;
+	if (!has_release)
+		times.release_seconds = FallbackEnvelopeSeconds;
+
+	times.attack_seconds = std::min(std::max(times.attack_seconds, 0.01f), MaxAttackSeconds);
+	return times;
+}
+
+struct RenderedNote
+{
+	std::vector<int16_t> samples;
+	uint32_t attack_frames;
+	uint32_t loop_frames;
+	float scale;
+};
+
+static bool render_note(RenderedNote &rendered, const FMPreset &preset, float sample_rate,
+                        unsigned note, float attack_seconds)
+{
+	auto *fm = fmsynth_new(sample_rate, 1);
+	if (!fm)
+		return false;
+
+	apply_preset(fm, preset);
+
+	// A whole number of periods, so the loop point lines up with the waveform.
+	float freq = 440.0f * exp2f((float(note) - 69.0f) / 12.0f);
+	float period = sample_rate / freq;
+	float periods = ceilf(MinLoopSeconds * sample_rate / period);
+	auto loop_frames = std::max(uint32_t(roundf(periods * period)), 2 * LoopCrossfadeFrames);
+	auto attack_frames = std::max(uint32_t(attack_seconds * sample_rate), LoopCrossfadeFrames);
+	size_t total_frames = attack_frames + loop_frames;
+
+	std::vector<float> left(total_frames), right(total_frames);
+	fmsynth_note_on(fm, uint8_t(note), 255);
+
+	for (size_t offset = 0; offset < total_frames; )
+	{
+		auto to_render = unsigned(std::min<size_t>(total_frames - offset, 1024));
+		fmsynth_render(fm, left.data() + offset, right.data() + offset, to_render);
+		offset += to_render;
+	}
+	fmsynth_free(fm);
+
+	// Playback is mono, the split mixer pans it.
+	std::vector<float> mono(total_frames);
+	float peak = 0.0f;
+	for (size_t i = 0; i < total_frames; i++)
+	{
+		mono[i] = 0.5f * (left[i] + right[i]);
+		peak = std::max(peak, fabsf(mono[i]));
+	}
+
+	// Blend the end of the loop into what precedes the loop start, so wrapping around is seamless.
+	for (unsigned i = 0; i < LoopCrossfadeFrames; i++)
+	{
+		size_t dst = total_frames - LoopCrossfadeFrames + i;
+		size_t src = attack_frames - LoopCrossfadeFrames + i;
+		float t = (float(i) + 0.5f) / float(LoopCrossfadeFrames);
+		mono[dst] = mono[dst] * (1.0f - t) + mono[src] * t;
+	}
+
+	rendered.scale = peak > 0.0f ? peak / 32767.0f : 1.0f;
+	float inv_scale = 1.0f / rendered.scale;
+	rendered.samples.resize(total_frames);
+	for (size_t i = 0; i < total_frames; i++)
+		rendered.samples[i] = int16_t(lrintf(std::min(std::max(mono[i] * inv_scale, -32767.0f), 32767.0f)));
+
+	rendered.attack_frames = attack_frames;
+	rendered.loop_frames = loop_frames;
+	return true;
+}
+
+bool WavetableBank::build(const FMPreset &preset, float sample_rate, unsigned first_note_, unsigned num_notes)
+{
+	notes.clear();
+	storage.reset();
+	storage_samples = 0;
+	first_note = first_note_;
+
+	auto times = get_envelope_times(preset);
+	release_seconds = times.release_seconds;
+
+	std::vector<RenderedNote> rendered(num_notes);
+	std::atomic<unsigned> next_note{0};
+	std::atomic<bool> failed{false};
+
+	const auto worker = [&]() {
+		unsigned index;
+		while ((index = next_note.fetch_add(1, std::memory_order_relaxed)) < num_notes)
+		{
+			if (!render_note(rendered[index], preset, sample_rate, first_note + index, times.attack_seconds))
+				failed.store(true, std::memory_order_relaxed);
+		}
+	};
+
+	unsigned num_threads = std::max(1u, std::min(std::thread::hardware_concurrency(), num_notes));
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < num_threads; i++)
+		threads.emplace_back(worker);
+	worker();
+	for (auto &thread : threads)
+		thread.join();
+
+	if (failed.load(std::memory_order_relaxed))
+	{
+		fprintf(stderr, "Failed to render wavetables for preset %s.\n", preset.name);
+		return false;
+	}
+
+	// Pack everything into one allocation, every note starting on a cache line.
+	const size_t align_samples = StorageAlignment / sizeof(int16_t);
+	size_t total = 0;
+	for (auto &note : rendered)
+		total += (note.samples.size() + align_samples - 1) & ~(align_samples - 1);
+
+	storage.reset(static_cast<int16_t *>(Util::memalign_alloc(StorageAlignment, total * sizeof(int16_t))));
+	if (!storage)
+		return false;
+	storage_samples = total;
+
+	notes.resize(num_notes);
+	size_t offset = 0;
+	for (unsigned i = 0; i < num_notes; i++)
+	{
+		auto &src = rendered[i];
+		auto *dst = storage.get() + offset;
+		memcpy(dst, src.samples.data(), src.samples.size() * sizeof(int16_t));
+
+		notes[i].samples = dst;
+		notes[i].attack_frames = src.attack_frames;
+		notes[i].loop_frames = src.loop_frames;
+		notes[i].scale = src.scale;
+		offset += (src.samples.size() + align_samples - 1) & ~(align_samples - 1);
+	}
+
+	return true;
+}
@@ -0,0 +1,77 @@
+/* Copyright (c) 2022 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "preset.hpp"
+#include "aligned_alloc.hpp"
+#include <memory>
+
+// Pre-rendered notes for a fixed preset.
+// Each note is rendered once through fmsynth: the attack up to the sustain phase,
+// followed by a short crossfaded loop of the sustained waveform.
+// Playback only reads samples, and release is an exponential ramp over the preset's release time.
+class WavetableBank
+{
+public:
+	struct Note
+	{
+		// Mono, starts on a cache line.
+		const int16_t *samples;
+		// The loop starts right after the attack.
+		uint32_t attack_frames;
+		uint32_t loop_frames;
+		// Converts samples to float.
+		float scale;
+	};
+
+	// Renders notes [first_note, first_note + num_notes) on all cores.
+	bool build(const FMPreset &preset, float sample_rate, unsigned first_note, unsigned num_notes);
+
+	// Returns nullptr if the note wasn't rendered.
+	const Note *get_note(unsigned note) const noexcept
+	{
+		if (note < first_note || note - first_note >= notes.size())
+			return nullptr;
+		return &notes[note - first_note];
+	}
+
+	float get_release_seconds() const noexcept
+	{
+		return release_seconds;
+	}
+
+	size_t get_size_bytes() const noexcept
+	{
+		return storage_samples * sizeof(int16_t);
+	}
+
+private:
+	std::vector<Note> notes;
+	std::unique_ptr<int16_t, Util::AlignedDeleter> storage;
+	size_t storage_samples = 0;
+	unsigned first_note = 0;
+	float release_seconds = 0.0f;
+};